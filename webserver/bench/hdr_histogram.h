@@ -0,0 +1,127 @@
+#ifndef HDR_HISTOGRAM_H
+#define HDR_HISTOGRAM_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+
+/*
+    HdrHistogram式的延迟直方图
+    小于2048的值每个值一个桶；更大的值按2的幂分段，每段再等分成1024个子桶，
+    相对误差不超过1/1024（约3位有效数字），记录一次只是一次clz和一次加法。
+    压测的每个线程各有一个，结束后合并再计算分位数，记录时不需要同步。
+*/
+class hdr_histogram {
+public:
+    static const int SUB_BITS = 10;                 // 每段子桶数的位数
+    static const int SUB_COUNT = 1 << SUB_BITS;
+    static const int MAX_BITS = 44;                 // 能记录的最大值为2^44，以纳秒计约4.8小时
+    static const int BUCKETS = ( MAX_BITS - SUB_BITS + 1 ) * SUB_COUNT;
+
+    hdr_histogram() : m_total( 0 ), m_sum( 0 ), m_min( UINT64_MAX ), m_max( 0 ) {
+        m_counts = ( uint64_t* )calloc( BUCKETS, sizeof( uint64_t ) );
+    }
+    ~hdr_histogram() { free( m_counts ); }
+
+    void record( uint64_t v ) {
+        if( v >= ( ( uint64_t )1 << MAX_BITS ) ) {
+            v = ( ( uint64_t )1 << MAX_BITS ) - 1;
+        }
+        ++m_counts[ index( v ) ];
+        ++m_total;
+        m_sum += v;
+        if( v < m_min ) {
+            m_min = v;
+        }
+        if( v > m_max ) {
+            m_max = v;
+        }
+    }
+
+    void merge( const hdr_histogram& other ) {
+        for( int i = 0; i < BUCKETS; ++i ) {
+            m_counts[ i ] += other.m_counts[ i ];
+        }
+        m_total += other.m_total;
+        m_sum += other.m_sum;
+        if( other.m_min < m_min ) {
+            m_min = other.m_min;
+        }
+        if( other.m_max > m_max ) {
+            m_max = other.m_max;
+        }
+    }
+
+    void reset() {
+        memset( m_counts, 0, BUCKETS * sizeof( uint64_t ) );
+        m_total = 0;
+        m_sum = 0;
+        m_min = UINT64_MAX;
+        m_max = 0;
+    }
+
+    // 不小于百分之p的记录值的最小值（桶内取上界），p取0到100
+    uint64_t percentile( double p ) const {
+        if( m_total == 0 ) {
+            return 0;
+        }
+        uint64_t target = ( uint64_t )( p / 100.0 * m_total + 0.5 );
+        if( target < 1 ) {
+            target = 1;
+        }
+        uint64_t seen = 0;
+        for( int i = 0; i < BUCKETS; ++i ) {
+            seen += m_counts[ i ];
+            if( seen >= target ) {
+                uint64_t v = highest_equivalent( i );
+                return v < m_max ? v : m_max;
+            }
+        }
+        return m_max;
+    }
+
+    uint64_t count() const { return m_total; }
+    uint64_t min() const { return m_total ? m_min : 0; }
+    uint64_t max() const { return m_max; }
+    double mean() const { return m_total ? ( double )m_sum / m_total : 0; }
+
+    // 输出一行摘要，unit为显示单位对应的记录值（如记录纳秒、以微秒显示时为1000）
+    void print( const char* label, double unit, const char* unit_name ) const {
+        printf( "%-20s n=%-10llu min=%.2f mean=%.2f p50=%.2f p90=%.2f p99=%.2f p999=%.2f max=%.2f (%s)\n",
+                label, ( unsigned long long )m_total, min() / unit, mean() / unit,
+                percentile( 50 ) / unit, percentile( 90 ) / unit, percentile( 99 ) / unit,
+                percentile( 99.9 ) / unit, max() / unit, unit_name );
+    }
+
+private:
+    static int index( uint64_t v ) {
+        if( v < 2 * SUB_COUNT ) {
+            return ( int )v;
+        }
+        // v右移shift位后落在[SUB_COUNT, 2 * SUB_COUNT)中
+        int shift = 63 - __builtin_clzll( v ) - SUB_BITS;
+        return ( shift + 1 ) * SUB_COUNT + ( int )( ( v >> shift ) - SUB_COUNT );
+    }
+
+    static uint64_t highest_equivalent( int idx ) {
+        if( idx < 2 * SUB_COUNT ) {
+            return ( uint64_t )idx;
+        }
+        int shift = idx / SUB_COUNT - 1;
+        uint64_t sub = ( uint64_t )( idx % SUB_COUNT + SUB_COUNT );
+        return ( sub << shift ) + ( ( ( uint64_t )1 << shift ) - 1 );
+    }
+
+private:
+    hdr_histogram( const hdr_histogram& );
+    hdr_histogram& operator=( const hdr_histogram& );
+
+    uint64_t* m_counts;
+    uint64_t m_total;
+    uint64_t m_sum;
+    uint64_t m_min;
+    uint64_t m_max;
+};
+
+#endif
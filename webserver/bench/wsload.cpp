@@ -0,0 +1,556 @@
+/*
+    压测客户端：按给定的并发数、keep-alive比例、流水线深度和文件组合向服务器发送GET请求，
+    输出吞吐量和请求延迟（连接建立延迟）的直方图。
+    每个线程用一个epoll驱动自己的一组非阻塞连接，一个连接同一时刻只有一批（流水线深度个）请求在途，
+    一批全部收到应答后才发下一批，所以这是闭环压测：服务器变慢时发送速率也随之下降。
+
+    编译： g++ -O2 bench/wsload.cpp -pthread -o wsload
+    运行： ./wsload [options] host port_number
+*/
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <libgen.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include "hdr_histogram.h"
+
+static const int MAX_EVENTS = 1024;
+static const int READ_CHUNK = 64 * 1024;
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ( uint64_t )ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// 请求组合中的一项，按权重随机选取
+struct target {
+    std::string path;
+    int weight;
+};
+
+struct options {
+    options() : connections( 64 ), threads( 2 ), duration_s( 10 ), warmup_s( 1 ),
+            keepalive( 1.0 ), pipeline( 1 ), port( 0 ) {}
+    int connections;        // 总并发连接数
+    int threads;            // 压测线程数
+    int duration_s;         // 压测时长（秒），不含预热
+    int warmup_s;           // 预热时长（秒），这段时间内的结果不统计
+    double keepalive;       // 一批请求之后保持连接的概率，1表示全部keep-alive，0表示每批都重新建立连接
+    int pipeline;           // 流水线深度，即一批请求的个数
+    std::vector< target > targets;
+    int total_weight;
+    std::string host;
+    int port;
+    struct sockaddr_in addr;
+};
+
+// 一个压测连接
+struct client {
+    int fd;
+    bool connecting;
+    bool keep;              // 这一批应答之后是否保持连接
+    uint64_t connect_start;
+    uint64_t batch_start;   // 这一批请求开始发送的时间
+    std::string out;        // 待发送的请求
+    size_t out_off;
+    int pending;            // 这一批还没有收到应答的请求数
+    std::string head;       // 正在接收的应答头部
+    long body_left;         // 正在接收的应答体还剩多少字节，-1表示正在接收头部
+    int status;             // 正在接收的应答的状态码
+};
+
+// 每个线程的统计，结束后合并
+struct stats {
+    stats() : requests( 0 ), bytes( 0 ), connects( 0 ), errors( 0 ) {
+        memset( status, 0, sizeof( status ) );
+    }
+    hdr_histogram latency;  // 请求延迟（纳秒），从这一批开始发送到该请求的应答接收完
+    hdr_histogram connect;  // 连接建立延迟（纳秒）
+    uint64_t requests;
+    uint64_t bytes;
+    uint64_t connects;
+    uint64_t errors;
+    uint64_t status[ 6 ];   // 按状态码的百位统计，status[0]为无法解析的应答
+};
+
+struct worker {
+    const options* opts;
+    int connections;
+    uint64_t record_start;  // 预热结束的时间，之后完成的请求才统计
+    uint64_t deadline;
+    unsigned int seed;
+    stats st;
+    pthread_t thread;
+};
+
+static bool parse_targets( options& opts, const char* spec ) {
+    opts.targets.clear();
+    opts.total_weight = 0;
+    std::string s( spec );
+    size_t pos = 0;
+    while( pos <= s.size() ) {
+        size_t comma = s.find( ',', pos );
+        if( comma == std::string::npos ) {
+            comma = s.size();
+        }
+        std::string item = s.substr( pos, comma - pos );
+        pos = comma + 1;
+        if( item.empty() ) {
+            continue;
+        }
+        target t;
+        t.weight = 1;
+        size_t colon = item.find( ':' );
+        if( colon != std::string::npos ) {
+            t.weight = atoi( item.c_str() + colon + 1 );
+            item.resize( colon );
+        }
+        if( item.empty() || item[0] != '/' || t.weight <= 0 ) {
+            return false;
+        }
+        t.path = item;
+        opts.total_weight += t.weight;
+        opts.targets.push_back( t );
+    }
+    return !opts.targets.empty();
+}
+
+static const target& pick_target( worker* w ) {
+    const options* opts = w->opts;
+    int r = rand_r( &w->seed ) % opts->total_weight;
+    for( size_t i = 0; i < opts->targets.size(); ++i ) {
+        r -= opts->targets[i].weight;
+        if( r < 0 ) {
+            return opts->targets[i];
+        }
+    }
+    return opts->targets.back();
+}
+
+// 生成下一批请求，不保持连接的一批中最后一个请求要求服务器关闭连接
+static void build_batch( worker* w, client* c ) {
+    const options* opts = w->opts;
+    c->keep = opts->keepalive >= 1.0 || rand_r( &w->seed ) < opts->keepalive * RAND_MAX;
+    c->out.clear();
+    c->out_off = 0;
+    for( int i = 0; i < opts->pipeline; ++i ) {
+        const target& t = pick_target( w );
+        c->out += "GET ";
+        c->out += t.path;
+        c->out += " HTTP/1.1\r\nHost: ";
+        c->out += opts->host;
+        c->out += ( c->keep || i + 1 < opts->pipeline ) ? "\r\nConnection: keep-alive\r\n\r\n" : "\r\nConnection: close\r\n\r\n";
+    }
+    c->pending = opts->pipeline;
+    c->head.clear();
+    c->body_left = -1;
+    c->batch_start = now_ns();
+}
+
+static void update_events( int epollfd, client* c ) {
+    epoll_event ev;
+    ev.data.ptr = c;
+    ev.events = EPOLLIN | ( c->connecting || c->out_off < c->out.size() ? EPOLLOUT : 0 );
+    epoll_ctl( epollfd, EPOLL_CTL_MOD, c->fd, &ev );
+}
+
+static bool open_conn( worker* w, int epollfd, client* c ) {
+    c->fd = socket( PF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 );
+    if( c->fd < 0 ) {
+        return false;
+    }
+    int one = 1;
+    setsockopt( c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof( one ) );
+    c->connect_start = now_ns();
+    c->connecting = true;
+    if( connect( c->fd, ( struct sockaddr* )&w->opts->addr, sizeof( w->opts->addr ) ) < 0 && errno != EINPROGRESS ) {
+        close( c->fd );
+        c->fd = -1;
+        return false;
+    }
+    epoll_event ev;
+    ev.data.ptr = c;
+    ev.events = EPOLLIN | EPOLLOUT;
+    epoll_ctl( epollfd, EPOLL_CTL_ADD, c->fd, &ev );
+    return true;
+}
+
+static void close_conn( int epollfd, client* c ) {
+    if( c->fd >= 0 ) {
+        epoll_ctl( epollfd, EPOLL_CTL_DEL, c->fd, 0 );
+        close( c->fd );
+        c->fd = -1;
+    }
+}
+
+static void reconnect( worker* w, int epollfd, client* c ) {
+    close_conn( epollfd, c );
+    if( !open_conn( w, epollfd, c ) ) {
+        ++w->st.errors;
+    }
+}
+
+static bool flush_out( client* c ) {
+    while( c->out_off < c->out.size() ) {
+        ssize_t n = send( c->fd, c->out.data() + c->out_off, c->out.size() - c->out_off, MSG_NOSIGNAL );
+        if( n < 0 ) {
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        c->out_off += n;
+    }
+    return true;
+}
+
+// 一个应答接收完毕
+static void response_done( worker* w, client* c, int status ) {
+    uint64_t now = now_ns();
+    if( now >= w->record_start ) {
+        w->st.latency.record( now - c->batch_start );
+        ++w->st.requests;
+        ++w->st.status[ status >= 100 && status < 600 ? status / 100 : 0 ];
+    }
+    --c->pending;
+}
+
+/*
+    处理收到的数据，返回false表示连接出错或应答无法解析。
+    应答头部在c->head中拼接，找到空行后按Content-Length跳过应答体，应答体的内容不保存。
+*/
+static bool consume( worker* w, client* c, const char* data, long len ) {
+    if( now_ns() >= w->record_start ) {
+        w->st.bytes += len;
+    }
+    while( len > 0 ) {
+        if( c->body_left > 0 ) {
+            long n = len < c->body_left ? len : c->body_left;
+            c->body_left -= n;
+            data += n;
+            len -= n;
+            if( c->body_left == 0 ) {
+                c->body_left = -1;
+                response_done( w, c, c->status );
+            }
+            continue;
+        }
+        if( c->pending == 0 ) {
+            // 没有在途的请求却收到了数据
+            return false;
+        }
+        // 接收头部，空行可能跨越两次读取，从上次结束前3个字节开始查找
+        size_t old = c->head.size();
+        c->head.append( data, len );
+        size_t from = old > 3 ? old - 3 : 0;
+        size_t end = c->head.find( "\r\n\r\n", from );
+        if( end == std::string::npos ) {
+            if( c->head.size() > 64 * 1024 ) {
+                return false;
+            }
+            return true;
+        }
+        end += 4;
+        // 头部之后的数据留给下一轮当作应答体或下一个应答
+        long used = ( long )( end - old );
+        data += used;
+        len -= used;
+        c->head.resize( end );
+
+        if( c->head.compare( 0, 5, "HTTP/" ) != 0 || c->head.size() < 12 ) {
+            return false;
+        }
+        c->status = atoi( c->head.c_str() + 9 );
+        long content_length = 0;
+        const char* p = c->head.c_str();
+        while( ( p = strchr( p, '\n' ) ) != NULL ) {
+            ++p;
+            if( strncasecmp( p, "Content-Length:", 15 ) == 0 ) {
+                content_length = atol( p + 15 );
+                break;
+            }
+        }
+        c->head.clear();
+        if( content_length > 0 ) {
+            c->body_left = content_length;
+        } else {
+            response_done( w, c, c->status );
+        }
+    }
+    return true;
+}
+
+// 一批应答都收到之后，保持连接的发下一批，否则等待服务器关闭连接
+static void next_batch( worker* w, int epollfd, client* c ) {
+    if( c->pending > 0 || c->body_left > 0 ) {
+        return;
+    }
+    if( c->keep ) {
+        build_batch( w, c );
+        if( !flush_out( c ) ) {
+            ++w->st.errors;
+            reconnect( w, epollfd, c );
+            return;
+        }
+        update_events( epollfd, c );
+    }
+}
+
+static void handle_event( worker* w, int epollfd, client* c, unsigned int events, char* buf ) {
+    if( c->connecting ) {
+        if( !( events & ( EPOLLOUT | EPOLLERR | EPOLLHUP ) ) ) {
+            return;
+        }
+        int err = 0;
+        socklen_t elen = sizeof( err );
+        getsockopt( c->fd, SOL_SOCKET, SO_ERROR, &err, &elen );
+        if( err != 0 ) {
+            ++w->st.errors;
+            reconnect( w, epollfd, c );
+            return;
+        }
+        c->connecting = false;
+        uint64_t now = now_ns();
+        if( now >= w->record_start ) {
+            w->st.connect.record( now - c->connect_start );
+            ++w->st.connects;
+        }
+        build_batch( w, c );
+        if( !flush_out( c ) ) {
+            ++w->st.errors;
+            reconnect( w, epollfd, c );
+            return;
+        }
+        update_events( epollfd, c );
+        return;
+    }
+
+    if( events & EPOLLOUT ) {
+        if( !flush_out( c ) ) {
+            ++w->st.errors;
+            reconnect( w, epollfd, c );
+            return;
+        }
+        update_events( epollfd, c );
+    }
+
+    if( events & ( EPOLLIN | EPOLLERR | EPOLLHUP ) ) {
+        while( true ) {
+            ssize_t n = recv( c->fd, buf, READ_CHUNK, 0 );
+            if( n > 0 ) {
+                if( !consume( w, c, buf, n ) ) {
+                    ++w->st.errors;
+                    reconnect( w, epollfd, c );
+                    return;
+                }
+                if( n < READ_CHUNK ) {
+                    break;
+                }
+            } else if( n == 0 ) {
+                // 服务器关闭连接，这一批的应答应该已经全部收到
+                if( c->pending > 0 || c->keep ) {
+                    ++w->st.errors;
+                }
+                reconnect( w, epollfd, c );
+                return;
+            } else {
+                if( errno == EAGAIN || errno == EWOULDBLOCK ) {
+                    break;
+                }
+                ++w->st.errors;
+                reconnect( w, epollfd, c );
+                return;
+            }
+        }
+        next_batch( w, epollfd, c );
+    }
+}
+
+static void* run_worker( void* arg ) {
+    worker* w = ( worker* )arg;
+    int epollfd = epoll_create1( EPOLL_CLOEXEC );
+    std::vector< client > clients( w->connections );
+    for( int i = 0; i < w->connections; ++i ) {
+        clients[i].fd = -1;
+        clients[i].status = 0;
+        if( !open_conn( w, epollfd, &clients[i] ) ) {
+            ++w->st.errors;
+        }
+    }
+
+    char* buf = ( char* )malloc( READ_CHUNK );
+    epoll_event events[ MAX_EVENTS ];
+    while( true ) {
+        uint64_t now = now_ns();
+        if( now >= w->deadline ) {
+            break;
+        }
+        int timeout = ( int )( ( w->deadline - now ) / 1000000 ) + 1;
+        int number = epoll_wait( epollfd, events, MAX_EVENTS, timeout < 100 ? timeout : 100 );
+        if( number < 0 && errno != EINTR ) {
+            break;
+        }
+        for( int i = 0; i < number; ++i ) {
+            handle_event( w, epollfd, ( client* )events[i].data.ptr, events[i].events, buf );
+        }
+        // 建立连接失败的连接在这里重试
+        for( int i = 0; i < w->connections; ++i ) {
+            if( clients[i].fd < 0 && !open_conn( w, epollfd, &clients[i] ) ) {
+                ++w->st.errors;
+            }
+        }
+    }
+
+    for( int i = 0; i < w->connections; ++i ) {
+        close_conn( epollfd, &clients[i] );
+    }
+    free( buf );
+    close( epollfd );
+    return w;
+}
+
+static void usage( const char* prog ) {
+    printf( "usage: %s [options] host port_number\n"
+            "  -c, --connections=N       并发连接数，默认64\n"
+            "  -t, --threads=N           压测线程数，默认2\n"
+            "  -d, --duration=S          压测时长（秒），默认10\n"
+            "  -w, --warmup=S            预热时长（秒），不计入统计，默认1\n"
+            "  -k, --keepalive=R         一批请求之后保持连接的比例，0到1，默认1\n"
+            "  -p, --pipeline=N          流水线深度，一批连续发送的请求数，默认1\n"
+            "  -m, --mix=PATH[:W],...    请求的文件及权重，默认/index.html，\n"
+            "                            例如 /index.html:9,/images/image1.jpg:1\n",
+            basename( ( char* )prog ) );
+}
+
+static bool parse_options( options& opts, int argc, char* argv[] ) {
+    static const struct option long_options[] = {
+        { "connections",    required_argument,  NULL,   'c' },
+        { "threads",        required_argument,  NULL,   't' },
+        { "duration",       required_argument,  NULL,   'd' },
+        { "warmup",         required_argument,  NULL,   'w' },
+        { "keepalive",      required_argument,  NULL,   'k' },
+        { "pipeline",       required_argument,  NULL,   'p' },
+        { "mix",            required_argument,  NULL,   'm' },
+        { NULL,             0,                  NULL,   0 }
+    };
+    parse_targets( opts, "/index.html" );
+    int opt;
+    while( ( opt = getopt_long( argc, argv, "c:t:d:w:k:p:m:", long_options, NULL ) ) != -1 ) {
+        switch( opt ) {
+            case 'c': opts.connections = atoi( optarg ); break;
+            case 't': opts.threads = atoi( optarg ); break;
+            case 'd': opts.duration_s = atoi( optarg ); break;
+            case 'w': opts.warmup_s = atoi( optarg ); break;
+            case 'k': opts.keepalive = atof( optarg ); break;
+            case 'p': opts.pipeline = atoi( optarg ); break;
+            case 'm':
+                if( !parse_targets( opts, optarg ) ) {
+                    return false;
+                }
+                break;
+            default:
+                return false;
+        }
+    }
+    if( optind + 2 != argc ) {
+        return false;
+    }
+    opts.host = argv[ optind ];
+    opts.port = atoi( argv[ optind + 1 ] );
+    if( opts.connections <= 0 || opts.threads <= 0 || opts.duration_s <= 0 || opts.warmup_s < 0
+            || opts.keepalive < 0 || opts.keepalive > 1 || opts.pipeline <= 0 || opts.port <= 0 ) {
+        return false;
+    }
+    if( opts.threads > opts.connections ) {
+        opts.threads = opts.connections;
+    }
+
+    struct addrinfo hints, *res;
+    memset( &hints, 0, sizeof( hints ) );
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if( getaddrinfo( opts.host.c_str(), NULL, &hints, &res ) != 0 ) {
+        printf( "cannot resolve %s\n", opts.host.c_str() );
+        return false;
+    }
+    opts.addr = *( struct sockaddr_in* )res->ai_addr;
+    opts.addr.sin_port = htons( opts.port );
+    freeaddrinfo( res );
+    return true;
+}
+
+int main( int argc, char* argv[] ) {
+    options opts;
+    if( !parse_options( opts, argc, argv ) ) {
+        usage( argv[0] );
+        return 1;
+    }
+
+    printf( "%d connections, %d threads, %ds (+%ds warmup), keepalive %.2f, pipeline %d\n",
+            opts.connections, opts.threads, opts.duration_s, opts.warmup_s, opts.keepalive, opts.pipeline );
+    for( size_t i = 0; i < opts.targets.size(); ++i ) {
+        printf( "  %s weight %d\n", opts.targets[i].path.c_str(), opts.targets[i].weight );
+    }
+
+    uint64_t start = now_ns();
+    uint64_t record_start = start + ( uint64_t )opts.warmup_s * 1000000000ull;
+    uint64_t deadline = record_start + ( uint64_t )opts.duration_s * 1000000000ull;
+    std::vector< worker* > workers;
+    for( int i = 0; i < opts.threads; ++i ) {
+        worker* w = new worker;
+        w->opts = &opts;
+        // 连接尽量平均分给各线程
+        w->connections = opts.connections / opts.threads + ( i < opts.connections % opts.threads ? 1 : 0 );
+        w->record_start = record_start;
+        w->deadline = deadline;
+        w->seed = ( unsigned int )( start >> 10 ) + i * 7919;
+        if( pthread_create( &w->thread, NULL, run_worker, w ) != 0 ) {
+            printf( "create thread failure\n" );
+            return 1;
+        }
+        workers.push_back( w );
+    }
+
+    stats total;
+    for( size_t i = 0; i < workers.size(); ++i ) {
+        pthread_join( workers[i]->thread, NULL );
+        stats& st = workers[i]->st;
+        total.latency.merge( st.latency );
+        total.connect.merge( st.connect );
+        total.requests += st.requests;
+        total.bytes += st.bytes;
+        total.connects += st.connects;
+        total.errors += st.errors;
+        for( int j = 0; j < 6; ++j ) {
+            total.status[j] += st.status[j];
+        }
+        delete workers[i];
+    }
+
+    double seconds = opts.duration_s;
+    printf( "requests %llu (%.0f req/s), %.2f MB/s, connects %llu, errors %llu\n",
+            ( unsigned long long )total.requests, total.requests / seconds,
+            total.bytes / seconds / ( 1024 * 1024 ), ( unsigned long long )total.connects,
+            ( unsigned long long )total.errors );
+    printf( "status 2xx %llu, 3xx %llu, 4xx %llu, 5xx %llu, other %llu\n",
+            ( unsigned long long )total.status[2], ( unsigned long long )total.status[3],
+            ( unsigned long long )total.status[4], ( unsigned long long )total.status[5],
+            ( unsigned long long )( total.status[0] + total.status[1] ) );
+    total.latency.print( "latency", 1000, "us" );
+    if( total.connect.count() > 0 ) {
+        total.connect.print( "connect", 1000, "us" );
+    }
+    return 0;
+}
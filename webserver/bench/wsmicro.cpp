@@ -0,0 +1,378 @@
+/*
+    http_conn的进程内微基准：不经过socket，用feed()把构造好的请求放进读缓冲区，
+    process_requests()依次对每个请求调用process_read()和process_write()，
+    再用send_iov()/sent()模拟发送完成，统计每一轮的耗时。
+    文件从真实的打开文件缓存中取得，第一轮之后都命中缓存，所以测到的是解析和生成应答本身的开销。
+    同时替换了malloc/calloc/realloc，统计预热之后主线程在请求路径上的分配次数：稳态下请求路径不应该调用malloc，
+    任何一个用例有分配时打印出来并以非0退出，可以放在提交检查中。
+    开始计时之前先在子进程中检查超过2GB的文件（临时目录中的稀疏文件）走sendfile时的Content-Length和待发送字节数，
+    不符合时同样以非0退出。
+
+    编译（在webserver目录下）：
+        g++ -O2 -I. bench/wsmicro.cpp http_conn.cpp http_parser.cpp http_response.cpp \
+            buffer_pool.cpp file_cache.cpp mime_types.cpp body_handler.cpp timer_wheel.cpp metrics.cpp logger.cpp conn_table.cpp upstream.cpp response_arena.cpp tls.cpp hpack.cpp http2.cpp doc_index.cpp numa.cpp -pthread -o wsmicro
+    运行： ./wsmicro [-n iterations] [-r doc_root] [-l log_file] [-s small_file_bytes] [case...]
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <libgen.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/wait.h>
+#include <string>
+#include "http_conn.h"
+#include "doc_index.h"
+#include "file_cache.h"
+#include "response_arena.h"
+#include "http_response.h"
+#include "logger.h"
+#include "hdr_histogram.h"
+
+extern const char* doc_root;
+
+/*
+    统计分配次数：可执行文件中定义的malloc等覆盖glibc的版本（operator new也通过它们），
+    真正的分配交给glibc导出的__libc_*。只有打开了alloc_counting的线程计数。
+*/
+extern "C" void* __libc_malloc( size_t size );
+extern "C" void* __libc_calloc( size_t n, size_t size );
+extern "C" void* __libc_realloc( void* p, size_t size );
+
+static __thread bool alloc_counting = false;
+static __thread long alloc_count = 0;
+
+extern "C" void* malloc( size_t size ) {
+    if( alloc_counting ) {
+        ++alloc_count;
+    }
+    return __libc_malloc( size );
+}
+
+extern "C" void* calloc( size_t n, size_t size ) {
+    if( alloc_counting ) {
+        ++alloc_count;
+    }
+    return __libc_calloc( n, size );
+}
+
+extern "C" void* realloc( void* p, size_t size ) {
+    if( alloc_counting ) {
+        ++alloc_count;
+    }
+    return __libc_realloc( p, size );
+}
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ( uint64_t )ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static const char* browser_headers =
+    "Host: 127.0.0.1:10000\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:128.0) Gecko/20100101 Firefox/128.0\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+    "Accept-Language: zh-CN,zh;q=0.8,en-US;q=0.5,en;q=0.3\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Connection: keep-alive\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "\r\n";
+
+// 一个基准用例：每一轮把data整体feed进去，应答一共requests个
+struct bench_case {
+    const char* name;
+    std::string data;
+    int requests;
+};
+
+static std::string make_get( const char* path, const char* headers ) {
+    std::string s = "GET ";
+    s += path;
+    s += " HTTP/1.1\r\n";
+    s += headers;
+    return s;
+}
+
+static void build_cases( bench_case* cases, int* count ) {
+    int n = 0;
+    cases[n].name = "get";
+    cases[n].data = make_get( "/index.html", browser_headers );
+    cases[n++].requests = 1;
+
+    cases[n].name = "get-minimal";
+    cases[n].data = make_get( "/index.html", "Connection: keep-alive\r\n\r\n" );
+    cases[n++].requests = 1;
+
+    cases[n].name = "get-large-file";
+    cases[n].data = make_get( "/images/image1.jpg", browser_headers );
+    cases[n++].requests = 1;
+
+    // 条件请求命中，回复不带内容的304
+    cases[n].name = "not-modified";
+    cases[n].data = make_get( "/index.html", "Connection: keep-alive\r\n"
+            "If-Modified-Since: Fri, 01 Jan 2100 00:00:00 GMT\r\n\r\n" );
+    cases[n++].requests = 1;
+
+    cases[n].name = "not-found";
+    cases[n].data = make_get( "/no-such-file.html", browser_headers );
+    cases[n++].requests = 1;
+
+    // 头部很多的请求，主要是解析的开销
+    std::string many = "Host: 127.0.0.1:10000\r\nConnection: keep-alive\r\n";
+    for( int i = 0; i < 28; ++i ) {
+        char line[ 96 ];
+        snprintf( line, sizeof( line ), "X-Bench-Header-%02d: value-%02d-abcdefghijklmnopqrstuvwxyz\r\n", i, i );
+        many += line;
+    }
+    many += "\r\n";
+    cases[n].name = "many-headers";
+    cases[n].data = make_get( "/index.html", many.c_str() );
+    cases[n++].requests = 1;
+
+    // 一次到达16个流水线请求，一批应答，主要是生成和合并应答的开销
+    std::string one = make_get( "/index.html", browser_headers );
+    cases[n].name = "pipeline-16";
+    cases[n].data.clear();
+    for( int i = 0; i < http_conn::MAX_PIPELINE; ++i ) {
+        cases[n].data += one;
+    }
+    cases[n++].requests = http_conn::MAX_PIPELINE;
+
+    // 带请求体的POST，处理者在连接的conn_arena中创建
+    std::string body( 256, 'x' );
+    cases[n].name = "post-small";
+    cases[n].data = "POST /submit HTTP/1.1\r\nHost: 127.0.0.1:10000\r\nConnection: keep-alive\r\n"
+            "Content-Type: text/plain\r\nContent-Length: 256\r\n\r\n" + body;
+    cases[n++].requests = 1;
+
+    cases[n].name = "post-chunked";
+    cases[n].data = "POST /submit HTTP/1.1\r\nHost: 127.0.0.1:10000\r\nConnection: keep-alive\r\n"
+            "Transfer-Encoding: chunked\r\n\r\n100\r\n" + body + "\r\n0\r\n\r\n";
+    cases[n++].requests = 1;
+
+    *count = n;
+}
+
+/*
+    跑一轮：feed、解析并生成应答、把待发送的字节全部标记为已发送，直到读缓冲区中的请求都应答完。
+    一批放不下的流水线请求分成几批应答，和服务器发完一批再处理下一批相同。
+    返回false表示结果不符合预期（没有应答或连接被要求关闭）。
+*/
+static bool run_once( http_conn* conn, const bench_case* c ) {
+    if( !conn->feed( c->data.data(), ( int )c->data.size() ) ) {
+        return false;
+    }
+    do {
+        if( !conn->process_requests() || !conn->writing() ) {
+            return false;
+        }
+        struct iovec* iov;
+        int cnt = conn->send_iov( &iov );
+        int total = 0;
+        for( int i = 0; i < cnt; ++i ) {
+            total += ( int )iov[i].iov_len;
+        }
+        if( !conn->sent( total ) ) {
+            return false;
+        }
+    } while( conn->pending_input() );
+    return true;
+}
+
+/*
+    超过INT_MAX字节的文件：Content-Length和sendfile要发送的字节数都不能截断。
+    在子进程中用单独的临时根目录和打开文件缓存检查，不影响之后的基准用例，返回是否通过
+*/
+static bool check_huge_file() {
+    pid_t pid = fork();
+    if( pid < 0 ) {
+        return false;
+    }
+    if( pid > 0 ) {
+        int status = 0;
+        return waitpid( pid, &status, 0 ) == pid && WIFEXITED( status ) && WEXITSTATUS( status ) == 0;
+    }
+
+    const off_t size = ( off_t )INT_MAX + 4097;
+    char dir[] = "/tmp/wsmicro.XXXXXX";
+    if( !mkdtemp( dir ) ) {
+        _exit( 1 );
+    }
+    std::string path = std::string( dir ) + "/huge.bin";
+    int fd = open( path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+    bool ok = fd >= 0 && ftruncate( fd, size ) == 0;
+    if( fd >= 0 ) {
+        close( fd );
+    }
+    doc_root = dir;
+    http_conn::m_sendfile_threshold = 256 * 1024;
+    ok = ok && doc_index::instance()->init( doc_root )
+            && file_cache::instance()->init( 64 * 1024 * 1024, 16, 1000, false );
+    file_cache::instance()->set_map_limit( http_conn::m_sendfile_threshold );
+    update_http_date();
+
+    if( ok ) {
+        http_conn* conn = new http_conn;
+        sockaddr_in addr;
+        memset( &addr, 0, sizeof( addr ) );
+        conn->init( open( "/dev/null", O_RDWR ), addr, -1 );
+        std::string req = make_get( "/huge.bin", "Connection: keep-alive\r\n\r\n" );
+        if( !conn->feed( req.data(), ( int )req.size() ) || !conn->process_requests() ) {
+            printf( "%-20s GET /huge.bin failure\n", "huge-file" );
+            ok = false;
+        }
+        struct iovec* iov;
+        int cnt = ok ? conn->send_iov( &iov ) : 0;
+        std::string head;
+        for( int i = 0; i < cnt; ++i ) {
+            head.append( ( const char* )iov[i].iov_base, iov[i].iov_len );
+        }
+        char expect[ 64 ];
+        snprintf( expect, sizeof( expect ), "\r\nContent-Length: %lld\r\n", ( long long )size );
+        if( ok && head.find( expect ) == std::string::npos ) {
+            printf( "%-20s Content-Length of a %lld byte file is wrong\n", "huge-file", ( long long )size );
+            ok = false;
+        }
+        // 响应头发完之后，文件内容还没有发送
+        if( ok && ( !conn->writing() || !conn->sent( ( int )head.size() ) || !conn->writing() ) ) {
+            printf( "%-20s bytes to send of a %lld byte file are wrong\n", "huge-file", ( long long )size );
+            ok = false;
+        }
+        conn->close_conn();
+        delete conn;
+    } else {
+        printf( "%-20s create %s failure\n", "huge-file", path.c_str() );
+    }
+    unlink( path.c_str() );
+    rmdir( dir );
+    fflush( stdout );
+    _exit( ok ? 0 : 1 );
+}
+
+static void usage( const char* prog ) {
+    printf( "usage: %s [options] [case...]\n"
+            "  -n, --iterations=N        每个用例的轮数，默认200000\n"
+            "  -r, --root=DIR            网站根目录，默认使用服务器编译进去的doc_root\n"
+            "  -l, --log=PATH            打开访问日志，写入PATH，用来衡量日志的开销\n"
+            "  -s, --small-file=BYTES    不大于该大小的文件使用预先生成的完整应答，默认1024，0表示不使用\n"
+            "cases: get get-minimal get-large-file not-modified not-found many-headers pipeline-16 post-small post-chunked\n",
+            basename( ( char* )prog ) );
+}
+
+int main( int argc, char* argv[] ) {
+    static const struct option long_options[] = {
+        { "iterations",     required_argument,  NULL,   'n' },
+        { "root",           required_argument,  NULL,   'r' },
+        { "log",            required_argument,  NULL,   'l' },
+        { "small-file",     required_argument,  NULL,   's' },
+        { NULL,             0,                  NULL,   0 }
+    };
+    long iterations = 200000;
+    const char* log_path = NULL;
+    int opt;
+    while( ( opt = getopt_long( argc, argv, "n:r:l:s:", long_options, NULL ) ) != -1 ) {
+        switch( opt ) {
+            case 'n': iterations = atol( optarg ); break;
+            case 'r': doc_root = optarg; break;
+            case 'l': log_path = optarg; break;
+            case 's': http_conn::m_prerender_size = atoi( optarg ); break;
+            default: usage( argv[0] ); return 1;
+        }
+    }
+    if( iterations <= 0 ) {
+        usage( argv[0] );
+        return 1;
+    }
+
+    if( !check_huge_file() ) {
+        return 1;
+    }
+    if( !doc_index::instance()->init( doc_root ) ) {
+        printf( "scan document root %s failure\n", doc_root );
+        return 1;
+    }
+    if( !file_cache::instance()->init( 64 * 1024 * 1024, 1024, 1000, false ) ) {
+        printf( "init file cache failure\n" );
+        return 1;
+    }
+    if( http_conn::m_prerender_size > 0 && !response_arena::instance()->init( 4 * 1024 * 1024 ) ) {
+        printf( "map response arena failure\n" );
+        return 1;
+    }
+    // 文件内容都从映射发送，与io_uring模式相同，不需要真正的socket
+    http_conn::m_sendfile_threshold = -1;
+    if( log_path && !logger::start( log_path, LOG_LEVEL_INFO, 1, 0, 0 ) ) {
+        printf( "open log file %s failure\n", log_path );
+        return 1;
+    }
+    update_http_date();
+
+    bench_case cases[ 16 ];
+    int count;
+    build_cases( cases, &count );
+
+    // 连接不会真正收发，给它一个有效的fd即可
+    int devnull = open( "/dev/null", O_RDWR );
+    int saved_stdout = dup( STDOUT_FILENO );
+    hdr_histogram hist;
+    bool allocated = false;     // 是否有用例在稳态下调用了malloc
+
+    printf( "doc_root %s, %ld iterations, scanner %s\n", doc_root, iterations, http_scanner_name() );
+    for( int i = 0; i < count; ++i ) {
+        const bench_case* c = &cases[i];
+        bool selected = optind == argc;
+        for( int j = optind; j < argc; ++j ) {
+            selected = selected || strcmp( argv[j], c->name ) == 0;
+        }
+        if( !selected ) {
+            continue;
+        }
+
+        http_conn* conn = new http_conn;
+        sockaddr_in addr;
+        memset( &addr, 0, sizeof( addr ) );
+        conn->init( dup( devnull ), addr, -1 );
+        hist.reset();
+
+        // 服务器在请求路径上的输出也计入耗时，但不显示出来
+        fflush( stdout );
+        dup2( devnull, STDOUT_FILENO );
+        bool ok = run_once( conn, c );      // 预热：把文件装进缓存，填满缓冲区池
+        alloc_count = 0;
+        alloc_counting = true;
+        uint64_t start = now_ns();
+        for( long k = 0; ok && k < iterations; ++k ) {
+            uint64_t t0 = now_ns();
+            ok = run_once( conn, c );
+            hist.record( now_ns() - t0 );
+        }
+        uint64_t elapsed = now_ns() - start;
+        alloc_counting = false;
+        fflush( stdout );
+        dup2( saved_stdout, STDOUT_FILENO );
+
+        if( !ok ) {
+            printf( "%-20s failed\n", c->name );
+        } else {
+            hist.print( c->name, 1, "ns" );
+            printf( "%-20s %.1f ns/request, %.0f requests/s\n", "",
+                    ( double )elapsed / ( iterations * c->requests ),
+                    iterations * c->requests * 1e9 / elapsed );
+            if( alloc_count > 0 ) {
+                printf( "%-20s %ld mallocs in %ld iterations, %.2f per request\n", "", alloc_count, iterations,
+                        ( double )alloc_count / ( iterations * c->requests ) );
+                allocated = true;
+            }
+        }
+        // 连接没有注册到epoll，close_conn直接关闭它的fd副本
+        conn->close_conn();
+        delete conn;
+    }
+    close( devnull );
+    logger::stop();
+    return allocated ? 1 : 0;
+}
@@ -0,0 +1,97 @@
+#include "body_handler.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "logger.h"
+
+const char* file_upload::m_dir = NULL;
+
+body_handler* file_upload::create( const char* url, conn_arena* arena ) {
+    if( !m_dir || url[0] != '/' ) {
+        return NULL;
+    }
+    // 只接受一级的文件名，不能以'.'开头（临时文件以'.'开头，也排除了".."），不能有'/'等特殊字符
+    const char* name = url + 1;
+    if( name[0] == '\0' || name[0] == '.' ) {
+        return NULL;
+    }
+    for( const char* p = name; *p; ++p ) {
+        if( !( ( *p >= 'a' && *p <= 'z' ) || ( *p >= 'A' && *p <= 'Z' ) || ( *p >= '0' && *p <= '9' )
+                || *p == '.' || *p == '-' || *p == '_' ) ) {
+            return NULL;
+        }
+    }
+    arena_allocator< char > alloc( arena );
+    arena_string path( m_dir, alloc );
+    path += "/";
+    path += name;
+    arena_string temp( m_dir, alloc );
+    temp += "/.";
+    temp += name;
+    temp += ".XXXXXX";
+    int fd = mkostemp( &temp[0], O_CLOEXEC );
+    if( fd < 0 ) {
+        LOG_ERROR( "create upload file for %s failure: %s", name, strerror( errno ) );
+        return NULL;
+    }
+    void* p = arena->alloc( sizeof( file_upload ), alignof( file_upload ) );
+    if( !p ) {
+        close( fd );
+        unlink( temp.c_str() );
+        return NULL;
+    }
+    return new ( p ) file_upload( fd, path, temp );
+}
+
+file_upload::~file_upload() {
+    if( m_fd >= 0 ) {
+        close( m_fd );
+    }
+}
+
+bool file_upload::write( const char* data, int len ) {
+    while( len > 0 ) {
+        ssize_t n = ::write( m_fd, data, len );
+        if( n < 0 ) {
+            if( errno == EINTR ) {
+                continue;
+            }
+            LOG_ERROR( "write upload file %s failure: %s", m_temp.c_str(), strerror( errno ) );
+            return false;
+        }
+        data += n;
+        len -= n;
+        m_size += n;
+    }
+    return true;
+}
+
+int file_upload::finish( char* msg, int size ) {
+    close( m_fd );
+    m_fd = -1;
+    bool existed = access( m_path.c_str(), F_OK ) == 0;
+    if( rename( m_temp.c_str(), m_path.c_str() ) < 0 ) {
+        LOG_ERROR( "rename upload file %s failure: %s", m_temp.c_str(), strerror( errno ) );
+        unlink( m_temp.c_str() );
+        snprintf( msg, size, "Failed to store the uploaded file.\n" );
+        return 500;
+    }
+    snprintf( msg, size, "Stored %ld bytes.\n", m_size );
+    return existed ? 200 : 201;
+}
+
+void file_upload::abort() {
+    if( m_fd >= 0 ) {
+        close( m_fd );
+        m_fd = -1;
+        unlink( m_temp.c_str() );
+    }
+}
+
+int discard_body::finish( char* msg, int size ) {
+    snprintf( msg, size, "Received %ld bytes.\n", m_size );
+    return 200;
+}
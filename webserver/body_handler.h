@@ -0,0 +1,66 @@
+#ifndef BODY_HANDLER_H
+#define BODY_HANDLER_H
+
+#include "conn_arena.h"
+
+/*
+    请求体的处理者
+    http_conn解析完请求头后创建处理者，请求体（去掉分块编码之后）按到达的顺序一块一块地交给write()，
+    连接中只保留一个读缓冲区大小的数据，内存占用与请求体的大小无关。
+    处理者提供了splice_fd()时，epoll模式下长度已知的请求体不经过读缓冲区，由splice从socket经过管道直接写入这个文件。
+    处理者只被连接当前所在的线程使用，不需要加锁。
+    处理者和它用到的内存都放在连接的conn_arena中，请求结束时http_conn显式调用析构函数，不delete。
+*/
+class body_handler {
+public:
+    virtual ~body_handler() {}
+    virtual bool write( const char* data, int len ) = 0;    // 返回false时中止请求，回复500
+    virtual int splice_fd() { return -1; }                  // 可以用splice直接写入的文件，-1表示不支持
+    virtual void spliced( long len ) {}                     // 有len字节已经splice进了splice_fd()
+    // 请求体接收完毕，返回应答的状态码，应答内容（文本）写入msg
+    virtual int finish( char* msg, int size ) = 0;
+    // 请求体没有收完连接就关闭了，或者请求出错，丢弃已经收到的内容
+    virtual void abort() {}
+};
+
+// PUT：请求体写入上传目录中的同名文件。先写临时文件，收完后rename，读者不会看到写了一半的文件
+class file_upload : public body_handler {
+public:
+    static void set_dir( const char* dir ) { m_dir = dir; }
+    static bool enabled() { return m_dir != NULL; }
+    // url只能是上传目录下的一个普通文件名，否则（或者没有设置上传目录）返回NULL
+    static body_handler* create( const char* url, conn_arena* arena );
+
+    ~file_upload();
+    bool write( const char* data, int len );
+    int splice_fd() { return m_fd; }
+    void spliced( long len ) { m_size += len; }
+    int finish( char* msg, int size );
+    void abort();
+
+private:
+    file_upload( int fd, const arena_string& path, const arena_string& temp ) : m_fd( fd ), m_size( 0 ), m_path( path ), m_temp( temp ) {}
+
+    static const char* m_dir;   // 上传目录，NULL表示不接受PUT
+    int m_fd;                   // 临时文件
+    long m_size;                // 已写入的字节数
+    arena_string m_path;        // 目标文件
+    arena_string m_temp;        // 临时文件，收完后rename成目标文件
+};
+
+// POST的默认处理者：只统计字节数，内容丢弃。应用可以通过http_conn::m_post_handler换成自己的处理者
+class discard_body : public body_handler {
+public:
+    static body_handler* create( const char* url, conn_arena* arena ) {
+        void* p = arena->alloc( sizeof( discard_body ) );
+        return p ? new ( p ) discard_body : NULL;
+    }
+    discard_body() : m_size( 0 ) {}
+    bool write( const char* data, int len ) { m_size += len; return true; }
+    int finish( char* msg, int size );
+
+private:
+    long m_size;
+};
+
+#endif
@@ -0,0 +1,122 @@
+#include "buffer_pool.h"
+#include <stdlib.h>
+#include <stdint.h>
+
+buffer_pool* buffer_pool::instance() {
+    // 进程内唯一的实例，且不析构，退出时可能还有线程在归还缓冲区
+    static buffer_pool* pool = new buffer_pool;
+    return pool;
+}
+
+buffer_pool::buffer_pool() : m_per_node( false ) {
+}
+
+buffer_pool::~buffer_pool() {
+    if( m_per_node ) {
+        // 缓冲区都在大页块中，块不单独记录，随进程退出释放
+        return;
+    }
+    for( int i = 0; i <= MAX_SHIFT - MIN_SHIFT; ++i ) {
+        size_class& sc = m_nodes[0].classes[i];
+        while( sc.head ) {
+            free_buf* b = sc.head;
+            sc.head = b->next;
+            free( b );
+        }
+    }
+}
+
+void buffer_pool::init_numa() {
+    m_per_node = true;
+}
+
+int buffer_pool::class_of( int size ) {
+    int c = 0;
+    while( ( MIN_SIZE << c ) < size ) {
+        ++c;
+    }
+    return c;
+}
+
+char* buffer_pool::carve( int node, size_t size ) {
+    node_pool& np = m_nodes[node];
+    char* p = NULL;
+
+    np.lock.lock();
+    if( !np.chunk || np.used + size > CHUNK_SIZE ) {
+        // 换一个新的块，旧块末尾放不下的部分不再使用（最多不到一个最大等级）
+        bool huge;
+        char* chunk = ( char* )numa::map( CHUNK_SIZE, node, &huge );
+        if( chunk ) {
+            ( ( chunk_header* )chunk )->node = node;
+            np.chunk = chunk;
+            np.used = CHUNK_HEADER_SIZE;
+        }
+    }
+    if( np.chunk && np.used + size <= CHUNK_SIZE ) {
+        p = np.chunk + np.used;
+        np.used += size;
+    }
+    np.lock.unlock();
+    return p;
+}
+
+char* buffer_pool::acquire( int size, int* actual ) {
+    if( size > MAX_SIZE ) {
+        return NULL;
+    }
+    int c = class_of( size );
+    int node = m_per_node ? numa::current_node() : 0;
+    size_class& sc = m_nodes[node].classes[c];
+
+    sc.lock.lock();
+    free_buf* b = sc.head;
+    if( b ) {
+        sc.head = b->next;
+        --sc.free_count;
+    }
+    sc.lock.unlock();
+
+    if( !b ) {
+        b = ( free_buf* )( m_per_node ? carve( node, MIN_SIZE << c ) : ( char* )malloc( MIN_SIZE << c ) );
+        if( !b ) {
+            return NULL;
+        }
+    }
+    *actual = MIN_SIZE << c;
+    return ( char* )b;
+}
+
+void buffer_pool::release( char* buf, int size ) {
+    if( !buf ) {
+        return;
+    }
+    int c = class_of( size );
+    free_buf* b = ( free_buf* )buf;
+
+    if( m_per_node ) {
+        // 块按大页对齐，由地址找到块的开头，归还到切出它的节点
+        chunk_header* h = ( chunk_header* )( ( uintptr_t )buf & ~( uintptr_t )( CHUNK_SIZE - 1 ) );
+        size_class& sc = m_nodes[ h->node ].classes[c];
+        sc.lock.lock();
+        b->next = sc.head;
+        sc.head = b;
+        ++sc.free_count;
+        sc.lock.unlock();
+        return;
+    }
+
+    size_class& sc = m_nodes[0].classes[c];
+    sc.lock.lock();
+    if( sc.free_count * size < MAX_FREE_BYTES ) {
+        b->next = sc.head;
+        sc.head = b;
+        ++sc.free_count;
+        b = NULL;
+    }
+    sc.lock.unlock();
+
+    if( b ) {
+        free( b );
+    }
+}
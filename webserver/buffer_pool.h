@@ -0,0 +1,75 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <stddef.h>
+#include "locker.h"
+#include "numa.h"
+
+/*
+    进程级的连接缓冲区池
+    缓冲区按2的幂分为若干大小等级（1KB ~ 64KB），每个等级一条空闲链表，链表节点直接放在空闲缓冲区的开头，不额外分配内存。
+    连接开始收发数据时才从池中取缓冲区，空闲时归还，常驻内存与活跃连接数成正比，而不是与MAX_FD成正比。
+    每个等级最多保留MAX_FREE_BYTES字节的空闲缓冲区，多余的直接free还给系统。
+    缓冲区会在反应堆线程和工作线程之间交接，所以每个等级各有一把锁。
+
+    按节点分池（init_numa()，--numa）：每个NUMA节点一组空闲链表，缓冲区从调用线程所在节点的2MB大页块中切出，
+    块的开头记录所属的节点，由哪个线程归还都回到原来节点的链表上，所以解析和写应答时访问的缓冲区总在取得它的线程的节点上。
+    大页块不还给系统，空闲的缓冲区都留在链表上，常驻内存是各等级用量的高水位。
+*/
+class buffer_pool {
+public:
+    static const int MIN_SHIFT = 10;                        // 最小的等级1KB
+    static const int MAX_SHIFT = 16;                        // 最大的等级64KB
+    static const int MIN_SIZE = 1 << MIN_SHIFT;
+    static const int MAX_SIZE = 1 << MAX_SHIFT;
+    static const size_t MAX_FREE_BYTES = 4 * 1024 * 1024;   // 每个等级保留的空闲缓冲区上限
+    static const size_t CHUNK_SIZE = numa::HUGE_PAGE_SIZE;  // 按节点分池时每次映射的大页块
+
+public:
+    static buffer_pool* instance();
+
+    // 改为按节点分池，应在开始处理请求之前调用
+    void init_numa();
+
+    // 取一块不小于size的缓冲区，实际大小（所在等级的大小）写入*actual，size超过MAX_SIZE或内存不足时返回NULL
+    char* acquire( int size, int* actual );
+    // 归还acquire得到的缓冲区，size是acquire给出的实际大小
+    void release( char* buf, int size );
+
+private:
+    buffer_pool();
+    ~buffer_pool();
+    static int class_of( int size );    // 不小于size的最小等级
+    char* carve( int node, size_t size );   // 从节点node的大页块中切出size字节
+
+    struct free_buf {
+        free_buf* next;
+    };
+
+    struct size_class {
+        size_class() : head( NULL ), free_count( 0 ) {}
+        locker lock;
+        free_buf* head;     // 空闲链表
+        size_t free_count;  // 空闲缓冲区个数
+    };
+
+    // 大页块的开头，之后依次切出缓冲区
+    struct chunk_header {
+        int node;
+    };
+    static const size_t CHUNK_HEADER_SIZE = 64;
+
+    // 一个节点的空闲链表和正在切分的大页块，不按节点分池时只用第0个
+    struct node_pool {
+        node_pool() : chunk( NULL ), used( 0 ) {}
+        size_class classes[ MAX_SHIFT - MIN_SHIFT + 1 ];
+        locker lock;        // 保护chunk和used
+        char* chunk;
+        size_t used;        // chunk中已经切出的字节数
+    };
+
+    node_pool m_nodes[ numa::MAX_NODES ];
+    bool m_per_node;        // 是否按节点分池
+};
+
+#endif
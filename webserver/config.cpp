@@ -0,0 +1,285 @@
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <libgen.h>
+#include <string.h>
+#include "threadpool.h"
+#include "event_loop.h"
+#include "logger.h"
+
+config::config() :
+        port( 0 ), doc_root( NULL ), reactor_number( 1 ), numa( false ), io_mode( IO_EPOLL ),
+        backlog( 1024 ), defer_accept( 1 ), max_connections( 0 ),
+        cache_max_bytes( 64 * 1024 * 1024 ), cache_max_entries( 1024 ),
+        cache_revalidate_ms( 1000 ), cache_inotify( false ),
+        queue_mode( QUEUE_LOCKED ), pin_mode( PIN_NONE ), pool_threads( 0 ), pool_max_threads( 0 ),
+        queue_slo_ms( 200 ), sendfile_threshold( 256 * 1024 ),
+        small_file_bytes( 1024 ), small_cache_bytes( 4 * 1024 * 1024 ),
+        upload_dir( NULL ), max_body_bytes( 1024ll * 1024 * 1024 ), mime_types_path( NULL ),
+        proxy_route_number( 0 ), upstream_keepalive( 32 ), tls_cert( NULL ), tls_key( NULL ),
+        http2( false ),
+        log_path( NULL ), log_level( LOG_LEVEL_INFO ), log_sample( 1 ), log_max_bytes( 64 * 1024 * 1024 ), log_keep( 4 ),
+        timer_tick_ms( 100 ), header_timeout_ms( 10000 ), body_timeout_ms( 30000 ),
+        idle_timeout_ms( 60000 ), write_timeout_ms( 60000 ), drain_timeout_ms( 30000 ) {
+}
+
+void config::usage( const char* prog ) {
+    printf( "usage: %s [options] port_number\n"
+            "      --root=DIR            网站根目录，默认使用编译进去的doc_root；启动时建立索引，之后的变化由inotify跟踪\n"
+            "  -r, --reactors=N          反应堆（事件循环线程）数量，默认1\n"
+            "      --numa                反应堆轮流绑定到各NUMA节点，连接缓冲区从所在节点的大页内存分配\n"
+            "      --io=epoll|uring|coro 事件循环使用的I/O机制，默认epoll；内核不支持时uring退回到epoll，coro需要C++20编译\n"
+            "      --backlog=N           监听队列的长度，默认1024\n"
+            "      --defer-accept=S      TCP_DEFER_ACCEPT的秒数，默认1，0表示不使用\n"
+            "      --max-conn=N          同时服务的连接数上限，超过时新连接收到503，默认0（只受MAX_FD限制）\n"
+            "      --cache-size=MB       打开文件缓存的总大小上限，默认64\n"
+            "      --cache-entries=N     打开文件缓存的缓存项个数上限，默认1024\n"
+            "      --revalidate-ms=MS    缓存项重新stat验证的间隔，默认1000，0表示每次都验证\n"
+            "      --inotify             使用inotify使缓存项失效，代替定时验证\n"
+            "      --queue=locked|lockfree|stealing  线程池请求队列的实现，默认locked\n"
+            "      --pin=none|cpu|numa   工作线程绑定到CPU或NUMA节点，默认none\n"
+            "      --threads=N           线程池的工作线程数（下限），默认0表示可用的CPU个数\n"
+            "      --max-threads=N       排队时间变长时工作线程数的上限，默认0表示下限的4倍\n"
+            "      --queue-slo=MS        线程池排队时间的SLO，超过时新请求直接收到503，默认200，0表示不限制\n"
+            "      --sendfile-threshold=BYTES  不小于该大小的文件用sendfile发送，默认262144，-1表示不使用\n"
+            "      --small-file=BYTES    不大于该大小的文件缓存预先生成的完整应答，默认1024，最大3072，0表示不使用\n"
+            "      --small-cache=MB      存放预生成应答的大页区的大小，默认4\n"
+            "      --upload-dir=DIR      PUT请求的请求体保存为DIR下的同名文件，默认不接受PUT\n"
+            "      --max-body=MB         请求体的大小上限，超过时回复413，默认1024，0表示不限制\n"
+            "      --mime-types=PATH     mime.types格式的文件（\"类型 扩展名...\"），追加或覆盖内置的扩展名表\n"
+            "      --proxy=PREFIX=HOST:PORT  URL以PREFIX开头的请求转发给后端，可以重复，最多16个\n"
+            "      --upstream-keepalive=N  每个反应堆每个后端保留的空闲keep-alive连接数，默认32\n"
+            "      --tls-cert=PATH       PEM格式的证书链，指定后端口上的连接都是HTTPS（需要用-DWS_WITH_TLS编译）\n"
+            "      --tls-key=PATH        PEM格式的私钥，默认从证书文件中读取\n"
+            "      --http2               接受HTTP/2：HTTPS用ALPN协商，明文连接用prior knowledge或Upgrade: h2c\n"
+            "      --header-timeout=S    读取请求行和头部的超时（秒），默认10，0表示不限制\n"
+            "      --body-timeout=S      读取请求体的超时（秒），默认30\n"
+            "      --idle-timeout=S      keep-alive连接的空闲超时（秒），默认60\n"
+            "      --write-timeout=S     发送响应的超时（秒），默认60\n"
+            "      --drain-timeout=S     平滑退出时等待已有连接的时间（秒），默认30，0表示一直等待\n"
+            "      --log=PATH            异步写入的访问和错误日志文件，默认不写（错误输出到标准输出）\n"
+            "      --log-level=error|warn|info|debug  记录的最高级别，默认info（包括访问日志）\n"
+            "      --log-sample=N        每N个请求记录一条访问日志，默认1\n"
+            "      --log-max-size=MB     日志文件超过该大小时轮转，默认64，0表示不轮转\n"
+            "      --log-keep=N          轮转时保留的旧日志文件个数，默认4\n",
+            basename( ( char* )prog ) );
+}
+
+bool config::parse( int argc, char* argv[] ) {
+    enum { OPT_CACHE_SIZE = 256, OPT_CACHE_ENTRIES, OPT_REVALIDATE_MS, OPT_INOTIFY, OPT_SENDFILE_THRESHOLD, OPT_QUEUE, OPT_PIN,
+            OPT_HEADER_TIMEOUT, OPT_BODY_TIMEOUT, OPT_IDLE_TIMEOUT, OPT_WRITE_TIMEOUT, OPT_IO,
+            OPT_BACKLOG, OPT_DEFER_ACCEPT, OPT_MAX_CONN, OPT_LOG, OPT_LOG_LEVEL, OPT_LOG_SAMPLE, OPT_LOG_MAX_SIZE,
+            OPT_LOG_KEEP, OPT_MIME_TYPES, OPT_UPLOAD_DIR, OPT_MAX_BODY, OPT_DRAIN_TIMEOUT,
+            OPT_PROXY, OPT_UPSTREAM_KEEPALIVE, OPT_SMALL_FILE, OPT_SMALL_CACHE, OPT_TLS_CERT, OPT_TLS_KEY, OPT_HTTP2,
+            OPT_THREADS, OPT_MAX_THREADS, OPT_QUEUE_SLO, OPT_ROOT, OPT_NUMA };
+    static const struct option options[] = {
+        { "root",           required_argument,  NULL,   OPT_ROOT },
+        { "reactors",       required_argument,  NULL,   'r' },
+        { "numa",           no_argument,        NULL,   OPT_NUMA },
+        { "cache-size",     required_argument,  NULL,   OPT_CACHE_SIZE },
+        { "cache-entries",  required_argument,  NULL,   OPT_CACHE_ENTRIES },
+        { "revalidate-ms",  required_argument,  NULL,   OPT_REVALIDATE_MS },
+        { "inotify",        no_argument,        NULL,   OPT_INOTIFY },
+        { "sendfile-threshold", required_argument, NULL, OPT_SENDFILE_THRESHOLD },
+        { "queue",          required_argument,  NULL,   OPT_QUEUE },
+        { "pin",            required_argument,  NULL,   OPT_PIN },
+        { "threads",        required_argument,  NULL,   OPT_THREADS },
+        { "max-threads",    required_argument,  NULL,   OPT_MAX_THREADS },
+        { "queue-slo",      required_argument,  NULL,   OPT_QUEUE_SLO },
+        { "header-timeout", required_argument,  NULL,   OPT_HEADER_TIMEOUT },
+        { "body-timeout",   required_argument,  NULL,   OPT_BODY_TIMEOUT },
+        { "idle-timeout",   required_argument,  NULL,   OPT_IDLE_TIMEOUT },
+        { "write-timeout",  required_argument,  NULL,   OPT_WRITE_TIMEOUT },
+        { "drain-timeout",  required_argument,  NULL,   OPT_DRAIN_TIMEOUT },
+        { "io",             required_argument,  NULL,   OPT_IO },
+        { "backlog",        required_argument,  NULL,   OPT_BACKLOG },
+        { "defer-accept",   required_argument,  NULL,   OPT_DEFER_ACCEPT },
+        { "max-conn",       required_argument,  NULL,   OPT_MAX_CONN },
+        { "log",            required_argument,  NULL,   OPT_LOG },
+        { "log-level",      required_argument,  NULL,   OPT_LOG_LEVEL },
+        { "log-sample",     required_argument,  NULL,   OPT_LOG_SAMPLE },
+        { "log-max-size",   required_argument,  NULL,   OPT_LOG_MAX_SIZE },
+        { "log-keep",       required_argument,  NULL,   OPT_LOG_KEEP },
+        { "mime-types",     required_argument,  NULL,   OPT_MIME_TYPES },
+        { "upload-dir",     required_argument,  NULL,   OPT_UPLOAD_DIR },
+        { "max-body",       required_argument,  NULL,   OPT_MAX_BODY },
+        { "proxy",          required_argument,  NULL,   OPT_PROXY },
+        { "upstream-keepalive", required_argument, NULL, OPT_UPSTREAM_KEEPALIVE },
+        { "small-file",     required_argument,  NULL,   OPT_SMALL_FILE },
+        { "small-cache",    required_argument,  NULL,   OPT_SMALL_CACHE },
+        { "tls-cert",       required_argument,  NULL,   OPT_TLS_CERT },
+        { "tls-key",        required_argument,  NULL,   OPT_TLS_KEY },
+        { "http2",          no_argument,        NULL,   OPT_HTTP2 },
+        { NULL,             0,                  NULL,   0 }
+    };
+
+    int opt;
+    while( ( opt = getopt_long( argc, argv, "r:", options, NULL ) ) != -1 ) {
+        switch( opt ) {
+            case 'r':
+                reactor_number = atoi( optarg );
+                break;
+            case OPT_CACHE_SIZE:
+                cache_max_bytes = ( size_t )atol( optarg ) * 1024 * 1024;
+                break;
+            case OPT_CACHE_ENTRIES:
+                cache_max_entries = atoi( optarg );
+                break;
+            case OPT_REVALIDATE_MS:
+                cache_revalidate_ms = atoi( optarg );
+                break;
+            case OPT_INOTIFY:
+                cache_inotify = true;
+                break;
+            case OPT_QUEUE:
+                if( strcmp( optarg, "locked" ) == 0 ) {
+                    queue_mode = QUEUE_LOCKED;
+                } else if( strcmp( optarg, "lockfree" ) == 0 ) {
+                    queue_mode = QUEUE_LOCKFREE;
+                } else if( strcmp( optarg, "stealing" ) == 0 ) {
+                    queue_mode = QUEUE_STEALING;
+                } else {
+                    return false;
+                }
+                break;
+            case OPT_PIN:
+                if( strcmp( optarg, "none" ) == 0 ) {
+                    pin_mode = PIN_NONE;
+                } else if( strcmp( optarg, "cpu" ) == 0 ) {
+                    pin_mode = PIN_CPU;
+                } else if( strcmp( optarg, "numa" ) == 0 ) {
+                    pin_mode = PIN_NUMA;
+                } else {
+                    return false;
+                }
+                break;
+            case OPT_ROOT:
+                doc_root = optarg;
+                break;
+            case OPT_NUMA:
+                numa = true;
+                break;
+            case OPT_THREADS:
+                pool_threads = atoi( optarg );
+                break;
+            case OPT_MAX_THREADS:
+                pool_max_threads = atoi( optarg );
+                break;
+            case OPT_QUEUE_SLO:
+                queue_slo_ms = atoi( optarg );
+                break;
+            case OPT_HEADER_TIMEOUT:
+                header_timeout_ms = atoi( optarg ) * 1000;
+                break;
+            case OPT_BODY_TIMEOUT:
+                body_timeout_ms = atoi( optarg ) * 1000;
+                break;
+            case OPT_IDLE_TIMEOUT:
+                idle_timeout_ms = atoi( optarg ) * 1000;
+                break;
+            case OPT_WRITE_TIMEOUT:
+                write_timeout_ms = atoi( optarg ) * 1000;
+                break;
+            case OPT_DRAIN_TIMEOUT:
+                drain_timeout_ms = atoi( optarg ) * 1000;
+                break;
+            case OPT_IO:
+                if( strcmp( optarg, "epoll" ) == 0 ) {
+                    io_mode = IO_EPOLL;
+                } else if( strcmp( optarg, "uring" ) == 0 ) {
+                    io_mode = IO_URING;
+                } else if( strcmp( optarg, "coro" ) == 0 ) {
+                    io_mode = IO_CORO;
+                } else {
+                    return false;
+                }
+                break;
+            case OPT_BACKLOG:
+                backlog = atoi( optarg );
+                break;
+            case OPT_DEFER_ACCEPT:
+                defer_accept = atoi( optarg );
+                break;
+            case OPT_MAX_CONN:
+                max_connections = atoi( optarg );
+                break;
+            case OPT_LOG:
+                log_path = optarg;
+                break;
+            case OPT_LOG_LEVEL:
+                if( strcmp( optarg, "error" ) == 0 ) {
+                    log_level = LOG_LEVEL_ERROR;
+                } else if( strcmp( optarg, "warn" ) == 0 ) {
+                    log_level = LOG_LEVEL_WARN;
+                } else if( strcmp( optarg, "info" ) == 0 ) {
+                    log_level = LOG_LEVEL_INFO;
+                } else if( strcmp( optarg, "debug" ) == 0 ) {
+                    log_level = LOG_LEVEL_DEBUG;
+                } else {
+                    return false;
+                }
+                break;
+            case OPT_LOG_SAMPLE:
+                log_sample = atoi( optarg );
+                break;
+            case OPT_LOG_MAX_SIZE:
+                log_max_bytes = atol( optarg ) * 1024 * 1024;
+                break;
+            case OPT_LOG_KEEP:
+                log_keep = atoi( optarg );
+                break;
+            case OPT_SENDFILE_THRESHOLD:
+                sendfile_threshold = atol( optarg );
+                break;
+            case OPT_SMALL_FILE:
+                small_file_bytes = atoi( optarg );
+                break;
+            case OPT_SMALL_CACHE:
+                small_cache_bytes = ( size_t )atol( optarg ) * 1024 * 1024;
+                break;
+            case OPT_MIME_TYPES:
+                mime_types_path = optarg;
+                break;
+            case OPT_UPLOAD_DIR:
+                upload_dir = optarg;
+                break;
+            case OPT_MAX_BODY:
+                max_body_bytes = atoll( optarg ) * 1024 * 1024;
+                break;
+            case OPT_PROXY:
+                if( proxy_route_number >= MAX_PROXY_ROUTES ) {
+                    return false;
+                }
+                proxy_routes[ proxy_route_number++ ] = optarg;
+                break;
+            case OPT_UPSTREAM_KEEPALIVE:
+                upstream_keepalive = atoi( optarg );
+                break;
+            case OPT_TLS_CERT:
+                tls_cert = optarg;
+                break;
+            case OPT_TLS_KEY:
+                tls_key = optarg;
+                break;
+            case OPT_HTTP2:
+                http2 = true;
+                break;
+            default:
+                return false;
+        }
+    }
+
+    if( optind >= argc ) {
+        return false;
+    }
+    // 获取端口号
+    port = atoi( argv[optind] );
+
+    return port > 0 && reactor_number > 0 && backlog > 0 && defer_accept >= 0 && max_connections >= 0
+            && max_body_bytes >= 0 && log_sample > 0 && log_max_bytes >= 0 && log_keep >= 0
+            && cache_max_entries > 0 && cache_revalidate_ms >= 0
+            && header_timeout_ms >= 0 && body_timeout_ms >= 0 && idle_timeout_ms >= 0 && write_timeout_ms >= 0
+            && drain_timeout_ms >= 0 && upstream_keepalive >= 0 && ( tls_cert || !tls_key )
+            && small_file_bytes >= 0 && small_file_bytes <= http_conn::MAX_PRERENDER_SIZE;
+}
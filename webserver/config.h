@@ -0,0 +1,69 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <stddef.h>
+
+// 服务器的启动参数，由命令行解析得到
+class config {
+public:
+    config();
+    bool parse( int argc, char* argv[] );   // 解析命令行，参数不合法时返回false
+    void usage( const char* prog );
+
+public:
+    int port;                   // 监听端口
+    const char* doc_root;       // 网站根目录，NULL表示使用编译进去的默认目录
+    int reactor_number;         // 反应堆（事件循环线程）数量
+    bool numa;                  // 反应堆按NUMA节点绑定，连接缓冲区从所在节点的大页内存分配
+    int io_mode;                // 事件循环使用的I/O机制，见IO_MODE
+    int backlog;                // 监听队列的长度
+    int defer_accept;           // TCP_DEFER_ACCEPT（秒），收到数据后才完成accept，0表示不使用
+    int max_connections;        // 同时服务的连接数上限，超过时新连接收到503，0表示只受MAX_FD限制
+
+    // 打开文件缓存
+    size_t cache_max_bytes;     // 缓存映射的总字节数上限
+    int cache_max_entries;      // 缓存项个数上限
+    int cache_revalidate_ms;    // 定时验证间隔（毫秒）
+    bool cache_inotify;         // 使用inotify代替定时验证
+
+    int queue_mode;             // 线程池请求队列的实现，见QUEUE_MODE
+    int pin_mode;               // 工作线程的CPU绑定方式，见PIN_MODE
+    int pool_threads;           // 线程池的工作线程数（下限），0表示可用的CPU个数
+    int pool_max_threads;       // 按排队时间增加工作线程时的上限，0表示下限的4倍
+    int queue_slo_ms;           // 线程池排队时间的SLO（毫秒），超过时直接回复503，0表示不限制
+
+    long sendfile_threshold;    // 不小于该大小的文件用sendfile发送，负数表示不使用
+    int small_file_bytes;       // 不大于该大小的文件缓存预先生成的完整应答，0表示不使用
+    size_t small_cache_bytes;   // 存放预生成应答的大页区的大小
+    const char* upload_dir;     // PUT上传的文件保存的目录，NULL表示不接受PUT
+    long long max_body_bytes;   // 请求体的大小上限，0表示不限制
+    const char* mime_types_path;    // 追加或覆盖内置类型的mime.types文件，NULL表示只用内置的类型
+
+    // 反向代理
+    static const int MAX_PROXY_ROUTES = 16;
+    const char* proxy_routes[ MAX_PROXY_ROUTES ];   // "前缀=主机:端口"，由upstream::add_route解析
+    int proxy_route_number;
+    int upstream_keepalive;     // 每个反应堆每个路由保留的空闲后端连接数
+
+    // HTTPS
+    const char* tls_cert;       // PEM格式的证书链，NULL表示只提供HTTP
+    const char* tls_key;        // PEM格式的私钥，NULL表示和证书在同一个文件中
+    bool http2;                 // 接受HTTP/2（HTTPS用ALPN协商，明文用prior knowledge或h2c升级）
+
+    // 日志
+    const char* log_path;       // 日志文件，NULL表示不写日志文件（错误日志输出到标准输出）
+    int log_level;              // 记录的最高级别，见LOG_LEVEL
+    int log_sample;             // 每log_sample个请求记录一条访问日志
+    long log_max_bytes;         // 单个日志文件的大小上限，超过时轮转，0表示不轮转
+    int log_keep;               // 轮转时保留的旧日志文件个数
+
+    // 连接超时（毫秒），0表示不限制
+    int timer_tick_ms;          // 时间轮的滴答间隔
+    int header_timeout_ms;      // 读取请求行和头部的总时间
+    int body_timeout_ms;        // 读取请求体时两批数据之间的间隔
+    int idle_timeout_ms;        // keep-alive连接两个请求之间的空闲时间
+    int write_timeout_ms;       // 发送响应时客户端不接收数据的时间
+    int drain_timeout_ms;       // 平滑退出时等待已有连接处理完的时间，超过后强制关闭
+};
+
+#endif
@@ -0,0 +1,111 @@
+#ifndef CONN_ARENA_H
+#define CONN_ARENA_H
+
+#include <stddef.h>
+#include <new>
+#include <string>
+#include "buffer_pool.h"
+
+/*
+    连接的请求级内存区
+    一个请求用到的、大小不固定的结构（请求体的处理者以及它们的字符串等）从这里按顺序切出，不逐个释放，
+    请求结束（init_request()）、连接初始化和关闭时整体归还。内存块从buffer_pool取得，稳态下请求路径上不调用malloc，
+    空闲的keep-alive连接也不占用任何块。只被连接当前所在的线程使用，不需要加锁。
+    放在这里的对象不会被delete：需要析构的由使用者显式调用析构函数，之后再reset()。
+*/
+class conn_arena {
+public:
+    static const int CHUNK_SIZE = 4096;     // 一般的块大小，更大的分配使用单独的块，不超过buffer_pool::MAX_SIZE
+
+    conn_arena() : m_chunk( NULL ), m_used( 0 ), m_size( 0 ) {}
+    ~conn_arena() { reset(); }
+
+    // 切出size字节，按align对齐，内存不足或size太大时返回NULL
+    void* alloc( size_t size, size_t align = alignof( max_align_t ) ) {
+        size_t start = ( m_used + align - 1 ) & ~( align - 1 );
+        if( !m_chunk || start + size > m_size ) {
+            if( !grow( size + align ) ) {
+                return NULL;
+            }
+            start = ( m_used + align - 1 ) & ~( align - 1 );
+        }
+        m_used = start + size;
+        return ( char* )m_chunk + start;
+    }
+
+    // 归还所有的块，之前切出的内存都不能再使用
+    void reset() {
+        while( m_chunk ) {
+            chunk* c = m_chunk;
+            m_chunk = c->prev;
+            buffer_pool::instance()->release( ( char* )c, c->size );
+        }
+        m_used = m_size = 0;
+    }
+
+    bool empty() const { return m_chunk == NULL; }
+
+private:
+    // 块的开头记录前一个块和自己的大小，reset()时依次归还
+    struct chunk {
+        chunk* prev;
+        int size;
+    };
+
+    bool grow( size_t need ) {
+        need += sizeof( chunk );
+        if( need > ( size_t )buffer_pool::MAX_SIZE ) {
+            return false;
+        }
+        int size = 0;
+        chunk* c = ( chunk* )buffer_pool::instance()->acquire( need > ( size_t )CHUNK_SIZE ? ( int )need : CHUNK_SIZE, &size );
+        if( !c ) {
+            return false;
+        }
+        c->prev = m_chunk;
+        c->size = size;
+        m_chunk = c;
+        m_used = sizeof( chunk );
+        m_size = size;
+        return true;
+    }
+
+    chunk* m_chunk;     // 当前的块，链表的表头
+    size_t m_used;      // 当前块中已经切出的字节数（包括块的头部）
+    size_t m_size;      // 当前块的大小
+};
+
+// 从conn_arena分配的STL分配器，deallocate什么也不做，内存随reset()一起归还
+template< class T >
+class arena_allocator {
+public:
+    typedef T value_type;
+
+    explicit arena_allocator( conn_arena* arena ) : m_arena( arena ) {}
+    template< class U >
+    arena_allocator( const arena_allocator< U >& other ) : m_arena( other.arena() ) {}
+
+    T* allocate( size_t n ) {
+        void* p = m_arena->alloc( n * sizeof( T ), alignof( T ) );
+        if( !p ) {
+            throw std::bad_alloc();
+        }
+        return ( T* )p;
+    }
+    void deallocate( T* p, size_t n ) {}
+
+    conn_arena* arena() const { return m_arena; }
+
+private:
+    conn_arena* m_arena;
+};
+
+template< class T, class U >
+bool operator==( const arena_allocator< T >& a, const arena_allocator< U >& b ) { return a.arena() == b.arena(); }
+template< class T, class U >
+bool operator!=( const arena_allocator< T >& a, const arena_allocator< U >& b ) { return a.arena() != b.arena(); }
+
+// 放在conn_arena中的字符串
+typedef std::basic_string< char, std::char_traits< char >, arena_allocator< char > > arena_string;
+
+#endif
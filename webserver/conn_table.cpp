@@ -0,0 +1,44 @@
+#include "conn_table.h"
+#include <sys/mman.h>
+#include "numa.h"
+
+conn_table* conn_table::instance() {
+    // 进程内唯一的实例，且不析构，退出时工作线程可能还引用着连接
+    static conn_table* table = new conn_table;
+    return table;
+}
+
+conn_table::~conn_table() {
+    if( m_conns ) {
+        munmap( m_conns, sizeof( http_conn ) * m_size );
+    }
+    delete [] m_shards;
+}
+
+bool conn_table::init( int size, int shards ) {
+    if( m_conns || size <= 0 || shards <= 0 ) {
+        return false;
+    }
+    size_t bytes = sizeof( http_conn ) * size;
+    void* p = mmap( NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0 );
+    if( p == MAP_FAILED ) {
+        return false;
+    }
+    // 系统的透明大页设为always时也不要合并成大页，否则碰到一个槽位就占用2MB
+    madvise( p, bytes, MADV_NOHUGEPAGE );
+    numa::place( p, bytes, numa::INTERLEAVE );
+    // 不调用构造函数：零页就是已关闭的连接（见http_conn的构造函数），槽位在第一次init()时才被写入、占用内存
+    m_conns = ( http_conn* )p;
+    m_shards = new shard[ shards ];
+    m_size = size;
+    m_shard_number = shards;
+    return true;
+}
+
+int conn_table::count() const {
+    int n = 0;
+    for( int i = 0; i < m_shard_number; ++i ) {
+        n += m_shards[i].count.load( std::memory_order_relaxed );
+    }
+    return n;
+}
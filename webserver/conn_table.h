@@ -0,0 +1,69 @@
+#ifndef CONN_TABLE_H
+#define CONN_TABLE_H
+
+#include <atomic>
+#include <stdint.h>
+#include "mpmc_queue.h"
+#include "http_conn.h"
+
+/*
+    进程级的连接表
+    连接按fd索引，fd在进程内唯一，同一时刻只属于一个事件循环，所以表本身不需要加锁。
+    连接数按事件循环分片：每个分片只由所属的事件循环修改（单写者，不需要原子的读-改-写），各占一个缓存行，
+    准入控制和/metrics把所有分片加起来。多个线程对同一个int做++、--会丢失更新，计数会慢慢漂移，分片计数不会。
+
+    epoll中保存的不是fd而是连接的句柄：(代数 << 32) | fd。连接关闭时代数加一，
+    同一批事件中已经关闭的连接的事件，以及fd已经被（另一个事件循环）复用之后才处理到的旧事件，代数都对不上，
+    lookup()返回NULL，不会把旧事件当成新连接的事件处理。
+
+    连接对象放在一整块普通（4KB页的）匿名映射中，并且关掉透明大页：只有用到的槽位所在的页才占用内存，
+    常驻内存随活跃的连接数增长，而不是随MAX_FD。频繁访问的是读写缓冲区，它们才使用大页，见buffer_pool。
+    fd由内核分配，哪个反应堆accept到它由SO_REUSEPORT的哈希决定，连接对象没法预先放在所属反应堆的节点上，
+    多节点的机器上按页交错分配到所有节点，不会全部落在主线程所在的节点上。
+*/
+class conn_table {
+public:
+    static conn_table* instance();
+
+    // 分配size个连接和shards个计数分片，应在创建事件循环之前调用
+    bool init( int size, int shards );
+
+    int size() const { return m_size; }
+    http_conn* at( int fd ) { return m_conns + fd; }
+    // 句柄对应的连接仍然打开时返回它，否则（连接已关闭或fd已被复用）返回NULL
+    http_conn* lookup( uint64_t handle ) {
+        int fd = ( int )( uint32_t )handle;
+        if( fd < 0 || fd >= m_size ) {
+            return NULL;
+        }
+        http_conn* conn = m_conns + fd;
+        // 连接关闭时代数已经加一，关闭之后的旧句柄都对不上
+        return conn->generation() == ( uint32_t )( handle >> 32 ) ? conn : NULL;
+    }
+
+    void opened( int shard ) { bump( shard, 1 ); }
+    void closed( int shard ) { bump( shard, -1 ); }
+    int shard_count( int shard ) const { return m_shards[ shard ].count.load( std::memory_order_relaxed ); }
+    int count() const;      // 所有分片的连接数之和
+
+private:
+    conn_table() : m_conns( NULL ), m_size( 0 ), m_shards( NULL ), m_shard_number( 0 ) {}
+    ~conn_table();
+
+    void bump( int shard, int n ) {
+        std::atomic< int >& c = m_shards[ shard ].count;
+        c.store( c.load( std::memory_order_relaxed ) + n, std::memory_order_relaxed );
+    }
+
+    struct alignas( CACHELINE_SIZE ) shard {
+        shard() : count( 0 ) {}
+        std::atomic< int > count;
+    };
+
+    http_conn* m_conns;
+    int m_size;
+    shard* m_shards;
+    int m_shard_number;
+};
+
+#endif
@@ -0,0 +1,113 @@
+#ifndef CORO_H
+#define CORO_H
+
+/*
+    C++20协程的基础部分，用 g++ -std=c++20 *.cpp -pthread 编译时才有（编译器定义__cpp_impl_coroutine）
+    - coro_task<T>：惰性启动的协程，被co_await时才开始执行，结束时直接恢复等待它的协程（对称转移），不经过任何调度器
+    - 协程帧从buffer_pool中分配，帧的大小在编译时就确定了，落在固定的等级上，稳态下没有malloc；
+      内存不足时协程不会创建，co_await它直接得到T()
+    等待I/O和定时器的awaitable由coro_reactor提供，事件到达时由反应堆线程直接恢复挂起的协程。
+    协程只在创建它的反应堆线程中运行，不需要加锁。
+*/
+#ifdef __cpp_impl_coroutine
+
+#include <coroutine>
+#include <exception>
+#include "buffer_pool.h"
+
+// 帧的开头记录buffer_pool给出的实际大小，归还时要用；保持new的默认对齐
+static const int CORO_FRAME_HEADER = __STDCPP_DEFAULT_NEW_ALIGNMENT__;
+
+inline void* coro_frame_alloc( size_t size ) {
+    int actual = 0;
+    char* p = buffer_pool::instance()->acquire( ( int )( size + CORO_FRAME_HEADER ), &actual );
+    if( !p ) {
+        return NULL;
+    }
+    *( int* )p = actual;
+    return p + CORO_FRAME_HEADER;
+}
+
+inline void coro_frame_free( void* frame ) {
+    char* p = ( char* )frame - CORO_FRAME_HEADER;
+    buffer_pool::instance()->release( p, *( int* )p );
+}
+
+template< typename T >
+class coro_task {
+public:
+    struct promise_type;
+    typedef std::coroutine_handle< promise_type > handle_type;
+
+    // 协程结束时恢复等待它的协程，没有（最外层的协程）时回到恢复它的地方
+    struct final_awaiter {
+        bool await_ready() noexcept { return false; }
+        std::coroutine_handle<> await_suspend( handle_type h ) noexcept {
+            std::coroutine_handle<> next = h.promise().m_continuation;
+            return next ? next : std::noop_coroutine();
+        }
+        void await_resume() noexcept {}
+    };
+
+    struct promise_type {
+        promise_type() : m_value(), m_continuation( NULL ) {}
+
+        coro_task get_return_object() { return coro_task( handle_type::from_promise( *this ) ); }
+        static coro_task get_return_object_on_allocation_failure() { return coro_task(); }
+        std::suspend_always initial_suspend() noexcept { return std::suspend_always(); }
+        final_awaiter final_suspend() noexcept { return final_awaiter(); }
+        void return_value( const T& value ) { m_value = value; }
+        void unhandled_exception() { std::terminate(); }
+
+        static void* operator new( size_t size ) noexcept { return coro_frame_alloc( size ); }
+        static void operator delete( void* frame ) { coro_frame_free( frame ); }
+
+        T m_value;
+        std::coroutine_handle<> m_continuation;     // co_await这个协程的协程
+    };
+
+    coro_task() : m_handle( NULL ) {}
+    coro_task( coro_task&& other ) noexcept : m_handle( other.m_handle ) { other.m_handle = NULL; }
+    ~coro_task() {
+        if( m_handle ) {
+            m_handle.destroy();
+        }
+    }
+    coro_task& operator=( coro_task&& other ) noexcept {
+        if( this != &other ) {
+            if( m_handle ) {
+                m_handle.destroy();
+            }
+            m_handle = other.m_handle;
+            other.m_handle = NULL;
+        }
+        return *this;
+    }
+
+    bool valid() const { return bool( m_handle ); }
+    // 交出协程帧，之后由调用者resume和destroy（最外层的协程由反应堆管理）
+    handle_type release() {
+        handle_type h = m_handle;
+        m_handle = NULL;
+        return h;
+    }
+
+    // co_await一个协程：记下自己，转去执行它
+    bool await_ready() const noexcept { return !m_handle; }
+    std::coroutine_handle<> await_suspend( std::coroutine_handle<> caller ) noexcept {
+        m_handle.promise().m_continuation = caller;
+        return m_handle;
+    }
+    T await_resume() { return m_handle ? m_handle.promise().m_value : T(); }
+
+private:
+    explicit coro_task( handle_type h ) : m_handle( h ) {}
+    coro_task( const coro_task& );
+    coro_task& operator=( const coro_task& );
+
+    handle_type m_handle;
+};
+
+#endif
+
+#endif
@@ -0,0 +1,327 @@
+#include "coro_reactor.h"
+#include <sys/timerfd.h>
+#include "http_response.h"
+#include "conn_table.h"
+
+extern void addfd( int epollfd, int fd, bool one_shot, uint64_t data );
+extern void removefd( int epollfd, int fd );
+extern void modfd( int epollfd, int fd, int ev, uint64_t data );
+
+#ifdef __cpp_impl_coroutine
+
+bool coro_reactor::supported() {
+    return true;
+}
+
+coro_reactor::coro_reactor( int id, const config& conf ) :
+        event_loop( id, conf ), m_states( NULL ), m_epollfd( -1 ), m_timerfd( -1 ) {
+
+    // 同reactor：本事件循环自己的epoll对象，监听socket和timerfd的数据就是fd本身
+    m_epollfd = epoll_create1( EPOLL_CLOEXEC );
+    if( m_epollfd < 0 ) {
+        throw std::exception();
+    }
+    addfd( m_epollfd, m_listenfd, false, m_listenfd );
+
+    m_timerfd = timerfd_create( CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC );
+    if( m_timerfd < 0 ) {
+        close( m_epollfd );
+        throw std::exception();
+    }
+    struct itimerspec its;
+    its.it_interval.tv_sec = m_wheel.tick_ms() / 1000;
+    its.it_interval.tv_nsec = ( m_wheel.tick_ms() % 1000 ) * 1000000L;
+    its.it_value = its.it_interval;
+    timerfd_settime( m_timerfd, 0, &its, NULL );
+    addfd( m_epollfd, m_timerfd, false, m_timerfd );
+
+    // 按fd索引，calloc在用到时才分配物理页
+    m_states = ( conn_state* )calloc( m_table->size(), sizeof( conn_state ) );
+    if( !m_states ) {
+        close( m_timerfd );
+        close( m_epollfd );
+        throw std::exception();
+    }
+}
+
+coro_reactor::~coro_reactor() {
+    free( m_states );
+    close( m_timerfd );
+    close( m_epollfd );
+}
+
+// 写和握手先直接尝试一次，通常不用挂起
+bool coro_reactor::io_awaiter::await_ready() {
+    if( op == WAIT_WRITE ) {
+        // 应答一般能一次写进socket发送缓冲区，写完就不用注册EPOLLOUT、不用挂起
+        result = conn->write();
+        return !result || !conn->writing();
+    } else if( op == WAIT_HANDSHAKE ) {
+        tls::RESULT ret = conn->handshake();
+        result = ret == tls::TLS_DONE;
+        return ret != tls::TLS_WANT_READ && ret != tls::TLS_WANT_WRITE;
+    }
+    return false;
+}
+
+void coro_reactor::io_awaiter::await_suspend( std::coroutine_handle<> h ) {
+    int fd = conn - loop->m_users;
+    waiter = h;
+    loop->m_states[ fd ].waiting = this;
+    if( op == WAIT_READ ) {
+        modfd( loop->m_epollfd, fd, EPOLLIN, conn->handle() );
+    } else if( op == WAIT_WRITE ) {
+        // write()遇到EAGAIN时已经注册了EPOLLOUT
+        loop->set_timer( conn, http_conn::PHASE_WRITE );
+    } else if( op == WAIT_SLEEP ) {
+        // 和阶段超时共用连接的定时器，醒来后由协程重新设置阶段
+        loop->m_wheel.reset( &conn->m_timer, ms );
+    }
+    // 握手时handshake()已经按WANT_READ/WANT_WRITE注册了事件
+}
+
+bool coro_reactor::io_awaiter::await_resume() {
+    return result;
+}
+
+/*
+    一个连接的全部处理，和reactor、线程池中分散在各个事件里的状态转移是同一个顺序：
+    读入数据 -> 解析出一批应答 -> 发送 -> 还有流水线请求时直接继续，否则空闲等待下一个请求
+    返回值只表示是否是正常结束，协程结束后都由事件循环关闭连接
+*/
+coro_task< bool > coro_reactor::serve( http_conn* conn ) {
+    // co_await的结果先存到局部变量再判断：g++ 12把if条件中的co_await编译成直接跳过整个协程体
+    bool ok;
+    if( conn->handshaking() ) {
+        // 握手完成时请求可能已经跟在客户端的Finished后面到达，先读一次
+        ok = co_await async_handshake( conn );
+        ok = ok && conn->read();
+    } else {
+        ok = co_await async_read( conn );
+    }
+    if( !ok ) {
+        co_return false;
+    }
+
+    while( true ) {
+        if( conn->process_requests() ) {
+            // 不保持连接时发完这一批就结束
+            ok = co_await async_write( conn );
+            if( !ok ) {
+                co_return true;
+            }
+            if( conn->pending_input() ) {
+                // 读缓冲区中还有流水线请求，开始计算下一个请求的超时，直接处理
+                set_timer( conn, http_conn::PHASE_HEADER );
+                continue;
+            }
+            // 响应发送完毕，keep-alive连接进入空闲
+            set_timer( conn, http_conn::PHASE_IDLE );
+        }
+
+        // 请求还不完整，或者在等下一个请求；用户态TLS读缓冲区满时解密出的数据还有一部分留在SSL中，
+        // 不会再有EPOLLIN，直接接着读
+        if( conn->tls_pending() ) {
+            ok = conn->read();
+        } else {
+            ok = co_await async_read( conn );
+        }
+        if( !ok ) {
+            co_return false;
+        }
+        if( conn->m_phase == http_conn::PHASE_IDLE ) {
+            // keep-alive连接上新请求的第一个字节，开始计算请求头超时
+            set_timer( conn, http_conn::PHASE_HEADER );
+        } else if( conn->reading_body() ) {
+            // 请求体每收到一批数据就重置超时
+            set_timer( conn, http_conn::PHASE_BODY );
+        }
+    }
+}
+
+void coro_reactor::start( http_conn* conn ) {
+    conn_state& st = m_states[ conn - m_users ];
+    coro_task< bool > task = serve( conn );
+    if( !task.valid() ) {
+        // 内存不足，协程帧分配失败
+        close_conn( conn );
+        return;
+    }
+    st.task = task.release();
+    st.waiting = NULL;
+    st.task.resume();
+    if( st.task.done() ) {
+        close_conn( conn );
+    }
+}
+
+void coro_reactor::complete( http_conn* conn, bool result ) {
+    conn_state& st = m_states[ conn - m_users ];
+    io_awaiter* a = st.waiting;
+    st.waiting = NULL;
+    a->result = result;
+    // 协程一直运行到下一个挂起点或者结束
+    a->waiter.resume();
+    if( st.task.done() ) {
+        close_conn( conn );
+    }
+}
+
+// 推进挂起的协程在等待的操作，中间的EAGAIN不恢复协程
+void coro_reactor::handle_event( http_conn* conn, uint32_t events ) {
+    io_awaiter* a = m_states[ conn - m_users ].waiting;
+    if( !a || a->op == WAIT_SLEEP ) {
+        // 协程没有在等待连接上的事件，one-shot的事件已经消耗掉，协程下次等待时重新注册
+        return;
+    }
+    if( events & ( EPOLLRDHUP | EPOLLHUP | EPOLLERR ) ) {
+        // 对方异常断开或错误等事件
+        complete( conn, false );
+        return;
+    }
+
+    if( a->op == WAIT_READ ) {
+        // 一次性把全部数据读完
+        complete( conn, conn->read() );
+
+    } else if( a->op == WAIT_WRITE ) {
+        bool ok = conn->write();
+        if( ok && conn->writing() ) {
+            // 没有发完，等待客户端接收，发送有进展就重置超时
+            set_timer( conn, http_conn::PHASE_WRITE );
+        } else {
+            complete( conn, ok );
+        }
+
+    } else if( a->op == WAIT_HANDSHAKE ) {
+        // 不论等的是可读还是可写都继续推进，还没完成时handshake()已经重新注册了事件
+        tls::RESULT ret = conn->handshake();
+        if( ret != tls::TLS_WANT_READ && ret != tls::TLS_WANT_WRITE ) {
+            complete( conn, ret == tls::TLS_DONE );
+        }
+    }
+}
+
+void coro_reactor::close_conn( http_conn* conn ) {
+    conn_state& st = m_states[ conn - m_users ];
+    if( st.task ) {
+        // 挂起的协程帧中只有局部变量，直接销毁
+        st.task.destroy();
+        st.task = NULL;
+    }
+    st.waiting = NULL;
+    m_wheel.del( &conn->m_timer );
+    release( conn );
+}
+
+void coro_reactor::on_timeout( tw_timer* timer, void* arg ) {
+    coro_reactor* r = ( coro_reactor* )arg;
+    http_conn* conn = ( http_conn* )timer->data;
+    if( conn->closed() ) {
+        return;
+    }
+    io_awaiter* a = r->m_states[ conn - r->m_users ].waiting;
+    if( a ) {
+        // 等待的操作超时，协程以失败恢复；sleep到期则是正常醒来
+        r->complete( conn, a->op == WAIT_SLEEP );
+    } else {
+        r->close_conn( conn );
+    }
+}
+
+// 有客户端连接进来，同reactor::handle_accept()，每个新连接创建一个协程
+void coro_reactor::handle_accept() {
+    for( int i = 0; i < MAX_ACCEPT_BATCH; ++i ) {
+        struct sockaddr_in client_address;
+        socklen_t client_addrlength = sizeof( client_address );
+        int connfd = accept4( m_listenfd, ( struct sockaddr* )&client_address, &client_addrlength,
+                SOCK_NONBLOCK | SOCK_CLOEXEC );
+
+        if ( connfd < 0 ) {
+            if( errno == EAGAIN || errno == EWOULDBLOCK ) {
+                break;
+            } else if( errno == EINTR || errno == ECONNABORTED ) {
+                continue;
+            } else if( ( errno == EMFILE || errno == ENFILE ) && shed_one() ) {
+                continue;
+            }
+            LOG_ERROR( "coro reactor %d: accept failure, errno is: %d", m_id, errno );
+            break;
+        }
+
+        if( !admit( connfd ) ) {
+            continue;
+        }
+        m_users[connfd].init( connfd, client_address, m_epollfd );
+        track( connfd );
+        set_timer( m_users + connfd, http_conn::PHASE_HEADER );
+        start( m_users + connfd );
+    }
+}
+
+void coro_reactor::stop_accept() {
+    removefd( m_epollfd, m_listenfd );
+    m_listenfd = -1;
+}
+
+void coro_reactor::handle_tick() {
+    uint64_t expirations = 0;
+    if( ::read( m_timerfd, &expirations, sizeof( expirations ) ) != sizeof( expirations ) ) {
+        return;
+    }
+    update_http_date();
+    for( uint64_t i = 0; i < expirations; ++i ) {
+        m_wheel.tick( on_timeout, this );
+    }
+    drain_tick();
+}
+
+void coro_reactor::run() {
+    while( !m_stopped ) {
+
+        int number = epoll_wait( m_epollfd, m_events, MAX_EVENT_NUMBER, -1 );
+
+        if ( ( number < 0 ) && ( errno != EINTR ) ) {
+            LOG_ERROR( "coro reactor %d: epoll failure", m_id );
+            break;
+        }
+
+        for ( int i = 0; i < number; i++ ) {
+
+            uint64_t data = m_events[i].data.u64;
+
+            if( data == ( uint64_t )m_listenfd ) {
+                handle_accept();
+            } else if( data == ( uint64_t )m_timerfd ) {
+                handle_tick();
+            } else {
+                // 同一批事件中前面已经关闭的连接，或者fd已经被复用，句柄对不上
+                http_conn* conn = m_table->lookup( data );
+                if( conn ) {
+                    handle_event( conn, m_events[i].events );
+                }
+            }
+        }
+    }
+}
+
+#else
+
+// 没有用C++20编译时只保留类型，main在创建之前就退回到epoll
+bool coro_reactor::supported() {
+    return false;
+}
+
+coro_reactor::coro_reactor( int id, const config& conf ) : event_loop( id, conf ), m_epollfd( -1 ), m_timerfd( -1 ) {
+    throw std::exception();
+}
+
+coro_reactor::~coro_reactor() {}
+void coro_reactor::run() {}
+void coro_reactor::handle_accept() {}
+void coro_reactor::handle_tick() {}
+void coro_reactor::on_timeout( tw_timer*, void* ) {}
+void coro_reactor::close_conn( http_conn* conn ) { release( conn ); }
+void coro_reactor::stop_accept() {}
+
+#endif
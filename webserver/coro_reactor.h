@@ -0,0 +1,82 @@
+#ifndef CORO_REACTOR_H
+#define CORO_REACTOR_H
+
+#include "reactor.h"
+#include "coro.h"
+
+/*
+    协程模式的epoll事件循环（--io=coro），需要用 g++ -std=c++20 *.cpp -pthread 编译
+    每个连接是一个协程serve()，握手、读请求、发应答、keep-alive都写成一个顺序的循环，
+    挂起点是三个awaitable：async_read（等待可读并读入读缓冲区）、async_write（发送这一批应答）和sleep。
+    挂起时协程把要完成的操作登记在本事件循环中，epoll事件到达时由本线程推进这个操作（read()、write()、握手），
+    操作完成或超时才恢复协程，中间的EAGAIN不会回到协程，也不经过线程池。
+    请求的解析和应答都在事件循环线程中直接完成（同io_uring模式），命中打开文件缓存时只是几次memcpy和一次writev；
+    上传的请求体写文件也在这个线程中，大量上传时用epoll模式。
+    超时仍然由时间轮按连接的阶段计算，到期时挂起的协程以失败恢复，由它自己结束；
+    平滑退出和强制关闭时直接销毁挂起的协程帧。不支持反向代理（配置了路由时退回到epoll）。
+*/
+class coro_reactor : public event_loop {
+public:
+    coro_reactor( int id, const config& conf );
+    ~coro_reactor();
+    void run();     // 事件循环
+
+    static bool supported();    // 编译时是否支持协程
+
+private:
+    void handle_accept();
+    void handle_tick();
+    static void on_timeout( tw_timer* timer, void* arg );
+    void close_conn( http_conn* conn );     // 销毁连接的协程，删除定时器并关闭连接
+    void stop_accept();
+
+#ifdef __cpp_impl_coroutine
+    // 挂起的协程在等待的操作
+    enum WAIT_OP { WAIT_NONE = 0, WAIT_READ, WAIT_WRITE, WAIT_HANDSHAKE, WAIT_SLEEP };
+
+    struct io_awaiter;
+
+    // 每个连接在本事件循环中的协程状态
+    struct conn_state {
+        std::coroutine_handle<> task;       // 连接的最外层协程，连接关闭时销毁
+        io_awaiter* waiting;                // 挂起的协程正在等待的操作，在协程帧中，恢复前一直有效
+    };
+
+    // 挂起当前协程，直到反应堆完成op操作
+    struct io_awaiter {
+        coro_reactor* loop;
+        http_conn* conn;
+        int op;                             // 见WAIT_OP
+        int ms;                             // WAIT_SLEEP的时长
+        bool result;                        // 操作是否成功，恢复时交给协程
+        std::coroutine_handle<> waiter;     // 挂起的协程
+
+        bool await_ready();
+        void await_suspend( std::coroutine_handle<> h );
+        bool await_resume();
+    };
+
+    // 等待连接可读，把数据读入读缓冲区，对方关闭、出错或者超时时返回false
+    io_awaiter async_read( http_conn* conn ) { io_awaiter a = { this, conn, WAIT_READ, 0, false, NULL }; return a; }
+    // 发送这一批应答，发完并保持连接时返回true，不保持连接、出错或者超时时返回false
+    io_awaiter async_write( http_conn* conn ) { io_awaiter a = { this, conn, WAIT_WRITE, 0, false, NULL }; return a; }
+    // 推进TLS握手直到完成，握手失败或者超时时返回false
+    io_awaiter async_handshake( http_conn* conn ) { io_awaiter a = { this, conn, WAIT_HANDSHAKE, 0, false, NULL }; return a; }
+    // 挂起ms毫秒（按时间轮的滴答取整），期间连接上的事件不会恢复协程，总是返回true
+    io_awaiter sleep( http_conn* conn, int ms ) { io_awaiter a = { this, conn, WAIT_SLEEP, ms, false, NULL }; return a; }
+
+    coro_task< bool > serve( http_conn* conn );     // 一个连接从接受到关闭的全部处理
+    void start( http_conn* conn );                  // 为新连接创建协程并运行到第一个挂起点
+    void complete( http_conn* conn, bool result );  // 等待的操作完成，恢复协程，它结束时关闭连接
+    void handle_event( http_conn* conn, uint32_t events );
+
+    conn_state* m_states;               // 按fd索引，calloc分配
+#endif
+
+private:
+    int m_epollfd;
+    int m_timerfd;
+    epoll_event m_events[ MAX_EVENT_NUMBER ];
+};
+
+#endif
@@ -0,0 +1,319 @@
+#include "doc_index.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <string.h>
+#include <limits.h>
+#include <dirent.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <algorithm>
+#include "logger.h"
+
+// 目录中有文件或子目录被创建、删除、移动，或者目录本身被删除、移动时重新扫描
+static const uint32_t WATCH_MASK = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO
+        | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR;
+
+// 一串变化最多等这么久就重新扫描，持续有变化时索引也不会一直不更新
+static const int SETTLE_MAX_MS = 1000;
+
+static long now_ms() {
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+doc_index* doc_index::instance() {
+    // 进程内唯一的实例，且不析构，避免退出时与监听线程竞争
+    static doc_index* index = new doc_index;
+    return index;
+}
+
+doc_index::doc_index() : m_current( NULL ), m_inotify_fd( -1 ) {
+}
+
+bool doc_index::init( const char* root ) {
+    m_root = root;
+    while( m_root.size() > 1 && m_root[ m_root.size() - 1 ] == '/' ) {
+        m_root.resize( m_root.size() - 1 );
+    }
+    snapshot* s = scan();
+    if( !s ) {
+        return false;
+    }
+    m_current.store( s, std::memory_order_release );
+
+    m_inotify_fd = inotify_init1( IN_CLOEXEC );
+    if( m_inotify_fd < 0 ) {
+        LOG_WARN( "doc index: inotify unavailable, %s is indexed only once", m_root.c_str() );
+        return true;
+    }
+    watch_dirs( s );
+    pthread_t tid;
+    if( pthread_create( &tid, NULL, watch_worker, this ) != 0 ) {
+        close( m_inotify_fd );
+        m_inotify_fd = -1;
+        return false;
+    }
+    pthread_detach( tid );
+    return true;
+}
+
+int doc_index::size() const {
+    return ( int )m_current.load( std::memory_order_acquire )->entries.size();
+}
+
+/*
+    把URL的路径部分规范化到out：去掉查询串，合并连续的'/'，去掉"."，".."删除前一段，
+    结果以'/'开头、不以'/'结尾（根目录为"/"）。*trailing表示原路径以'/'、"."或".."结尾，只能是目录。
+    返回长度，".."越过根目录时返回-1，结果放不下时返回-2
+*/
+int doc_index::normalize( const char* url, char* out, int size, bool* trailing ) {
+    if( url[0] != '/' ) {
+        return -1;
+    }
+    const char* p = url;
+    int len = 0;
+    bool dir = false;
+    while( true ) {
+        bool slash = false;
+        while( *p == '/' ) {
+            ++p;
+            slash = true;
+        }
+        const char* seg = p;
+        while( *p && *p != '/' && *p != '?' ) {
+            ++p;
+        }
+        int n = p - seg;
+        if( n == 0 ) {
+            dir = dir || slash;
+            break;
+        }
+        if( n == 1 && seg[0] == '.' ) {
+            dir = true;
+            continue;
+        }
+        if( n == 2 && seg[0] == '.' && seg[1] == '.' ) {
+            if( len == 0 ) {
+                return -1;
+            }
+            // 每一段都以'/'开头，退回到最后一个'/'
+            do {
+                --len;
+            } while( out[ len ] != '/' );
+            dir = true;
+            continue;
+        }
+        if( len + 1 + n >= size ) {
+            return -2;
+        }
+        out[ len++ ] = '/';
+        memcpy( out + len, seg, n );
+        len += n;
+        dir = false;
+    }
+    if( len == 0 ) {
+        out[ len++ ] = '/';
+    }
+    out[ len ] = '\0';
+    *trailing = dir;
+    return len;
+}
+
+doc_index::RESULT doc_index::lookup( const char* url, char* path, int path_size ) const {
+    const snapshot* s = m_current.load( std::memory_order_acquire );
+    char key[ PATH_MAX ];
+    bool trailing = false;
+    int size = std::min( ( int )sizeof( key ), s->max_url_len + 2 );
+    int len = normalize( url, key, size, &trailing );
+    if( len == -1 ) {
+        return BAD_PATH;
+    } else if( len < 0 ) {
+        // 比索引中最长的路径还长
+        return NOT_FOUND;
+    }
+
+    // 在按URL路径排序的数组中二分查找
+    const char* strings = s->strings.data();
+    int lo = 0, hi = ( int )s->entries.size();
+    while( lo < hi ) {
+        int mid = ( lo + hi ) / 2;
+        const entry& e = s->entries[ mid ];
+        const char* u = strings + e.offset + s->root_len;
+        int c = memcmp( u, key, std::min( ( int )e.url_len, len ) );
+        if( c == 0 ) {
+            c = ( int )e.url_len - len;
+        }
+        if( c == 0 ) {
+            if( e.is_dir ) {
+                return IS_DIR;
+            }
+            if( trailing ) {
+                // "/index.html/"之类的路径，文件不是目录
+                return NOT_FOUND;
+            }
+            // 路径复制出去，调用者之后的stat、open、mmap（可能很慢）都不再引用这个索引
+            int path_len = s->root_len + e.url_len;
+            if( path_len >= path_size ) {
+                return NOT_FOUND;
+            }
+            memcpy( path, strings + e.offset, path_len + 1 );
+            return IS_FILE;
+        }
+        if( c < 0 ) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return NOT_FOUND;
+}
+
+bool doc_index::url_less::operator()( const entry& a, const entry& b ) const {
+    int c = memcmp( strings + a.offset + root_len, strings + b.offset + root_len, std::min( a.url_len, b.url_len ) );
+    return c < 0 || ( c == 0 && a.url_len < b.url_len );
+}
+
+void doc_index::add( snapshot* s, const std::string& path, bool is_dir ) {
+    size_t url_len = path.size() - s->root_len;
+    if( url_len > 0xffff ) {
+        return;
+    }
+    entry e;
+    e.offset = ( uint32_t )s->strings.size();
+    e.url_len = ( uint16_t )url_len;
+    e.is_dir = is_dir;
+    s->strings.append( path.c_str(), path.size() + 1 );
+    s->entries.push_back( e );
+    s->max_url_len = std::max( s->max_url_len, ( int )url_len );
+}
+
+// 扫描一个目录，dirfd由这里关闭；ancestors是从根目录到这里的各级目录，符号链接指回它们时不再展开
+void doc_index::scan_dir( snapshot* s, int dirfd, std::string& path, int depth,
+        std::vector< std::pair< dev_t, ino_t > >& ancestors ) {
+    DIR* dir = fdopendir( dirfd );
+    if( !dir ) {
+        close( dirfd );
+        return;
+    }
+    struct dirent* d;
+    while( ( d = readdir( dir ) ) != NULL ) {
+        if( strcmp( d->d_name, "." ) == 0 || strcmp( d->d_name, ".." ) == 0 ) {
+            continue;
+        }
+        // 和以前直接stat完整路径一样跟随符号链接
+        struct stat st;
+        if( fstatat( dirfd, d->d_name, &st, 0 ) < 0 ) {
+            continue;
+        }
+        size_t old_len = path.size();
+        path += '/';
+        path += d->d_name;
+        if( S_ISREG( st.st_mode ) ) {
+            add( s, path, false );
+        } else if( S_ISDIR( st.st_mode ) ) {
+            add( s, path, true );
+            bool loop = false;
+            for( size_t i = 0; i < ancestors.size(); ++i ) {
+                loop = loop || ( ancestors[i].first == st.st_dev && ancestors[i].second == st.st_ino );
+            }
+            int fd = -1;
+            if( !loop && depth + 1 < MAX_DEPTH
+                    && ( fd = openat( dirfd, d->d_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC ) ) >= 0 ) {
+                ancestors.push_back( std::make_pair( st.st_dev, st.st_ino ) );
+                scan_dir( s, fd, path, depth + 1, ancestors );
+                ancestors.pop_back();
+            }
+        }
+        // FIFO、socket、设备文件不进入索引
+        path.resize( old_len );
+    }
+    closedir( dir );
+}
+
+doc_index::snapshot* doc_index::scan() {
+    int fd = open( m_root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC );
+    struct stat st;
+    if( fd < 0 || fstat( fd, &st ) < 0 ) {
+        if( fd >= 0 ) {
+            close( fd );
+        }
+        return NULL;
+    }
+    snapshot* s = new snapshot;
+    s->root_len = ( int )m_root.size();
+    s->max_url_len = 1;
+    // 根目录本身是"/"
+    add( s, m_root + "/", true );
+    std::string path = m_root;
+    std::vector< std::pair< dev_t, ino_t > > ancestors( 1, std::make_pair( st.st_dev, st.st_ino ) );
+    scan_dir( s, fd, path, 0, ancestors );
+
+    url_less less = { s->strings.data(), s->root_len };
+    std::sort( s->entries.begin(), s->entries.end(), less );
+    return s;
+}
+
+void doc_index::watch_dirs( const snapshot* s ) {
+    // 同一个目录重复添加时内核返回原来的监听描述符，已删除的目录的监听由内核移除
+    for( size_t i = 0; i < s->entries.size(); ++i ) {
+        const entry& e = s->entries[i];
+        if( e.is_dir && inotify_add_watch( m_inotify_fd, s->strings.data() + e.offset, WATCH_MASK ) < 0 ) {
+            LOG_WARN( "doc index: watch %s failure, errno is: %d", s->strings.data() + e.offset, errno );
+        }
+    }
+}
+
+void* doc_index::watch_worker( void* arg ) {
+    doc_index* index = ( doc_index* )arg;
+    index->watch_loop();
+    return index;
+}
+
+void doc_index::watch_loop() {
+    char buf[ 4096 ] __attribute__ ( ( aligned( __alignof__( struct inotify_event ) ) ) );
+    while( true ) {
+        ssize_t len = ::read( m_inotify_fd, buf, sizeof( buf ) );
+        if( len <= 0 ) {
+            if( len < 0 && errno == EINTR ) {
+                continue;
+            }
+            LOG_ERROR( "doc index: inotify read failure" );
+            break;
+        }
+        // 一次改动（比如复制进一个目录）会产生一连串事件，安静下来之后才重新扫描
+        struct pollfd pfd;
+        pfd.fd = m_inotify_fd;
+        pfd.events = POLLIN;
+        long deadline = now_ms() + SETTLE_MAX_MS;
+        while( now_ms() < deadline && poll( &pfd, 1, SETTLE_MS ) > 0 && ::read( m_inotify_fd, buf, sizeof( buf ) ) > 0 ) {
+        }
+
+        snapshot* s = scan();
+        if( !s ) {
+            LOG_ERROR( "doc index: rescan %s failure, errno is: %d", m_root.c_str(), errno );
+            continue;
+        }
+        watch_dirs( s );
+        snapshot* old = m_current.exchange( s, std::memory_order_acq_rel );
+
+        // 查找的一方不加锁，只在lookup()之内读取索引（没有系统调用），找到的路径已经复制给调用者，
+        // 旧索引保留RETIRE_MS足够所有正在进行的lookup()结束
+        long now = now_ms();
+        size_t kept = 0;
+        for( size_t i = 0; i < m_retired.size(); ++i ) {
+            if( now - m_retired[i].second >= RETIRE_MS ) {
+                delete m_retired[i].first;
+            } else {
+                m_retired[ kept++ ] = m_retired[i];
+            }
+        }
+        m_retired.resize( kept );
+        m_retired.push_back( std::make_pair( old, now ) );
+        LOG_INFO( "doc index: rescanned %s, %d entries", m_root.c_str(), ( int )s->entries.size() );
+    }
+}
@@ -0,0 +1,87 @@
+#ifndef DOC_INDEX_H
+#define DOC_INDEX_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+/*
+    网站根目录的索引
+    启动时扫描整个根目录，把其中的普通文件和目录按规范化的URL路径（"/images/image1.jpg"）排序，
+    连同完整路径一起放进一块连续的只读内存，查找是对排好序的扁平数组做二分查找，不需要任何系统调用：
+    - 索引中没有的路径直接回复404，不会为它stat、也不会进入打开文件缓存
+    - URL先规范化（去掉查询串、合并'/'、处理"."和".."），越过根目录的".."回复400；
+      能找到的只有扫描时在根目录之下的文件，路径穿越从结构上就不可能
+    - 完整路径是扫描时生成的，不再受FILENAME_LEN截断
+    FIFO、设备等特殊文件不进入索引（打开FIFO会阻塞工作线程）；符号链接照常跟随，指回上级目录的不再展开，避免循环。
+    后台线程用inotify监听所有目录，有文件或目录被创建、删除、移动时，安静SETTLE_MS之后重新扫描，
+    生成新的索引后原子地替换；查找的一方不加锁，只在lookup()之内读取索引，结果的路径复制给调用者，
+    旧索引过RETIRE_MS之后才释放，比任何一次lookup()都长得多。
+    文件内容的变化仍然由打开文件缓存验证，索引只记录路径是否存在。
+*/
+class doc_index {
+public:
+    enum RESULT { IS_FILE = 0, IS_DIR, NOT_FOUND, BAD_PATH };
+
+    static const int MAX_DEPTH = 32;            // 扫描目录的最大深度
+    static const int SETTLE_MS = 100;           // 最后一个变化之后等待这么久再重新扫描
+    static const int RETIRE_MS = 10000;         // 被替换的旧索引保留的时间
+
+    static doc_index* instance();
+
+    // 扫描root建立索引，并开始监听变化（inotify不可用时只在启动时扫描一次），应在开始处理请求之前调用
+    bool init( const char* root );
+
+    /*
+        查找URL对应的文件或目录，找到普通文件时把它的完整路径复制到path（path_size字节）中，
+        放不下的路径按不存在处理。path不引用索引，索引在这之后被替换、释放也不影响它
+    */
+    RESULT lookup( const char* url, char* path, int path_size ) const;
+
+    int size() const;       // 索引中的文件和目录个数
+
+private:
+    // 一个文件或目录，路径都在snapshot::strings中
+    struct entry {
+        uint32_t offset;    // 完整路径在strings中的偏移，URL路径从offset + root_len开始
+        uint16_t url_len;   // URL路径的长度
+        uint16_t is_dir;
+    };
+
+    // 一次扫描的结果，生成之后不再修改
+    struct snapshot {
+        std::string strings;            // 所有完整路径，各以'\0'结尾
+        std::vector< entry > entries;   // 按URL路径排序
+        int root_len;
+        int max_url_len;                // 最长的URL路径，更长的URL不用查找
+    };
+
+    // 按URL路径排序
+    struct url_less {
+        const char* strings;
+        int root_len;
+        bool operator()( const entry& a, const entry& b ) const;
+    };
+
+    doc_index();
+
+    snapshot* scan();
+    void scan_dir( snapshot* s, int dirfd, std::string& path, int depth,
+            std::vector< std::pair< dev_t, ino_t > >& ancestors );
+    void add( snapshot* s, const std::string& path, bool is_dir );
+    static int normalize( const char* url, char* out, int size, bool* trailing );
+
+    static void* watch_worker( void* arg );
+    void watch_loop();
+    void watch_dirs( const snapshot* s );   // 为索引中的每个目录添加inotify监听
+
+private:
+    std::string m_root;
+    std::atomic< snapshot* > m_current;
+    std::vector< std::pair< snapshot*, long > > m_retired;  // 被替换的索引和替换的时间，只由监听线程访问
+    int m_inotify_fd;
+};
+
+#endif
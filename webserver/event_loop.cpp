@@ -0,0 +1,240 @@
+#include "event_loop.h"
+#include <netinet/tcp.h>
+#include <stdlib.h>
+#include "http_response.h"
+#include "conn_table.h"
+#include "numa.h"
+
+// 从上一个进程继承的监听socket，被事件循环取走后置为-1
+static std::vector< int > g_inherited;
+static bool g_inherited_parsed = false;
+
+int event_loop::inherited_listener( int id, int port ) {
+    if( !g_inherited_parsed ) {
+        // 只解析一次，并从环境中删除，以后由本进程启动的新进程会重新设置
+        g_inherited_parsed = true;
+        const char* env = getenv( LISTEN_FDS_ENV );
+        for( const char* p = env; p && *p; ) {
+            char* end = NULL;
+            long fd = strtol( p, &end, 10 );
+            if( end == p ) {
+                break;
+            }
+            g_inherited.push_back( ( int )fd );
+            p = *end == ',' ? end + 1 : end;
+        }
+        unsetenv( LISTEN_FDS_ENV );
+    }
+    if( id >= ( int )g_inherited.size() || g_inherited[id] < 0 ) {
+        return -1;
+    }
+    int fd = g_inherited[id];
+    struct sockaddr_in addr;
+    socklen_t len = sizeof( addr );
+    int listening = 0;
+    socklen_t optlen = sizeof( listening );
+    if( getsockname( fd, ( struct sockaddr* )&addr, &len ) < 0 || addr.sin_family != AF_INET
+            || ntohs( addr.sin_port ) != port
+            || getsockopt( fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &optlen ) < 0 || !listening ) {
+        // 端口改了，或者不是监听socket，留给close_inherited()关闭
+        return -1;
+    }
+    g_inherited[id] = -1;
+    // 状态标志（O_NONBLOCK）属于打开的文件，继承下来仍然有效；close-on-exec属于fd，exec时被清掉了，重新设置
+    fcntl( fd, F_SETFD, FD_CLOEXEC );
+    return fd;
+}
+
+void event_loop::close_inherited() {
+    for( size_t i = 0; i < g_inherited.size(); ++i ) {
+        if( g_inherited[i] >= 0 ) {
+            close( g_inherited[i] );
+            g_inherited[i] = -1;
+        }
+    }
+}
+
+event_loop::event_loop( int id, const config& conf ) :
+        m_id( id ), m_listenfd( -1 ), m_wheel( conf.timer_tick_ms ), m_table( conn_table::instance() ),
+        m_users( m_table->at( 0 ) ),
+        m_max_conn( conf.max_connections > 0 && conf.max_connections < m_table->size() ? conf.max_connections : m_table->size() ),
+        m_spare_fd( -1 ), m_stopped( false ), m_node( conf.numa ? id % numa::node_count() : -1 ), m_owned( m_table->size(), 0 ),
+        m_draining( false ), m_drain_timeout_ms( 0 ), m_drain_started( false ), m_drain_deadline_ns( 0 ) {
+
+    m_timeout_ms[ http_conn::PHASE_HEADER ] = conf.header_timeout_ms;
+    m_timeout_ms[ http_conn::PHASE_BODY ] = conf.body_timeout_ms;
+    m_timeout_ms[ http_conn::PHASE_IDLE ] = conf.idle_timeout_ms;
+    m_timeout_ms[ http_conn::PHASE_WRITE ] = conf.write_timeout_ms;
+
+    // 热升级：直接使用上一个进程的监听socket，监听队列中的连接不会丢失；重新listen以采用新的backlog
+    m_listenfd = inherited_listener( id, conf.port );
+    if( m_listenfd >= 0 ) {
+        if( conf.defer_accept > 0 ) {
+            setsockopt( m_listenfd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &conf.defer_accept, sizeof( conf.defer_accept ) );
+        }
+        listen( m_listenfd, conf.backlog );
+        m_spare_fd = open( "/dev/null", O_RDONLY | O_CLOEXEC );
+        return;
+    }
+
+    // 创建监听套接字，非阻塞以便一次把已完成的连接全部accept出来
+    m_listenfd = socket( PF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 );
+    if( m_listenfd < 0 ) {
+        throw std::exception();
+    }
+
+    struct sockaddr_in address;
+    bzero( &address, sizeof( address ) );
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_family = AF_INET;
+    address.sin_port = htons( conf.port );
+
+    // 端口复用，SO_REUSEPORT允许每个事件循环各自绑定同一个端口，由内核负责在它们之间分发新连接
+    int reuse = 1;
+    setsockopt( m_listenfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof( reuse ) );
+    setsockopt( m_listenfd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof( reuse ) );
+    // 客户端发来请求数据后内核才把连接交给accept，只建立连接不发数据的连接不占用用户态资源
+    if( conf.defer_accept > 0 ) {
+        setsockopt( m_listenfd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &conf.defer_accept, sizeof( conf.defer_accept ) );
+    }
+    if( bind( m_listenfd, ( struct sockaddr* )&address, sizeof( address ) ) < 0
+            || listen( m_listenfd, conf.backlog ) < 0 ) {
+        close( m_listenfd );
+        throw std::exception();
+    }
+    m_spare_fd = open( "/dev/null", O_RDONLY | O_CLOEXEC );
+}
+
+event_loop::~event_loop() {
+    if( m_spare_fd >= 0 ) {
+        close( m_spare_fd );
+    }
+    if( m_listenfd >= 0 ) {
+        close( m_listenfd );
+    }
+}
+
+bool event_loop::start() {
+    return pthread_create( &m_thread, NULL, worker, this ) == 0;
+}
+
+void event_loop::join() {
+    pthread_join( m_thread, NULL );
+}
+
+void* event_loop::worker( void* arg ) {
+    event_loop* loop = ( event_loop* )arg;
+    // 先绑定再开始事件循环，之后取得的缓冲区都从本节点分配
+    if( loop->m_node >= 0 && !numa::bind_thread( loop->m_node ) ) {
+        LOG_WARN( "event loop %d: bind to NUMA node %d failure", loop->m_id, loop->m_node );
+    }
+    loop->run();
+    return loop;
+}
+
+void event_loop::drain( int timeout_ms ) {
+    m_drain_timeout_ms = timeout_ms;
+    m_draining.store( true, std::memory_order_release );
+}
+
+void event_loop::track( int fd ) {
+    m_owned[fd] = m_users[fd].handle();
+    m_table->opened( m_id );
+}
+
+void event_loop::release( http_conn* conn ) {
+    int fd = conn - m_users;
+    // 只关闭本事件循环登记的那个连接；槽位已经关闭或者被其他事件循环复用时不能碰它，但登记和计数照样注销
+    if( m_owned[fd] != 0 && conn->handle() == m_owned[fd] ) {
+        conn->close_conn();
+    }
+    disown( fd );
+}
+
+void event_loop::disown( int fd ) {
+    if( m_owned[fd] != 0 ) {
+        m_owned[fd] = 0;
+        m_table->closed( m_id );
+    }
+}
+
+void event_loop::drain_tick() {
+    if( !m_draining.load( std::memory_order_acquire ) ) {
+        return;
+    }
+    uint64_t now = metrics::now_ns();
+    if( !m_drain_started ) {
+        m_drain_started = true;
+        m_drain_deadline_ns = now + ( uint64_t )m_drain_timeout_ms * 1000000;
+        http_conn::m_draining.store( true, std::memory_order_relaxed );
+        stop_accept();
+        LOG_INFO( "event loop %d: draining %d connections", m_id, m_table->shard_count( m_id ) );
+    }
+    bool force = m_drain_timeout_ms > 0 && now >= m_drain_deadline_ns;
+    // 关闭连接会减少计数，先取出来
+    int count = m_table->shard_count( m_id );
+    for( int fd = 0, seen = 0; fd < m_table->size() && seen < count; ++fd ) {
+        if( !m_owned[fd] ) {
+            continue;
+        }
+        ++seen;
+        http_conn* conn = m_users + fd;
+        if( conn->handle() != m_owned[fd] ) {
+            // 登记的连接已经不在槽位中了，不会再有它的事件和定时器，只注销，否则平滑退出永远等不到计数归零
+            disown( fd );
+            continue;
+        }
+        // 正在工作线程中的连接不能在这里关闭，下一个滴答再看
+        if( !conn->m_in_worker.load( std::memory_order_acquire )
+                && ( force || conn->m_phase == http_conn::PHASE_IDLE ) ) {
+            close_conn( conn );
+        }
+    }
+    if( m_table->shard_count( m_id ) == 0 ) {
+        m_stopped = true;
+    }
+}
+
+void event_loop::set_timer( http_conn* conn, http_conn::CONN_PHASE phase ) {
+    conn->m_phase = phase;
+    if( m_timeout_ms[ phase ] > 0 ) {
+        m_wheel.reset( &conn->m_timer, m_timeout_ms[ phase ] );
+    } else {
+        m_wheel.del( &conn->m_timer );
+    }
+}
+
+bool event_loop::admit( int connfd ) {
+    // fd超出连接表，或者所有事件循环的连接数之和已满
+    if( connfd >= m_table->size() || m_table->count() >= m_max_conn ) {
+        metrics::add( METRIC_REJECTS, 1 );
+        reject( connfd );
+        return false;
+    }
+    metrics::add( METRIC_ACCEPTS, 1 );
+    return true;
+}
+
+void event_loop::reject( int connfd ) {
+    // 先读走已经到达的请求，否则带着未读数据close会发送RST，客户端可能收不到503
+    char buf[ 4096 ];
+    recv( connfd, buf, sizeof( buf ), MSG_DONTWAIT );
+    // HTTPS的连接还没有握手，明文的503客户端也读不懂，直接关闭
+    if( !tls::enabled() ) {
+        send( connfd, HTTP_RESPONSE_503.data, HTTP_RESPONSE_503.len, MSG_DONTWAIT | MSG_NOSIGNAL );
+    }
+    close( connfd );
+}
+
+bool event_loop::shed_one() {
+    if( m_spare_fd < 0 ) {
+        return false;
+    }
+    close( m_spare_fd );
+    int connfd = accept4( m_listenfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC );
+    if( connfd >= 0 ) {
+        reject( connfd );
+    }
+    m_spare_fd = open( "/dev/null", O_RDONLY | O_CLOEXEC );
+    return connfd >= 0;
+}
@@ -0,0 +1,86 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <pthread.h>
+#include <atomic>
+#include <vector>
+#include "http_conn.h"
+#include "timer_wheel.h"
+#include "config.h"
+
+class conn_table;
+
+#define MAX_FD 65536   // 最大的文件描述符个数
+#define LISTEN_FDS_ENV "WS_LISTEN_FDS"  // 热升级时新进程从这个环境变量得到继承的监听socket，形如"3,4"
+
+// 事件循环使用的I/O机制
+enum IO_MODE {
+    IO_EPOLL = 0,   // epoll反应堆，业务逻辑交给线程池
+    IO_URING,       // io_uring，收发都由内核异步完成，业务逻辑在事件循环线程中直接处理
+    IO_CORO         // epoll，每个连接是一个C++20协程，由事件循环线程直接恢复，不经过线程池
+};
+
+/*
+    事件循环的公共部分，每个线程拥有一个实例
+    每个事件循环拥有自己的SO_REUSEPORT监听socket和时间轮，以及由它accept进来的那一部分连接，
+    内核按四元组哈希把新连接分散到各个监听socket上。
+    连接都在进程级的conn_table中按fd索引，fd在进程内唯一，所以所有事件循环共享同一张表，互不冲突；
+    连接数按事件循环分片统计，每个事件循环只修改自己的分片。
+    具体的I/O机制（epoll或io_uring）由派生类的run()实现。
+    --numa时第i个事件循环的线程绑定到第i个节点（按节点个数取模）的CPU上，它取得的读写缓冲区都在这个节点的内存中。
+
+    平滑退出：drain()之后的下一个滴答停止accept并关闭监听socket（热升级时新进程持有同一个socket，继续接受连接），
+    之后的应答都带Connection: close，空闲的keep-alive连接直接关闭，其余连接发完当前的应答后关闭；
+    本事件循环的连接全部关闭后run()返回。超过排空时间仍未关闭的连接被强制关闭。
+*/
+class event_loop {
+public:
+    event_loop( int id, const config& conf );
+    virtual ~event_loop();
+    bool start();   // 创建线程运行事件循环
+    void join();    // 等待事件循环线程结束
+    virtual void run() = 0;     // 事件循环
+    // 由其他线程（收到信号的主线程）调用，开始平滑退出，timeout_ms之后强制关闭剩下的连接，0表示一直等待
+    void drain( int timeout_ms );
+    int listen_fd() const { return m_listenfd; }
+    static void close_inherited();  // 关闭没有被任何事件循环使用的继承的监听socket
+
+protected:
+    void track( int fd );                   // 登记一个新接受的连接
+    void release( http_conn* conn );        // 关闭本事件循环登记的连接并注销，连接已经关闭时只注销
+    void drain_tick();                      // 每个滴答调用，平滑退出时关闭可以关闭的连接，都关闭后设置m_stopped
+    virtual void stop_accept() = 0;         // 不再接受新连接，关闭监听socket
+    virtual void close_conn( http_conn* conn ) = 0;     // 删除定时器并关闭连接
+
+    void set_timer( http_conn* conn, http_conn::CONN_PHASE phase );  // 进入新的超时阶段并重置定时器
+    bool admit( int connfd );   // 新连接的准入控制，连接数已满时发送503并关闭，返回false
+    void reject( int connfd );  // 发送预先生成的503应答并关闭连接
+    bool shed_one();            // 文件描述符用完（EMFILE）时，借用备用fd接受一个连接并拒绝它，返回是否接受到
+
+private:
+    static void* worker( void* arg );
+    static int inherited_listener( int id, int port );  // 取得继承的第id个监听socket，没有或端口不同时返回-1
+    void disown( int fd );                  // 注销fd上登记的连接并减少计数，没有登记时什么也不做
+
+protected:
+    int m_id;                           // 事件循环编号
+    int m_listenfd;                     // 本事件循环独占的监听socket（SO_REUSEPORT）
+    timer_wheel m_wheel;                // 本事件循环所有连接的超时定时器
+    int m_timeout_ms[ 4 ];              // 各超时阶段的超时时间，按CONN_PHASE索引，0表示不限制
+    conn_table* m_table;                // 进程级的连接表，本事件循环的分片编号为m_id
+    http_conn* m_users;                 // 所有客户端连接，按fd索引，即m_table->at( 0 )
+    int m_max_conn;                     // 同时服务的连接数上限
+    int m_spare_fd;                     // 预留的备用fd，EMFILE时先关闭它才能accept出连接并拒绝
+    bool m_stopped;                     // 平滑退出完成，run()应当返回
+
+private:
+    pthread_t m_thread;
+    int m_node;                         // 事件循环线程绑定的NUMA节点，-1表示不绑定
+    std::vector< uint64_t > m_owned;    // 按fd索引，属于本事件循环的连接登记时的句柄，0表示不属于
+    std::atomic< bool > m_draining;     // 是否已经要求平滑退出
+    int m_drain_timeout_ms;
+    bool m_drain_started;               // 是否已经停止accept
+    uint64_t m_drain_deadline_ns;       // 强制关闭剩余连接的时刻
+};
+
+#endif
@@ -0,0 +1,435 @@
+#include "file_cache.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/inotify.h>
+#include <string>
+#include "logger.h"
+#include "mime_types.h"
+#include "response_arena.h"
+#ifdef WS_WITH_ZLIB
+#include <strings.h>
+#include <zlib.h>
+#endif
+
+// 预先压缩好的文件的后缀，按CONTENT_ENCODING的顺序
+static const char* encoding_suffix[ ENCODING_NUMBER ] = { ".gz", ".br" };
+
+// 比这还小的文件压缩后省不了多少字节，不值得多一个版本
+static const off_t MIN_COMPRESS_SIZE = 256;
+
+// 文件被修改、属性改变（包括链接数变化，即被rename覆盖）、删除或移动时，缓存项失效
+static const uint32_t WATCH_MASK = IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_MOVE_SELF | IN_DELETE_SELF;
+
+file_cache* file_cache::instance() {
+    // 进程内唯一的实例，且不析构，避免退出时与inotify线程竞争
+    static file_cache* cache = new file_cache;
+    return cache;
+}
+
+file_cache::file_cache() :
+        m_lru_head( NULL ), m_lru_tail( NULL ), m_bytes( 0 ),
+        m_max_bytes( 64 * 1024 * 1024 ), m_max_entries( 1024 ), m_revalidate_ms( 1000 ),
+        m_map_min_skip( 0 ), m_inotify_fd( -1 ), m_hits( 0 ), m_misses( 0 ) {
+}
+
+file_cache::~file_cache() {
+}
+
+bool file_cache::init( size_t max_bytes, int max_entries, int revalidate_ms, bool use_inotify ) {
+    m_max_bytes = max_bytes;
+    m_max_entries = max_entries;
+    m_revalidate_ms = revalidate_ms;
+    if( use_inotify && m_inotify_fd < 0 ) {
+        m_inotify_fd = inotify_init1( IN_CLOEXEC );
+        if( m_inotify_fd < 0 ) {
+            return false;
+        }
+        pthread_t tid;
+        if( pthread_create( &tid, NULL, inotify_worker, this ) != 0 ) {
+            close( m_inotify_fd );
+            m_inotify_fd = -1;
+            return false;
+        }
+        pthread_detach( tid );
+    }
+    return true;
+}
+
+// 单调时钟的粗粒度版本通过vDSO读取，不会陷入内核
+long file_cache::now_ms() {
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC_COARSE, &ts );
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+file_cache::RESULT file_cache::acquire( const char* path, entry** out ) {
+    m_lock.lock();
+    std::unordered_map< const char*, entry*, cstr_hash, cstr_equal >::iterator it = m_entries.find( path );
+    if( it != m_entries.end() ) {
+        entry* e = it->second;
+        long now = 0;
+        if( m_inotify_fd < 0 && ( now = now_ms() ) - e->validated_ms >= m_revalidate_ms ) {
+            // 到了验证时间，先持有引用再解锁去stat，避免在锁内做系统调用
+            e->refcount++;
+            m_lock.unlock();
+            struct stat st;
+            bool valid = stat( path, &st ) == 0 && st.st_ino == e->st.st_ino && st.st_dev == e->st.st_dev
+                    && st.st_size == e->st.st_size && st.st_mtim.tv_sec == e->st.st_mtim.tv_sec
+                    && st.st_mtim.tv_nsec == e->st.st_mtim.tv_nsec;
+            m_lock.lock();
+            if( valid && e->cached ) {
+                e->validated_ms = now;
+                m_hits++;
+                lru_unlink( e );
+                lru_push_front( e );
+                m_lock.unlock();
+                *out = e;
+                return OK;
+            }
+            // 文件已经变化，让旧的缓存项失效，重新加载
+            if( e->cached ) {
+                invalidate( e );
+            }
+            if( --e->refcount == 0 ) {
+                destroy( e );
+            }
+        } else {
+            // 命中
+            m_hits++;
+            e->refcount++;
+            lru_unlink( e );
+            lru_push_front( e );
+            m_lock.unlock();
+            *out = e;
+            return OK;
+        }
+    }
+    m_misses++;
+    m_lock.unlock();
+    return load( path, out );
+}
+
+// 未命中时打开并映射文件，然后插入缓存
+file_cache::RESULT file_cache::load( const char* path, entry** out ) {
+    struct stat st;
+    if( stat( path, &st ) < 0 ) {
+        return NOT_FOUND;
+    }
+    // 判断访问权限
+    if( !( st.st_mode & S_IROTH ) ) {
+        return FORBIDDEN;
+    }
+    // 判断是否是目录
+    if( S_ISDIR( st.st_mode ) ) {
+        return IS_DIR;
+    }
+
+    // 以只读方式打开文件，并创建所有连接共享的内存映射
+    int fd = open( path, O_RDONLY | O_CLOEXEC );
+    if( fd < 0 ) {
+        return errno == ENOENT ? NOT_FOUND : FORBIDDEN;
+    }
+    char* address = NULL;
+    if( st.st_size > 0 && ( m_map_min_skip == 0 || ( size_t )st.st_size < m_map_min_skip ) ) {
+        address = ( char* )mmap( 0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+        if( address == MAP_FAILED ) {
+            close( fd );
+            return ERROR;
+        }
+    }
+
+    entry* e = new entry;
+    e->path = strdup( path );
+    e->fd = fd;
+    e->st = st;
+    e->address = address;
+    e->refcount = 1;
+    e->cached = false;
+    e->wd = -1;
+    e->validated_ms = now_ms();
+    e->prev = e->next = NULL;
+    // 文件变化时缓存项一定会重新加载，校验器在这里生成一次，之后的每个应答直接复制
+    e->etag_len = snprintf( e->etag, ETAG_LEN, "%lx-%lx-%llx", ( unsigned long )st.st_ino, ( unsigned long )st.st_size,
+            ( unsigned long long )st.st_mtim.tv_sec * 1000000000ull + st.st_mtim.tv_nsec );
+    format_http_date( e->last_modified, st.st_mtime );
+    e->content_type = mime_types::lookup( path );
+    for( int i = 0; i <= ENCODING_NUMBER; ++i ) {
+        e->responses[i][0].store( NULL, std::memory_order_relaxed );
+        e->responses[i][1].store( NULL, std::memory_order_relaxed );
+    }
+    load_variants( e );
+    if( m_inotify_fd >= 0 ) {
+        e->wd = inotify_add_watch( m_inotify_fd, path, WATCH_MASK );
+    }
+
+    m_lock.lock();
+    // 超过总字节数上限的大文件不进入缓存，最后一个引用释放时直接销毁
+    if( mapped_bytes( e ) <= m_max_bytes
+            && m_entries.find( path ) == m_entries.end() ) {
+        e->cached = true;
+        m_entries[ e->path ] = e;
+        if( e->wd >= 0 ) {
+            m_watches.insert( std::make_pair( e->wd, e ) );
+        }
+        m_bytes += mapped_bytes( e );
+        lru_push_front( e );
+        evict();
+    } else if( e->wd >= 0 && m_watches.count( e->wd ) == 0 ) {
+        inotify_rm_watch( m_inotify_fd, e->wd );
+        e->wd = -1;
+    }
+    m_lock.unlock();
+    *out = e;
+    return OK;
+}
+
+void file_cache::release( entry* e ) {
+    if( !e ) {
+        return;
+    }
+    m_lock.lock();
+    if( --e->refcount == 0 && !e->cached ) {
+        destroy( e );
+    }
+    m_lock.unlock();
+}
+
+// 调用者需持有m_lock
+void file_cache::invalidate( entry* e ) {
+    m_entries.erase( e->path );
+    lru_unlink( e );
+    m_bytes -= mapped_bytes( e );
+    e->cached = false;
+    if( e->wd >= 0 ) {
+        std::pair< std::unordered_multimap< int, entry* >::iterator,
+                std::unordered_multimap< int, entry* >::iterator > range = m_watches.equal_range( e->wd );
+        for( std::unordered_multimap< int, entry* >::iterator it = range.first; it != range.second; ++it ) {
+            if( it->second == e ) {
+                m_watches.erase( it );
+                break;
+            }
+        }
+        // 同一个inode可能被多个路径（硬链接）共享同一个监听描述符
+        if( m_watches.count( e->wd ) == 0 ) {
+            inotify_rm_watch( m_inotify_fd, e->wd );
+        }
+        e->wd = -1;
+    }
+}
+
+size_t file_cache::mapped_bytes( const entry* e ) {
+    size_t bytes = e->address ? e->st.st_size : 0;
+    for( int i = 0; i < ENCODING_NUMBER; ++i ) {
+        if( e->variants[i].address ) {
+            bytes += e->variants[i].size;
+        }
+    }
+    return bytes;
+}
+
+#ifdef WS_WITH_ZLIB
+// 适合在加载时压缩的文本文件
+static bool compressible( const char* path ) {
+    static const char* types[] = { ".html", ".htm", ".css", ".js", ".json", ".txt", ".svg", ".xml" };
+    const char* dot = strrchr( path, '.' );
+    if( !dot ) {
+        return false;
+    }
+    for( size_t i = 0; i < sizeof( types ) / sizeof( types[0] ); ++i ) {
+        if( strcasecmp( dot, types[i] ) == 0 ) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// 以gzip格式压缩，压缩后不比原文件小时返回false
+static bool gzip_compress( const char* data, off_t size, char** out, off_t* out_size ) {
+    z_stream zs;
+    memset( &zs, 0, sizeof( zs ) );
+    // windowBits加16表示输出gzip头部和校验
+    if( deflateInit2( &zs, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY ) != Z_OK ) {
+        return false;
+    }
+    uLong bound = deflateBound( &zs, size );
+    char* buf = ( char* )malloc( bound );
+    if( !buf ) {
+        deflateEnd( &zs );
+        return false;
+    }
+    zs.next_in = ( Bytef* )data;
+    zs.avail_in = size;
+    zs.next_out = ( Bytef* )buf;
+    zs.avail_out = bound;
+    int ret = deflate( &zs, Z_FINISH );
+    off_t len = zs.total_out;
+    deflateEnd( &zs );
+    if( ret != Z_STREAM_END || len >= size ) {
+        free( buf );
+        return false;
+    }
+    *out = buf;
+    *out_size = len;
+    return true;
+}
+#endif
+
+// 在锁外调用，缓存项还没有插入缓存
+void file_cache::load_variants( entry* e ) {
+    for( int i = 0; i < ENCODING_NUMBER; ++i ) {
+        variant& v = e->variants[i];
+        v.fd = -1;
+        v.address = NULL;
+        v.size = 0;
+        v.compressed = false;
+        if( !S_ISREG( e->st.st_mode ) || e->st.st_size < MIN_COMPRESS_SIZE ) {
+            continue;
+        }
+
+        // 压缩文件要比原文件小，也不能比原文件旧（否则可能是原文件更新前压缩的）
+        std::string path = std::string( e->path ) + encoding_suffix[i];
+        struct stat st;
+        if( stat( path.c_str(), &st ) < 0 || !S_ISREG( st.st_mode ) || !( st.st_mode & S_IROTH )
+                || st.st_size == 0 || st.st_size >= e->st.st_size || st.st_mtime < e->st.st_mtime ) {
+            continue;
+        }
+        int fd = open( path.c_str(), O_RDONLY | O_CLOEXEC );
+        if( fd < 0 ) {
+            continue;
+        }
+        char* address = NULL;
+        if( m_map_min_skip == 0 || ( size_t )st.st_size < m_map_min_skip ) {
+            address = ( char* )mmap( 0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+            if( address == MAP_FAILED ) {
+                close( fd );
+                continue;
+            }
+        }
+        v.fd = fd;
+        v.address = address;
+        v.size = st.st_size;
+    }
+
+#ifdef WS_WITH_ZLIB
+    variant& gz = e->variants[ ENCODING_GZIP ];
+    if( gz.size == 0 && e->address && e->st.st_size >= MIN_COMPRESS_SIZE && compressible( e->path ) ) {
+        if( gzip_compress( e->address, e->st.st_size, &gz.address, &gz.size ) ) {
+            gz.compressed = true;
+        }
+    }
+#endif
+}
+
+// 调用者需持有m_lock，且缓存项已经不在缓存中、没有任何引用
+void file_cache::destroy( entry* e ) {
+    if( e->address ) {
+        munmap( e->address, e->st.st_size );
+    }
+    for( int i = 0; i < ENCODING_NUMBER; ++i ) {
+        variant& v = e->variants[i];
+        if( v.compressed ) {
+            free( v.address );
+        } else if( v.address ) {
+            munmap( v.address, v.size );
+        }
+        if( v.fd >= 0 ) {
+            close( v.fd );
+        }
+    }
+    for( int i = 0; i <= ENCODING_NUMBER; ++i ) {
+        for( int j = 0; j < 2; ++j ) {
+            response* r = e->responses[i][j].load( std::memory_order_relaxed );
+            if( r ) {
+                response_arena::instance()->free( ( char* )r, r->size );
+            }
+        }
+    }
+    close( e->fd );
+    free( e->path );
+    delete e;
+}
+
+// 从LRU链表尾部开始淘汰，直到满足字节数和个数上限
+void file_cache::evict() {
+    entry* e = m_lru_tail;
+    while( e && ( m_bytes > m_max_bytes || ( int )m_entries.size() > m_max_entries ) ) {
+        entry* prev = e->prev;
+        invalidate( e );
+        if( e->refcount == 0 ) {
+            destroy( e );
+        }
+        e = prev;
+    }
+}
+
+void file_cache::lru_unlink( entry* e ) {
+    if( e->prev ) {
+        e->prev->next = e->next;
+    } else if( m_lru_head == e ) {
+        m_lru_head = e->next;
+    }
+    if( e->next ) {
+        e->next->prev = e->prev;
+    } else if( m_lru_tail == e ) {
+        m_lru_tail = e->prev;
+    }
+    e->prev = e->next = NULL;
+}
+
+void file_cache::lru_push_front( entry* e ) {
+    e->prev = NULL;
+    e->next = m_lru_head;
+    if( m_lru_head ) {
+        m_lru_head->prev = e;
+    }
+    m_lru_head = e;
+    if( !m_lru_tail ) {
+        m_lru_tail = e;
+    }
+}
+
+void* file_cache::inotify_worker( void* arg ) {
+    file_cache* cache = ( file_cache* )arg;
+    cache->inotify_loop();
+    return cache;
+}
+
+// 读取inotify事件，让对应的缓存项失效
+void file_cache::inotify_loop() {
+    char buf[ 4096 ] __attribute__ ( ( aligned( __alignof__( struct inotify_event ) ) ) );
+    while( true ) {
+        ssize_t len = ::read( m_inotify_fd, buf, sizeof( buf ) );
+        if( len <= 0 ) {
+            if( len < 0 && errno == EINTR ) {
+                continue;
+            }
+            LOG_ERROR( "file cache: inotify read failure" );
+            break;
+        }
+        m_lock.lock();
+        for( char* p = buf; p < buf + len; ) {
+            struct inotify_event* event = ( struct inotify_event* )p;
+            p += sizeof( struct inotify_event ) + event->len;
+
+            std::unordered_multimap< int, entry* >::iterator it;
+            while( ( it = m_watches.find( event->wd ) ) != m_watches.end() ) {
+                entry* e = it->second;
+                if( event->mask & IN_IGNORED ) {
+                    // 监听已被内核移除（文件已删除），不能再调用inotify_rm_watch
+                    e->wd = -1;
+                    m_watches.erase( it );
+                }
+                invalidate( e );
+                if( e->refcount == 0 ) {
+                    destroy( e );
+                }
+            }
+        }
+        m_lock.unlock();
+    }
+}
@@ -0,0 +1,143 @@
+#ifndef FILE_CACHE_H
+#define FILE_CACHE_H
+
+#include <sys/stat.h>
+#include <pthread.h>
+#include <string.h>
+#include <unordered_map>
+#include <atomic>
+#include "locker.h"
+#include "http_response.h"
+
+/*
+    进程级的打开文件缓存
+    以do_request()从根目录索引中查到的完整路径为键，缓存文件的fd、struct stat以及一份所有连接共享的只读映射。
+    命中时只做一次哈希查找和引用计数加1，不再有stat、open、mmap、close和munmap这些系统调用。
+    缓存项的有效性有两种验证方式：
+    - 定时验证：距离上次验证超过revalidate_ms毫秒时，重新stat一次，比较inode、mtime和大小
+    - inotify：后台线程监听已缓存的文件，文件被修改、删除或移动时立即让缓存项失效，命中时不做任何检查
+    缓存按LRU淘汰，受总字节数和缓存项个数两个上限约束。仍被连接引用的缓存项被淘汰或失效后，
+    要等最后一个引用释放时才真正munmap和close。
+
+    加载文件时同时查找预先压缩好的同名.gz、.br文件，作为缓存项的编码版本一起缓存；
+    用-DWS_WITH_ZLIB编译（并链接-lz）时，没有.gz文件的文本文件在加载时压缩一次，
+    压缩结果放在内存中。编码版本只在原文件重新加载时重新查找，更新压缩文件时应同时更新原文件。
+*/
+
+// 内容编码，即编码版本在entry::variants中的下标
+enum CONTENT_ENCODING { ENCODING_GZIP = 0, ENCODING_BR, ENCODING_NUMBER };
+
+class file_cache {
+public:
+    // 文件的一个编码版本
+    struct variant {
+        int fd;                 // 预先压缩好的文件，加载时压缩的为-1
+        char* address;          // 内容的映射或加载时压缩的内存，没有这个版本时为NULL（fd有效时也可能为NULL，只能sendfile）
+        off_t size;             // 内容的大小，没有这个版本时为0
+        bool compressed;        // 内容是否为加载时压缩的（malloc得到的内存）
+    };
+
+    static const int ETAG_LEN = 56;     // 三个64位数的十六进制加两个'-'
+
+    /*
+        小文件预先生成的完整200应答，紧跟在这个结构之后，放在response_arena中。
+        第一次发送某个版本的完整应答时由http_conn生成，之后的应答直接复制它、只改写Date。
+        它属于缓存项：文件变化、缓存项重新加载时，新的缓存项重新生成，旧的随旧缓存项一起释放。
+    */
+    struct response {
+        int len;                // 应答的字节数
+        int size;               // 所在块的大小
+        int date;               // Date头部在应答中的偏移
+        char* data() { return ( char* )( this + 1 ); }
+    };
+
+    struct entry {
+        char* path;             // 文件完整路径，同时也是哈希表的键
+        int fd;                 // 打开的文件描述符
+        struct stat st;         // 文件状态
+        char* address;          // 文件的只读共享映射，空文件以及超过映射上限、只能用sendfile发送的大文件为NULL
+        int refcount;           // 正在使用该缓存项的连接数
+        bool cached;            // 是否仍在哈希表和LRU链表中
+        int wd;                 // inotify监听描述符，没有监听时为-1
+        long validated_ms;      // 上次验证有效性的时间
+        variant variants[ ENCODING_NUMBER ];    // 各编码版本，只比原文件小时才保留
+        char etag[ ETAG_LEN ];  // 原文件的强校验器"inode-大小-修改时间"（十六进制，不含引号），加载时生成
+        int etag_len;
+        char last_modified[ 32 ];   // 修改时间的HTTP日期格式，加载时生成
+        const http_fragment* content_type;  // 按扩展名确定的Content-Type响应头，编码版本也使用它
+        std::atomic< response* > responses[ ENCODING_NUMBER + 1 ][ 2 ];   // [编码版本 + 1（0为原文件）][是否keep-alive]
+        entry* prev;            // LRU链表，表头是最近使用的
+        entry* next;
+    };
+
+    // 查找的结果，对应do_request()的几种返回值
+    enum RESULT { OK = 0, NOT_FOUND, FORBIDDEN, IS_DIR, ERROR };
+
+public:
+    static file_cache* instance();
+
+    /*
+        设置缓存参数，应在服务启动、开始处理请求之前调用
+        max_bytes: 缓存映射的总字节数上限    max_entries: 缓存项个数上限
+        revalidate_ms: 定时验证的间隔，0表示每次命中都验证    use_inotify: 使用inotify代替定时验证
+    */
+    bool init( size_t max_bytes, int max_entries, int revalidate_ms, bool use_inotify );
+    // 大于等于map_min_skip字节的文件只缓存fd和stat、不做映射，由调用者用sendfile发送，0表示全部映射
+    void set_map_limit( size_t map_min_skip ) { m_map_min_skip = map_min_skip; }
+
+    RESULT acquire( const char* path, entry** out );  // 获取文件，成功时引用计数加1
+    void release( entry* e );                         // 释放acquire得到的缓存项
+
+    unsigned long hits() const { return m_hits; }
+    unsigned long misses() const { return m_misses; }
+
+private:
+    file_cache();
+    ~file_cache();
+
+    static long now_ms();
+    static void* inotify_worker( void* arg );
+    void inotify_loop();
+
+    RESULT load( const char* path, entry** out );
+    void invalidate( entry* e );    // 把缓存项移出哈希表和LRU链表
+    void destroy( entry* e );       // munmap、close并释放缓存项
+    void evict();                   // 按LRU淘汰，直到满足上限
+    void lru_unlink( entry* e );
+    void lru_push_front( entry* e );
+    void load_variants( entry* e );     // 查找（或生成）文件的编码版本
+    static size_t mapped_bytes( const entry* e );
+
+    struct cstr_hash {
+        size_t operator()( const char* s ) const {
+            // FNV-1a
+            size_t h = 14695981039346656037ULL;
+            for( ; *s; ++s ) {
+                h = ( h ^ ( unsigned char )*s ) * 1099511628211ULL;
+            }
+            return h;
+        }
+    };
+    struct cstr_equal {
+        bool operator()( const char* a, const char* b ) const { return strcmp( a, b ) == 0; }
+    };
+
+private:
+    locker m_lock;      // 保护下面所有成员
+    std::unordered_map< const char*, entry*, cstr_hash, cstr_equal > m_entries;
+    std::unordered_multimap< int, entry* > m_watches;   // inotify监听描述符到缓存项
+    entry* m_lru_head;
+    entry* m_lru_tail;
+    size_t m_bytes;         // 当前缓存的映射总字节数
+
+    size_t m_max_bytes;
+    int m_max_entries;
+    int m_revalidate_ms;
+    size_t m_map_min_skip;
+    int m_inotify_fd;       // 使用inotify时的inotify实例，否则为-1
+
+    unsigned long m_hits;
+    unsigned long m_misses;
+};
+
+#endif
@@ -0,0 +1,388 @@
+#include "hpack.h"
+#include <string.h>
+
+#define S( s ) s, sizeof( s ) - 1
+
+// 静态表（RFC 7541附录A），下标从1开始
+static const struct {
+    const char* name;
+    int name_len;
+    const char* value;
+    int value_len;
+} static_table[ HPACK_STATIC_NUMBER + 1 ] = {
+    { S( "" ), S( "" ) },
+    { S( ":authority" ), S( "" ) },
+    { S( ":method" ), S( "GET" ) },
+    { S( ":method" ), S( "POST" ) },
+    { S( ":path" ), S( "/" ) },
+    { S( ":path" ), S( "/index.html" ) },
+    { S( ":scheme" ), S( "http" ) },
+    { S( ":scheme" ), S( "https" ) },
+    { S( ":status" ), S( "200" ) },
+    { S( ":status" ), S( "204" ) },
+    { S( ":status" ), S( "206" ) },
+    { S( ":status" ), S( "304" ) },
+    { S( ":status" ), S( "400" ) },
+    { S( ":status" ), S( "404" ) },
+    { S( ":status" ), S( "500" ) },
+    { S( "accept-charset" ), S( "" ) },
+    { S( "accept-encoding" ), S( "gzip, deflate" ) },
+    { S( "accept-language" ), S( "" ) },
+    { S( "accept-ranges" ), S( "" ) },
+    { S( "accept" ), S( "" ) },
+    { S( "access-control-allow-origin" ), S( "" ) },
+    { S( "age" ), S( "" ) },
+    { S( "allow" ), S( "" ) },
+    { S( "authorization" ), S( "" ) },
+    { S( "cache-control" ), S( "" ) },
+    { S( "content-disposition" ), S( "" ) },
+    { S( "content-encoding" ), S( "" ) },
+    { S( "content-language" ), S( "" ) },
+    { S( "content-length" ), S( "" ) },
+    { S( "content-location" ), S( "" ) },
+    { S( "content-range" ), S( "" ) },
+    { S( "content-type" ), S( "" ) },
+    { S( "cookie" ), S( "" ) },
+    { S( "date" ), S( "" ) },
+    { S( "etag" ), S( "" ) },
+    { S( "expect" ), S( "" ) },
+    { S( "expires" ), S( "" ) },
+    { S( "from" ), S( "" ) },
+    { S( "host" ), S( "" ) },
+    { S( "if-match" ), S( "" ) },
+    { S( "if-modified-since" ), S( "" ) },
+    { S( "if-none-match" ), S( "" ) },
+    { S( "if-range" ), S( "" ) },
+    { S( "if-unmodified-since" ), S( "" ) },
+    { S( "last-modified" ), S( "" ) },
+    { S( "link" ), S( "" ) },
+    { S( "location" ), S( "" ) },
+    { S( "max-forwards" ), S( "" ) },
+    { S( "proxy-authenticate" ), S( "" ) },
+    { S( "proxy-authorization" ), S( "" ) },
+    { S( "range" ), S( "" ) },
+    { S( "referer" ), S( "" ) },
+    { S( "refresh" ), S( "" ) },
+    { S( "retry-after" ), S( "" ) },
+    { S( "server" ), S( "" ) },
+    { S( "set-cookie" ), S( "" ) },
+    { S( "strict-transport-security" ), S( "" ) },
+    { S( "transfer-encoding" ), S( "" ) },
+    { S( "user-agent" ), S( "" ) },
+    { S( "vary" ), S( "" ) },
+    { S( "via" ), S( "" ) },
+    { S( "www-authenticate" ), S( "" ) },
+};
+
+/*
+    HPACK的Huffman编码（RFC 7541附录B）是规范的：码字按长度、同样长度的按符号排列，依次加一。
+    解码只需要每种长度的码字个数和按这个顺序排列的符号，不需要码字表
+*/
+static const int HUFFMAN_MAX_BITS = 30;
+static const int HUFFMAN_EOS = 256;
+static const unsigned char huffman_count[ HUFFMAN_MAX_BITS + 1 ] = {
+    0, 0, 0, 0, 0, 10, 26, 32, 6, 0, 5, 3, 2, 6, 2, 3, 0, 0, 0, 3, 8, 13, 26, 29, 12, 4, 15, 19, 29, 0, 4
+};
+static const unsigned short huffman_symbol[ 257 ] = {
+    48, 49, 50, 97, 99, 101, 105, 111, 115, 116, 32, 37, 45, 46, 47, 51,
+    52, 53, 54, 55, 56, 57, 61, 65, 95, 98, 100, 102, 103, 104, 108, 109,
+    110, 112, 114, 117, 58, 66, 67, 68, 69, 70, 71, 72, 73, 74, 75, 76,
+    77, 78, 79, 80, 81, 82, 83, 84, 85, 86, 87, 89, 106, 107, 113, 118,
+    119, 120, 121, 122, 38, 42, 44, 59, 88, 90, 33, 34, 40, 41, 63, 39,
+    43, 124, 35, 62, 0, 36, 64, 91, 93, 126, 94, 125, 60, 96, 123, 92,
+    195, 208, 128, 130, 131, 162, 184, 194, 224, 226, 153, 161, 167, 172, 176, 177,
+    179, 209, 216, 217, 227, 229, 230, 129, 132, 133, 134, 136, 146, 154, 156, 160,
+    163, 164, 169, 170, 173, 178, 181, 185, 186, 187, 189, 190, 196, 198, 228, 232,
+    233, 1, 135, 137, 138, 139, 140, 141, 143, 147, 149, 150, 151, 152, 155, 157,
+    158, 165, 166, 168, 174, 175, 180, 182, 183, 188, 191, 197, 231, 239, 9, 142,
+    144, 145, 148, 159, 171, 206, 215, 225, 236, 237, 199, 207, 234, 235, 192, 193,
+    200, 201, 202, 205, 210, 213, 218, 219, 238, 240, 242, 243, 255, 203, 204, 211,
+    212, 214, 221, 222, 223, 241, 244, 245, 246, 247, 248, 250, 251, 252, 253, 254,
+    2, 3, 4, 5, 6, 7, 8, 11, 12, 14, 15, 16, 17, 18, 19, 20,
+    21, 23, 24, 25, 26, 27, 28, 29, 30, 31, 127, 220, 249, 10, 13, 22,
+    256,
+};
+
+static const int MAX_STRING_LEN = 65536;    // 单个字符串的长度上限，超过时当作压缩错误
+
+// 解码prefix位前缀的整数（RFC 7541 5.1）
+static bool decode_int( const unsigned char** p, const unsigned char* end, int prefix, int* out ) {
+    if( *p >= end ) {
+        return false;
+    }
+    int mask = ( 1 << prefix ) - 1;
+    int v = **p & mask;
+    ++*p;
+    if( v == mask ) {
+        int shift = 0;
+        while( true ) {
+            if( *p >= end || shift > 21 ) {
+                return false;
+            }
+            unsigned char b = *( *p )++;
+            v += ( b & 0x7f ) << shift;
+            shift += 7;
+            if( !( b & 0x80 ) ) {
+                break;
+            }
+        }
+    }
+    *out = v;
+    return true;
+}
+
+/*
+    按规范编码逐位解码：长度为len的码字从first开始，共huffman_count[len]个，对应的符号从index开始。
+    结尾不足一个码字的位只能是最多7个1（EOS的前缀），出现EOS本身也是错误
+*/
+static int huffman_decode( const unsigned char* p, int len, char* out ) {
+    char* o = out;
+    int code = 0, first = 0, index = 0, bits = 0;
+    for( const unsigned char* end = p + len; p < end; ++p ) {
+        for( int bit = 7; bit >= 0; --bit ) {
+            code |= ( *p >> bit ) & 1;
+            ++bits;
+            int count = huffman_count[ bits ];
+            if( code - first < count ) {
+                int sym = huffman_symbol[ index + code - first ];
+                if( sym == HUFFMAN_EOS ) {
+                    return -1;
+                }
+                *o++ = ( char )sym;
+                code = first = index = bits = 0;
+                continue;
+            }
+            if( bits == HUFFMAN_MAX_BITS ) {
+                return -1;
+            }
+            index += count;
+            first = ( first + count ) << 1;
+            code <<= 1;
+        }
+    }
+    // 剩下的位都是1时code（已经左移了一位）等于这一长度的全1再加0
+    if( bits > 7 || code != ( ( 1 << bits ) - 1 ) << 1 ) {
+        return -1;
+    }
+    return o - out;
+}
+
+// 解码一个字符串，放进arena并以'\0'结尾
+static bool decode_string( const unsigned char** p, const unsigned char* end, conn_arena* arena, const char** out, int* out_len ) {
+    if( *p >= end ) {
+        return false;
+    }
+    bool huffman = ( **p & 0x80 ) != 0;
+    int len = 0;
+    if( !decode_int( p, end, 7, &len ) || len > end - *p || len > MAX_STRING_LEN ) {
+        return false;
+    }
+    // Huffman编码的码字至少5位，解码后最多是原长度的8/5
+    int size = huffman ? len * 8 / 5 + 1 : len;
+    char* s = ( char* )arena->alloc( size + 1, 1 );
+    if( !s ) {
+        return false;
+    }
+    int n = len;
+    if( huffman ) {
+        n = huffman_decode( *p, len, s );
+        if( n < 0 ) {
+            return false;
+        }
+    } else {
+        memcpy( s, *p, len );
+    }
+    *p += len;
+    s[ n ] = '\0';
+    *out = s;
+    *out_len = n;
+    return true;
+}
+
+bool hpack_decoder::decode( const unsigned char* p, int len, conn_arena* arena, hpack_header* out, int max, int* count ) {
+    const unsigned char* end = p + len;
+    int n = 0;
+    bool fields = false;
+    while( p < end ) {
+        unsigned char b = *p;
+        hpack_header h;
+        if( b & 0x80 ) {
+            // 索引的头部：1xxxxxxx
+            int index = 0;
+            if( !decode_int( &p, end, 7, &index ) || !lookup( index, arena, &h ) ) {
+                return false;
+            }
+        } else if( ( b & 0xe0 ) == 0x20 ) {
+            // 动态表大小更新：001xxxxx，只能出现在头部块的开头
+            int size = 0;
+            if( fields || !decode_int( &p, end, 5, &size ) || size > TABLE_SIZE ) {
+                return false;
+            }
+            m_max_size = size;
+            evict( size );
+            continue;
+        } else {
+            // 字面值：01xxxxxx加入动态表，0000xxxx不加入，0001xxxx永不加入（对我们来说和不加入一样）
+            bool indexing = ( b & 0x40 ) != 0;
+            int index = 0;
+            if( !decode_int( &p, end, indexing ? 6 : 4, &index ) ) {
+                return false;
+            }
+            if( index == 0 ) {
+                h.index = 0;
+                if( !decode_string( &p, end, arena, &h.name, &h.name_len ) ) {
+                    return false;
+                }
+            } else if( !lookup( index, arena, &h ) ) {
+                return false;
+            }
+            if( !decode_string( &p, end, arena, &h.value, &h.value_len ) ) {
+                return false;
+            }
+            if( indexing ) {
+                insert( h );
+            }
+        }
+        fields = true;
+        if( n < max ) {
+            out[ n++ ] = h;
+        }
+    }
+    *count = n;
+    return true;
+}
+
+// 动态表中的内容会随淘汰移动，取出的名称和值复制到arena中
+bool hpack_decoder::lookup( int index, conn_arena* arena, hpack_header* h ) const {
+    if( index <= 0 ) {
+        return false;
+    }
+    if( index <= HPACK_STATIC_NUMBER ) {
+        h->name = static_table[ index ].name;
+        h->name_len = static_table[ index ].name_len;
+        h->value = static_table[ index ].value;
+        h->value_len = static_table[ index ].value_len;
+        // 同名的几项（:method、:path、:scheme、:status）都用第一项的下标
+        while( index > 1 && static_table[ index - 1 ].name_len == h->name_len
+                && memcmp( static_table[ index - 1 ].name, h->name, h->name_len ) == 0 ) {
+            --index;
+        }
+        h->index = index;
+        return true;
+    }
+    // 动态表的第一项（下标62）是最新加入的
+    index -= HPACK_STATIC_NUMBER + 1;
+    if( index >= m_count ) {
+        return false;
+    }
+    const entry& e = m_entries[ m_count - 1 - index ];
+    char* s = ( char* )arena->alloc( e.name_len + e.value_len + 2, 1 );
+    if( !s ) {
+        return false;
+    }
+    memcpy( s, m_data + e.offset, e.name_len );
+    s[ e.name_len ] = '\0';
+    memcpy( s + e.name_len + 1, m_data + e.offset + e.name_len, e.value_len );
+    s[ e.name_len + 1 + e.value_len ] = '\0';
+    h->name = s;
+    h->name_len = e.name_len;
+    h->value = s + e.name_len + 1;
+    h->value_len = e.value_len;
+    h->index = e.index;
+    return true;
+}
+
+void hpack_decoder::insert( const hpack_header& h ) {
+    int size = h.name_len + h.value_len + 32;
+    if( size > m_max_size ) {
+        // 比整个表还大的项使表变空，本身也不加入，这不是错误
+        evict( 0 );
+        return;
+    }
+    evict( m_max_size - size );
+    entry& e = m_entries[ m_count++ ];
+    e.offset = m_used;
+    e.name_len = h.name_len;
+    e.value_len = h.value_len;
+    e.index = h.index;
+    memcpy( m_data + m_used, h.name, h.name_len );
+    memcpy( m_data + m_used + h.name_len, h.value, h.value_len );
+    m_used += h.name_len + h.value_len;
+    m_size += size;
+}
+
+void hpack_decoder::evict( int size ) {
+    int n = 0;
+    while( m_size > size ) {
+        const entry& e = m_entries[ n++ ];
+        m_size -= e.name_len + e.value_len + 32;
+    }
+    if( n == 0 ) {
+        return;
+    }
+    m_count -= n;
+    int shift = m_count > 0 ? m_entries[ n ].offset : m_used;
+    memmove( m_data, m_data + shift, m_used - shift );
+    m_used -= shift;
+    memmove( m_entries, m_entries + n, m_count * sizeof( entry ) );
+    for( int i = 0; i < m_count; ++i ) {
+        m_entries[ i ].offset -= shift;
+    }
+}
+
+// 编码prefix位前缀的整数，first是第一个字节中前缀之外的高位
+static char* encode_int( char* p, char* end, int prefix, unsigned char first, int v ) {
+    int mask = ( 1 << prefix ) - 1;
+    if( p >= end ) {
+        return NULL;
+    }
+    if( v < mask ) {
+        *p++ = ( char )( first | v );
+        return p;
+    }
+    *p++ = ( char )( first | mask );
+    v -= mask;
+    while( v >= 0x80 ) {
+        if( p >= end ) {
+            return NULL;
+        }
+        *p++ = ( char )( ( v & 0x7f ) | 0x80 );
+        v >>= 7;
+    }
+    if( p >= end ) {
+        return NULL;
+    }
+    *p++ = ( char )v;
+    return p;
+}
+
+char* hpack_encoder::status( char* p, char* end, int status ) {
+    int index = 0;
+    switch( status ) {
+        case 200: index = 8; break;
+        case 204: index = 9; break;
+        case 206: index = 10; break;
+        case 304: index = 11; break;
+        case 400: index = 12; break;
+        case 404: index = 13; break;
+        case 500: index = 14; break;
+        default: {
+            char digits[3] = { ( char )( '0' + status / 100 % 10 ), ( char )( '0' + status / 10 % 10 ), ( char )( '0' + status % 10 ) };
+            return header( p, end, HPACK_STATUS, digits, 3 );
+        }
+    }
+    // 静态表中的状态码只要一个字节
+    return encode_int( p, end, 7, 0x80, index );
+}
+
+char* hpack_encoder::header( char* p, char* end, int index, const char* value, int len ) {
+    p = encode_int( p, end, 4, 0x00, index );
+    if( p ) {
+        p = encode_int( p, end, 7, 0x00, len );
+    }
+    if( !p || end - p < len ) {
+        return NULL;
+    }
+    memcpy( p, value, len );
+    return p + len;
+}
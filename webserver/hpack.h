@@ -0,0 +1,82 @@
+#ifndef HPACK_H
+#define HPACK_H
+
+#include <stddef.h>
+#include "conn_arena.h"
+
+/*
+    HTTP/2的头部压缩（RFC 7541）
+    - 解码：静态表、动态表、整数和Huffman编码都按RFC实现。解码出的字符串以'\0'结尾，
+      静态表中的名称和值直接指向静态字符串，其余的复制到连接的conn_arena中，请求结束时一起归还。
+      名称来自静态表（或者插入动态表时名称来自静态表）的头部带上它在静态表中的下标，
+      http2_session按下标分派，常见的请求头部不用比较字符串
+    - 编码：应答的头部只用静态表，:status是常见的状态码时只占一个字节，其余的头部是名称引用静态表、
+      不加入动态表的字面值，不使用Huffman编码。客户端不必为我们维护动态表的状态，编码也不需要任何状态
+    解码器属于一个连接，同一时刻只被一个线程使用，不需要加锁。
+*/
+
+// 解码出的一个头部
+struct hpack_header {
+    const char* name;
+    int name_len;
+    const char* value;
+    int value_len;
+    int index;              // 名称在静态表中的下标，不在静态表中为0
+};
+
+// 静态表中用到的下标
+enum HPACK_STATIC_INDEX {
+    HPACK_AUTHORITY = 1, HPACK_METHOD = 2, HPACK_PATH = 4, HPACK_SCHEME = 6, HPACK_STATUS = 8,
+    HPACK_ACCEPT_ENCODING = 16, HPACK_ACCEPT_RANGES = 18, HPACK_CONTENT_ENCODING = 26, HPACK_CONTENT_LENGTH = 28,
+    HPACK_CONTENT_RANGE = 30, HPACK_CONTENT_TYPE = 31, HPACK_DATE = 33, HPACK_ETAG = 34,
+    HPACK_IF_MODIFIED_SINCE = 40, HPACK_IF_NONE_MATCH = 41, HPACK_IF_RANGE = 42, HPACK_LAST_MODIFIED = 44,
+    HPACK_RANGE = 50, HPACK_VARY = 59, HPACK_STATIC_NUMBER = 61
+};
+
+class hpack_decoder {
+public:
+    static const int TABLE_SIZE = 4096;     // 动态表的大小上限，即SETTINGS_HEADER_TABLE_SIZE的默认值，我们不修改它
+    static const int MAX_ENTRIES = TABLE_SIZE / 32;     // 每个表项至少占32字节
+
+    hpack_decoder() : m_size( 0 ), m_max_size( TABLE_SIZE ), m_used( 0 ), m_count( 0 ) {}
+
+    /*
+        解码一个完整的头部块，头部依次写入out，超过max个的头部照常解码（动态表的状态要和对方一致）但不输出，
+        *count为输出的个数。返回false表示压缩错误，连接不能再继续使用
+    */
+    bool decode( const unsigned char* p, int len, conn_arena* arena, hpack_header* out, int max, int* count );
+
+private:
+    // 动态表的一项，名称和值连续地放在m_data中
+    struct entry {
+        int offset;
+        int name_len;
+        int value_len;
+        int index;          // 名称在静态表中的下标
+    };
+
+    bool lookup( int index, conn_arena* arena, hpack_header* h ) const;    // 按下标取静态表或动态表中的项
+    void insert( const hpack_header& h );               // 加入动态表，先淘汰最旧的项
+    void evict( int size );                             // 淘汰最旧的项，直到表的大小不超过size
+
+    /*
+        动态表：m_data中的名称和值按插入顺序从旧到新排列，m_entries也是从旧到新，
+        淘汰旧项时把剩下的内容整体前移，表不超过4KB，代价很小，下标计算和查找都不用处理回绕
+    */
+    char m_data[ TABLE_SIZE ];
+    entry m_entries[ MAX_ENTRIES ];
+    int m_size;             // 按RFC计算的表的大小（每项名称、值的长度加32）
+    int m_max_size;         // 当前的大小上限，由头部块中的大小更新指令设置，不超过TABLE_SIZE
+    int m_used;             // m_data中已使用的字节数
+    int m_count;            // 表项个数
+};
+
+class hpack_encoder {
+public:
+    // 以下函数把一个头部追加到p，空间不够时返回NULL，否则返回写入之后的位置
+    static char* status( char* p, char* end, int status );
+    // 名称引用静态表的第index项、不加入动态表的字面值
+    static char* header( char* p, char* end, int index, const char* value, int len );
+};
+
+#endif
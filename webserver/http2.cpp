@@ -0,0 +1,944 @@
+#include "http2.h"
+#include <new>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+// 错误页面的内容，与HTTP/1.1的应答相同
+extern const char* error_400_form;
+extern const char* error_403_form;
+extern const char* error_404_form;
+extern const char* error_414_form;
+extern const char* error_500_form;
+static const char error_501_form[] = "The request method is not supported over HTTP/2 by this server.\n";
+
+static const char connection_preface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+// 帧的标志
+static const int FLAG_END_STREAM = 0x1;
+static const int FLAG_ACK = 0x1;
+static const int FLAG_END_HEADERS = 0x4;
+static const int FLAG_PADDED = 0x8;
+static const int FLAG_PRIORITY = 0x20;
+
+// SETTINGS的参数
+static const int SETTINGS_ENABLE_PUSH = 0x2;
+static const int SETTINGS_MAX_CONCURRENT_STREAMS = 0x3;
+static const int SETTINGS_INITIAL_WINDOW_SIZE = 0x4;
+static const int SETTINGS_MAX_FRAME_SIZE = 0x5;
+
+static const long MAX_WINDOW = 0x7fffffff;
+
+bool http2_session::m_enabled = false;
+
+static uint32_t get32( const unsigned char* p ) {
+    return ( ( uint32_t )p[0] << 24 ) | ( ( uint32_t )p[1] << 16 ) | ( ( uint32_t )p[2] << 8 ) | p[3];
+}
+
+static void put32( unsigned char* p, uint32_t v ) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+// 去掉预生成片段中的名称和行尾，只留下头部的值
+static const char* fragment_value( const http_fragment& f, int* len ) {
+    const char* p = ( const char* )memchr( f.data, ':', f.len ) + 1;
+    while( *p == ' ' ) {
+        ++p;
+    }
+    *len = f.data + f.len - 2 - p;
+    return p;
+}
+
+// HTTP2-Settings是去掉填充的base64url，返回解码出的字节数，出错时返回-1
+static int base64url_decode( const char* s, unsigned char* out, int size ) {
+    int n = 0, bits = 0;
+    uint32_t acc = 0;
+    for( ; *s; ++s ) {
+        int v;
+        if( *s >= 'A' && *s <= 'Z' ) {
+            v = *s - 'A';
+        } else if( *s >= 'a' && *s <= 'z' ) {
+            v = *s - 'a' + 26;
+        } else if( *s >= '0' && *s <= '9' ) {
+            v = *s - '0' + 52;
+        } else if( *s == '-' ) {
+            v = 62;
+        } else if( *s == '_' ) {
+            v = 63;
+        } else if( *s == '=' ) {
+            break;
+        } else {
+            return -1;
+        }
+        acc = ( acc << 6 ) | v;
+        bits += 6;
+        if( bits >= 8 ) {
+            bits -= 8;
+            if( n >= size ) {
+                return -1;
+            }
+            out[ n++ ] = ( unsigned char )( acc >> bits );
+        }
+    }
+    return n;
+}
+
+int http2_session::match_preface( const char* data, int len ) {
+    int n = len < PREFACE_LEN ? len : PREFACE_LEN;
+    if( memcmp( data, connection_preface, n ) != 0 ) {
+        return -1;
+    }
+    return len >= PREFACE_LEN ? 1 : 0;
+}
+
+http2_session* http2_session::create( http_conn* conn ) {
+    int size = 0;
+    char* p = buffer_pool::instance()->acquire( sizeof( http2_session ), &size );
+    if( !p ) {
+        return NULL;
+    }
+    http2_session* session = new ( p ) http2_session( conn );
+    session->m_size = size;
+    // 一批帧总是一次writev发出，Nagle没有好处；窗口用完后的下一批很小，等对方的延迟确认会停顿几十毫秒
+    int one = 1;
+    setsockopt( conn->m_sockfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof( one ) );
+    return session;
+}
+
+void http2_session::destroy( http2_session* session ) {
+    int size = session->m_size;
+    session->~http2_session();
+    buffer_pool::instance()->release( ( char* )session, size );
+}
+
+http2_session::http2_session( http_conn* conn ) : m_size( 0 ), m_conn( conn ), m_stream_count( 0 ), m_next( 0 ), m_last_stream( 0 ),
+        m_window( DEFAULT_WINDOW ), m_initial_window( DEFAULT_WINDOW ), m_max_frame( MAX_FRAME_SIZE ), m_recv_window( DEFAULT_WINDOW ),
+        m_preface( false ), m_settings_sent( false ), m_goaway( false ), m_failed( false ) {
+    memset( m_streams, 0, sizeof( m_streams ) );
+}
+
+http2_session::~http2_session() {
+    for( int i = 0; i < MAX_STREAMS; ++i ) {
+        if( m_streams[i].id ) {
+            abort_stream( m_streams + i );
+        }
+    }
+}
+
+bool http2_session::has_room( int bytes, int iovs ) const {
+    return http_conn::WRITE_BUFFER_SIZE - m_conn->m_write_idx >= bytes && m_conn->m_iv_count + iovs <= http_conn::MAX_IOV;
+}
+
+char* http2_session::frame( int type, int flags, uint32_t id, int len ) {
+    unsigned char* p = ( unsigned char* )m_conn->m_write_buf + m_conn->m_write_idx;
+    p[0] = len >> 16;
+    p[1] = len >> 8;
+    p[2] = len;
+    p[3] = type;
+    p[4] = flags;
+    put32( p + 5, id & 0x7fffffff );
+    return ( char* )p + FRAME_HEAD_LEN;
+}
+
+void http2_session::send_frame( char* payload, int len ) {
+    m_conn->m_write_idx += FRAME_HEAD_LEN + len;
+    m_conn->add_iv( payload - FRAME_HEAD_LEN, FRAME_HEAD_LEN + len );
+}
+
+void http2_session::send_settings() {
+    unsigned char* p = ( unsigned char* )frame( FRAME_SETTINGS, 0, 0, 12 );
+    p[0] = 0;
+    p[1] = SETTINGS_MAX_CONCURRENT_STREAMS;
+    put32( p + 2, MAX_STREAMS );
+    p[6] = 0;
+    p[7] = SETTINGS_INITIAL_WINDOW_SIZE;
+    put32( p + 8, RECV_WINDOW );
+    send_frame( ( char* )p, 12 );
+    m_settings_sent = true;
+}
+
+void http2_session::send_rst( uint32_t id, ERROR_CODE code ) {
+    char* p = frame( FRAME_RST_STREAM, 0, id, 4 );
+    put32( ( unsigned char* )p, code );
+    send_frame( p, 4 );
+}
+
+void http2_session::send_goaway( ERROR_CODE code ) {
+    unsigned char* p = ( unsigned char* )frame( FRAME_GOAWAY, 0, 0, 8 );
+    put32( p, m_last_stream );
+    put32( p + 4, code );
+    send_frame( ( char* )p, 8 );
+    m_goaway = true;
+}
+
+void http2_session::send_window_update( uint32_t id, uint32_t increment ) {
+    char* p = frame( FRAME_WINDOW_UPDATE, 0, id, 4 );
+    put32( ( unsigned char* )p, increment );
+    send_frame( p, 4 );
+}
+
+void http2_session::connection_error( ERROR_CODE code ) {
+    LOG_DEBUG( "http2 connection error %d, last stream %u", code, m_last_stream );
+    send_goaway( code );
+    m_failed = true;
+}
+
+bool http2_session::acquire_write_buf() {
+    if( !m_conn->m_write_buf ) {
+        int size = 0;
+        m_conn->m_write_buf = buffer_pool::instance()->acquire( http_conn::WRITE_BUFFER_SIZE, &size );
+    }
+    return m_conn->m_write_buf != NULL;
+}
+
+void http2_session::consume( int len ) {
+    http_conn* c = m_conn;
+    c->m_checked_idx += len;
+    c->m_req_start = c->m_start_line = c->m_checked_idx;
+}
+
+bool http2_session::upgrade( const char* settings, http_conn::HTTP_CODE ret, uint64_t start ) {
+    http_conn* c = m_conn;
+    unsigned char buf[ 256 ];
+    int len = base64url_decode( settings, buf, sizeof( buf ) );
+    if( len < 0 || len % 6 != 0 || !apply_settings( buf, len ) || !acquire_write_buf()
+            || !c->add_bytes( HTTP_SWITCHING_PROTOCOLS.data, HTTP_SWITCHING_PROTOCOLS.len ) ) {
+        // 不能升级时照常用HTTP/1.1应答
+        return false;
+    }
+    c->add_iv( c->m_write_buf, c->m_write_idx );
+    // 101之后第一个帧是服务端的SETTINGS，HTTP2-Settings由101隐式确认，不回复ACK
+    send_settings();
+    // 升级的请求就是流1，它没有请求体，已经是半关闭的
+    m_last_stream = 1;
+    respond( 1, true, ret, start );
+    return true;
+}
+
+bool http2_session::process() {
+    http_conn* c = m_conn;
+    if( !acquire_write_buf() ) {
+        c->m_keep_alive = false;
+        return true;
+    }
+    if( !m_settings_sent ) {
+        send_settings();
+    }
+    if( !m_preface ) {
+        int m = match_preface( c->m_read_buf + c->m_checked_idx, c->m_read_idx - c->m_checked_idx );
+        if( m < 0 ) {
+            connection_error( H2_PROTOCOL_ERROR );
+        } else if( m > 0 ) {
+            m_preface = true;
+            consume( PREFACE_LEN );
+        }
+    }
+    // 每个帧最多生成一个HEADERS和一个RST_STREAM，写缓冲区放不下时剩下的帧等这一批发完再处理
+    while( m_preface && !m_failed && has_room( http_conn::MAX_RESPONSE_HEAD, 2 ) ) {
+        int avail = c->m_read_idx - c->m_checked_idx;
+        if( avail < FRAME_HEAD_LEN ) {
+            break;
+        }
+        int n = handle_frame( ( unsigned char* )c->m_read_buf + c->m_checked_idx, avail );
+        if( n == 0 ) {
+            break;
+        }
+        consume( n );
+    }
+    if( !m_failed ) {
+        if( m_recv_window < RECV_WINDOW ) {
+            // 不处理请求体，收到多少就归还多少，但连接初始的窗口只归还到RECV_WINDOW
+            send_window_update( 0, RECV_WINDOW - m_recv_window );
+            m_recv_window = RECV_WINDOW;
+        }
+        if( http_conn::m_draining.load( std::memory_order_relaxed ) && !m_goaway ) {
+            // 平滑退出：不再接受新流，已经打开的流发送完后关闭连接
+            send_goaway( H2_NO_ERROR );
+        }
+        schedule();
+    }
+    c->compact_read_buf();
+    c->m_keep_alive = !m_failed && !( m_goaway && m_stream_count == 0 );
+    // 输入都处理完了、也没有要发送的内容时交出一个空批次，反应堆把连接当作空闲；读缓冲区中只有半个帧时继续等待数据
+    return c->m_bytes_to_send > 0 || !c->m_keep_alive || c->m_read_idx == 0;
+}
+
+bool http2_session::want_write() const {
+    if( m_failed || !m_preface || m_window <= 0 ) {
+        return false;
+    }
+    for( int i = 0; i < MAX_STREAMS; ++i ) {
+        const stream& s = m_streams[i];
+        if( s.id && s.remaining > 0 && s.window > 0 ) {
+            return true;
+        }
+    }
+    return false;
+}
+
+int http2_session::handle_frame( unsigned char* head, int avail ) {
+    int len = ( head[0] << 16 ) | ( head[1] << 8 ) | head[2];
+    int type = head[3];
+    int flags = head[4];
+    uint32_t id = get32( head + 5 ) & 0x7fffffff;
+    if( len > MAX_FRAME_SIZE ) {
+        connection_error( H2_FRAME_SIZE_ERROR );
+        return 0;
+    }
+    if( type == FRAME_HEADERS ) {
+        return handle_headers( head, avail );
+    }
+    if( avail < FRAME_HEAD_LEN + len ) {
+        return 0;
+    }
+    unsigned char* p = head + FRAME_HEAD_LEN;
+    switch( type ) {
+        case FRAME_DATA: {
+            if( id == 0 ) {
+                connection_error( H2_PROTOCOL_ERROR );
+                return 0;
+            }
+            // 请求体不处理：已经应答并关闭的流上的DATA也要计入连接的窗口
+            m_recv_window -= len;
+            stream* s = find( id );
+            if( !s ) {
+                break;
+            }
+            if( flags & FLAG_END_STREAM ) {
+                remote_closed( s );
+            } else if( len > 0 ) {
+                // 同样归还流的窗口，客户端才能把请求体发完
+                send_window_update( id, len );
+            }
+            break;
+        }
+        case FRAME_PRIORITY: {
+            // 优先级不影响调度，各个流轮流发送
+            break;
+        }
+        case FRAME_RST_STREAM: {
+            if( len != 4 || id == 0 ) {
+                connection_error( len != 4 ? H2_FRAME_SIZE_ERROR : H2_PROTOCOL_ERROR );
+                return 0;
+            }
+            stream* s = find( id );
+            if( s ) {
+                abort_stream( s );
+            }
+            break;
+        }
+        case FRAME_SETTINGS: {
+            if( id != 0 ) {
+                connection_error( H2_PROTOCOL_ERROR );
+                return 0;
+            }
+            if( flags & FLAG_ACK ) {
+                if( len != 0 ) {
+                    connection_error( H2_FRAME_SIZE_ERROR );
+                    return 0;
+                }
+                break;
+            }
+            if( len % 6 != 0 ) {
+                connection_error( H2_FRAME_SIZE_ERROR );
+                return 0;
+            }
+            if( !apply_settings( p, len ) ) {
+                return 0;
+            }
+            send_frame( frame( FRAME_SETTINGS, FLAG_ACK, 0, 0 ), 0 );
+            break;
+        }
+        case FRAME_PING: {
+            if( len != 8 || id != 0 ) {
+                connection_error( len != 8 ? H2_FRAME_SIZE_ERROR : H2_PROTOCOL_ERROR );
+                return 0;
+            }
+            if( !( flags & FLAG_ACK ) ) {
+                char* q = frame( FRAME_PING, FLAG_ACK, 0, 8 );
+                memcpy( q, p, 8 );
+                send_frame( q, 8 );
+            }
+            break;
+        }
+        case FRAME_GOAWAY: {
+            // 对方不再发起新流，打开的流照常发送完
+            m_goaway = true;
+            break;
+        }
+        case FRAME_WINDOW_UPDATE: {
+            if( len != 4 ) {
+                connection_error( H2_FRAME_SIZE_ERROR );
+                return 0;
+            }
+            handle_window_update( id, get32( p ) & 0x7fffffff );
+            break;
+        }
+        case FRAME_PUSH_PROMISE:
+        case FRAME_CONTINUATION: {
+            // 客户端不能推送；CONTINUATION只能跟在HEADERS之后，由handle_headers()一起处理
+            connection_error( H2_PROTOCOL_ERROR );
+            return 0;
+        }
+        default: {
+            // 未知类型的帧必须忽略
+            break;
+        }
+    }
+    return FRAME_HEAD_LEN + len;
+}
+
+/*
+    头部块可能跨若干个CONTINUATION帧，它们之间不能插入其他帧。
+    整个头部块都到达之后，把各帧的内容在读缓冲区中原地连接起来再一次解码，这些帧随后都被丢弃
+*/
+int http2_session::handle_headers( unsigned char* head, int avail ) {
+    http_conn* c = m_conn;
+    int len = ( head[0] << 16 ) | ( head[1] << 8 ) | head[2];
+    int flags = head[4];
+    uint32_t id = get32( head + 5 ) & 0x7fffffff;
+    if( id == 0 || !( id & 1 ) ) {
+        connection_error( H2_PROTOCOL_ERROR );
+        return 0;
+    }
+    int total = FRAME_HEAD_LEN + len;
+    if( avail < total ) {
+        return 0;
+    }
+    unsigned char* block = head + FRAME_HEAD_LEN;
+    int block_len = len;
+    int pad = 0;
+    if( flags & FLAG_PADDED ) {
+        if( block_len < 1 ) {
+            connection_error( H2_PROTOCOL_ERROR );
+            return 0;
+        }
+        pad = block[0];
+        ++block;
+        --block_len;
+    }
+    if( flags & FLAG_PRIORITY ) {
+        if( block_len < 5 ) {
+            connection_error( H2_PROTOCOL_ERROR );
+            return 0;
+        }
+        block += 5;
+        block_len -= 5;
+    }
+    if( pad > block_len ) {
+        connection_error( H2_PROTOCOL_ERROR );
+        return 0;
+    }
+    block_len -= pad;
+
+    // 先确认整个头部块都已到达，再移动内容，不完整时读缓冲区保持原样
+    int first = total;
+    for( int f = flags; !( f & FLAG_END_HEADERS ); ) {
+        if( avail - total < FRAME_HEAD_LEN ) {
+            return 0;
+        }
+        unsigned char* h = head + total;
+        int l = ( h[0] << 16 ) | ( h[1] << 8 ) | h[2];
+        if( h[3] != FRAME_CONTINUATION || ( get32( h + 5 ) & 0x7fffffff ) != id ) {
+            connection_error( H2_PROTOCOL_ERROR );
+            return 0;
+        }
+        if( l > MAX_FRAME_SIZE ) {
+            connection_error( H2_FRAME_SIZE_ERROR );
+            return 0;
+        }
+        if( avail - total < FRAME_HEAD_LEN + l ) {
+            return 0;
+        }
+        f = h[4];
+        total += FRAME_HEAD_LEN + l;
+    }
+    for( int off = first; off < total; ) {
+        unsigned char* h = head + off;
+        int l = ( h[0] << 16 ) | ( h[1] << 8 ) | h[2];
+        memmove( block + block_len, h + FRAME_HEAD_LEN, l );
+        block_len += l;
+        off += FRAME_HEAD_LEN + l;
+    }
+
+    // 解码出的字符串放在m_arena中，这个请求应答之后随init_request()归还
+    uint64_t start = metrics::now_ns();
+    c->init_request();
+    hpack_header headers[ http_conn::MAX_HEADERS ];
+    int count = 0;
+    if( !m_decoder.decode( block, block_len, &c->m_arena, headers, http_conn::MAX_HEADERS, &count ) ) {
+        connection_error( H2_COMPRESSION_ERROR );
+        return 0;
+    }
+    bool end_stream = ( flags & FLAG_END_STREAM ) != 0;
+    if( id <= m_last_stream ) {
+        // 打开的流上的尾部字段，或者已经关闭的流，解码只是为了让动态表和对方保持一致
+        stream* s = find( id );
+        if( s && end_stream ) {
+            remote_closed( s );
+        }
+    } else if( !m_goaway ) {
+        m_last_stream = id;
+        if( m_stream_count >= MAX_STREAMS ) {
+            send_rst( id, H2_REFUSED_STREAM );
+        } else {
+            request( id, headers, count, end_stream, start );
+        }
+    }
+    c->init_request();
+    return total;
+}
+
+bool http2_session::apply_settings( const unsigned char* p, int len ) {
+    for( int i = 0; i + 6 <= len; i += 6 ) {
+        int id = ( p[i] << 8 ) | p[i + 1];
+        uint32_t value = get32( p + i + 2 );
+        switch( id ) {
+            case SETTINGS_ENABLE_PUSH: {
+                // 我们不推送，只检查取值
+                if( value > 1 ) {
+                    connection_error( H2_PROTOCOL_ERROR );
+                    return false;
+                }
+                break;
+            }
+            case SETTINGS_INITIAL_WINDOW_SIZE: {
+                // 新的初始窗口按差值调整所有打开的流
+                if( value > ( uint32_t )MAX_WINDOW ) {
+                    connection_error( H2_FLOW_CONTROL_ERROR );
+                    return false;
+                }
+                long delta = ( long )value - m_initial_window;
+                for( int k = 0; k < MAX_STREAMS; ++k ) {
+                    stream& s = m_streams[k];
+                    if( s.id && s.window + delta > MAX_WINDOW ) {
+                        connection_error( H2_FLOW_CONTROL_ERROR );
+                        return false;
+                    }
+                    s.window += delta;
+                }
+                m_initial_window = value;
+                break;
+            }
+            case SETTINGS_MAX_FRAME_SIZE: {
+                if( value < ( uint32_t )MAX_FRAME_SIZE || value > 0xffffff ) {
+                    connection_error( H2_PROTOCOL_ERROR );
+                    return false;
+                }
+                m_max_frame = value;
+                break;
+            }
+            default: {
+                // SETTINGS_HEADER_TABLE_SIZE：应答的编码不使用动态表，其余的参数与服务端无关，未知的参数必须忽略
+                break;
+            }
+        }
+    }
+    return true;
+}
+
+void http2_session::handle_window_update( uint32_t id, uint32_t increment ) {
+    if( id == 0 ) {
+        m_window += increment;
+        if( increment == 0 || m_window > MAX_WINDOW ) {
+            connection_error( increment == 0 ? H2_PROTOCOL_ERROR : H2_FLOW_CONTROL_ERROR );
+        }
+        return;
+    }
+    stream* s = find( id );
+    if( !s ) {
+        return;
+    }
+    if( increment == 0 || s->window + increment > MAX_WINDOW ) {
+        send_rst( id, increment == 0 ? H2_PROTOCOL_ERROR : H2_FLOW_CONTROL_ERROR );
+        abort_stream( s );
+        return;
+    }
+    s->window += increment;
+}
+
+// 按静态表的下标分派请求头部，名称是字面值的头部只检查是不是伪头部
+void http2_session::request( uint32_t id, const hpack_header* headers, int count, bool end_stream, uint64_t start ) {
+    http_conn* c = m_conn;
+    const char* method = NULL;
+    const char* path = NULL;
+    bool scheme = false;
+    bool malformed = false;
+    for( int i = 0; i < count; ++i ) {
+        const hpack_header& h = headers[i];
+        switch( h.index ) {
+            case HPACK_METHOD: method = h.value; break;
+            case HPACK_PATH: path = h.value; break;
+            case HPACK_SCHEME: scheme = true; break;
+            case HPACK_ACCEPT_ENCODING: c->m_accept_encoding = http_conn::parse_accept_encoding( h.value ); break;
+            case HPACK_IF_NONE_MATCH: c->m_if_none_match = ( char* )h.value; break;
+            case HPACK_IF_MODIFIED_SINCE: c->m_if_modified_since = ( char* )h.value; break;
+            case HPACK_RANGE: c->m_range = ( char* )h.value; break;
+            case HPACK_IF_RANGE: c->m_if_range = ( char* )h.value; break;
+            case 0: malformed |= h.name_len > 0 && h.name[0] == ':'; break;
+            default: break;
+        }
+    }
+    if( malformed || !method || !path || !scheme ) {
+        send_rst( id, H2_PROTOCOL_ERROR );
+        return;
+    }
+    // 截断的URL只用于访问日志，放不下时回复414
+    strncpy( c->m_url_buf, path, http_conn::FILENAME_LEN - 1 );
+    c->m_url_buf[ http_conn::FILENAME_LEN - 1 ] = '\0';
+    c->m_url = c->m_url_buf;
+    http_conn::HTTP_CODE ret = http_conn::BAD_REQUEST;
+    if( strcmp( method, "GET" ) == 0 || strcmp( method, "HEAD" ) == 0 ) {
+        c->m_method = method[0] == 'G' ? http_conn::GET : http_conn::HEAD;
+        if( strlen( path ) >= ( size_t )http_conn::FILENAME_LEN ) {
+            ret = http_conn::URI_TOO_LONG;
+        } else if( path[0] == '/' ) {
+            ret = c->do_request();
+        }
+    } else {
+        // 请求体没有交给处理者的途径，这类请求仍然用HTTP/1.1发送
+        c->m_method = http_conn::POST;
+        metrics::request( http_conn::BAD_REQUEST, metrics::now_ns() - start );
+        char* payload = c->m_write_buf + c->m_write_idx + FRAME_HEAD_LEN;
+        char* end = c->m_write_buf + http_conn::WRITE_BUFFER_SIZE - RST_LEN;
+        char* p = hpack_encoder::status( payload, end, 501 );
+        p = error_headers( p, end, sizeof( error_501_form ) - 1 );
+        open_stream( id, end_stream, 501, payload, p, error_501_form, sizeof( error_501_form ) - 1, NULL, NULL, start );
+        return;
+    }
+    metrics::request( ret, metrics::now_ns() - start );
+    respond( id, end_stream, ret, start );
+}
+
+char* http2_session::error_headers( char* p, char* end, int len ) {
+    char date[ HTTP_DATE_LEN ];
+    char num[ 24 ];
+    int html_len = 0;
+    const char* html = fragment_value( HTTP_CONTENT_TYPE_HTML, &html_len );
+    copy_http_date( date );
+    if( p ) {
+        p = hpack_encoder::header( p, end, HPACK_CONTENT_TYPE, html, html_len );
+    }
+    if( p ) {
+        p = hpack_encoder::header( p, end, HPACK_CONTENT_LENGTH, num, format_uint( num, len ) );
+    }
+    if( p ) {
+        p = hpack_encoder::header( p, end, HPACK_DATE, date + 6, HTTP_DATE_VALUE_LEN );
+    }
+    return p;
+}
+
+// 把do_request()的结果编码成HEADERS帧，要发送的内容交给一个新的流
+void http2_session::respond( uint32_t id, bool end_stream, http_conn::HTTP_CODE ret, uint64_t start ) {
+    http_conn* c = m_conn;
+    char* body = NULL;
+    int body_len = 0;
+    if( ( ret == http_conn::FILE_REQUEST || ret == http_conn::PARTIAL_CONTENT ) && c->m_file_size > 0 && !c->m_file_address ) {
+        // 没有映射的文件只能用sendfile发送，DATA帧做不到；--http2时不设置映射的大小上限，这里只是防御
+        file_cache::instance()->release( c->m_file_entry );
+        c->m_file_entry = NULL;
+        ret = http_conn::INTERNAL_ERROR;
+    }
+    if( ret == http_conn::METRICS_REQUEST ) {
+        int size = 0;
+        body = buffer_pool::instance()->acquire( http_conn::BODY_BUFFER_SIZE, &size );
+        body_len = body ? metrics::render( body, http_conn::BODY_BUFFER_SIZE ) : -1;
+        if( body_len < 0 ) {
+            if( body ) {
+                buffer_pool::instance()->release( body, http_conn::BODY_BUFFER_SIZE );
+                body = NULL;
+            }
+            ret = http_conn::INTERNAL_ERROR;
+        }
+    }
+
+    // 留出一个RST_STREAM的位置：客户端的请求还没有结束时，应答之后要重置这个流
+    char* payload = c->m_write_buf + c->m_write_idx + FRAME_HEAD_LEN;
+    char* end = c->m_write_buf + http_conn::WRITE_BUFFER_SIZE - RST_LEN;
+    char* p = payload;
+    char date[ HTTP_DATE_LEN ];
+    char num[ 64 ];
+    int n = 0;
+    const char* v = NULL;
+    int status = 500;
+    const char* data = NULL;
+    off_t len = 0;
+    file_cache::entry* entry = NULL;
+    switch( ret ) {
+        case http_conn::FILE_REQUEST:
+        case http_conn::PARTIAL_CONTENT: {
+            // 多区间的Range发送整个文件
+            const http_conn::byte_range* range = ( ret == http_conn::PARTIAL_CONTENT && c->m_range_count == 1 ) ? c->m_ranges : NULL;
+            entry = c->m_file_entry;
+            c->m_file_entry = NULL;
+            status = range ? 206 : 200;
+            data = c->m_file_address;
+            len = c->m_file_size;
+            if( range ) {
+                data += range->first;
+                len = range->last - range->first + 1;
+            }
+            copy_http_date( date );
+            v = fragment_value( c->m_content_type ? *c->m_content_type : HTTP_CONTENT_TYPE_HTML, &n );
+            p = hpack_encoder::status( p, end, status );
+            if( p ) {
+                p = hpack_encoder::header( p, end, HPACK_CONTENT_TYPE, v, n );
+            }
+            if( p ) {
+                p = hpack_encoder::header( p, end, HPACK_CONTENT_LENGTH, num, format_uint( num, len ) );
+            }
+            if( p && range ) {
+                // bytes first-last/size
+                memcpy( num, "bytes ", 6 );
+                n = 6 + format_uint( num + 6, range->first );
+                num[ n++ ] = '-';
+                n += format_uint( num + n, range->last );
+                num[ n++ ] = '/';
+                n += format_uint( num + n, c->m_file_size );
+                p = hpack_encoder::header( p, end, HPACK_CONTENT_RANGE, num, n );
+            }
+            if( p ) {
+                p = hpack_encoder::header( p, end, HPACK_DATE, date + 6, HTTP_DATE_VALUE_LEN );
+            }
+            if( p ) {
+                p = hpack_encoder::header( p, end, HPACK_ETAG, c->m_etag, c->m_etag_len );
+            }
+            if( p ) {
+                p = hpack_encoder::header( p, end, HPACK_LAST_MODIFIED, entry->last_modified, HTTP_DATE_VALUE_LEN );
+            }
+            if( p ) {
+                p = hpack_encoder::header( p, end, HPACK_ACCEPT_RANGES, "bytes", 5 );
+            }
+            if( p && c->m_encoding >= 0 ) {
+                v = fragment_value( HTTP_CONTENT_ENCODING[ c->m_encoding ], &n );
+                p = hpack_encoder::header( p, end, HPACK_CONTENT_ENCODING, v, n );
+            }
+            if( p && c->m_vary ) {
+                p = hpack_encoder::header( p, end, HPACK_VARY, "accept-encoding", 15 );
+            }
+            break;
+        }
+        case http_conn::NOT_MODIFIED: {
+            file_cache::instance()->release( c->m_file_entry );
+            c->m_file_entry = NULL;
+            status = 304;
+            copy_http_date( date );
+            p = hpack_encoder::status( p, end, status );
+            if( p ) {
+                p = hpack_encoder::header( p, end, HPACK_DATE, date + 6, HTTP_DATE_VALUE_LEN );
+            }
+            if( p ) {
+                p = hpack_encoder::header( p, end, HPACK_ETAG, c->m_etag, c->m_etag_len );
+            }
+            if( p && c->m_vary ) {
+                p = hpack_encoder::header( p, end, HPACK_VARY, "accept-encoding", 15 );
+            }
+            break;
+        }
+        case http_conn::RANGE_NOT_SATISFIABLE: {
+            file_cache::instance()->release( c->m_file_entry );
+            c->m_file_entry = NULL;
+            status = 416;
+            copy_http_date( date );
+            memcpy( num, "bytes */", 8 );
+            n = 8 + format_uint( num + 8, c->m_file_size );
+            p = hpack_encoder::status( p, end, status );
+            if( p ) {
+                p = hpack_encoder::header( p, end, HPACK_CONTENT_LENGTH, "0", 1 );
+            }
+            if( p ) {
+                p = hpack_encoder::header( p, end, HPACK_CONTENT_RANGE, num, n );
+            }
+            if( p ) {
+                p = hpack_encoder::header( p, end, HPACK_DATE, date + 6, HTTP_DATE_VALUE_LEN );
+            }
+            break;
+        }
+        case http_conn::METRICS_REQUEST: {
+            status = 200;
+            data = body;
+            len = body_len;
+            copy_http_date( date );
+            v = fragment_value( HTTP_CONTENT_TYPE_METRICS, &n );
+            p = hpack_encoder::status( p, end, status );
+            if( p ) {
+                p = hpack_encoder::header( p, end, HPACK_CONTENT_TYPE, v, n );
+            }
+            if( p ) {
+                p = hpack_encoder::header( p, end, HPACK_CONTENT_LENGTH, num, format_uint( num, len ) );
+            }
+            if( p ) {
+                p = hpack_encoder::header( p, end, HPACK_DATE, date + 6, HTTP_DATE_VALUE_LEN );
+            }
+            break;
+        }
+        default: {
+            // 错误页面的内容是静态字符串，不需要释放
+            switch( ret ) {
+                case http_conn::BAD_REQUEST: status = 400; data = error_400_form; break;
+                case http_conn::FORBIDDEN_REQUEST: status = 403; data = error_403_form; break;
+                case http_conn::NO_RESOURCE: status = 404; data = error_404_form; break;
+                case http_conn::URI_TOO_LONG: status = 414; data = error_414_form; break;
+                default: status = 500; data = error_500_form; break;
+            }
+            len = strlen( data );
+            p = error_headers( hpack_encoder::status( p, end, status ), end, len );
+            break;
+        }
+    }
+    open_stream( id, end_stream, status, payload, p, data, len, entry, body, start );
+}
+
+/*
+    HEADERS帧已经编码在payload到p之间（p为NULL表示写缓冲区放不下），发出它并为内容打开一个流；
+    没有内容或者是HEAD请求时HEADERS就结束这个流
+*/
+void http2_session::open_stream( uint32_t id, bool end_stream, int status, char* payload, char* p,
+        const char* data, off_t len, file_cache::entry* entry, char* body, uint64_t start ) {
+    http_conn* c = m_conn;
+    stream s;
+    s.id = id;
+    s.end_remote = end_stream;
+    s.window = m_initial_window;
+    s.data = data;
+    s.remaining = c->m_method == http_conn::HEAD ? 0 : len;
+    s.entry = entry;
+    s.body = body;
+    if( !p ) {
+        send_rst( id, H2_INTERNAL_ERROR );
+        release( s );
+        return;
+    }
+    int block = p - payload;
+    frame( FRAME_HEADERS, FLAG_END_HEADERS | ( s.remaining == 0 ? FLAG_END_STREAM : 0 ), id, block );
+    send_frame( payload, block );
+    LOG_ACCESS( c->m_address.sin_addr.s_addr, c->m_address.sin_port, c->m_method, c->m_url, status,
+            FRAME_HEAD_LEN + block + s.remaining, metrics::now_ns() - start );
+    if( s.remaining == 0 ) {
+        release( s );
+        if( s.end_remote ) {
+            return;
+        }
+        // 客户端还在发送请求体，流保持打开，等它的END_STREAM
+        s.entry = NULL;
+        s.body = NULL;
+    }
+    for( int i = 0; i < MAX_STREAMS; ++i ) {
+        if( m_streams[i].id == 0 ) {
+            m_streams[i] = s;
+            ++m_stream_count;
+            return;
+        }
+    }
+}
+
+http2_session::stream* http2_session::find( uint32_t id ) {
+    for( int i = 0; i < MAX_STREAMS; ++i ) {
+        if( m_streams[i].id == id ) {
+            return m_streams + i;
+        }
+    }
+    return NULL;
+}
+
+/*
+    流的内容都已加入这一批：缓存项和/metrics的缓冲区交给连接，这一批发送完后释放。
+    客户端的请求还没有结束（还在发送请求体）时流保持打开，收到END_STREAM再关闭。
+    也可以回复RST_STREAM(NO_ERROR)让它不必再发，但有的客户端会把应答也当作失败
+*/
+void http2_session::finish_stream( stream* s ) {
+    http_conn* c = m_conn;
+    if( s->entry ) {
+        c->m_file_entries[ c->m_file_count++ ] = s->entry;
+        s->entry = NULL;
+    }
+    if( s->body ) {
+        c->m_body_buf = s->body;
+        s->body = NULL;
+    }
+    if( s->end_remote ) {
+        s->id = 0;
+        --m_stream_count;
+    }
+}
+
+void http2_session::remote_closed( stream* s ) {
+    s->end_remote = true;
+    if( s->remaining == 0 ) {
+        // 应答早已发完，只在等请求结束
+        s->id = 0;
+        --m_stream_count;
+    }
+}
+
+void http2_session::release( const stream& s ) {
+    if( s.entry ) {
+        file_cache::instance()->release( s.entry );
+    }
+    if( s.body ) {
+        buffer_pool::instance()->release( s.body, http_conn::BODY_BUFFER_SIZE );
+    }
+}
+
+// 流被重置或者连接关闭，它的内容不在待发送的内存块中，直接释放
+void http2_session::abort_stream( stream* s ) {
+    release( *s );
+    s->id = 0;
+    --m_stream_count;
+}
+
+/*
+    轮流为每个有内容的流生成一个DATA帧，一轮之后还有空间就再来一轮，直到写缓冲区或m_iv用完，
+    或者连接的窗口用完；下一次从下一个槽开始，空间不够时也不会总是同一个流吃亏。
+    不超过SMALL_DATA的内容复制到帧头之后，其余的直接指向文件映射。
+    h2c升级时流1的DATA等客户端的连接前言到达后再发送，有的客户端切换协议时只能缓存很少的数据
+*/
+void http2_session::schedule() {
+    http_conn* c = m_conn;
+    if( !m_preface ) {
+        return;
+    }
+    bool progress = true;
+    while( progress ) {
+        progress = false;
+        for( int k = 0; k < MAX_STREAMS; ++k ) {
+            // 一帧最多占两块内存
+            if( m_window <= 0 || !has_room( FRAME_HEAD_LEN + SMALL_DATA, 2 ) ) {
+                return;
+            }
+            stream* s = m_streams + ( m_next + k ) % MAX_STREAMS;
+            if( s->id == 0 || s->remaining == 0 || s->window <= 0 ) {
+                continue;
+            }
+            off_t n = s->remaining;
+            n = n < s->window ? n : s->window;
+            n = n < m_window ? n : m_window;
+            n = n < m_max_frame ? n : m_max_frame;
+            bool last = n == s->remaining;
+            if( last && ( ( s->entry && c->m_file_count >= http_conn::MAX_PIPELINE ) || ( s->body && c->m_body_buf ) ) ) {
+                // 这一批引用的缓存项或内存已经满了，最后一帧留到下一批
+                continue;
+            }
+            char* payload = frame( FRAME_DATA, last ? FLAG_END_STREAM : 0, s->id, n );
+            if( n <= SMALL_DATA ) {
+                memcpy( payload, s->data, n );
+                send_frame( payload, n );
+            } else {
+                c->m_write_idx += FRAME_HEAD_LEN;
+                c->add_iv( payload - FRAME_HEAD_LEN, FRAME_HEAD_LEN );
+                c->add_iv( ( char* )s->data, n );
+            }
+            s->data += n;
+            s->remaining -= n;
+            s->window -= n;
+            m_window -= n;
+            progress = true;
+            if( last ) {
+                finish_stream( s );
+            }
+        }
+        m_next = ( m_next + 1 ) % MAX_STREAMS;
+    }
+}
@@ -0,0 +1,126 @@
+#ifndef HTTP2_H
+#define HTTP2_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "http_conn.h"
+#include "hpack.h"
+
+/*
+    HTTP/2（RFC 9113），用--http2打开
+    - 协商：HTTPS连接在握手时用ALPN选择h2；明文连接可以直接以连接前言开始（prior knowledge），
+      或者在第一个没有请求体的GET中带上Upgrade: h2c和HTTP2-Settings，回复101之后这个请求就是流1
+    - 连接切换到HTTP/2之后，http_conn的读写缓冲区、m_iv、批量writev以及反应堆和超时都不变，
+      process_requests()交给http2_session：读缓冲区中的完整帧逐个处理，每个流的请求头解码后填进http_conn的请求字段，
+      仍由do_request()和打开文件缓存找到要发送的内容，应答的HEADERS帧用HPACK的静态表编码
+    - 多个流的DATA帧轮流调度，每帧不超过对方的SETTINGS_MAX_FRAME_SIZE、流的窗口和连接的窗口，
+      帧头放在写缓冲区中，内容直接指向文件缓存的映射；窗口用完的流等WINDOW_UPDATE到达再继续，
+      窗口足够时一批发完了还有内容，由pending_input()让反应堆直接再处理一次
+    - 只提供静态文件和/metrics：GET和HEAD以外的方法回复501，不做反向代理（配置了路由时不协商HTTP/2），
+      多区间的Range发送整个文件；收到的请求体不处理，只更新连接的接收窗口
+    session和连接一样同一时刻只被一个线程使用，不需要加锁。
+*/
+class http2_session {
+public:
+    static const int MAX_STREAMS = 32;          // SETTINGS_MAX_CONCURRENT_STREAMS，同时打开的流，超过时拒绝新流
+    static const int MAX_FRAME_SIZE = 16384;    // 我们接收的帧的最大长度，即SETTINGS_MAX_FRAME_SIZE的默认值
+    static const int DEFAULT_WINDOW = 65535;    // 流和连接的初始窗口
+    static const int FRAME_HEAD_LEN = 9;
+    static const int SMALL_DATA = 256;          // 不超过这个大小的DATA内容复制到写缓冲区，和帧头合并成一块
+    static const int PREFACE_LEN = 24;
+    /*
+        我们给出的流和连接的接收窗口。io_uring在发送一批应答的过程中收到的数据都留在读缓冲区中，
+        窗口限制了这期间对方最多能发来多少请求体，不会超过读缓冲区的上限
+    */
+    static const int RECV_WINDOW = 16384;
+
+    static void set_enabled( bool on ) { m_enabled = on; }
+    static bool enabled() { return m_enabled; }
+    // 读缓冲区开头的数据是否是客户端的连接前言：1是，0还不够长、无法判断，-1不是
+    static int match_preface( const char* data, int len );
+
+    // session从buffer_pool中取得，内存不足时返回NULL
+    static http2_session* create( http_conn* conn );
+    static void destroy( http2_session* session );
+
+    // h2c升级：写入101和服务端的SETTINGS，升级的请求作为流1应答，settings是HTTP2-Settings的值
+    bool upgrade( const char* settings, http_conn::HTTP_CODE ret, uint64_t start );
+    // 同http_conn::process_requests()：处理读缓冲区中的帧，生成一批要发送的帧
+    bool process();
+    // 有流还有可以在窗口内发送的内容
+    bool want_write() const;
+
+private:
+    // 帧类型
+    enum FRAME_TYPE { FRAME_DATA = 0, FRAME_HEADERS, FRAME_PRIORITY, FRAME_RST_STREAM, FRAME_SETTINGS, FRAME_PUSH_PROMISE,
+            FRAME_PING, FRAME_GOAWAY, FRAME_WINDOW_UPDATE, FRAME_CONTINUATION };
+    // 错误码
+    enum ERROR_CODE { H2_NO_ERROR = 0, H2_PROTOCOL_ERROR, H2_INTERNAL_ERROR, H2_FLOW_CONTROL_ERROR, H2_SETTINGS_TIMEOUT,
+            H2_STREAM_CLOSED, H2_FRAME_SIZE_ERROR, H2_REFUSED_STREAM, H2_CANCEL, H2_COMPRESSION_ERROR };
+
+    static const int RST_LEN = FRAME_HEAD_LEN + 4;  // RST_STREAM帧的长度
+
+    // 一个打开的流，等待发送应答的内容
+    struct stream {
+        uint32_t id;                // 0表示空闲的槽
+        bool end_remote;            // 客户端已经发送了END_STREAM
+        long window;                // 流的发送窗口，对方减小初始窗口时可能为负
+        const char* data;           // 还没有发送的内容
+        off_t remaining;
+        file_cache::entry* entry;   // 内容所在的打开文件缓存项
+        char* body;                 // /metrics的内容，从buffer_pool取得
+    };
+
+    explicit http2_session( http_conn* conn );
+    ~http2_session();
+
+    bool acquire_write_buf();
+    void consume( int len );                        // 丢弃读缓冲区中已经处理的len字节
+    bool has_room( int bytes, int iovs ) const;     // 写缓冲区和m_iv中还能放下这么多内容
+    char* frame( int type, int flags, uint32_t id, int len );   // 在写缓冲区的末尾写入帧头，返回内容的位置
+    void send_frame( char* payload, int len );      // 帧（连同它的帧头）加入待发送的内存块
+    void send_settings();
+    void send_rst( uint32_t id, ERROR_CODE code );
+    void send_goaway( ERROR_CODE code );
+    void send_window_update( uint32_t id, uint32_t increment );
+    void connection_error( ERROR_CODE code );       // 发送GOAWAY，发完就关闭连接
+
+    // 处理读缓冲区中的一个帧，head指向帧头，返回处理的字节数，0表示还要等待数据或者出错
+    int handle_frame( unsigned char* head, int avail );
+    int handle_headers( unsigned char* head, int avail );  // HEADERS要等到整个头部块都到达
+    bool apply_settings( const unsigned char* p, int len );
+    void handle_window_update( uint32_t id, uint32_t increment );
+
+    void request( uint32_t id, const hpack_header* headers, int count, bool end_stream, uint64_t start );
+    void respond( uint32_t id, bool end_stream, http_conn::HTTP_CODE ret, uint64_t start );
+    char* error_headers( char* p, char* end, int len );     // 错误页面的Content-Type、Content-Length和Date
+    void open_stream( uint32_t id, bool end_stream, int status, char* payload, char* p,
+            const char* data, off_t len, file_cache::entry* entry, char* body, uint64_t start );
+    stream* find( uint32_t id );
+    void finish_stream( stream* s );                // 流的内容都已加入这一批
+    void remote_closed( stream* s );                // 客户端发送了END_STREAM
+    void release( const stream& s );                // 释放流引用的缓存项和内存
+    void abort_stream( stream* s );                 // 流被重置，释放它并空出槽
+    void schedule();                                // 轮流为各个流生成DATA帧
+
+private:
+    static bool m_enabled;
+
+    int m_size;                 // session所在缓冲区的大小
+    http_conn* m_conn;
+    hpack_decoder m_decoder;
+    stream m_streams[ MAX_STREAMS ];
+    int m_stream_count;
+    int m_next;                 // 下一轮调度从这个槽开始
+    uint32_t m_last_stream;     // 已经处理过的最大的流号
+    long m_window;              // 连接的发送窗口
+    long m_initial_window;      // 对方的SETTINGS_INITIAL_WINDOW_SIZE
+    int m_max_frame;            // 对方的SETTINGS_MAX_FRAME_SIZE
+    long m_recv_window;         // 对方眼中连接的接收窗口，处理完输入后用一个WINDOW_UPDATE补足到RECV_WINDOW
+    bool m_preface;             // 已经收到客户端的连接前言
+    bool m_settings_sent;       // 已经发送了服务端的SETTINGS
+    bool m_goaway;              // 已经发送或收到GOAWAY，不再接受新流，打开的流都结束后关闭连接
+    bool m_failed;              // 连接错误，发完GOAWAY就关闭
+};
+
+#endif
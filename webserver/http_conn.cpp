@@ -1,4 +1,8 @@
 #include "http_conn.h"
+#include "upstream.h"
+#include "response_arena.h"
+#include "http2.h"
+#include "doc_index.h"
 
 // 定义HTTP响应的一些状态信息
 const char* ok_200_title = "OK";
@@ -10,6 +14,12 @@ const char* error_404_title = "Not Found";
 const char* error_404_form = "The requested file was not found on this server.\n";
 const char* error_500_title = "Internal Error";
 const char* error_500_form = "There was an unusual problem serving the requested file.\n";
+const char* error_413_title = "Content Too Large";
+const char* error_413_form = "The request body is larger than the server allows.\n";
+const char* error_411_title = "Length Required";
+const char* error_411_form = "A proxied request body must have a Content-Length.\n";
+const char* error_414_title = "URI Too Long";
+const char* error_414_form = "The requested URL is longer than the server allows.\n";
 
 // 网站的根目录// /home/nowcoder/webserver/resources
 const char* doc_root = "/mnt/f/ming/project/WebServer/webserver/resources";
@@ -22,19 +32,18 @@ int setnonblocking( int fd ) {
     return old_option;
 }
 
-// 向epoll中添加需要监听的文件描述符
-void addfd( int epollfd, int fd, bool one_shot ) {
+// 向epoll中添加需要监听的文件描述符，data是事件中带回的数据：连接用它的句柄，监听socket和timerfd用fd本身
+void addfd( int epollfd, int fd, bool one_shot, uint64_t data ) {
     epoll_event event;
-    event.data.fd = fd;
+    event.data.u64 = data;
     event.events = EPOLLIN | EPOLLRDHUP;
     if(one_shot) 
     {
         // 防止同一个通信被不同的线程处理
         event.events |= EPOLLONESHOT;
     }
+    // 监听socket、timerfd和accept4得到的连接创建时就是非阻塞的，这里不再需要两次fcntl
     epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &event);
-    // 设置文件描述符非阻塞
-    setnonblocking(fd);  
 }
 
 // 从epoll中移除监听的文件描述符
@@ -44,45 +53,123 @@ void removefd( int epollfd, int fd ) {
 }
 
 // 修改文件描述符，重置socket上的EPOLLONESHOT事件，以确保下一次可读时，EPOLLIN事件能被触发
-void modfd(int epollfd, int fd, int ev) {
+void modfd( int epollfd, int fd, int ev, uint64_t data ) {
     epoll_event event;
-    event.data.fd = fd;
+    event.data.u64 = data;
     event.events = ev | EPOLLET | EPOLLONESHOT | EPOLLRDHUP;
     epoll_ctl( epollfd, EPOLL_CTL_MOD, fd, &event );
 }
 
-// 所有的客户数
-int http_conn::m_user_count = 0;
-// 所有socket上的事件都被注册到同一个epoll内核事件中，所以设置成静态的
-int http_conn::m_epollfd = -1;
+// 不小于该大小的文件用sendfile发送
+long http_conn::m_sendfile_threshold = 256 * 1024;
+// 小文件的完整应答预先生成
+int http_conn::m_prerender_size = 1024;
+// 请求体的大小上限
+long long http_conn::m_max_body_size = 1024ll * 1024 * 1024;
+// POST的请求体默认只统计字节数
+body_handler* ( *http_conn::m_post_handler )( const char* url, conn_arena* arena ) = discard_body::create;
+// 是否正在平滑退出
+std::atomic< bool > http_conn::m_draining( false );
 
 // 关闭连接
 void http_conn::close_conn() {
-    if(m_sockfd != -1) {
-        removefd(m_epollfd, m_sockfd);
+    if(m_open) {
+        unmap();
+        if ( m_h2 ) {
+            // 流还引用着缓存项，session随连接一起释放
+            http2_session::destroy( m_h2 );
+            m_h2 = NULL;
+        }
+        end_body();
+        m_arena.reset();
+        // 未处理的请求数据和未发送的应答都丢弃
+        m_read_idx = 0;
+        reset_write();
+        end_proxy();
+        if ( m_ssl ) {
+            tls::close( m_ssl );
+            m_ssl = NULL;
+        }
+        m_handshaking = false;
+        // 先使旧句柄失效再关闭fd：fd一旦关闭就可能被其他反应堆accept复用
+        uint32_t generation = m_generation.load( std::memory_order_relaxed ) + 1;
+        m_generation.store( generation ? generation : 1, std::memory_order_release );
+        // 关闭之前把这个槽位完全复位，之后只用局部变量：关闭之后其他反应堆可能已经accept到同一个fd并init()了这个槽位，
+        // 再写m_sockfd会把新连接标记为已关闭
+        int sockfd = m_sockfd;
+        int epollfd = m_epollfd;
         m_sockfd = -1;
-        m_user_count--; // 关闭一个连接，将客户总数量-1
+        m_open = false;
+        if ( epollfd >= 0 ) {
+            removefd(epollfd, sockfd);
+        } else {
+            close(sockfd);
+        }
     }
 }
 
 // 初始化连接,外部调用初始化套接字地址
-void http_conn::init(int sockfd, const sockaddr_in& addr){
+void http_conn::init(int sockfd, const sockaddr_in& addr, int epollfd){
+    // 槽位可能是从未用过的零页：代数为0的句柄属于监听socket，定时器要先复位（不在时间轮上）
+    if ( m_generation.load( std::memory_order_relaxed ) == 0 ) {
+        m_generation.store( 1, std::memory_order_release );
+    }
+    m_timer = tw_timer();
+    m_timer.data = this;
+    m_epollfd = epollfd;
     m_sockfd = sockfd;
+    m_open = true;
     m_address = addr;
-    
-    // 端口复用
-    int reuse = 1;
-    setsockopt( m_sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof( reuse ) );
-    addfd( m_epollfd, sockfd, true );
+    // HTTPS的连接先握手，SSL对象创建失败时handshake()返回TLS_ERROR，由反应堆关闭连接
+    m_ssl = tls::enabled() ? tls::accept( sockfd ) : NULL;
+    m_handshaking = tls::enabled();
+    m_ktls_send = m_ktls_recv = false;
+    // HTTPS的连接由ALPN决定是否使用HTTP/2
+    m_h2_preface = http2_session::enabled() && !m_ssl;
+
+    if ( m_epollfd >= 0 ) {
+        addfd( m_epollfd, sockfd, true, handle() );
+    }
 
-    // 用户数加1
-    m_user_count++; 
     init();
 }
 
+// 推进TLS握手，要等待socket时只注册OpenSSL需要的那个方向
+tls::RESULT http_conn::handshake() {
+    tls::RESULT ret = m_ssl ? tls::handshake( m_ssl, &m_ktls_send, &m_ktls_recv ) : tls::TLS_ERROR;
+    if ( ret == tls::TLS_WANT_READ || ret == tls::TLS_WANT_WRITE ) {
+        modfd( m_epollfd, m_sockfd, ret == tls::TLS_WANT_READ ? EPOLLIN : EPOLLOUT, handle() );
+    } else if ( ret == tls::TLS_DONE ) {
+        m_handshaking = false;
+        if ( tls::alpn_h2( m_ssl ) ) {
+            // 客户端在握手中选择了h2，第一批数据就是连接前言
+            m_h2 = http2_session::create( this );
+            if ( !m_h2 ) {
+                return tls::TLS_ERROR;
+            }
+        }
+    }
+    return ret;
+}
+
 // 初始化其他信息
 void http_conn::init()
 {
+    init_request();
+    reset_write();
+    m_start_line = 0;
+    m_checked_idx = 0;
+    m_read_idx = 0;
+    m_req_start = 0;
+    m_proxy_route = -1;     // 每个请求在请求头结束时重新确定，转发开始之前不能在init_request()中清除
+    release_buffers();
+}
+
+// 重置单个请求的解析状态，读缓冲区中后面的（流水线）请求数据保留
+void http_conn::init_request()
+{
+    end_body();
+    m_arena.reset();        // 上一个请求从m_arena切出的内存一起归还
     m_check_state = CHECK_STATE_REQUESTLINE;    // 初始状态为检查请求行
     m_linger = false;       // 默认不保持链接  Connection : keep-alive保持连接
 
@@ -90,26 +177,124 @@ void http_conn::init()
     m_url = 0;              
     m_version = 0;
     m_content_length = 0;
+    m_has_content_length = false;
+    m_chunked = false;
+    m_expect_continue = false;
+    m_body_remaining = 0;
+    m_body_received = 0;
+    m_body_error = NO_REQUEST;
+    m_splice = false;
     m_host = 0;
-    m_start_line = 0;
-    m_checked_idx = 0;
-    m_read_idx = 0;
+    m_header_count = 0;
+    m_accept_encoding = 0;
+    m_encoding = -1;
+    m_vary = false;
+    m_content_type = NULL;
+    m_if_none_match = 0;
+    m_if_modified_since = 0;
+    m_range = 0;
+    m_if_range = 0;
+    m_range_count = 0;
+    m_h2c = false;
+    m_h2_settings = 0;
+}
+
+// 清空发送状态，文件缓存项的引用由unmap()释放
+void http_conn::reset_write()
+{
     m_write_idx = 0;
-    bzero(m_read_buf, READ_BUFFER_SIZE);
-    bzero(m_write_buf, READ_BUFFER_SIZE);
-    bzero(m_real_file, FILENAME_LEN);
+    m_iv_count = 0;
+    m_iv_idx = 0;
+    m_bytes_to_send = 0;
+    m_bytes_have_send = 0;
+    m_keep_alive = false;
+    m_sendfile = false;
+    m_sendfile_fd = -1;
+    m_file_offset = 0;
+}
+
+// 已应答的请求数据从读缓冲区中丢弃，未处理完的请求移到开头
+void http_conn::compact_read_buf()
+{
+    if ( m_req_start == 0 ) {
+        return;
+    }
+    move_read_data( m_read_buf );
+}
+
+void http_conn::move_read_data( char* buf )
+{
+    char* start = m_read_buf + m_req_start;
+    memmove( buf, start, m_read_idx - m_req_start );
+    m_read_idx -= m_req_start;
+    m_checked_idx -= m_req_start;
+    m_start_line -= m_req_start;
+    if ( m_url && m_url != m_url_buf ) {
+        // 有请求体时m_url已经复制到m_url_buf中，不在读缓冲区里
+        m_url = buf + ( m_url - start );
+    }
+    if ( m_version ) {
+        m_version = buf + ( m_version - start );
+    }
+    if ( m_host ) {
+        m_host = buf + ( m_host - start );
+    }
+    char** values[] = { &m_if_none_match, &m_if_modified_since, &m_range, &m_if_range, &m_h2_settings };
+    for ( int i = 0; i < 5; ++i ) {
+        if ( *values[i] ) {
+            *values[i] = buf + ( *values[i] - start );
+        }
+    }
+    m_req_start = 0;
+}
+
+// 请求头部（如很大的Cookie）放不下时，换成大一级的缓冲区并把数据拷贝过去
+bool http_conn::grow_read_buf()
+{
+    if ( m_read_size >= MAX_READ_BUFFER_SIZE ) {
+        return false;
+    }
+    int size = 0;
+    char* buf = buffer_pool::instance()->acquire( m_read_size * 2, &size );
+    if ( !buf ) {
+        return false;
+    }
+    move_read_data( buf );
+    buffer_pool::instance()->release( m_read_buf, m_read_size );
+    m_read_buf = buf;
+    m_read_size = size;
+    return true;
+}
+
+void http_conn::release_buffers()
+{
+    if ( m_read_buf && m_read_idx == 0 ) {
+        buffer_pool::instance()->release( m_read_buf, m_read_size );
+        m_read_buf = NULL;
+        m_read_size = 0;
+        m_checked_idx = m_start_line = m_req_start = 0;
+    }
+    if ( m_write_buf && m_bytes_to_send == 0 ) {
+        buffer_pool::instance()->release( m_write_buf, WRITE_BUFFER_SIZE );
+        m_write_buf = NULL;
+    }
 }
 
 // 循环读取客户数据，直到无数据可读或者对方关闭连接
 bool http_conn::read() {
-    if( m_read_idx >= READ_BUFFER_SIZE ) {
+    if( m_splice ) {
+        // 请求体的剩余部分由工作线程直接从socket splice进文件
+        return true;
+    }
+    if( !reserve_read_buf() ) {
         return false;
     }
     int bytes_read = 0;
-    while(true) {
-        // 从m_read_buf + m_read_idx索引出开始保存数据，大小是READ_BUFFER_SIZE - m_read_idx
-        bytes_read = recv(m_sockfd, m_read_buf + m_read_idx, 
-        READ_BUFFER_SIZE - m_read_idx, 0 );
+    while( m_read_idx < m_read_size ) {
+        // 缓冲区满时停止读取，剩下的（流水线）数据留在socket中，处理完已读入的请求后重新注册EPOLLIN时会再次触发
+        // 从m_read_buf + m_read_idx索引出开始保存数据，大小是m_read_size - m_read_idx
+        bytes_read = socket_recv() ? recv(m_sockfd, m_read_buf + m_read_idx, m_read_size - m_read_idx, 0 )
+                : tls::read( m_ssl, m_read_buf + m_read_idx, m_read_size - m_read_idx );
         if (bytes_read == -1) {
             if( errno == EAGAIN || errno == EWOULDBLOCK ) {
                 // 没有数据
@@ -120,34 +305,71 @@ bool http_conn::read() {
             return false;
         }
         m_read_idx += bytes_read;
+        metrics::add( METRIC_BYTES_IN, bytes_read );
+    }
+    return true;
+}
+
+// 保证读缓冲区中还有空间
+bool http_conn::reserve_read_buf() {
+    if( !m_read_buf ) {
+        // 空闲连接上新请求的数据到达，从池中取读缓冲区
+        m_read_buf = buffer_pool::instance()->acquire( READ_BUFFER_SIZE, &m_read_size );
+        return m_read_buf != NULL;
+    }
+    if( m_read_idx >= m_read_size ) {
+        // 应答过的请求都已经丢弃，缓冲区仍然是满的，说明一个请求就放不下，换成大一级的缓冲区
+        return grow_read_buf();
+    }
+    return true;
+}
+
+// 追加由外部（io_uring）收到的数据
+bool http_conn::feed( const char* data, int len ) {
+    while( len > 0 ) {
+        if( !reserve_read_buf() ) {
+            return false;
+        }
+        int n = m_read_size - m_read_idx;
+        if( n > len ) {
+            n = len;
+        }
+        memcpy( m_read_buf + m_read_idx, data, n );
+        metrics::add( METRIC_BYTES_IN, n );
+        m_read_idx += n;
+        data += n;
+        len -= n;
     }
     return true;
 }
 
 // 解析一行，判断依据\r\n
+// 用向量化的scan_eol一次跳过一整段普通字符，只在遇到\r或\n时才逐个判断
 http_conn::LINE_STATUS http_conn::parse_line() {
-    char temp;
-    for ( ; m_checked_idx < m_read_idx; ++m_checked_idx ) {
-        temp = m_read_buf[ m_checked_idx ];
-        if ( temp == '\r' ) {
-            if ( ( m_checked_idx + 1 ) == m_read_idx ) {
-                return LINE_OPEN;
-            } else if ( m_read_buf[ m_checked_idx + 1 ] == '\n' ) {
-                m_read_buf[ m_checked_idx++ ] = '\0';
-                m_read_buf[ m_checked_idx++ ] = '\0';
-                return LINE_OK;
-            }
-            return LINE_BAD;
-        } else if( temp == '\n' )  {
-            if( ( m_checked_idx > 1) && ( m_read_buf[ m_checked_idx - 1 ] == '\r' ) ) {
-                m_read_buf[ m_checked_idx-1 ] = '\0';
-                m_read_buf[ m_checked_idx++ ] = '\0';
-                return LINE_OK;
-            }
-            return LINE_BAD;
+    const char* end = m_read_buf + m_read_idx;
+    const char* eol = scan_eol( m_read_buf + m_checked_idx, end );
+    m_checked_idx = eol - m_read_buf;
+    if ( eol == end ) {
+        return LINE_OPEN;
+    }
+    if ( *eol == '\r' ) {
+        if ( ( m_checked_idx + 1 ) == m_read_idx ) {
+            // \r是已读数据的最后一个字节，下次从\r重新开始判断
+            return LINE_OPEN;
+        } else if ( m_read_buf[ m_checked_idx + 1 ] == '\n' ) {
+            m_read_buf[ m_checked_idx++ ] = '\0';
+            m_read_buf[ m_checked_idx++ ] = '\0';
+            return LINE_OK;
         }
+        return LINE_BAD;
+    }
+    // 单独的\n
+    if( ( m_checked_idx > 1) && ( m_read_buf[ m_checked_idx - 1 ] == '\r' ) ) {
+        m_read_buf[ m_checked_idx-1 ] = '\0';
+        m_read_buf[ m_checked_idx++ ] = '\0';
+        return LINE_OK;
     }
-    return LINE_OPEN;
+    return LINE_BAD;
 }
 
 // 解析HTTP请求行，获得请求方法，目标URL,以及HTTP版本号
@@ -162,6 +384,10 @@ http_conn::HTTP_CODE http_conn::parse_request_line(char* text) {
     char* method = text;
     if ( strcasecmp(method, "GET") == 0 ) { // 忽略大小写比较
         m_method = GET;
+    } else if ( strcasecmp( method, "POST" ) == 0 ) {
+        m_method = POST;
+    } else if ( strcasecmp( method, "PUT" ) == 0 ) {
+        m_method = PUT;
     } else {
         return BAD_REQUEST;
     }
@@ -192,63 +418,443 @@ http_conn::HTTP_CODE http_conn::parse_request_line(char* text) {
     return NO_REQUEST;
 }
 
+// 解析一个非负的十进制数，溢出时返回false
+static bool parse_offset( const char** p, off_t* v ) {
+    const char* s = *p;
+    off_t n = 0;
+    while ( *s >= '0' && *s <= '9' ) {
+        if ( n > ( ( off_t )1 << 62 ) / 10 ) {
+            return false;
+        }
+        n = n * 10 + ( *s++ - '0' );
+    }
+    if ( s == *p ) {
+        return false;
+    }
+    *p = s;
+    *v = n;
+    return true;
+}
+
+// 解析Accept-Encoding的值，返回可以使用的编码的位图，q=0的编码是客户端明确拒绝的
+int http_conn::parse_accept_encoding( const char* p ) {
+    int mask = 0;
+    while ( *p ) {
+        while ( *p == ' ' || *p == '\t' || *p == ',' ) {
+            ++p;
+        }
+        const char* token = p;
+        while ( *p && *p != ',' && *p != ';' && *p != ' ' && *p != '\t' ) {
+            ++p;
+        }
+        int len = p - token;
+        bool refused = false;
+        while ( *p && *p != ',' ) {
+            if ( *p == ';' ) {
+                const char* q = p + 1;
+                while ( *q == ' ' || *q == '\t' ) {
+                    ++q;
+                }
+                if ( ( *q == 'q' || *q == 'Q' ) && q[1] == '=' ) {
+                    refused = strtod( q + 2, NULL ) <= 0;
+                }
+            }
+            ++p;
+        }
+        if ( refused || len == 0 ) {
+            continue;
+        }
+        if ( len == 4 && strncasecmp( token, "gzip", 4 ) == 0 ) {
+            mask |= 1 << ENCODING_GZIP;
+        } else if ( len == 2 && strncasecmp( token, "br", 2 ) == 0 ) {
+            mask |= 1 << ENCODING_BR;
+        } else if ( len == 1 && *token == '*' ) {
+            mask |= ( 1 << ENCODING_NUMBER ) - 1;
+        }
+    }
+    return mask;
+}
+
 // 解析HTTP请求的一个头部信息
-http_conn::HTTP_CODE http_conn::parse_headers(char* text) {   
+// 先用scan_header_name找到名称的结束位置，把名称和去掉空白的值以偏移对记入m_headers，
+// 再按名称长度分派，只对长度相同的已知头部做一次忽略大小写的比较
+http_conn::HTTP_CODE http_conn::parse_headers(char* text, int len) {   
     // 遇到空行，表示头部字段解析完毕
-    if( text[0] == '\0' ) {
-        // 如果HTTP请求有消息体，则还需要读取m_content_length字节的消息体，
-        // 状态机转移到CHECK_STATE_CONTENT状态
-        if ( m_content_length != 0 ) {
-            m_check_state = CHECK_STATE_CONTENT;
-            return NO_REQUEST;
+    if( len == 0 ) {
+        if ( m_has_content_length && m_chunked ) {
+            // 两种长度同时出现（哪怕Content-Length是0）是请求走私的典型手法，前面的代理可能按另一种划分请求体，直接拒绝；
+            // 转发的请求也在这里检查，不会把有歧义的请求交给后端
+            return BAD_REQUEST;
+        }
+        // 要转发给后端的请求，请求体由反应堆直接转发，这里不接收
+        m_proxy_route = upstream::match( m_url );
+        // 如果HTTP请求有消息体（POST、PUT没有消息体时也当作长度为0的消息体交给处理者），
+        // 状态机转移到CHECK_STATE_CONTENT状态，消息体边收边处理
+        if ( m_proxy_route < 0 && ( m_content_length != 0 || m_chunked || m_method != GET ) ) {
+            return begin_body();
         }
         // 否则说明我们已经得到了一个完整的HTTP请求
         return GET_REQUEST;
-    } else if ( strncasecmp( text, "Connection:", 11 ) == 0 ) {
-        // 处理Connection 头部字段  Connection: keep-alive
-        text += 11;
-        text += strspn( text, " \t" );
-        if ( strcasecmp( text, "keep-alive" ) == 0 ) {
-            m_linger = true;
-        }
-    } else if ( strncasecmp( text, "Content-Length:", 15 ) == 0 ) {
-        // 处理Content-Length头部字段
-        text += 15;
-        text += strspn( text, " \t" );
-        m_content_length = atol(text);
-    } else if ( strncasecmp( text, "Host:", 5 ) == 0 ) {
-        // 处理Host头部字段
-        text += 5;
-        text += strspn( text, " \t" );
-        m_host = text;
-    } else {
-        printf( "oop! unknow header %s\n", text );
+    }
+
+    // 名称: 值   名称必须紧跟':'，名称为空或者其中有空白、控制字符都是错误的请求
+    char* end = text + len;
+    char* colon = ( char* )scan_header_name( text, end );
+    if ( colon == text || colon == end || *colon != ':' ) {
+        return BAD_REQUEST;
+    }
+    char* value = colon + 1;
+    while ( value < end && ( *value == ' ' || *value == '\t' ) ) {
+        ++value;
+    }
+    while ( end > value && ( end[-1] == ' ' || end[-1] == '\t' ) ) {
+        --end;
+    }
+    *end = '\0';
+
+    if ( m_header_count >= MAX_HEADERS ) {
+        return BAD_REQUEST;
+    }
+    const char* base = m_read_buf + m_req_start;
+    http_header& h = m_headers[ m_header_count++ ];
+    h.name = text - base;
+    h.name_len = colon - text;
+    h.value = value - base;
+    h.value_len = end - value;
+
+    switch ( h.name_len ) {
+        case 5: {
+            if ( header_name_is( text, h.name_len, "range", 5 ) ) {
+                // Range: bytes=0-1023
+                m_range = value;
+            }
+            break;
+        }
+        case 8: {
+            if ( header_name_is( text, h.name_len, "if-range", 8 ) ) {
+                m_if_range = value;
+            }
+            break;
+        }
+        case 13: {
+            if ( header_name_is( text, h.name_len, "if-none-match", 13 ) ) {
+                // If-None-Match: "5f3a-15e-18b2c0d9e1f2a3b4"
+                m_if_none_match = value;
+            }
+            break;
+        }
+        case 17: {
+            if ( header_name_is( text, h.name_len, "if-modified-since", 17 ) ) {
+                m_if_modified_since = value;
+            } else if ( header_name_is( text, h.name_len, "transfer-encoding", 17 ) ) {
+                // 只支持chunked，其他的传输编码无法确定请求体在哪里结束
+                if ( strcasecmp( value, "chunked" ) != 0 ) {
+                    return BAD_REQUEST;
+                }
+                m_chunked = true;
+            }
+            break;
+        }
+        case 6: {
+            if ( header_name_is( text, h.name_len, "expect", 6 ) && strcasecmp( value, "100-continue" ) == 0 ) {
+                m_expect_continue = true;
+            }
+            break;
+        }
+        case 7: {
+            if ( header_name_is( text, h.name_len, "upgrade", 7 ) && strcasecmp( value, "h2c" ) == 0 ) {
+                // 只有明文连接可以用Upgrade切换到HTTP/2
+                m_h2c = m_h2_preface;
+            }
+            break;
+        }
+        case 4: {
+            if ( header_name_is( text, h.name_len, "host", 4 ) ) {
+                // 处理Host头部字段
+                m_host = value;
+            }
+            break;
+        }
+        case 10: {
+            if ( header_name_is( text, h.name_len, "connection", 10 ) ) {
+                // 处理Connection 头部字段  Connection: keep-alive
+                if ( strcasecmp( value, "keep-alive" ) == 0 ) {
+                    m_linger = true;
+                }
+            }
+            break;
+        }
+        case 14: {
+            if ( header_name_is( text, h.name_len, "content-length", 14 ) ) {
+                // 处理Content-Length头部字段，只能是十进制数字；重复出现时值必须相同，否则无法确定请求体的长度
+                const char* p = value;
+                off_t length;
+                if ( !parse_offset( &p, &length ) || *p != '\0'
+                        || ( m_has_content_length && length != m_content_length ) ) {
+                    return BAD_REQUEST;
+                }
+                m_content_length = length;
+                m_has_content_length = true;
+            } else if ( header_name_is( text, h.name_len, "http2-settings", 14 ) ) {
+                m_h2_settings = value;
+            }
+            break;
+        }
+        case 15: {
+            if ( header_name_is( text, h.name_len, "accept-encoding", 15 ) ) {
+                // Accept-Encoding: gzip, deflate, br
+                m_accept_encoding = parse_accept_encoding( value );
+            }
+            break;
+        }
+        default: {
+            break;
+        }
     }
     return NO_REQUEST;
 }
 
-// 我们没有真正解析HTTP请求的消息体，只是判断它是否被完整的读入了
-http_conn::HTTP_CODE http_conn::parse_content( char* text ) {
-    if ( m_read_idx >= ( m_content_length + m_checked_idx ) )
-    {
-        text[ m_content_length ] = '\0';
-        return GET_REQUEST;
+// 请求头之后还有请求体：检查长度、创建处理者，再把请求头从读缓冲区中丢弃，之后缓冲区中只有还没有处理的请求体
+// 出错时请求体还留在连接中，无法找到下一个请求的开始，应答之后关闭连接
+http_conn::HTTP_CODE http_conn::begin_body() {
+    if ( !m_chunked && m_max_body_size > 0 && m_content_length > m_max_body_size ) {
+        m_linger = false;
+        return BODY_TOO_LARGE;
     }
+    if ( strlen( m_url ) >= ( size_t )FILENAME_LEN ) {
+        // URL要复制到m_url_buf中，截断之后就是另一个资源了
+        m_linger = false;
+        return URI_TOO_LONG;
+    }
+    if ( m_method == POST ) {
+        m_handler = m_post_handler ? m_post_handler( m_url, &m_arena ) : NULL;
+    } else if ( m_method == PUT ) {
+        m_handler = file_upload::create( m_url, &m_arena );
+    }
+    if ( m_method != GET && !m_handler ) {
+        if ( m_expect_continue ) {
+            // 客户端还在等待100 Continue，请求体不会发过来，直接拒绝
+            m_linger = false;
+            return FORBIDDEN_REQUEST;
+        }
+        // 请求体已经在路上：收完丢弃之后再拒绝，否则关闭连接时socket中未读的数据会让客户端收到RST，丢掉应答
+        m_body_error = FORBIDDEN_REQUEST;
+    }
+
+    strcpy( m_url_buf, m_url );
+    m_url = m_url_buf;
+    m_version = m_host = 0;
+    m_if_none_match = m_if_modified_since = m_range = m_if_range = 0;
+    m_header_count = 0;
+    m_req_start = m_start_line = m_checked_idx;
+
+    m_chunk_state = CHUNK_SIZE;
+    m_body_remaining = m_chunked ? 0 : m_content_length;
+    m_splice = !m_chunked && m_epollfd >= 0 && socket_recv() && m_handler && m_handler->splice_fd() >= 0
+            && m_body_remaining > m_read_idx - m_checked_idx;
+    // 不能splice时换成大一些的读缓冲区，减少交给线程池的次数，大小仍然是固定的
+    while ( !m_splice && m_read_size < BODY_READ_BUFFER_SIZE && ( m_chunked || m_body_remaining > m_read_size )
+            && grow_read_buf() ) {
+    }
+    if ( m_expect_continue ) {
+        send_continue();
+    }
+    m_check_state = CHECK_STATE_CONTENT;
     return NO_REQUEST;
 }
 
+/*
+    客户端在等待这个中间应答，收到后才发送请求体。只在这一批中还没有应答时发送：此时socket的发送缓冲区是空的，
+    25个字节直接发出去，不经过m_iv；否则不发，客户端等待一段时间后也会发送请求体。
+    用户态TLS的连接也不发：SSL_write没写完时OpenSSL要求下一次写同样的数据，而它之后写的是应答
+*/
+void http_conn::send_continue() {
+    if ( m_bytes_to_send == 0 && socket_send() && send( m_sockfd, HTTP_CONTINUE.data, HTTP_CONTINUE.len, MSG_DONTWAIT | MSG_NOSIGNAL ) > 0 ) {
+        metrics::add( METRIC_BYTES_OUT, HTTP_CONTINUE.len );
+    }
+}
+
+bool http_conn::consume_body( const char* data, int len ) {
+    m_body_received += len;
+    return !m_handler || m_handler->write( data, len );
+}
+
+// 每个线程一个管道，splice进来的数据在同一次调用中全部写进文件，两次调用之间管道总是空的
+static int* splice_pipe() {
+    static thread_local int fds[2] = { -1, -1 };
+    if ( fds[0] < 0 && pipe2( fds, O_CLOEXEC ) < 0 ) {
+        fds[0] = fds[1] = -1;
+        return NULL;
+    }
+    return fds;
+}
+
+bool http_conn::splice_body() {
+    int* p = splice_pipe();
+    if ( !p ) {
+        // 没有管道可用，退回到读进缓冲区再写文件
+        m_splice = false;
+        return true;
+    }
+    int fd = m_handler->splice_fd();
+    while ( m_body_remaining > 0 ) {
+        size_t want = m_body_remaining < SPLICE_CHUNK ? m_body_remaining : SPLICE_CHUNK;
+        ssize_t n = splice( m_sockfd, NULL, p[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK );
+        if ( n < 0 ) {
+            // socket中暂时没有数据，等下一次EPOLLIN
+            return errno == EAGAIN || errno == EINTR;
+        }
+        if ( n == 0 ) {
+            return false;
+        }
+        metrics::add( METRIC_BYTES_IN, n );
+        for ( ssize_t left = n; left > 0; ) {
+            ssize_t m = splice( p[0], NULL, fd, NULL, left, SPLICE_F_MOVE );
+            if ( m <= 0 ) {
+                // 管道中留下了没写完的数据，换一个新的管道
+                close( p[0] );
+                close( p[1] );
+                p[0] = p[1] = -1;
+                return false;
+            }
+            left -= m;
+        }
+        m_body_remaining -= n;
+        m_body_received += n;
+        m_handler->spliced( n );
+    }
+    return true;
+}
+
+// 请求体边收边交给处理者，交出去的数据随即从读缓冲区中丢弃（m_req_start跟着前进），
+// 消息体之后可能紧跟着下一个流水线请求，所以不能在消息体末尾写入'\0'
+http_conn::HTTP_CODE http_conn::parse_content() {
+    while ( true ) {
+        if ( !m_chunked || m_chunk_state == CHUNK_DATA ) {
+            off_t n = m_read_idx - m_checked_idx;
+            if ( n > m_body_remaining ) {
+                n = m_body_remaining;
+            }
+            if ( n > 0 && !consume_body( m_read_buf + m_checked_idx, ( int )n ) ) {
+                m_linger = false;
+                return INTERNAL_ERROR;
+            }
+            m_checked_idx += n;
+            m_body_remaining -= n;
+            m_req_start = m_start_line = m_checked_idx;
+            if ( m_body_remaining > 0 && m_splice && !splice_body() ) {
+                m_linger = false;
+                return INTERNAL_ERROR;
+            }
+            if ( m_body_remaining > 0 ) {
+                return NO_REQUEST;
+            }
+            if ( !m_chunked ) {
+                return finish_body();
+            }
+            m_chunk_state = CHUNK_DATA_END;
+        }
+
+        // 分块编码中以行为单位的部分
+        LINE_STATUS line_status = parse_line();
+        if ( line_status == LINE_OPEN ) {
+            return NO_REQUEST;
+        } else if ( line_status == LINE_BAD ) {
+            return BAD_REQUEST;
+        }
+        char* text = get_line();
+        int len = m_checked_idx - m_start_line - 2;
+        m_req_start = m_start_line = m_checked_idx;
+        HTTP_CODE ret = parse_chunk_line( text, len );
+        if ( ret != NO_REQUEST ) {
+            return ret;
+        }
+    }
+}
+
+http_conn::HTTP_CODE http_conn::parse_chunk_line( char* text, int len ) {
+    switch ( m_chunk_state ) {
+        case CHUNK_SIZE: {
+            // 十六进制的块大小，后面可以有";扩展"，扩展被忽略
+            off_t size = 0;
+            char* p = text;
+            for ( ; isxdigit( ( unsigned char )*p ); ++p ) {
+                if ( size > ( ( off_t )1 << 58 ) ) {
+                    return BAD_REQUEST;
+                }
+                size = size * 16 + ( *p <= '9' ? *p - '0' : ( *p | 0x20 ) - 'a' + 10 );
+            }
+            while ( *p == ' ' || *p == '\t' ) {
+                ++p;
+            }
+            if ( p == text || ( *p != '\0' && *p != ';' ) ) {
+                return BAD_REQUEST;
+            }
+            if ( size == 0 ) {
+                m_chunk_state = CHUNK_TRAILER;
+            } else if ( m_max_body_size > 0 && m_body_received + size > m_max_body_size ) {
+                m_linger = false;
+                return BODY_TOO_LARGE;
+            } else {
+                m_body_remaining = size;
+                m_chunk_state = CHUNK_DATA;
+            }
+            return NO_REQUEST;
+        }
+        case CHUNK_DATA_END: {
+            if ( len != 0 ) {
+                return BAD_REQUEST;
+            }
+            m_chunk_state = CHUNK_SIZE;
+            return NO_REQUEST;
+        }
+        case CHUNK_TRAILER: {
+            // 尾部字段被忽略，空行表示请求体结束
+            return len == 0 ? finish_body() : NO_REQUEST;
+        }
+        default: {
+            return INTERNAL_ERROR;
+        }
+    }
+}
+
+http_conn::HTTP_CODE http_conn::finish_body() {
+    m_splice = false;
+    if ( !m_handler ) {
+        // GET等请求的请求体已经丢弃，照常处理请求
+        return m_body_error != NO_REQUEST ? m_body_error : do_request();
+    }
+    m_body_status = m_handler->finish( m_body_message, sizeof( m_body_message ) );
+    m_handler->~body_handler();     // 处理者在m_arena中，请求结束时随m_arena一起归还
+    m_handler = NULL;
+    return BODY_REQUEST;
+}
+
+void http_conn::end_body() {
+    if ( m_handler ) {
+        m_handler->abort();
+        m_handler->~body_handler();
+        m_handler = NULL;
+    }
+    m_splice = false;
+}
+
 // 主状态机，解析请求
 http_conn::HTTP_CODE http_conn::process_read() {
     LINE_STATUS line_status = LINE_OK;
     HTTP_CODE ret = NO_REQUEST;
     char* text = 0;
+    if ( m_check_state == CHECK_STATE_CONTENT ) {
+        // 正在接收请求体，分块编码的行由parse_content()自己解析，m_start_line可能正停在半行上
+        return parse_content();
+    }
     while (((m_check_state == CHECK_STATE_CONTENT) && (line_status == LINE_OK))
                 || ((line_status = parse_line()) == LINE_OK)) {
             //  解析到一行完整的数据 或者 解析到了请求体， 也是完整的数据
         // 获取一行数据
         text = get_line();
+        int len = m_checked_idx - m_start_line - 2;     // 去掉行尾\r\n（已被置为\0）后的长度
         m_start_line = m_checked_idx;
-        printf( "got 1 http line: %s\n", text );
 
         switch ( m_check_state ) {
             case CHECK_STATE_REQUESTLINE: {
@@ -259,21 +865,18 @@ http_conn::HTTP_CODE http_conn::process_read() {
                 break;
             }
             case CHECK_STATE_HEADER: {
-                ret = parse_headers( text );
-                if ( ret == BAD_REQUEST ) {
-                    return BAD_REQUEST;
-                } else if ( ret == GET_REQUEST ) {
+                ret = parse_headers( text, len );
+                if ( ret == GET_REQUEST ) {
                     return do_request();
+                } else if ( ret != NO_REQUEST ) {
+                    // 错误的请求，或者请求体不能接受
+                    return ret;
                 }
                 break;
             }
             case CHECK_STATE_CONTENT: {
-                ret = parse_content( text );
-                if ( ret == GET_REQUEST ) {
-                    return do_request();
-                }
-                line_status = LINE_OPEN;
-                break;
+                // 请求体不按行解析，处理完缓冲区中已有的部分就返回
+                return parse_content();
             }
             default: {
                 return INTERNAL_ERROR;
@@ -284,43 +887,244 @@ http_conn::HTTP_CODE http_conn::process_read() {
 }
 
 // 当得到一个完整、正确的HTTP请求时，我们就分析目标文件的属性，
-// 如果目标文件存在、对所有用户可读，且不是目录，则使用mmap将其
-// 映射到内存地址m_file_address处，并告诉调用者获取文件成功
+// 如果目标文件存在、对所有用户可读，且不是目录，则从打开文件缓存中取得
+// 它的共享映射m_file_address，并告诉调用者获取文件成功
 http_conn::HTTP_CODE http_conn::do_request()
 {
-    // "/home/nowcoder/webserver/resources"
-    strcpy( m_real_file, doc_root );
-    int len = strlen( doc_root );
-    strncpy( m_real_file + len, m_url, FILENAME_LEN - len - 1 );
-    // 获取m_real_file文件的相关的状态信息，-1失败，0成功
-    if ( stat( m_real_file, &m_file_stat ) < 0 ) {
-        return NO_RESOURCE;
+    if ( strcmp( m_url, "/metrics" ) == 0 ) {
+        return METRICS_REQUEST;
+    }
+    if ( m_proxy_route >= 0 ) {
+        // 请求体还在连接中没有读取，拒绝之后关闭连接
+        if ( m_chunked ) {
+            m_linger = false;
+            return LENGTH_REQUIRED;
+        }
+        if ( m_max_body_size > 0 && m_content_length > m_max_body_size ) {
+            m_linger = false;
+            return BODY_TOO_LARGE;
+        }
+        if ( strlen( m_url ) >= ( size_t )FILENAME_LEN ) {
+            // 访问日志用的URL复制在m_url_buf中
+            m_linger = false;
+            return URI_TOO_LONG;
+        }
+        if ( !socket_send() || !socket_recv() ) {
+            // 转发时请求体和应答直接在两个socket之间splice，用户态TLS的socket上是密文
+            m_linger = false;
+            return INTERNAL_ERROR;
+        }
+        return PROXY_REQUEST;
     }
 
-    // 判断访问权限
-    if ( ! ( m_file_stat.st_mode & S_IROTH ) ) {
-        return FORBIDDEN_REQUEST;
+    // 在启动时建立的根目录索引中查找规范化之后的路径，不存在的文件不会有任何系统调用
+    char real_file[ PATH_MAX ];
+    switch( doc_index::instance()->lookup( m_url, real_file, sizeof( real_file ) ) ) {
+        case doc_index::IS_FILE:
+            break;
+        case doc_index::NOT_FOUND:
+            return NO_RESOURCE;
+        default:
+            // 越过根目录的".."，或者是目录
+            return BAD_REQUEST;
     }
 
-    // 判断是否是目录
-    if ( S_ISDIR( m_file_stat.st_mode ) ) {
-        return BAD_REQUEST;
+    // 命中缓存时不会有任何文件系统的系统调用，未命中时由缓存完成stat、open和mmap
+    switch( file_cache::instance()->acquire( real_file, &m_file_entry ) ) {
+        case file_cache::OK:
+            break;
+        case file_cache::NOT_FOUND:
+            return NO_RESOURCE;
+        case file_cache::FORBIDDEN:
+            return FORBIDDEN_REQUEST;
+        case file_cache::IS_DIR:
+            return BAD_REQUEST;
+        default:
+            return INTERNAL_ERROR;
     }
+    m_file_stat = m_file_entry->st;
+    m_file_address = m_file_entry->address;
+    m_file_size = m_file_stat.st_size;
+    m_file_fd = m_file_entry->fd;
+    m_content_type = m_file_entry->content_type;
 
-    // 以只读方式打开文件
-    int fd = open( m_real_file, O_RDONLY );
-    // 创建内存映射
-    m_file_address = ( char* )mmap( 0, m_file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
-    close( fd );
-    return FILE_REQUEST;
+    // ETag: "inode-大小-修改时间"，编码版本的内容不同，在后面加上编码的后缀
+    m_etag[0] = '"';
+    memcpy( m_etag + 1, m_file_entry->etag, m_file_entry->etag_len );
+    m_etag_len = m_file_entry->etag_len + 1;
+    m_etag[ m_etag_len ] = '"';
+    m_etag[ m_etag_len + 1 ] = '\0';
+
+    // Range总是针对原文件，多区间的应答也就不涉及内容编码
+    bool ranged = m_range && if_range_matches();
+
+    // 在客户端接受的编码版本中选最小的一个，版本都是加载文件时准备好的，这里只是比较大小
+    for ( int i = 0; i < ENCODING_NUMBER; ++i ) {
+        const file_cache::variant& v = m_file_entry->variants[ i ];
+        if ( v.size == 0 ) {
+            continue;
+        }
+        m_vary = true;
+        if ( !ranged && ( m_accept_encoding & ( 1 << i ) ) && v.size < m_file_size ) {
+            m_encoding = i;
+            m_file_size = v.size;
+            m_file_address = v.address;
+            m_file_fd = v.fd;
+        }
+    }
+    if ( m_encoding >= 0 ) {
+        static const char* etag_suffix[ ENCODING_NUMBER ] = { "-gz\"", "-br\"" };
+        strcpy( m_etag + m_etag_len, etag_suffix[ m_encoding ] );
+        m_etag_len += strlen( etag_suffix[ m_encoding ] );
+    } else {
+        ++m_etag_len;
+    }
+    if ( !ranged ) {
+        m_range = 0;
+    }
+    return check_conditions();
 }
 
-// 对内存映射区执行munmap操作
+/*
+    解析Range: bytes=0-99, 200-, -50，把文件中存在的区间写入ranges，返回区间个数
+    返回0表示所有区间都超出了文件（应回复416），-1表示语法错误、不是bytes单位或者区间超过max个，应忽略Range
+*/
+static int parse_range( const char* p, off_t size, http_conn::byte_range* ranges, int max ) {
+    if ( strncasecmp( p, "bytes=", 6 ) != 0 ) {
+        return -1;
+    }
+    p += 6;
+    int n = 0;
+    while ( true ) {
+        while ( *p == ' ' || *p == '\t' ) {
+            ++p;
+        }
+        off_t first, last;
+        if ( *p == '-' ) {
+            // 最后suffix个字节
+            ++p;
+            off_t suffix;
+            if ( !parse_offset( &p, &suffix ) ) {
+                return -1;
+            }
+            first = suffix >= size ? 0 : size - suffix;
+            last = suffix > 0 ? size - 1 : -1;
+        } else {
+            if ( !parse_offset( &p, &first ) || *p++ != '-' ) {
+                return -1;
+            }
+            last = size - 1;
+            if ( *p >= '0' && *p <= '9' ) {
+                if ( !parse_offset( &p, &last ) || last < first ) {
+                    return -1;
+                }
+                if ( last >= size ) {
+                    last = size - 1;
+                }
+            }
+        }
+        // 超出文件的区间直接跳过
+        if ( first <= last && first < size ) {
+            if ( n == max ) {
+                return -1;
+            }
+            ranges[ n ].first = first;
+            ranges[ n ].last = last;
+            ++n;
+        }
+        while ( *p == ' ' || *p == '\t' ) {
+            ++p;
+        }
+        if ( *p == '\0' ) {
+            return n;
+        }
+        if ( *p++ != ',' ) {
+            return -1;
+        }
+    }
+}
+
+// If-None-Match的值是否包含etag或者为"*"，按弱比较，即忽略W/前缀
+static bool etag_list_matches( const char* p, const char* etag, int etag_len ) {
+    while ( true ) {
+        while ( *p == ' ' || *p == '\t' || *p == ',' ) {
+            ++p;
+        }
+        if ( *p == '*' ) {
+            return true;
+        }
+        if ( p[0] == 'W' && p[1] == '/' ) {
+            p += 2;
+        }
+        if ( *p != '"' ) {
+            return false;
+        }
+        const char* end = strchr( p + 1, '"' );
+        if ( !end ) {
+            return false;
+        }
+        if ( end - p + 1 == etag_len && memcmp( p, etag, etag_len ) == 0 ) {
+            return true;
+        }
+        p = end + 1;
+    }
+}
+
+bool http_conn::not_modified() const {
+    if ( m_if_none_match ) {
+        return etag_list_matches( m_if_none_match, m_etag, m_etag_len );
+    }
+    time_t since;
+    return m_if_modified_since && parse_http_date( m_if_modified_since, &since ) && m_file_stat.st_mtime <= since;
+}
+
+// If-Range是ETag时按强比较，是日期时必须与修改时间完全相同。调用时m_etag还是原文件的ETag
+bool http_conn::if_range_matches() const {
+    if ( !m_if_range ) {
+        return true;
+    }
+    if ( m_if_range[0] == '"' ) {
+        return strcmp( m_if_range, m_etag ) == 0;
+    }
+    time_t date;
+    return m_if_range[0] != 'W' && parse_http_date( m_if_range, &date ) && date == m_file_stat.st_mtime;
+}
+
+http_conn::HTTP_CODE http_conn::check_conditions() {
+    // 有If-None-Match时它优先于Range，文件没有变化就不用发送任何内容
+    if ( not_modified() ) {
+        return NOT_MODIFIED;
+    }
+    if ( !m_range ) {
+        return FILE_REQUEST;
+    }
+    int n = parse_range( m_range, m_file_size, m_ranges, MAX_RANGES );
+    if ( n == 0 ) {
+        return RANGE_NOT_SATISFIABLE;
+    }
+    if ( n < 0 || ( n > 1 && !m_file_address ) ) {
+        // 没有映射的大文件只能用sendfile发送一段，多区间时发送整个文件，这也是允许的
+        return FILE_REQUEST;
+    }
+    m_range_count = n;
+    return PARTIAL_CONTENT;
+}
+
+// 释放对打开文件缓存项的引用，映射本身由缓存管理
 void http_conn::unmap() {
-    if( m_file_address )
+    if( m_file_entry )
     {
-        munmap( m_file_address, m_file_stat.st_size );
-        m_file_address = 0;
+        file_cache::instance()->release( m_file_entry );
+        m_file_entry = NULL;
+    }
+    for ( int i = 0; i < m_file_count; ++i ) {
+        file_cache::instance()->release( m_file_entries[ i ] );
+    }
+    m_file_count = 0;
+    m_file_address = 0;
+    if ( m_body_buf ) {
+        buffer_pool::instance()->release( m_body_buf, BODY_BUFFER_SIZE );
+        m_body_buf = NULL;
     }
 }
 
@@ -328,46 +1132,125 @@ void http_conn::unmap() {
 bool http_conn::write()
 {
     int temp = 0;
-    int bytes_have_send = 0;    // 已经发送的字节
-    int bytes_to_send = m_write_idx;// 将要发送的字节 （m_write_idx）写缓冲区中待发送的字节数
     
-    if ( bytes_to_send == 0 ) {
+    if ( m_bytes_to_send == 0 ) {
         // 将要发送的字节为0，这一次响应结束。
-        modfd( m_epollfd, m_sockfd, EPOLLIN ); 
-        init();
-        return true;
+        // 工作线程生成响应失败时也会走到这里，此时m_keep_alive为false，由反应堆关闭连接
+        bool keep_alive = m_keep_alive;
+        reset_write();
+        release_buffers();
+        if ( m_proxy_buf ) {
+            // 这一批只有一个要转发的请求，由反应堆开始转发
+            return true;
+        }
+        modfd( m_epollfd, m_sockfd, EPOLLIN, handle() );
+        return keep_alive;
     }
 
     while(1) {
-        // 分散写
-        temp = writev(m_sockfd, m_iv, m_iv_count);
+        if ( !m_sendfile ) {
+            // 分散写，一次发出这一批流水线应答
+            temp = socket_send() ? writev(m_sockfd, m_iv + m_iv_idx, m_iv_count - m_iv_idx)
+                    : tls::writev( m_ssl, m_iv + m_iv_idx, m_iv_count - m_iv_idx );
+        } else if ( m_iv_idx < m_iv_count ) {
+            // 先发送文件之前的内容，MSG_MORE让内核暂不发出这个不满的分段，与随后sendfile的文件内容合并在第一个分段中
+            struct msghdr msg;
+            bzero( &msg, sizeof( msg ) );
+            msg.msg_iov = m_iv + m_iv_idx;
+            msg.msg_iovlen = m_iv_count - m_iv_idx;
+            temp = sendmsg( m_sockfd, &msg, MSG_MORE );
+        } else {
+            // 文件内容直接从页缓存发送到socket，不经过用户态映射，m_file_offset由sendfile推进
+            temp = sendfile( m_sockfd, m_sendfile_fd, &m_file_offset, m_bytes_to_send );
+            if ( temp == 0 ) {
+                // 文件在发送过程中被截断
+                unmap();
+                return false;
+            }
+        }
         if ( temp <= -1 ) {
             // 如果TCP写缓冲没有空间，则等待下一轮EPOLLOUT事件，虽然在此期间，
             // 服务器无法立即接收到同一客户的下一个请求，但可以保证连接的完整性。
+            // 已发送的进度保存在m_iv、m_file_offset和m_bytes_to_send中，下一轮从断点继续
             if( errno == EAGAIN ) {
-                modfd( m_epollfd, m_sockfd, EPOLLOUT );
+                metrics::add( METRIC_WRITE_STALLS, 1 );
+                modfd( m_epollfd, m_sockfd, EPOLLOUT, handle() );
                 return true;
             }
             unmap();
             return false;
         }
-        bytes_to_send -= temp;
-        bytes_have_send += temp;
-        if ( bytes_to_send <= bytes_have_send ) {
+        bytes_sent( temp );
+        if ( m_bytes_to_send <= 0 ) {
             // 发送HTTP响应成功，根据HTTP请求中的Connection字段决定是否立即关闭连接
-            unmap();
-            if(m_linger) {
-                init();
-                modfd( m_epollfd, m_sockfd, EPOLLIN );
-                return true;
-            } else {
-                modfd( m_epollfd, m_sockfd, EPOLLIN );
+            if ( !finish_write() ) {
                 return false;
-            } 
+            }
+            if ( pending_input() || m_proxy_buf ) {
+                // 读缓冲区中还有流水线请求，不重新注册EPOLLIN，由反应堆直接再次交给线程池；或者由反应堆开始转发
+                return true;
+            }
+            modfd( m_epollfd, m_sockfd, EPOLLIN, handle() );
+            return true;
+        }
+    }
+}
+
+// 一批应答发送完毕，释放文件和缓冲区，返回是否保持连接
+bool http_conn::finish_write() {
+    unmap();
+    bool keep_alive = m_keep_alive;
+    reset_write();
+    release_buffers();
+    return keep_alive;
+}
+
+// 由外部（io_uring）发送了len字节，全部发完时同write()一样结束这一批应答，返回是否保持连接
+bool http_conn::sent( int len ) {
+    bytes_sent( len );
+    if ( m_bytes_to_send > 0 ) {
+        // 没有一次发完，等内核再次完成发送
+        metrics::add( METRIC_WRITE_STALLS, 1 );
+        return true;
+    }
+    return finish_write();
+}
+
+// 记录本次发送的字节数，并把m_iv调整到第一个未发送的字节
+void http_conn::bytes_sent( int len ) {
+    m_bytes_have_send += len;
+    metrics::add( METRIC_BYTES_OUT, len );
+    m_bytes_to_send -= len;
+    while ( m_iv_idx < m_iv_count && len > 0 ) {
+        struct iovec& iv = m_iv[ m_iv_idx ];
+        int n = len < ( int )iv.iov_len ? len : iv.iov_len;
+        iv.iov_base = ( char* )iv.iov_base + n;
+        iv.iov_len -= n;
+        len -= n;
+        if ( iv.iov_len == 0 ) {
+            ++m_iv_idx;
         }
     }
 }
 
+void http_conn::add_iv( char* base, int len ) {
+    if ( len <= 0 ) {
+        return;
+    }
+    if ( m_iv_count > 0 ) {
+        struct iovec& last = m_iv[ m_iv_count - 1 ];
+        if ( ( char* )last.iov_base + last.iov_len == base ) {
+            last.iov_len += len;
+            m_bytes_to_send += len;
+            return;
+        }
+    }
+    m_iv[ m_iv_count ].iov_base = base;
+    m_iv[ m_iv_count ].iov_len = len;
+    m_iv_count++;
+    m_bytes_to_send += len;
+}
+
 // 往写缓冲中写入待发送的数据
 bool http_conn::add_response( const char* format, ... ) {
     if( m_write_idx >= WRITE_BUFFER_SIZE ) {
@@ -384,104 +1267,661 @@ bool http_conn::add_response( const char* format, ... ) {
     return true;
 }
 
+// 往写缓冲中追加一段内容固定的数据，同add_response一样至少留出1个字节
+bool http_conn::add_bytes( const char* data, int len ) {
+    if( len >= WRITE_BUFFER_SIZE - 1 - m_write_idx ) {
+        return false;
+    }
+    memcpy( m_write_buf + m_write_idx, data, len );
+    m_write_idx += len;
+    return true;
+}
+
 bool http_conn::add_status_line( int status, const char* title ) {
+    const http_fragment* line = http_status_line( status );
+    if( line ) {
+        return add_bytes( line->data, line->len );
+    }
     return add_response( "%s %d %s\r\n", "HTTP/1.1", status, title );
 }
 
 bool http_conn::add_headers(int content_len) {
-    add_content_length(content_len);
-    add_content_type();
-    add_linger();
-    add_blank_line();
+    return add_date() && add_content_length(content_len) && add_content_type()
+            && add_content_encoding() && add_linger() && add_blank_line();
+}
+
+bool http_conn::add_date() {
+    if( HTTP_DATE_LEN >= WRITE_BUFFER_SIZE - 1 - m_write_idx ) {
+        return false;
+    }
+    copy_http_date( m_write_buf + m_write_idx );
+    m_write_idx += HTTP_DATE_LEN;
+    return true;
 }
 
-bool http_conn::add_content_length(int content_len) {
-    return add_response( "Content-Length: %d\r\n", content_len );
+bool http_conn::add_content_length(off_t content_len) {
+    // "Content-Length: " + 最多20位数字 + "\r\n"
+    static const char name[] = "Content-Length: ";
+    const int name_len = sizeof( name ) - 1;
+    if( name_len + 20 + 2 >= WRITE_BUFFER_SIZE - 1 - m_write_idx ) {
+        return false;
+    }
+    char* p = m_write_buf + m_write_idx;
+    memcpy( p, name, name_len );
+    p += name_len;
+    p += format_uint( p, ( unsigned long )content_len );
+    *p++ = '\r';
+    *p++ = '\n';
+    m_write_idx = p - m_write_buf;
+    return true;
+}
+
+bool http_conn::add_content_encoding()
+{
+    if ( m_encoding >= 0 && !add_bytes( HTTP_CONTENT_ENCODING[ m_encoding ].data, HTTP_CONTENT_ENCODING[ m_encoding ].len ) ) {
+        return false;
+    }
+    return add_vary();
+}
+
+bool http_conn::add_vary()
+{
+    return !m_vary || add_bytes( HTTP_VARY_ACCEPT_ENCODING.data, HTTP_VARY_ACCEPT_ENCODING.len );
+}
+
+bool http_conn::add_etag()
+{
+    return add_bytes( "ETag: ", 6 ) && add_bytes( m_etag, m_etag_len ) && add_blank_line();
+}
+
+// 校验器在加载文件时已经生成，这里只是复制
+bool http_conn::add_validators()
+{
+    return add_etag() && add_bytes( "Last-Modified: ", 15 )
+            && add_bytes( m_file_entry->last_modified, HTTP_DATE_VALUE_LEN ) && add_blank_line()
+            && add_bytes( HTTP_ACCEPT_RANGES.data, HTTP_ACCEPT_RANGES.len );
+}
+
+bool http_conn::add_content_range( off_t first, off_t last )
+{
+    // "Content-Range: bytes " + 三个最多20位的数字 + "-/\r\n"
+    static const char name[] = "Content-Range: bytes ";
+    const int name_len = sizeof( name ) - 1;
+    if( name_len + 3 * 20 + 4 >= WRITE_BUFFER_SIZE - 1 - m_write_idx ) {
+        return false;
+    }
+    char* p = m_write_buf + m_write_idx;
+    memcpy( p, name, name_len );
+    p += name_len;
+    if ( first < 0 ) {
+        *p++ = '*';
+    } else {
+        p += format_uint( p, ( unsigned long )first );
+        *p++ = '-';
+        p += format_uint( p, ( unsigned long )last );
+    }
+    *p++ = '/';
+    p += format_uint( p, ( unsigned long )m_file_size );
+    *p++ = '\r';
+    *p++ = '\n';
+    m_write_idx = p - m_write_buf;
+    return true;
 }
 
 bool http_conn::add_linger()
 {
-    return add_response( "Connection: %s\r\n", ( m_linger == true ) ? "keep-alive" : "close" );
+    const http_fragment& f = m_linger ? HTTP_CONNECTION_KEEP_ALIVE : HTTP_CONNECTION_CLOSE;
+    return add_bytes( f.data, f.len );
 }
 
 bool http_conn::add_blank_line()
 {
-    return add_response( "%s", "\r\n" );
+    return add_bytes( HTTP_CRLF.data, HTTP_CRLF.len );
 }
 
 bool http_conn::add_content( const char* content )
 {
-    return add_response( "%s", content );
+    return add_bytes( content, strlen( content ) );
+}
+
+// 统计在生成应答时汇总到m_body_buf中，同一批中后面的应答不会覆盖它：process_requests在它之后就结束这一批
+bool http_conn::add_metrics() {
+    int head = m_write_idx;
+    int size = 0;
+    m_body_buf = buffer_pool::instance()->acquire( BODY_BUFFER_SIZE, &size );
+    if ( !m_body_buf ) {
+        return false;
+    }
+    int len = metrics::render( m_body_buf, BODY_BUFFER_SIZE );
+    if ( len < 0 || !add_status_line( 200, ok_200_title ) || !add_date() || !add_content_length( len )
+            || !add_bytes( HTTP_CONTENT_TYPE_METRICS.data, HTTP_CONTENT_TYPE_METRICS.len )
+            || !add_linger() || !add_blank_line() ) {
+        buffer_pool::instance()->release( m_body_buf, BODY_BUFFER_SIZE );
+        m_body_buf = NULL;
+        m_write_idx = head;
+        return false;
+    }
+    add_iv( m_write_buf + head, m_write_idx - head );
+    add_iv( m_body_buf, len );
+    return true;
+}
+
+bool http_conn::add_file_headers( off_t content_length, const byte_range* range ) {
+    return add_date() && add_content_length( content_length ) && add_content_type() && add_content_encoding()
+            && add_validators() && ( !range || add_content_range( range->first, range->last ) )
+            && add_linger() && add_blank_line();
+}
+
+// 响应头已经在写缓冲区中，文件缓存项已转入m_file_entries
+bool http_conn::add_file( off_t offset, off_t len ) {
+    // 大文件（以及缓存中没有映射的文件）用sendfile发送文件内容，加载时压缩的版本只在内存中
+    if ( len > 0 && m_file_fd >= 0 && socket_send() && ( !m_file_address
+            || ( m_sendfile_threshold >= 0 && m_file_size >= m_sendfile_threshold ) ) ) {
+        m_sendfile = true;
+        m_sendfile_fd = m_file_fd;
+        m_file_offset = offset;
+        m_bytes_to_send += len;
+        return true;
+    }
+    if ( len > 0 && !m_file_address ) {
+        // 用户态TLS只能从映射发送，启动时已经取消了映射的大小限制，这里只剩映射失败的文件
+        return false;
+    }
+    add_iv( m_file_address + offset, len );
+    return true;
+}
+
+/*
+    小文件的完整应答（状态行、头部和内容）在缓存项中有一份预先生成的，命中时整个复制进写缓冲区，
+    只改写其中的Date，不格式化任何头部，也不引用文件的映射，与这一批的其他应答合并在同一块内存中发出
+*/
+bool http_conn::add_prerendered() {
+    file_cache::response* r = m_file_entry->responses[ m_encoding + 1 ][ m_linger ].load( std::memory_order_acquire );
+    if ( !r || r->len >= WRITE_BUFFER_SIZE - m_write_idx ) {
+        return false;
+    }
+    char* p = m_write_buf + m_write_idx;
+    memcpy( p, r->data(), r->len );
+    copy_http_date( p + r->date );
+    m_write_idx += r->len;
+    add_iv( p, r->len );
+    // 应答已经复制出来，缓存项不需要保留到发送完毕
+    file_cache::instance()->release( m_file_entry );
+    m_file_entry = NULL;
+    return true;
+}
+
+// 这个版本第一次发送完整应答时调用，多个线程同时生成时只保留先发布的一份
+void http_conn::prerender( int head ) {
+    if ( m_prerender_size <= 0 || m_file_size > m_prerender_size || ( m_file_size > 0 && !m_file_address ) ) {
+        return;
+    }
+    std::atomic< file_cache::response* >& slot = m_file_entry->responses[ m_encoding + 1 ][ m_linger ];
+    if ( slot.load( std::memory_order_relaxed ) ) {
+        return;
+    }
+    int head_len = m_write_idx - head;
+    int size = 0;
+    file_cache::response* r = ( file_cache::response* )response_arena::instance()->alloc(
+            sizeof( file_cache::response ) + head_len + m_file_size, &size );
+    if ( !r ) {
+        return;
+    }
+    r->len = head_len + m_file_size;
+    r->size = size;
+    r->date = http_status_line( 200 )->len;     // add_file_headers()的第一个头部就是Date
+    memcpy( r->data(), m_write_buf + head, head_len );
+    memcpy( r->data() + head_len, m_file_address, m_file_size );
+    file_cache::response* expected = NULL;
+    if ( !slot.compare_exchange_strong( expected, r, std::memory_order_release, std::memory_order_relaxed ) ) {
+        response_arena::instance()->free( ( char* )r, size );
+    }
+}
+
+/*
+    多区间的应答：先把各段的分隔行和头部依次写进写缓冲区，再写整个应答的响应头，
+    这样写响应头时已经知道内容的总长度。m_iv依次是响应头、各段的头部和文件中的区间、结束分隔行。
+*/
+bool http_conn::add_multipart() {
+    if ( m_iv_count + 2 * m_range_count + 2 > MAX_IOV ) {
+        return false;
+    }
+    int head = m_write_idx;
+    int parts[ MAX_RANGES + 1 ];    // 各段头部在写缓冲区中的起始位置，最后一个是结束分隔行
+    long content_length = 0;
+    for ( int i = 0; i < m_range_count; ++i ) {
+        parts[ i ] = m_write_idx;
+        if ( !add_bytes( HTTP_BYTERANGES_PART.data, HTTP_BYTERANGES_PART.len ) || !add_content_type()
+                || !add_content_range( m_ranges[i].first, m_ranges[i].last ) || !add_blank_line() ) {
+            m_write_idx = head;
+            return false;
+        }
+        content_length += m_write_idx - parts[ i ] + m_ranges[i].last - m_ranges[i].first + 1;
+    }
+    parts[ m_range_count ] = m_write_idx;
+    if ( !add_bytes( HTTP_BYTERANGES_END.data, HTTP_BYTERANGES_END.len ) ) {
+        m_write_idx = head;
+        return false;
+    }
+    content_length += HTTP_BYTERANGES_END.len;
+
+    int status = m_write_idx;
+    if ( !add_status_line( 206, "Partial Content" ) || !add_date() || !add_content_length( content_length )
+            || !add_bytes( HTTP_CONTENT_TYPE_BYTERANGES.data, HTTP_CONTENT_TYPE_BYTERANGES.len )
+            || !add_vary() || !add_validators() || !add_linger() || !add_blank_line() ) {
+        m_write_idx = head;
+        return false;
+    }
+    add_iv( m_write_buf + status, m_write_idx - status );
+    for ( int i = 0; i < m_range_count; ++i ) {
+        add_iv( m_write_buf + parts[ i ], parts[ i + 1 ] - parts[ i ] );
+        add_iv( m_file_address + m_ranges[i].first, m_ranges[i].last - m_ranges[i].first + 1 );
+    }
+    add_iv( m_write_buf + parts[ m_range_count ], HTTP_BYTERANGES_END.len );
+    return true;
 }
 
 bool http_conn::add_content_type() {
-    return add_response("Content-Type:%s\r\n", "text/html");
+    const http_fragment& f = m_content_type ? *m_content_type : HTTP_CONTENT_TYPE_HTML;
+    return add_bytes( f.data, f.len );
+}
+
+// 逐跳的头部只对客户端到本服务器这一段连接有意义，不转发给后端
+static bool hop_by_hop( const char* name, int len ) {
+    switch ( len ) {
+        case 2:
+            return header_name_is( name, len, "te", 2 );
+        case 6:
+            return header_name_is( name, len, "expect", 6 );
+        case 7:
+            return header_name_is( name, len, "trailer", 7 ) || header_name_is( name, len, "upgrade", 7 );
+        case 10:
+            return header_name_is( name, len, "connection", 10 ) || header_name_is( name, len, "keep-alive", 10 );
+        case 16:
+            return header_name_is( name, len, "proxy-connection", 16 );
+        case 17:
+            return header_name_is( name, len, "transfer-encoding", 17 );
+        default:
+            return false;
+    }
+}
+
+// 客户端在Connection头部中列出的其他头部也是逐跳的（RFC 9110 7.6.1），比如Connection: close, X-Trace
+static bool connection_option( const char* base, const http_header* headers, int count, const char* name, int len ) {
+    for ( int i = 0; i < count; ++i ) {
+        if ( !header_name_is( base + headers[i].name, headers[i].name_len, "connection", 10 ) ) {
+            continue;
+        }
+        const char* p = base + headers[i].value;
+        while ( *p ) {
+            while ( *p == ' ' || *p == '\t' || *p == ',' ) {
+                ++p;
+            }
+            const char* token = p;
+            while ( *p && *p != ' ' && *p != '\t' && *p != ',' ) {
+                ++p;
+            }
+            if ( p - token == len && strncasecmp( token, name, len ) == 0 ) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+/*
+    转发给后端的请求：请求行、去掉逐跳头部的请求头、X-Forwarded-For，以及读缓冲区中已有的那部分请求体，
+    请求体的其余部分（m_proxy_body字节）还在socket中，由反应堆直接splice给后端
+*/
+bool http_conn::add_proxy_request() {
+    static const char* method_names[] = { "GET", "POST", "HEAD", "PUT", "DELETE", "TRACE", "OPTIONS", "CONNECT" };
+    const upstream::route& r = upstream::get( m_proxy_route );
+    const char* base = m_read_buf + m_req_start;
+    off_t prefix = m_read_idx - m_checked_idx;
+    if ( prefix > m_content_length ) {
+        prefix = m_content_length;
+    }
+    int url_len = strlen( m_url );
+    int need = url_len + prefix + 256;
+    for ( int i = 0; i < m_header_count; ++i ) {
+        need += m_headers[i].name_len + m_headers[i].value_len + 4;
+    }
+    m_proxy_buf = buffer_pool::instance()->acquire( need, &m_proxy_size );
+    if ( !m_proxy_buf ) {
+        return false;
+    }
+
+    char* p = m_proxy_buf;
+    int len = strlen( method_names[ m_method ] );
+    memcpy( p, method_names[ m_method ], len );
+    p += len;
+    *p++ = ' ';
+    memcpy( p, m_url, url_len );
+    p += url_len;
+    memcpy( p, " HTTP/1.1\r\n", 11 );
+    p += 11;
+    for ( int i = 0; i < m_header_count; ++i ) {
+        const http_header& h = m_headers[i];
+        if ( hop_by_hop( base + h.name, h.name_len )
+                || connection_option( base, m_headers, m_header_count, base + h.name, h.name_len ) ) {
+            continue;
+        }
+        memcpy( p, base + h.name, h.name_len );
+        p += h.name_len;
+        *p++ = ':';
+        *p++ = ' ';
+        memcpy( p, base + h.value, h.value_len );
+        p += h.value_len;
+        *p++ = '\r';
+        *p++ = '\n';
+    }
+    if ( !m_host ) {
+        p += sprintf( p, "Host: %s\r\n", r.host );
+    }
+    char addr[ INET_ADDRSTRLEN ];
+    inet_ntop( AF_INET, &m_address.sin_addr, addr, sizeof( addr ) );
+    p += sprintf( p, "X-Forwarded-For: %s\r\n\r\n", addr );
+    memcpy( p, m_read_buf + m_checked_idx, prefix );
+    p += prefix;
+    m_checked_idx += prefix;
+    m_start_line = m_checked_idx;
+    m_proxy_len = p - m_proxy_buf;
+
+    m_proxy_body = m_content_length - prefix;
+    m_proxy_linger = m_linger;
+    m_proxy_method = m_method;
+    m_proxy_start = metrics::now_ns();
+    strcpy( m_url_buf, m_url );
+    if ( m_expect_continue && m_proxy_body > 0 ) {
+        // 不把Expect转发给后端，由这里回复100 Continue
+        send_continue();
+    }
+    return true;
+}
+
+void http_conn::end_proxy() {
+    if ( m_proxy_buf ) {
+        buffer_pool::instance()->release( m_proxy_buf, m_proxy_size );
+        m_proxy_buf = NULL;
+    }
+    m_upstream = NULL;
+    release_buffers();
 }
 
 // 根据服务器处理HTTP请求的结果，决定返回给客户端的内容
+// 应答追加在写缓冲区和m_iv已有的内容之后；失败时撤销本次追加的内容
 bool http_conn::process_write(HTTP_CODE ret) {
+    if ( !m_write_buf ) {
+        // 这一批的第一个应答，从池中取写缓冲区
+        int size = 0;
+        m_write_buf = buffer_pool::instance()->acquire( WRITE_BUFFER_SIZE, &size );
+        if ( !m_write_buf ) {
+            return false;
+        }
+    }
+    int head = m_write_idx;
+    bool ok = true;
     switch (ret)
     {
         case INTERNAL_ERROR:
-            add_status_line( 500, error_500_title );
-            add_headers( strlen( error_500_form ) );
-            if ( ! add_content( error_500_form ) ) {
-                return false;
-            }
+            ok = add_status_line( 500, error_500_title ) && add_headers( strlen( error_500_form ) )
+                    && add_content( error_500_form );
             break;
         case BAD_REQUEST:
-            add_status_line( 400, error_400_title );
-            add_headers( strlen( error_400_form ) );
-            if ( ! add_content( error_400_form ) ) {
-                return false;
-            }
+            ok = add_status_line( 400, error_400_title ) && add_headers( strlen( error_400_form ) )
+                    && add_content( error_400_form );
             break;
         case NO_RESOURCE:
-            add_status_line( 404, error_404_title );
-            add_headers( strlen( error_404_form ) );
-            if ( ! add_content( error_404_form ) ) {
-                return false;
-            }
+            ok = add_status_line( 404, error_404_title ) && add_headers( strlen( error_404_form ) )
+                    && add_content( error_404_form );
             break;
         case FORBIDDEN_REQUEST:
-            add_status_line( 403, error_403_title );
-            add_headers(strlen( error_403_form));
-            if ( ! add_content( error_403_form ) ) {
-                return false;
+            ok = add_status_line( 403, error_403_title ) && add_headers(strlen( error_403_form))
+                    && add_content( error_403_form );
+            break;
+        case BODY_TOO_LARGE:
+            ok = add_status_line( 413, error_413_title ) && add_headers( strlen( error_413_form ) )
+                    && add_content( error_413_form );
+            break;
+        case LENGTH_REQUIRED:
+            ok = add_status_line( 411, error_411_title ) && add_headers( strlen( error_411_form ) )
+                    && add_content( error_411_form );
+            break;
+        case URI_TOO_LONG:
+            ok = add_status_line( 414, error_414_title ) && add_headers( strlen( error_414_form ) )
+                    && add_content( error_414_form );
+            break;
+        case PROXY_REQUEST:
+            // 应答由反应堆从后端转发，不占用写缓冲区
+            ok = add_proxy_request();
+            if ( !ok ) {
+                break;
             }
+            return true;
+        case BODY_REQUEST:
+            // 处理者给的状态码不在预生成的状态行中时，原因短语为空
+            ok = add_status_line( m_body_status, "" ) && add_headers( strlen( m_body_message ) )
+                    && add_content( m_body_message );
             break;
+        case PARTIAL_CONTENT:
+            if ( m_range_count > 1 ) {
+                // 多区间的应答在这一批中放不下时发送整个文件
+                if ( add_multipart() ) {
+                    m_file_entries[ m_file_count++ ] = m_file_entry;
+                    m_file_entry = NULL;
+                    return true;
+                }
+            } else {
+                const byte_range& range = m_ranges[0];
+                ok = add_status_line( 206, "Partial Content" ) && add_file_headers( range.last - range.first + 1, &range );
+                if ( !ok ) {
+                    break;
+                }
+                add_iv( m_write_buf + head, m_write_idx - head );
+                m_file_entries[ m_file_count++ ] = m_file_entry;
+                m_file_entry = NULL;
+                return add_file( range.first, range.last - range.first + 1 );
+            }
+            // fall through
         case FILE_REQUEST:
-            add_status_line(200, ok_200_title );
-            add_headers(m_file_stat.st_size);
-            m_iv[ 0 ].iov_base = m_write_buf;
-            m_iv[ 0 ].iov_len = m_write_idx;
-            m_iv[ 1 ].iov_base = m_file_address;
-            m_iv[ 1 ].iov_len = m_file_stat.st_size;
-            m_iv_count = 2;
+            if ( add_prerendered() ) {
+                return true;
+            }
+            ok = add_status_line(200, ok_200_title ) && add_file_headers( m_file_size, NULL );
+            if ( !ok ) {
+                break;
+            }
+            prerender( head );
+            add_iv( m_write_buf + head, m_write_idx - head );
+            m_file_entries[ m_file_count++ ] = m_file_entry;
+            m_file_entry = NULL;
+            return add_file( 0, m_file_size );
+        case NOT_MODIFIED:
+            // 304没有内容，只带上ETag和Vary，供缓存更新它保存的应答
+            ok = add_status_line( 304, "Not Modified" ) && add_date() && add_etag() && add_vary()
+                    && add_linger() && add_blank_line();
+            file_cache::instance()->release( m_file_entry );
+            m_file_entry = NULL;
+            break;
+        case RANGE_NOT_SATISFIABLE:
+            ok = add_status_line( 416, "Range Not Satisfiable" ) && add_date() && add_content_length( 0 )
+                    && add_content_range( -1, -1 ) && add_linger() && add_blank_line();
+            file_cache::instance()->release( m_file_entry );
+            m_file_entry = NULL;
+            break;
+        case METRICS_REQUEST:
+            ok = add_metrics();
+            if ( !ok ) {
+                break;
+            }
             return true;
         default:
-            return false;
+            ok = false;
+            break;
     }
 
-    m_iv[ 0 ].iov_base = m_write_buf;
-    m_iv[ 0 ].iov_len = m_write_idx;
-    m_iv_count = 1;
+    if ( !ok ) {
+        m_write_idx = head;
+        if ( m_file_entry ) {
+            file_cache::instance()->release( m_file_entry );
+            m_file_entry = NULL;
+        }
+        return false;
+    }
+    add_iv( m_write_buf + head, m_write_idx - head );
+    return true;
+}
+
+// 应答的状态码，与process_write中的选择一致
+static int response_status( http_conn::HTTP_CODE code ) {
+    switch ( code ) {
+        case http_conn::FILE_REQUEST:
+        case http_conn::METRICS_REQUEST:
+            return 200;
+        case http_conn::PARTIAL_CONTENT:
+            return 206;
+        case http_conn::NOT_MODIFIED:
+            return 304;
+        case http_conn::RANGE_NOT_SATISFIABLE:
+            return 416;
+        case http_conn::BODY_TOO_LARGE:
+            return 413;
+        case http_conn::LENGTH_REQUIRED:
+            return 411;
+        case http_conn::URI_TOO_LONG:
+            return 414;
+        case http_conn::BAD_REQUEST:
+            return 400;
+        case http_conn::FORBIDDEN_REQUEST:
+            return 403;
+        case http_conn::NO_RESOURCE:
+            return 404;
+        default:
+            return 500;
+    }
+}
+
+void http_conn::send_overload() {
+    if ( m_h2 ) {
+        return;
+    }
+    if ( socket_send() ) {
+        send( m_sockfd, HTTP_RESPONSE_503.data, HTTP_RESPONSE_503.len, MSG_DONTWAIT | MSG_NOSIGNAL );
+    } else {
+        struct iovec iv;
+        iv.iov_base = ( void* )HTTP_RESPONSE_503.data;
+        iv.iov_len = HTTP_RESPONSE_503.len;
+        tls::writev( m_ssl, &iv, 1 );
+    }
+}
+
+bool http_conn::pending_input() const {
+    return m_read_idx > 0 || tls_pending() || ( m_h2 && m_h2->want_write() );
+}
+
+// h2c升级：101、服务端的SETTINGS和这个请求（流1）的应答作为这一批，之后的数据都按HTTP/2处理
+bool http_conn::upgrade_h2( HTTP_CODE ret, uint64_t start ) {
+    m_h2 = http2_session::create( this );
+    if ( !m_h2 ) {
+        return false;
+    }
+    if ( !m_h2->upgrade( m_h2_settings, ret, start ) ) {
+        http2_session::destroy( m_h2 );
+        m_h2 = NULL;
+        return false;
+    }
+    m_h2_preface = false;
+    m_req_start = m_checked_idx;
+    init_request();
     return true;
 }
 
 // 由线程池中的工作线程调用，这是处理HTTP请求的入口函数
+// 依次解析读缓冲区中的所有完整请求（流水线），把它们的应答放进同一批，最后一次性交给反应堆发送
 void http_conn::process() {
-    // 解析HTTP请求
-    HTTP_CODE read_ret = process_read();
-    if ( read_ret == NO_REQUEST ) {
-        modfd( m_epollfd, m_sockfd, EPOLLIN );
-        return;
+    bool ready = process_requests();
+    // 用户态TLS：读缓冲区满时解密出的数据还有一部分留在SSL中，不会再有EPOLLIN，处理完已读入的请求后在这里接着读；
+    // 读取失败时像请求出错一样没有应答，由反应堆关闭连接
+    while ( !ready && tls_pending() ) {
+        ready = !read() || process_requests();
     }
-    
-    // 生成响应
-    bool write_ret = process_write( read_ret );
-    if ( !write_ret ) {
-        close_conn();
+
+    // 先重新注册事件再归还给反应堆：归还之前反应堆不会关闭连接（超时、平滑退出都只推迟），fd和槽位不会被新连接复用，
+    // 所以这里的EPOLL_CTL_MOD一定作用于这个连接；注册之后到达的事件由反应堆等到归还再处理
+    // 请求还不完整时继续等待数据，否则等待发送这一批应答
+    modfd( m_epollfd, m_sockfd, ready ? EPOLLOUT : EPOLLIN, handle() );
+    m_in_worker.store( false, std::memory_order_release );
+}
+
+bool http_conn::process_requests() {
+    if ( m_h2 ) {
+        return m_h2->process();
+    }
+    if ( m_h2_preface && m_read_idx > m_req_start ) {
+        // 明文连接的第一个请求之前先看是不是HTTP/2的连接前言（prior knowledge），不够长时等待更多数据
+        int preface = http2_session::match_preface( m_read_buf + m_req_start, m_read_idx - m_req_start );
+        if ( preface == 0 ) {
+            return false;
+        } else if ( preface > 0 ) {
+            m_h2_preface = false;
+            m_h2 = http2_session::create( this );
+            if ( !m_h2 ) {
+                m_keep_alive = false;
+                return true;
+            }
+            return m_h2->process();
+        }
+    }
+    int responses = 0;
+    bool failed = false;
+    while ( true ) {
+        // 解析HTTP请求，只统计解析出了结果的请求，等待更多数据的那一次不计时
+        uint64_t start = metrics::now_ns();
+        HTTP_CODE read_ret = process_read();
+        if ( read_ret == NO_REQUEST ) {
+            break;
+        }
+        metrics::request( read_ret, metrics::now_ns() - start );
+        if ( m_draining.load( std::memory_order_relaxed ) || read_ret == BAD_REQUEST ) {
+            // 平滑退出时让客户端换一个连接发送后面的请求（热升级时会连到新进程上）；
+            // 语法错误的请求之后无法确定下一个请求从哪里开始，发完应答就关闭连接。两者都要在生成应答之前清除，应答中才是Connection: close
+            m_linger = false;
+        } else if ( m_h2c && m_h2_settings && m_method == GET && m_content_length == 0 && !m_chunked
+                && upgrade_h2( read_ret, start ) ) {
+            // 读缓冲区中接下来是客户端的连接前言
+            return m_h2->process();
+        }
+        m_h2_preface = false;
+
+        // 生成响应
+        off_t queued = m_bytes_to_send;
+        bool write_ret = process_write( read_ret );
+        m_req_start = m_checked_idx;    // 这个请求的数据已经处理完，下一个请求从这里开始
+        if ( !write_ret ) {
+            // 连接只由所属的反应堆关闭（它还要删除定时器），这里让write()在发完已生成的应答后通知反应堆关闭
+            m_keep_alive = false;
+            failed = true;
+            break;
+        }
+        ++responses;
+        if ( read_ret == PROXY_REQUEST ) {
+            // 转发的请求在应答转发完时记录访问日志，是否保持连接也由那时决定
+            m_keep_alive = true;
+            init_request();
+            break;
+        }
+        // 访问日志只把原始字段放进本线程的环形缓冲区，格式化和写文件由日志线程完成
+        LOG_ACCESS( m_address.sin_addr.s_addr, m_address.sin_port, m_method, m_url,
+                read_ret == BODY_REQUEST ? m_body_status : response_status( read_ret ),
+                m_bytes_to_send - queued, metrics::now_ns() - start );
+        m_keep_alive = m_linger;
+        init_request();
+        // 客户端要求关闭连接、文件要用sendfile发送或者应答内容在m_body_buf中（只能是最后一个）、或者这一批已经放不下更多应答时，先发送这一批
+        if ( !m_keep_alive || m_sendfile || m_body_buf || responses >= MAX_PIPELINE || m_iv_count + 2 > MAX_IOV
+                || WRITE_BUFFER_SIZE - m_write_idx < MAX_RESPONSE_HEAD ) {
+            break;
+        }
     }
-    modfd( m_epollfd, m_sockfd, EPOLLOUT);
+    compact_read_buf();
+    return responses > 0 || failed;
 }
\ No newline at end of file
@@ -19,16 +19,43 @@
 #include <stdarg.h>
 #include <errno.h>
 #include "locker.h"
+#include "file_cache.h"
+#include "timer_wheel.h"
+#include "http_parser.h"
+#include "buffer_pool.h"
+#include "http_response.h"
+#include "metrics.h"
+#include "logger.h"
+#include "body_handler.h"
+#include "conn_arena.h"
+#include "tls.h"
+#include <atomic>
 #include <sys/uio.h>
+#include <sys/sendfile.h>
+
+struct upstream_conn;
+class http2_session;
 
 class http_conn
 {
+    friend class upstream_pool;
+    friend class http2_session;
 public:
     static const int FILENAME_LEN = 200;        // 文件名的最大长度
-    static const int READ_BUFFER_SIZE = 2048;   // 读缓冲区的大小
-    static const int WRITE_BUFFER_SIZE = 1024;  // 写缓冲区的大小
+    static const int READ_BUFFER_SIZE = 2048;   // 读缓冲区的初始大小，放不下一个请求时逐级翻倍
+    static const int MAX_READ_BUFFER_SIZE = buffer_pool::MAX_SIZE;  // 读缓冲区的最大大小，请求（头部）超过它时关闭连接
+    static const int WRITE_BUFFER_SIZE = 4096;  // 写缓冲区的大小
+    static const int MAX_PIPELINE = 16;         // 一批最多应答的流水线请求数
+    static const int MAX_IOV = 2 * MAX_PIPELINE;    // 每个应答最多占两块内存：响应头和文件
+    static const int MAX_RESPONSE_HEAD = 384;   // 写缓冲区剩余空间少于该值时不再追加下一个应答
+    static const int MAX_HEADERS = 32;          // 一个请求最多的头部个数
+    static const int BODY_BUFFER_SIZE = 16384;  // 由内存生成的应答内容（/metrics）的缓冲区大小
+    static const int MAX_RANGES = 8;            // Range请求最多的区间数，超过时忽略Range、发送整个文件
+    static const int BODY_READ_BUFFER_SIZE = 16384;     // 接收请求体时读缓冲区的大小，请求体按这个大小分块交给处理者
+    static const int SPLICE_CHUNK = 65536;      // 每次splice的最大字节数，不超过管道的容量
+    static const int MAX_PRERENDER_SIZE = 3072; // m_prerender_size的上限，应答要能放进response_arena的一块和一个写缓冲区
     
-    // HTTP请求方法，这里只支持GET
+    // HTTP请求方法，这里支持GET、POST和PUT
     enum METHOD {GET = 0, POST, HEAD, PUT, DELETE, TRACE, OPTIONS, CONNECT};
     
     /*
@@ -38,6 +65,15 @@ public:
         CHECK_STATE_CONTENT:当前正在解析请求体
     */
     enum CHECK_STATE { CHECK_STATE_REQUESTLINE = 0, CHECK_STATE_HEADER, CHECK_STATE_CONTENT };
+
+    /*
+        分块编码（Transfer-Encoding: chunked）的请求体中正在解析的部分
+        CHUNK_SIZE      :   块大小所在的行
+        CHUNK_DATA      :   块的数据，还剩m_body_remaining字节
+        CHUNK_DATA_END  :   块数据之后的空行
+        CHUNK_TRAILER   :   最后一个（大小为0的）块之后的尾部字段，直到空行
+    */
+    enum CHUNK_STATE { CHUNK_SIZE = 0, CHUNK_DATA, CHUNK_DATA_END, CHUNK_TRAILER };
     
     /*
         服务器处理HTTP请求的可能结果，报文解析的结果
@@ -49,74 +85,271 @@ public:
         FILE_REQUEST        :   文件请求,获取文件成功
         INTERNAL_ERROR      :   表示服务器内部错误
         CLOSED_CONNECTION   :   表示客户端已经关闭连接了
+        METRICS_REQUEST     :   请求的是/metrics，应答内容由内存中的统计生成
+        NOT_MODIFIED        :   条件请求（If-None-Match、If-Modified-Since）的文件没有变化，回复不带内容的304
+        PARTIAL_CONTENT     :   Range请求，只发送文件中请求的区间
+        RANGE_NOT_SATISFIABLE   :   Range请求的区间都超出了文件，回复416
+        BODY_REQUEST        :   POST、PUT的请求体已全部交给处理者，应答的状态码和内容由处理者决定
+        BODY_TOO_LARGE      :   请求体超过了m_max_body_size，回复413
+        PROXY_REQUEST       :   URL匹配反向代理的路由，请求交给反应堆转发给后端，应答也由它转发
+        LENGTH_REQUIRED     :   要转发的请求体使用分块编码，回复411
+        URI_TOO_LONG        :   有请求体或者要转发的请求，URL放不下m_url_buf，回复414
     */
-    enum HTTP_CODE { NO_REQUEST, GET_REQUEST, BAD_REQUEST, NO_RESOURCE, FORBIDDEN_REQUEST, FILE_REQUEST, INTERNAL_ERROR, CLOSED_CONNECTION };
+    enum HTTP_CODE { NO_REQUEST, GET_REQUEST, BAD_REQUEST, NO_RESOURCE, FORBIDDEN_REQUEST, FILE_REQUEST, INTERNAL_ERROR, CLOSED_CONNECTION,
+            METRICS_REQUEST, NOT_MODIFIED, PARTIAL_CONTENT, RANGE_NOT_SATISFIABLE, BODY_REQUEST, BODY_TOO_LARGE,
+            PROXY_REQUEST, LENGTH_REQUIRED, URI_TOO_LONG };
     
     // 从状态机的三种可能状态，即行的读取状态，分别表示
     // 1.读取到一个完整的行 2.行出错 3.行数据尚且不完整
     enum LINE_STATUS { LINE_OK = 0, LINE_BAD, LINE_OPEN };
+
+    /*
+        连接所处的超时阶段，由反应堆维护，决定定时器使用哪一种超时时间
+        PHASE_HEADER    :   正在读取请求行和头部，从请求的第一个字节（或accept）开始计时，收到新数据也不重置，防止slowloris
+        PHASE_BODY      :   正在读取请求体，每次收到数据时重置
+        PHASE_IDLE      :   keep-alive连接在两个请求之间空闲
+        PHASE_WRITE     :   响应没有一次发完，等待客户端接收，每次发送有进展时重置
+    */
+    enum CONN_PHASE { PHASE_HEADER = 0, PHASE_BODY, PHASE_IDLE, PHASE_WRITE };
+
+    // Range请求中的一个区间，first和last都包含在内
+    struct byte_range {
+        off_t first;
+        off_t last;
+    };
 public:
-    http_conn(){}
+    /*
+        全零的字节就是一个合法的、已关闭的连接：其余成员的初值都是0、false或NULL，
+        定时器、代数这些需要非零初值的状态都由init(sockfd, ...)设置。
+        所以conn_table可以直接使用匿名映射的零页而不调用构造函数，没有用到的槽位不占用内存；构造函数只给单独创建的连接用
+    */
+    http_conn() : m_phase( PHASE_HEADER ), m_in_worker( false ), m_queued_ns( 0 ), m_sockfd( -1 ), m_open( false ), m_generation( 1 ),
+            m_read_buf( NULL ), m_read_size( 0 ), m_read_idx( 0 ), m_handler( NULL ),
+            m_write_buf( NULL ), m_file_address( 0 ), m_file_entry( NULL ), m_body_buf( NULL ), m_file_count( 0 ),
+            m_proxy_buf( NULL ), m_upstream( NULL ), m_ssl( NULL ), m_handshaking( false ), m_h2( NULL ) {}
     ~http_conn(){}
 public:
-    void init(int sockfd, const sockaddr_in& addr); // 初始化新接受的连接
+    void init(int sockfd, const sockaddr_in& addr, int epollfd); // 初始化新接受的连接，epollfd是接受该连接的反应堆的epoll对象，-1表示不使用epoll
     void close_conn();  // 关闭连接
-    void process(); // 处理客户端请求
+    void process(); // 处理客户端请求，由线程池调用，处理完后重新注册epoll事件
+    // 解析读缓冲区中的完整请求并生成一批应答，返回false表示请求还不完整、需要更多数据，
+    // 返回true时要么有应答待发送，要么（writing()为false）出错、应由调用者关闭连接
+    bool process_requests();
     bool read();// 非阻塞读
     bool write();// 非阻塞写
+    // 线程池过载时由反应堆调用：不处理读到的请求，回复预先生成的503（Connection: close），之后由反应堆关闭连接；
+    // HTTP/2连接上不能发送HTTP/1.1的应答，什么也不做，客户端会在新的连接上重试
+    void send_overload();
+
+    // 以下三个函数供自己完成收发的I/O机制（io_uring）使用，此时init()的epollfd为-1
+    bool feed( const char* data, int len );     // 追加收到的数据，请求超过读缓冲区的最大大小时返回false
+    int send_iov( struct iovec** iov ) { *iov = m_iv + m_iv_idx; return m_iv_count - m_iv_idx; }  // 待发送的内存块
+    bool sent( int len );       // 发送了len字节，这一批全部发完时返回是否保持连接，否则返回true
+    bool closed() const { return !m_open; }
+    // 连接的代数，每关闭一次加一；句柄把代数和fd放在一起，注册到epoll中，见conn_table
+    uint32_t generation() const { return m_generation.load( std::memory_order_acquire ); }
+    uint64_t handle() const { return ( ( uint64_t )generation() << 32 ) | ( uint32_t )m_sockfd; }
+    bool reading_body() const { return m_check_state == CHECK_STATE_CONTENT; }  // 请求头已读完，正在等待请求体
+    bool writing() const { return m_bytes_to_send > 0; }  // 响应还没有发送完
+    // 读缓冲区（或SSL）中还有未处理的（流水线）请求数据，或者HTTP/2的流还有窗口内可以发送的内容
+    bool pending_input() const;
+    bool proxying() const { return m_proxy_buf != NULL; }  // 这一批的最后一个请求要转发给后端，前面的应答发完后由反应堆开始转发
+    bool relaying() const { return m_upstream != NULL; }   // 正在由反应堆转发，连接上的事件都交给upstream_pool
+
+    // TLS：握手由反应堆在连接上的事件到来时调用handshake()推进，需要等待时已经重新注册了相应的事件
+    bool handshaking() const { return m_handshaking; }
+    tls::RESULT handshake();
+    // 用户态解密出的数据有一部分因为读缓冲区满还留在SSL中，socket不会再因为它们触发EPOLLIN
+    bool tls_pending() const { return m_ssl && !m_ktls_recv && tls::pending( m_ssl ); }
 private:
     void init();    // 初始化连接
+    void init_request();    // 一个请求处理完毕，为解析同一连接上的下一个请求重置状态
+    void reset_write();     // 一批应答发送完毕，清空发送状态
+    void compact_read_buf();    // 把尚未处理完的请求数据移到读缓冲区的开头
+    void move_read_data( char* buf );   // 把尚未处理完的请求数据移到buf的开头，已解析出的指针随之平移
+    bool grow_read_buf();       // 读缓冲区换成大一级的缓冲区
+    void release_buffers();     // 连接空闲时把缓冲区还给缓冲区池
+    bool reserve_read_buf();    // 保证读缓冲区中有空闲空间
+    bool finish_write();        // 一批应答发送完毕，返回是否保持连接
     HTTP_CODE process_read();    // 解析HTTP请求
     bool process_write( HTTP_CODE ret );    // 填充HTTP应答
 
     // 下面这一组函数被process_read调用以分析HTTP请求
     HTTP_CODE parse_request_line( char* text );  // 解析HTTP请求首行
-    HTTP_CODE parse_headers( char* text );  // 解析HTTP请求头
-    HTTP_CODE parse_content( char* text );  // 解析HTTP请求内容
+    HTTP_CODE parse_headers( char* text, int len );  // 解析HTTP请求头，len为该行去掉\r\n后的长度
+    HTTP_CODE parse_content();  // 处理读缓冲区中已有的请求体，请求体还没有收完时返回NO_REQUEST
+    HTTP_CODE begin_body();     // 请求头解析完、有请求体时调用，创建处理者
+    HTTP_CODE finish_body();    // 请求体接收完毕
+    HTTP_CODE parse_chunk_line( char* text, int len );  // 解析分块编码中的一行（块大小、块后的空行或尾部字段）
+    static int parse_accept_encoding( const char* p );  // Accept-Encoding的值中可以使用的编码的位图
+    bool consume_body( const char* data, int len );     // 把一段请求体交给处理者，GET等没有处理者的请求直接丢弃
+    bool splice_body();         // 把socket中剩余的请求体直接splice进处理者的文件，出错或对方关闭时返回false
+    void end_body();            // 释放处理者，请求体没有收完时让它丢弃已收到的内容
+    void send_continue();       // 回复100 Continue
     HTTP_CODE do_request();
+    HTTP_CODE check_conditions();   // 在选定了要发送的文件版本之后处理条件请求和Range
+    bool not_modified() const;      // 按If-None-Match（优先）或If-Modified-Since判断文件是否没有变化
+    bool if_range_matches() const;  // 没有If-Range，或者它与文件当前的校验器一致时Range才有效
     char* get_line() { return m_read_buf + m_start_line; }
     LINE_STATUS parse_line();
 
     // 这一组函数被process_write调用以填充HTTP应答。
     void unmap();
-    bool add_response( const char* format, ... );
+    bool add_response( const char* format, ... );  // 按格式追加，只用于预生成的片段中没有的内容
+    bool add_bytes( const char* data, int len );    // 追加一段现成的数据
     bool add_content( const char* content );
-    bool add_content_type();
+    bool add_content_type();    // 目标文件的类型，没有目标文件时为text/html
+    bool add_content_encoding();    // 内容编码和Vary头部，文件没有编码版本时什么也不加
+    bool add_vary();
+    bool add_etag();
+    bool add_validators();  // ETag、Last-Modified和Accept-Ranges
+    bool add_content_range( off_t first, off_t last );  // first为负数表示"bytes */大小"
+    bool add_file_headers( off_t content_length, const byte_range* range );  // 200或单区间206应答的头部
+    bool add_file( off_t offset, off_t len );   // 发送文件内容中的一段，整个文件或单个区间
+    bool add_prerendered();     // 复制缓存项中预先生成的完整应答，没有时返回false且不留下任何内容
+    void prerender( int head ); // 把写缓冲区中从head开始的响应头和文件内容保存为缓存项的预生成应答
+    bool add_multipart();   // 多区间的206应答，写缓冲区或m_iv放不下时返回false且不留下任何内容
+    bool add_metrics();     // 生成/metrics的应答，内容放在m_body_buf中
     bool add_status_line( int status, const char* title );
     bool add_headers( int content_length );
-    bool add_content_length( int content_length );
+    bool add_content_length( off_t content_length );
+    bool add_date();
     bool add_linger();
     bool add_blank_line();
+    bool add_proxy_request();   // 生成转发给后端的请求，放在m_proxy_buf中
+    void end_proxy();           // 转发结束，释放m_proxy_buf
+    void bytes_sent( int len );     // 按已发送的字节数调整m_iv和m_bytes_to_send
+    void add_iv( char* base, int len ); // 向待发送的内存块中追加一块，与上一块相邻时直接合并
+
+    // 这个方向能否直接用socket的系统调用收发明文：不是TLS连接，或者由内核加解密
+    bool socket_send() const { return !m_ssl || m_ktls_send; }
+    bool socket_recv() const { return !m_ssl || m_ktls_recv; }
+    bool upgrade_h2( HTTP_CODE ret, uint64_t start );  // 回复101，连接从这个请求开始换成HTTP/2，不能升级时返回false
 
 public:
-    static int m_epollfd;       // 所有socket上的事件都被注册到同一个epoll内核事件中，所以设置成静态的
-    static int m_user_count;    // 统计用户的数量
+    // 以下成员只由连接所属的反应堆线程读写（m_in_worker除外）
+    tw_timer m_timer;               // 连接的超时定时器
+    CONN_PHASE m_phase;             // 连接所处的超时阶段
+    std::atomic< bool > m_in_worker;    // 连接是否已交给线程池、正在处理中，此时超时只能推迟，不能关闭连接
+    uint64_t m_queued_ns;               // 交给线程池的时刻，线程池据此计算排队时间
+
+    static long m_sendfile_threshold;   // 不小于该大小的文件用sendfile发送，负数表示不使用sendfile
+    static int m_prerender_size;        // 不大于该大小的文件缓存预先生成的完整应答，0表示不使用
+    static long long m_max_body_size;   // 请求体的大小上限，超过时回复413，0表示不限制
+    static body_handler* ( *m_post_handler )( const char* url, conn_arena* arena );    // 为POST请求在arena中创建处理者，返回NULL时回复403
+    static std::atomic< bool > m_draining;  // 服务正在平滑退出，之后的应答都带Connection: close
 
 private:
+    int m_epollfd;          // 该连接所属反应堆的epoll对象，多反应堆模式下每个连接只注册在接受它的那个反应堆上
     int m_sockfd;           // 该HTTP连接的socket和对方的socket地址
+    bool m_open;            // 连接是否打开，全零的槽位为false
+    std::atomic< uint32_t > m_generation;   // 打开的连接至少为1，代数为0的数据是监听socket和timerfd；只由打开、关闭连接的线程修改
     sockaddr_in m_address;
     
-    char m_read_buf[ READ_BUFFER_SIZE ];    // 读缓冲区
+    /*
+        读写缓冲区都从buffer_pool中获取：读缓冲区在开始读取请求时获取，写缓冲区在生成应答时获取，
+        一批应答发送完、读缓冲区中也没有剩余数据时都还给池，空闲的keep-alive连接不占用缓冲区。
+    */
+    char* m_read_buf;                       // 读缓冲区，连接空闲时为NULL
+    int m_read_size;                        // 读缓冲区的大小
     int m_read_idx;                         // 标识读缓冲区中已经读入的客户端数据的最后一个字节的下一个位置
     int m_checked_idx;                      // 当前正在分析的字符在读缓冲区中的位置
     int m_start_line;                       // 当前正在解析的行的起始位置
+    int m_req_start;                        // 当前正在解析的请求的起始位置，之前的数据都已应答，整理缓冲区时丢弃
 
     CHECK_STATE m_check_state;              // 主状态机当前所处的状态
     METHOD m_method;                        // 请求方法
 
-    char m_real_file[ FILENAME_LEN ];       // 客户请求的目标文件的完整路径，其内容等于 doc_root + m_url, doc_root是网站根目录
     char* m_url;                            // 客户请求的目标文件的文件名
+    char m_url_buf[ FILENAME_LEN ];         // 有请求体时请求头会从读缓冲区中丢弃，m_url复制到这里，放不下的URL回复414
     char* m_version;                        // HTTP协议版本号，我们仅支持HTTP1.1
     char* m_host;                           // 主机名
-    int m_content_length;                   // HTTP请求的消息总长度
+    off_t m_content_length;                 // HTTP请求的消息总长度
+    bool m_has_content_length;              // 请求头中有Content-Length（值可以是0）
+    bool m_chunked;                         // 请求体使用分块编码
+    bool m_expect_continue;                 // 请求头中有Expect: 100-continue
     bool m_linger;                          // HTTP请求是否要求保持连接
+    int m_accept_encoding;                  // 客户端接受的内容编码，第i位对应CONTENT_ENCODING中的i
+    http_header m_headers[ MAX_HEADERS ];   // 当前请求已解析的头部（名称、值的偏移对）
+    int m_header_count;
 
-    char m_write_buf[ WRITE_BUFFER_SIZE ];  // 写缓冲区
+    /*
+        请求体边收边交给处理者：已经处理的请求体随即从读缓冲区中丢弃（m_req_start跟着前进），
+        长度已知、处理者有文件时直接splice，连接上的内存占用与请求体的大小无关
+    */
+    body_handler* m_handler;                // 请求体的处理者，放在m_arena中，GET等请求的请求体直接丢弃，为NULL
+    CHUNK_STATE m_chunk_state;
+    off_t m_body_remaining;                 // 请求体（分块编码时为当前块）还没有收到的字节数
+    off_t m_body_received;                  // 已经收到的请求体字节数
+    bool m_splice;                          // 请求体剩余部分用splice接收，read()不再从socket读取
+    HTTP_CODE m_body_error;                 // 收完请求体后才给出的错误应答，NO_REQUEST表示没有
+    int m_body_status;                      // 处理者给出的应答状态码
+    char m_body_message[ 64 ];              // 处理者给出的应答内容
+    conn_arena m_arena;                     // 请求级的内存区，每个请求结束时归还
+
+    char* m_write_buf;                      // 写缓冲区，大小为WRITE_BUFFER_SIZE，没有待发送的应答时为NULL
     int m_write_idx;                        // 写缓冲区中待发送的字节数
-    char* m_file_address;                   // 客户请求的目标文件被mmap到内存中的起始位置
+    char* m_file_address;                   // 客户请求的目标文件被mmap到内存中的起始位置，该映射由打开文件缓存持有，所有连接共享
+    file_cache::entry* m_file_entry;        // 目标文件所在的打开文件缓存项，生成应答后转入m_file_entries
+    char* m_body_buf;                       // 由内存生成的应答内容，从buffer_pool获取，一批中最多一个，发送完毕后归还
     struct stat m_file_stat;                // 目标文件的状态。通过它我们可以判断文件是否存在、是否为目录、是否可读，并获取文件大小等信息
-    struct iovec m_iv[2];                   // 我们将采用writev来执行写操作，所以定义下面两个成员，其中m_iv_count表示被写内存块的数量。
+    off_t m_file_size;                      // 要发送的内容（原文件或者编码版本）的大小，m_file_address是它的映射
+    int m_file_fd;                          // 要发送的内容的文件，用sendfile发送时使用，加载时压缩的版本为-1
+    int m_encoding;                         // 应答使用的编码版本，-1表示原文件
+    bool m_vary;                            // 目标文件有编码版本，应答要带上Vary: Accept-Encoding
+    const http_fragment* m_content_type;    // 目标文件的Content-Type，来自文件缓存项，NULL表示错误页面的text/html
+    char* m_if_none_match;                  // If-None-Match、If-Modified-Since、Range和If-Range头部的值，没有时为NULL
+    char* m_if_modified_since;
+    char* m_range;
+    char* m_if_range;
+    char m_etag[ file_cache::ETAG_LEN + 8 ];    // 应答的ETag（带引号），编码版本在原文件的校验器后加上编码的后缀
+    int m_etag_len;
+    byte_range m_ranges[ MAX_RANGES ];      // PARTIAL_CONTENT时要发送的区间
+    int m_range_count;
+
+    /*
+        流水线：一次process()依次解析读缓冲区中的多个请求，它们的应答追加在同一个写缓冲区中，
+        与各自的文件映射一起组成m_iv，由一次writev批量发出。
+    */
+    struct iovec m_iv[ MAX_IOV ];           // 我们将采用writev来执行写操作，所以定义下面两个成员，其中m_iv_count表示被写内存块的数量。
     int m_iv_count;
+    int m_iv_idx;                           // 第一个还没有发送完的内存块
+    file_cache::entry* m_file_entries[ MAX_PIPELINE ];  // 这一批应答引用的文件缓存项，发送完毕后释放
+    int m_file_count;
+    off_t m_bytes_to_send;                  // 剩余待发送的字节数（响应头加文件），文件可以超过2GB
+    off_t m_bytes_have_send;                // 已经发送的字节数
+    bool m_keep_alive;                      // 这一批应答发送完毕后是否保持连接，即最后一个请求的m_linger
+
+    // sendfile发送模式：只能是一批中的最后一个应答，m_iv全部用MSG_MORE发出后，文件内容从缓存项的fd直接发送
+    bool m_sendfile;                        // 本次响应的文件内容是否用sendfile发送
+    int m_sendfile_fd;                      // 用sendfile发送的文件
+    off_t m_file_offset;                    // sendfile下一次发送的文件偏移，跨越多轮EPOLLOUT保持
+
+    /*
+        反向代理：工作线程把改写过的请求头和读缓冲区中已有的请求体放进m_proxy_buf，作为这一批的最后一个请求，
+        之后的转发由反应堆的upstream_pool完成，应答不经过m_iv
+    */
+    int m_proxy_route;                      // 请求匹配的路由，-1表示不转发
+    char* m_proxy_buf;                      // 要发给后端的请求，从buffer_pool获取，没有要转发的请求时为NULL
+    int m_proxy_size;
+    int m_proxy_len;
+    off_t m_proxy_body;                     // 还留在客户端socket中、要直接splice给后端的请求体字节数
+    bool m_proxy_linger;                    // 转发的请求是否要求保持连接
+    METHOD m_proxy_method;                  // 访问日志用的请求方法和开始时间，URL复制在m_url_buf中
+    uint64_t m_proxy_start;
+    upstream_conn* m_upstream;              // 正在使用的后端连接，只由反应堆线程读写
+
+    // TLS连接的状态，握手完成之后只读
+    ssl_st* m_ssl;                          // 明文连接为NULL
+    bool m_handshaking;                     // 正在握手，还不能读取请求
+    bool m_ktls_send;                       // 发送方向由内核加密，writev、sendfile直接使用socket
+    bool m_ktls_recv;                       // 接收方向由内核解密，recv、splice直接使用socket
+
+    // HTTP/2：切换之后process_requests()都交给m_h2
+    http2_session* m_h2;                    // 还是HTTP/1.1时为NULL
+    bool m_h2_preface;                      // 明文连接上还没有处理过请求，可能以HTTP/2的连接前言开始
+    bool m_h2c;                             // 当前请求带有Upgrade: h2c
+    char* m_h2_settings;                    // 当前请求的HTTP2-Settings的值，没有时为NULL
 };
 
 #endif
@@ -0,0 +1,134 @@
+#include "http_parser.h"
+#include <stddef.h>
+
+#if defined( __x86_64__ ) || defined( __i386__ )
+#include <immintrin.h>
+#define HTTP_PARSER_X86 1
+#endif
+
+// 头部名称中不能出现的字符
+static inline bool is_name_delim( unsigned char c ) {
+    return c <= 0x20 || c == ':' || c >= 0x7f;
+}
+
+static const char* scan_eol_scalar( const char* p, const char* end ) {
+    for( ; p < end; ++p ) {
+        if( *p == '\r' || *p == '\n' ) {
+            break;
+        }
+    }
+    return p;
+}
+
+static const char* scan_header_name_scalar( const char* p, const char* end ) {
+    for( ; p < end; ++p ) {
+        if( is_name_delim( ( unsigned char )*p ) ) {
+            break;
+        }
+    }
+    return p;
+}
+
+#ifdef HTTP_PARSER_X86
+
+// pcmpestri在16字节中查找属于给定集合（或范围）的第一个字节，找不到时返回16
+__attribute__(( target( "sse4.2" ) ))
+static const char* scan_eol_sse42( const char* p, const char* end ) {
+    const __m128i set = _mm_setr_epi8( '\r', '\n', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 );
+    for( ; end - p >= 16; p += 16 ) {
+        __m128i v = _mm_loadu_si128( ( const __m128i* )p );
+        int idx = _mm_cmpestri( set, 2, v, 16, _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY | _SIDD_LEAST_SIGNIFICANT );
+        if( idx != 16 ) {
+            return p + idx;
+        }
+    }
+    return scan_eol_scalar( p, end );
+}
+
+__attribute__(( target( "sse4.2" ) ))
+static const char* scan_header_name_sse42( const char* p, const char* end ) {
+    // 三个范围：控制字符和空格、':'、DEL和非ASCII字符
+    const __m128i ranges = _mm_setr_epi8( 0x00, 0x20, ':', ':', 0x7f, ( char )0xff,
+            0, 0, 0, 0, 0, 0, 0, 0, 0, 0 );
+    for( ; end - p >= 16; p += 16 ) {
+        __m128i v = _mm_loadu_si128( ( const __m128i* )p );
+        int idx = _mm_cmpestri( ranges, 6, v, 16, _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES | _SIDD_LEAST_SIGNIFICANT );
+        if( idx != 16 ) {
+            return p + idx;
+        }
+    }
+    return scan_header_name_scalar( p, end );
+}
+
+__attribute__(( target( "avx2" ) ))
+static const char* scan_eol_avx2( const char* p, const char* end ) {
+    const __m256i cr = _mm256_set1_epi8( '\r' );
+    const __m256i lf = _mm256_set1_epi8( '\n' );
+    for( ; end - p >= 32; p += 32 ) {
+        __m256i v = _mm256_loadu_si256( ( const __m256i* )p );
+        __m256i hit = _mm256_or_si256( _mm256_cmpeq_epi8( v, cr ), _mm256_cmpeq_epi8( v, lf ) );
+        unsigned int mask = ( unsigned int )_mm256_movemask_epi8( hit );
+        if( mask ) {
+            return p + __builtin_ctz( mask );
+        }
+    }
+    return scan_eol_scalar( p, end );
+}
+
+__attribute__(( target( "avx2" ) ))
+static const char* scan_header_name_avx2( const char* p, const char* end ) {
+    // 有符号比较下非ASCII字符（0x80~0xff）都是负数，一次 < 0x21 就同时找出了控制字符、空格和非ASCII字符
+    const __m256i space = _mm256_set1_epi8( 0x21 );
+    const __m256i colon = _mm256_set1_epi8( ':' );
+    const __m256i del = _mm256_set1_epi8( 0x7f );
+    for( ; end - p >= 32; p += 32 ) {
+        __m256i v = _mm256_loadu_si256( ( const __m256i* )p );
+        __m256i hit = _mm256_or_si256( _mm256_cmpgt_epi8( space, v ),
+                _mm256_or_si256( _mm256_cmpeq_epi8( v, colon ), _mm256_cmpeq_epi8( v, del ) ) );
+        unsigned int mask = ( unsigned int )_mm256_movemask_epi8( hit );
+        if( mask ) {
+            return p + __builtin_ctz( mask );
+        }
+    }
+    return scan_header_name_scalar( p, end );
+}
+
+#endif
+
+// 启动时（main之前的静态初始化）选定的实现
+struct scanner_impl {
+    const char* ( *eol )( const char*, const char* );
+    const char* ( *header_name )( const char*, const char* );
+    const char* name;
+};
+
+static scanner_impl select_scanner() {
+    scanner_impl impl = { scan_eol_scalar, scan_header_name_scalar, "scalar" };
+#ifdef HTTP_PARSER_X86
+    __builtin_cpu_init();
+    if( __builtin_cpu_supports( "avx2" ) ) {
+        impl.eol = scan_eol_avx2;
+        impl.header_name = scan_header_name_avx2;
+        impl.name = "avx2";
+    } else if( __builtin_cpu_supports( "sse4.2" ) ) {
+        impl.eol = scan_eol_sse42;
+        impl.header_name = scan_header_name_sse42;
+        impl.name = "sse4.2";
+    }
+#endif
+    return impl;
+}
+
+static const scanner_impl g_scanner = select_scanner();
+
+const char* scan_eol( const char* p, const char* end ) {
+    return g_scanner.eol( p, end );
+}
+
+const char* scan_header_name( const char* p, const char* end ) {
+    return g_scanner.header_name( p, end );
+}
+
+const char* http_scanner_name() {
+    return g_scanner.name;
+}
@@ -0,0 +1,45 @@
+#ifndef HTTP_PARSER_H
+#define HTTP_PARSER_H
+
+/*
+    HTTP请求的向量化扫描（参考picohttpparser）
+    逐字节查找行尾和头部名称的结束位置是解析小请求时的主要开销，这里用SIMD一次比较16或32个字节：
+    - AVX2：每次32字节，用字节比较得到掩码后取最低位的1
+    - SSE4.2：每次16字节，用pcmpestri按字符集合/字符范围查找
+    - 其他CPU：逐字节查找
+    程序启动时按CPU支持的指令集选定实现，之后每次调用只是一次间接跳转。
+    所有实现都只读取[p, end)范围内的数据，不足一个向量的尾部逐字节处理。
+*/
+
+// 请求中的一个头部，名称和值都用相对于请求起始位置的偏移表示，读缓冲区整理（整体移动）后仍然有效
+struct http_header {
+    unsigned short name;        // 头部名称的偏移
+    unsigned short name_len;
+    unsigned short value;       // 头部值的偏移，已去掉前后的空白，并以'\0'结尾
+    unsigned short value_len;
+};
+
+// 返回[p, end)中第一个'\r'或'\n'的位置，没有时返回end
+const char* scan_eol( const char* p, const char* end );
+
+// 返回[p, end)中第一个不能出现在头部名称中的字符（控制字符、空格、':'、DEL和非ASCII字符）的位置，没有时返回end
+const char* scan_header_name( const char* p, const char* end );
+
+// 头部名称是否等于lower（小写，只含字母、数字和'-'），忽略大小写
+inline bool header_name_is( const char* name, int len, const char* lower, int lower_len ) {
+    if( len != lower_len ) {
+        return false;
+    }
+    for( int i = 0; i < len; ++i ) {
+        // 名称中不含控制字符，或上0x20只会把大写字母变成小写，不会产生别的相等
+        if( ( name[i] | 0x20 ) != lower[i] ) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// 当前使用的扫描实现："avx2"、"sse4.2"或"scalar"
+const char* http_scanner_name();
+
+#endif
@@ -0,0 +1,173 @@
+#include "http_response.h"
+#include <atomic>
+#include <string.h>
+#include <time.h>
+
+#define FRAGMENT( s ) { s, sizeof( s ) - 1 }
+#define STATUS_LINE( code, title ) FRAGMENT( "HTTP/1.1 " #code " " title "\r\n" )
+// 多段应答各段之间的分隔符，文件内容中恰好出现"\r\n--"加这个串的可能性可以忽略
+#define BYTERANGES_BOUNDARY "5e7a0c3f19d24b86"
+
+static const http_fragment status_200 = STATUS_LINE( 200, "OK" );
+static const http_fragment status_201 = STATUS_LINE( 201, "Created" );
+static const http_fragment status_206 = STATUS_LINE( 206, "Partial Content" );
+static const http_fragment status_304 = STATUS_LINE( 304, "Not Modified" );
+static const http_fragment status_400 = STATUS_LINE( 400, "Bad Request" );
+static const http_fragment status_403 = STATUS_LINE( 403, "Forbidden" );
+static const http_fragment status_404 = STATUS_LINE( 404, "Not Found" );
+static const http_fragment status_411 = STATUS_LINE( 411, "Length Required" );
+static const http_fragment status_413 = STATUS_LINE( 413, "Content Too Large" );
+static const http_fragment status_414 = STATUS_LINE( 414, "URI Too Long" );
+static const http_fragment status_416 = STATUS_LINE( 416, "Range Not Satisfiable" );
+static const http_fragment status_500 = STATUS_LINE( 500, "Internal Error" );
+static const http_fragment status_503 = STATUS_LINE( 503, "Service Unavailable" );
+
+const http_fragment* http_status_line( int status ) {
+    switch( status ) {
+        case 200: return &status_200;
+        case 201: return &status_201;
+        case 206: return &status_206;
+        case 304: return &status_304;
+        case 400: return &status_400;
+        case 403: return &status_403;
+        case 404: return &status_404;
+        case 411: return &status_411;
+        case 413: return &status_413;
+        case 414: return &status_414;
+        case 416: return &status_416;
+        case 500: return &status_500;
+        case 503: return &status_503;
+        default: return NULL;
+    }
+}
+
+const http_fragment HTTP_CONNECTION_KEEP_ALIVE = FRAGMENT( "Connection: keep-alive\r\n" );
+const http_fragment HTTP_CONNECTION_CLOSE = FRAGMENT( "Connection: close\r\n" );
+const http_fragment HTTP_CONTENT_TYPE_HTML = FRAGMENT( "Content-Type:text/html\r\n" );
+const http_fragment HTTP_CONTENT_TYPE_METRICS = FRAGMENT( "Content-Type:text/plain; version=0.0.4\r\n" );
+const http_fragment HTTP_VARY_ACCEPT_ENCODING = FRAGMENT( "Vary: Accept-Encoding\r\n" );
+const http_fragment HTTP_CONTENT_ENCODING[] = { FRAGMENT( "Content-Encoding: gzip\r\n" ), FRAGMENT( "Content-Encoding: br\r\n" ) };
+const http_fragment HTTP_ACCEPT_RANGES = FRAGMENT( "Accept-Ranges: bytes\r\n" );
+const http_fragment HTTP_CONTENT_TYPE_BYTERANGES = FRAGMENT( "Content-Type: multipart/byteranges; boundary=" BYTERANGES_BOUNDARY "\r\n" );
+const http_fragment HTTP_BYTERANGES_PART = FRAGMENT( "\r\n--" BYTERANGES_BOUNDARY "\r\n" );
+const http_fragment HTTP_BYTERANGES_END = FRAGMENT( "\r\n--" BYTERANGES_BOUNDARY "--\r\n" );
+const http_fragment HTTP_CRLF = FRAGMENT( "\r\n" );
+const http_fragment HTTP_CONTINUE = FRAGMENT( "HTTP/1.1 100 Continue\r\n\r\n" );
+const http_fragment HTTP_SWITCHING_PROTOCOLS = FRAGMENT( "HTTP/1.1 101 Switching Protocols\r\n"
+        "Connection: Upgrade\r\nUpgrade: h2c\r\n\r\n" );
+const http_fragment HTTP_RESPONSE_503 = FRAGMENT( "HTTP/1.1 503 Service Unavailable\r\n"
+        "Content-Length: 0\r\nRetry-After: 1\r\nConnection: close\r\n\r\n" );
+const http_fragment HTTP_RESPONSE_502 = FRAGMENT( "HTTP/1.1 502 Bad Gateway\r\n"
+        "Content-Length: 0\r\nConnection: close\r\n\r\n" );
+
+// "00" "01" ... "99"，每次除以100输出两位，除法次数减半
+static const char digit_pairs[201] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+int format_uint( char* buf, unsigned long v ) {
+    // 先计算位数，再从低位向高位填写，不需要反转
+    int len = 1;
+    for( unsigned long t = v; t >= 10; t /= 10 ) {
+        ++len;
+    }
+    char* p = buf + len;
+    while( v >= 100 ) {
+        const char* d = digit_pairs + ( v % 100 ) * 2;
+        v /= 100;
+        *--p = d[1];
+        *--p = d[0];
+    }
+    if( v >= 10 ) {
+        const char* d = digit_pairs + v * 2;
+        *--p = d[1];
+        *--p = d[0];
+    } else {
+        *--p = ( char )( '0' + v );
+    }
+    return len;
+}
+
+/*
+    Date头部轮流写在4个槽中，生成新的一秒时写入下一个槽，再发布槽号。
+    读者复制的槽要再过3秒才会被改写，复制37个字节不会跨越这么长的时间。
+*/
+static char date_slots[ 4 ][ HTTP_DATE_LEN + 1 ];
+static std::atomic< int > date_index( 0 );
+static std::atomic< long > date_second( -1 );
+
+void update_http_date() {
+    long now = ( long )time( NULL );
+    long last = date_second.load( std::memory_order_relaxed );
+    if( now == last || !date_second.compare_exchange_strong( last, now, std::memory_order_relaxed ) ) {
+        return;
+    }
+    int next = ( date_index.load( std::memory_order_relaxed ) + 1 ) & 3;
+    time_t t = ( time_t )now;
+    struct tm tm;
+    gmtime_r( &t, &tm );
+    strftime( date_slots[ next ], sizeof( date_slots[ next ] ), "Date: %a, %d %b %Y %H:%M:%S GMT\r\n", &tm );
+    date_index.store( next, std::memory_order_release );
+}
+
+void copy_http_date( char* buf ) {
+    memcpy( buf, date_slots[ date_index.load( std::memory_order_acquire ) ], HTTP_DATE_LEN );
+}
+
+int format_http_date( char* buf, time_t t ) {
+    struct tm tm;
+    gmtime_r( &t, &tm );
+    return ( int )strftime( buf, HTTP_DATE_VALUE_LEN + 1, "%a, %d %b %Y %H:%M:%S GMT", &tm );
+}
+
+// 两位数字
+static int parse_2digits( const char* p ) {
+    if( p[0] < '0' || p[0] > '9' || p[1] < '0' || p[1] > '9' ) {
+        return -1;
+    }
+    return ( p[0] - '0' ) * 10 + ( p[1] - '0' );
+}
+
+/*
+    IMF-fixdate的每个字段都在固定位置："Tue, 14 Oct 2026 08:00:00 GMT"，
+    直接按位置取数字，再由年月日算出距1970-01-01的天数，不经过strptime和timegm（它们与locale、时区有关，也慢得多）
+*/
+bool parse_http_date( const char* s, time_t* t ) {
+    static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    if( strlen( s ) != HTTP_DATE_VALUE_LEN || s[3] != ',' || s[4] != ' ' || s[7] != ' ' || s[11] != ' '
+            || s[16] != ' ' || s[19] != ':' || s[22] != ':' || memcmp( s + 25, " GMT", 4 ) != 0 ) {
+        return false;
+    }
+    int month = 0;
+    while( month < 12 && memcmp( months + month * 3, s + 8, 3 ) != 0 ) {
+        ++month;
+    }
+    int day = parse_2digits( s + 5 );
+    int century = parse_2digits( s + 12 );
+    int year = parse_2digits( s + 14 );
+    int hour = parse_2digits( s + 17 );
+    int minute = parse_2digits( s + 20 );
+    int second = parse_2digits( s + 23 );
+    if( month == 12 || day < 1 || day > 31 || century < 0 || year < 0 || hour < 0 || hour > 23
+            || minute < 0 || minute > 59 || second < 0 || second > 60 ) {
+        return false;
+    }
+    year += century * 100;
+    // 把3月作为一年的第一个月，闰日落在年末，每400年为一个周期
+    int y = month < 2 ? year - 1 : year;
+    int era = y / 400;
+    int yoe = y - era * 400;
+    int doy = ( 153 * ( month < 2 ? month + 10 : month - 2 ) + 2 ) / 5 + day - 1;
+    int doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    long days = ( long )era * 146097 + doe - 719468;
+    *t = ( time_t )( days * 86400 + hour * 3600 + minute * 60 + second );
+    return true;
+}
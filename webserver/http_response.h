@@ -0,0 +1,55 @@
+#ifndef HTTP_RESPONSE_H
+#define HTTP_RESPONSE_H
+
+#include <time.h>
+
+/*
+    预先生成的响应头片段
+    状态行、Connection、Content-Type这些内容固定的部分在编译期就是完整的字符串，生成应答时直接memcpy；
+    Content-Length用查两位数字表的整数格式化代替printf；
+    Date头部由反应堆每秒重新生成一次，所有连接共享。
+*/
+
+// 一段内容固定的响应头
+struct http_fragment {
+    const char* data;
+    int len;
+};
+
+// 状态码对应的完整状态行（"HTTP/1.1 200 OK\r\n"），表中没有的状态码返回NULL
+const http_fragment* http_status_line( int status );
+
+extern const http_fragment HTTP_CONNECTION_KEEP_ALIVE;  // "Connection: keep-alive\r\n"
+extern const http_fragment HTTP_CONNECTION_CLOSE;       // "Connection: close\r\n"
+extern const http_fragment HTTP_CONTENT_TYPE_HTML;      // "Content-Type:text/html\r\n"
+extern const http_fragment HTTP_CONTENT_TYPE_METRICS;   // Prometheus文本格式
+extern const http_fragment HTTP_VARY_ACCEPT_ENCODING;   // "Vary: Accept-Encoding\r\n"
+extern const http_fragment HTTP_CONTENT_ENCODING[];     // 按CONTENT_ENCODING索引的"Content-Encoding: ...\r\n"
+extern const http_fragment HTTP_ACCEPT_RANGES;          // "Accept-Ranges: bytes\r\n"
+extern const http_fragment HTTP_CONTENT_TYPE_BYTERANGES;    // 多段（multipart/byteranges）应答的Content-Type
+extern const http_fragment HTTP_BYTERANGES_PART;        // 多段应答中每一段之前的分隔行
+extern const http_fragment HTTP_BYTERANGES_END;         // 多段应答最后的结束分隔行
+extern const http_fragment HTTP_CRLF;                   // 头部结束的空行
+extern const http_fragment HTTP_CONTINUE;               // 收到Expect: 100-continue时发送的中间应答
+extern const http_fragment HTTP_SWITCHING_PROTOCOLS;    // h2c升级时发送的101
+extern const http_fragment HTTP_RESPONSE_503;           // 拒绝新连接时发送的完整应答
+extern const http_fragment HTTP_RESPONSE_502;           // 反向代理连不上后端或后端出错时发送的完整应答
+
+// 把v的十进制表示写入buf（不以'\0'结尾），返回写入的字节数，buf至少要有20字节
+int format_uint( char* buf, unsigned long v );
+
+static const int HTTP_DATE_LEN = 37;   // "Date: Tue, 14 Oct 2026 08:00:00 GMT\r\n"的长度
+
+static const int HTTP_DATE_VALUE_LEN = 29;     // "Tue, 14 Oct 2026 08:00:00 GMT"的长度
+
+// 把t按HTTP日期格式写入buf并以'\0'结尾，返回长度，buf至少要有HTTP_DATE_VALUE_LEN + 1字节
+int format_http_date( char* buf, time_t t );
+// 解析HTTP日期（只接受上面的IMF-fixdate格式，不接受已废弃的两种格式），成功时返回true
+bool parse_http_date( const char* s, time_t* t );
+
+// 秒数变化时重新生成Date头部，由各反应堆在每个滴答调用，多个线程同时调用时只有一个会真正生成
+void update_http_date();
+// 把当前的Date头部（HTTP_DATE_LEN字节）复制到buf
+void copy_http_date( char* buf );
+
+#endif
@@ -4,6 +4,13 @@
 #include <exception>
 #include <pthread.h>
 #include <semaphore.h>
+#include <time.h>
+#include <errno.h>
+#include <atomic>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
 // 线程同步机制封装类
 
@@ -189,8 +196,96 @@ public:
     bool post() {
         return sem_post( &m_sem ) == 0;
     }
+
+    // 同wait，最多等待ms毫秒，超时（或被信号打断）时返回false
+    bool timedwait( int ms ) {
+        struct timespec ts;
+        clock_gettime( CLOCK_REALTIME, &ts );
+        ts.tv_sec += ms / 1000;
+        ts.tv_nsec += ( ms % 1000 ) * 1000000L;
+        if( ts.tv_nsec >= 1000000000L ) {
+            ts.tv_sec += 1;
+            ts.tv_nsec -= 1000000000L;
+        }
+        return sem_timedwait( &m_sem, &ts ) == 0;
+    }
 private:
     sem_t m_sem; // 信号量对象
 };
 
+
+// 自旋等待时提示CPU降低功耗、让出流水线给同核的另一个超线程
+inline void cpu_relax() {
+#if defined( __x86_64__ ) || defined( __i386__ )
+    __builtin_ia32_pause();
+#elif defined( __aarch64__ )
+    asm volatile( "yield" );
+#endif
+}
+
+// 基于futex的事件计数器，用于无锁队列的消费者在空闲时休眠
+/*
+消费者的用法：
+    key = prepare_wait();        // 登记为等待者，并取得当前的序号
+    if (再检查一次条件成立) { cancel_wait(); } else { wait(key); }
+生产者在使条件成立之后调用notify_one()。只有存在等待者时才会执行futex系统调用，
+忙碌时生产者和消费者都不陷入内核。
+登记等待者和读取等待者数量之间都有全序的内存屏障，因此要么生产者看到等待者并唤醒它，
+要么消费者再次检查时看到生产者的修改，不会丢失唤醒。
+*/
+class eventcount {
+public:
+    eventcount() : m_seq( 0 ), m_waiters( 0 ) {}
+
+    int prepare_wait() {
+        m_waiters.fetch_add( 1, std::memory_order_seq_cst );
+        return m_seq.load( std::memory_order_seq_cst );
+    }
+
+    void cancel_wait() {
+        m_waiters.fetch_sub( 1, std::memory_order_relaxed );
+    }
+
+    // 序号仍等于key时休眠，直到被notify唤醒
+    void wait( int key ) {
+        if( m_seq.load( std::memory_order_acquire ) == key ) {
+            syscall( SYS_futex, ( int* )&m_seq, FUTEX_WAIT_PRIVATE, key, NULL, NULL, 0 );
+        }
+        m_waiters.fetch_sub( 1, std::memory_order_relaxed );
+    }
+
+    // 同wait，最多休眠ms毫秒，超时时返回false
+    bool wait( int key, int ms ) {
+        bool woken = true;
+        if( m_seq.load( std::memory_order_acquire ) == key ) {
+            struct timespec ts;
+            ts.tv_sec = ms / 1000;
+            ts.tv_nsec = ( ms % 1000 ) * 1000000L;
+            woken = syscall( SYS_futex, ( int* )&m_seq, FUTEX_WAIT_PRIVATE, key, &ts, NULL, 0 ) == 0 || errno != ETIMEDOUT;
+        }
+        m_waiters.fetch_sub( 1, std::memory_order_relaxed );
+        return woken;
+    }
+
+    // 存在等待者时唤醒其中一个并返回true
+    bool notify_one() {
+        std::atomic_thread_fence( std::memory_order_seq_cst );
+        if( m_waiters.load( std::memory_order_relaxed ) > 0 ) {
+            m_seq.fetch_add( 1, std::memory_order_release );
+            syscall( SYS_futex, ( int* )&m_seq, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0 );
+            return true;
+        }
+        return false;
+    }
+
+    void notify_all() {
+        m_seq.fetch_add( 1, std::memory_order_seq_cst );
+        syscall( SYS_futex, ( int* )&m_seq, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0 );
+    }
+
+private:
+    std::atomic< int > m_seq;       // futex字，每次唤醒加1
+    std::atomic< int > m_waiters;   // 已登记的等待者数量
+};
+
 #endif
\ No newline at end of file
@@ -0,0 +1,282 @@
+#include "logger.h"
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#include <string>
+
+int logger::g_level = LOG_LEVEL_ERROR;
+bool logger::g_access = false;
+
+static std::atomic< logger::ring* > g_rings[ logger::MAX_RINGS ];
+static std::atomic< int > g_ring_count( 0 );
+static std::atomic< bool > g_stop( false );
+static bool g_running = false;
+static pthread_t g_thread;
+
+static std::string g_path;
+static int g_fd = -1;
+static int g_sample = 1;
+static long g_max_bytes = 0;
+static int g_keep = 0;
+static long g_file_size = 0;
+
+static const int FLUSH_SIZE = 256 * 1024;   // 后台线程攒够这么多字节才write一次
+static const int IDLE_MS = 10;              // 没有日志时后台线程的休眠间隔
+
+// 按http_conn::METHOD的顺序
+static const char* method_names[] = { "GET", "POST", "HEAD", "PUT", "DELETE", "TRACE", "OPTIONS", "CONNECT" };
+static const char* level_names[] = { "none", "error", "warn", "info", "debug" };
+
+static int64_t wall_ns() {
+    struct timespec ts;
+    clock_gettime( CLOCK_REALTIME, &ts );
+    return ( int64_t )ts.tv_sec * 1000000000ll + ts.tv_nsec;
+}
+
+bool logger::start( const char* path, int level, int sample, long max_bytes, int keep ) {
+    g_path = path;
+    g_fd = open( path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644 );
+    if( g_fd < 0 ) {
+        return false;
+    }
+    struct stat st;
+    g_file_size = fstat( g_fd, &st ) == 0 ? st.st_size : 0;
+    g_sample = sample > 0 ? sample : 1;
+    g_max_bytes = max_bytes;
+    g_keep = keep;
+    g_stop.store( false );
+    if( pthread_create( &g_thread, NULL, worker, NULL ) != 0 ) {
+        close( g_fd );
+        g_fd = -1;
+        return false;
+    }
+    g_running = true;
+    g_level = level;
+    g_access = level >= LOG_LEVEL_INFO;
+    return true;
+}
+
+void logger::stop() {
+    if( !g_running ) {
+        return;
+    }
+    g_access = false;
+    g_level = LOG_LEVEL_ERROR;
+    g_running = false;
+    g_stop.store( true );
+    pthread_join( g_thread, NULL );
+    close( g_fd );
+    g_fd = -1;
+}
+
+logger::ring* logger::local() {
+    static thread_local ring* r = NULL;
+    static thread_local bool claimed = false;
+    if( !claimed ) {
+        claimed = true;
+        int i = g_ring_count.fetch_add( 1, std::memory_order_relaxed );
+        if( i < MAX_RINGS ) {
+            r = new ring;
+            g_rings[ i ].store( r, std::memory_order_release );
+        }
+    }
+    return r;
+}
+
+logger::record* logger::reserve( ring* r ) {
+    uint32_t tail = r->tail.load( std::memory_order_relaxed );
+    if( tail - r->cached_head >= ( uint32_t )RING_SIZE ) {
+        r->cached_head = r->head.load( std::memory_order_acquire );
+        if( tail - r->cached_head >= ( uint32_t )RING_SIZE ) {
+            r->dropped.store( r->dropped.load( std::memory_order_relaxed ) + 1, std::memory_order_relaxed );
+            return NULL;
+        }
+    }
+    return r->records + ( tail & ( RING_SIZE - 1 ) );
+}
+
+void logger::message( int level, const char* format, ... ) {
+    va_list arg_list;
+    va_start( arg_list, format );
+    if( !g_running ) {
+        // 没有日志文件，保持原来直接输出的行为
+        vprintf( format, arg_list );
+        va_end( arg_list );
+        printf( "\n" );
+        return;
+    }
+    ring* r = local();
+    record* rec = r ? reserve( r ) : NULL;
+    if( rec ) {
+        // 消息很少，在调用的线程中格式化
+        vsnprintf( rec->text, TEXT_LEN, format, arg_list );
+        rec->time_ns = wall_ns();
+        rec->level = ( uint8_t )level;
+        rec->access = 0;
+        commit( r );
+    }
+    va_end( arg_list );
+}
+
+void logger::access( uint32_t addr, uint16_t port, int method, const char* url, int status,
+        uint64_t bytes, uint64_t duration_ns ) {
+    ring* r = local();
+    if( !r || ( g_sample > 1 && ++r->sample_count % g_sample != 0 ) ) {
+        return;
+    }
+    record* rec = reserve( r );
+    if( !rec ) {
+        return;
+    }
+    rec->time_ns = wall_ns();
+    rec->bytes = bytes;
+    rec->addr = addr;
+    rec->duration_us = ( uint32_t )( duration_ns / 1000 );
+    rec->port = port;
+    rec->status = ( uint16_t )status;
+    rec->level = LOG_LEVEL_INFO;
+    rec->access = 1;
+    rec->method = ( uint8_t )method;
+    size_t len = url ? strnlen( url, TEXT_LEN - 1 ) : 0;
+    memcpy( rec->text, url, len );
+    rec->text[ len ] = '\0';
+    commit( r );
+}
+
+// 同一秒内的时间戳只格式化一次
+static int format_time( char* buf, int64_t time_ns ) {
+    static time_t cached_sec = -1;
+    static char cached[ 32 ];
+    time_t sec = ( time_t )( time_ns / 1000000000ll );
+    if( sec != cached_sec ) {
+        struct tm tm;
+        gmtime_r( &sec, &tm );
+        strftime( cached, sizeof( cached ), "%d/%b/%Y:%H:%M:%S", &tm );
+        cached_sec = sec;
+    }
+    return sprintf( buf, "[%s.%03d +0000]", cached, ( int )( time_ns / 1000000 % 1000 ) );
+}
+
+int logger::drain( char* buf, int size, int* len ) {
+    int count = g_ring_count.load( std::memory_order_relaxed );
+    if( count > MAX_RINGS ) {
+        count = MAX_RINGS;
+    }
+    int taken = 0;
+    for( int i = 0; i < count; ++i ) {
+        ring* r = g_rings[ i ].load( std::memory_order_acquire );
+        if( !r ) {
+            continue;
+        }
+        uint32_t head = r->head.load( std::memory_order_relaxed );
+        uint32_t tail = r->tail.load( std::memory_order_acquire );
+        for( ; head != tail; ++head, ++taken ) {
+            // 一条记录格式化后不超过256字节
+            if( size - *len < 256 ) {
+                flush( buf, *len );
+                *len = 0;
+            }
+            const record* rec = r->records + ( head & ( RING_SIZE - 1 ) );
+            char* p = buf + *len;
+            if( rec->access ) {
+                char ip[ INET_ADDRSTRLEN ];
+                struct in_addr a;
+                a.s_addr = rec->addr;
+                inet_ntop( AF_INET, &a, ip, sizeof( ip ) );
+                p += sprintf( p, "%s:%u - ", ip, ntohs( rec->port ) );
+                p += format_time( p, rec->time_ns );
+                p += sprintf( p, " \"%s %s\" %u %llu %uus\n",
+                        rec->method < sizeof( method_names ) / sizeof( method_names[0] ) ? method_names[ rec->method ] : "-",
+                        rec->text[0] ? rec->text : "-", rec->status, ( unsigned long long )rec->bytes, rec->duration_us );
+            } else {
+                p += format_time( p, rec->time_ns );
+                p += sprintf( p, " %s: %s\n", level_names[ rec->level ], rec->text );
+            }
+            *len = p - buf;
+        }
+        r->head.store( head, std::memory_order_release );
+    }
+    return taken;
+}
+
+void* logger::worker( void* arg ) {
+    char* buf = new char[ FLUSH_SIZE ];
+    int len = 0;
+    uint64_t reported_dropped = 0;
+    while( true ) {
+        bool stopping = g_stop.load();
+        int taken = drain( buf, FLUSH_SIZE, &len );
+
+        // 报告环满时丢弃的记录
+        uint64_t dropped = 0;
+        int count = g_ring_count.load( std::memory_order_relaxed );
+        for( int i = 0; i < count && i < MAX_RINGS; ++i ) {
+            ring* r = g_rings[ i ].load( std::memory_order_acquire );
+            if( r ) {
+                dropped += r->dropped.load( std::memory_order_relaxed );
+            }
+        }
+        if( dropped != reported_dropped ) {
+            if( FLUSH_SIZE - len < 256 ) {
+                flush( buf, len );
+                len = 0;
+            }
+            char* p = buf + len;
+            p += format_time( p, wall_ns() );
+            p += sprintf( p, " warn: logger dropped %llu records\n", ( unsigned long long )( dropped - reported_dropped ) );
+            len = p - buf;
+            reported_dropped = dropped;
+        }
+
+        if( len > 0 && ( taken == 0 || len >= FLUSH_SIZE / 2 ) ) {
+            // 日志少的时候也及时写出，不会在缓冲区中停留超过一个休眠间隔
+            flush( buf, len );
+            len = 0;
+        }
+        if( taken == 0 ) {
+            if( stopping ) {
+                break;
+            }
+            usleep( IDLE_MS * 1000 );
+        }
+    }
+    delete [] buf;
+    return NULL;
+}
+
+void logger::flush( const char* buf, int len ) {
+    while( len > 0 ) {
+        ssize_t n = write( g_fd, buf, len );
+        if( n <= 0 ) {
+            return;
+        }
+        buf += n;
+        len -= n;
+        g_file_size += n;
+    }
+    if( g_max_bytes > 0 && g_file_size >= g_max_bytes ) {
+        rotate();
+    }
+}
+
+void logger::rotate() {
+    close( g_fd );
+    // path.(keep-1) -> path.keep, ..., path -> path.1，最旧的被覆盖
+    for( int i = g_keep - 1; i >= 1; --i ) {
+        std::string from = g_path + "." + std::to_string( i );
+        std::string to = g_path + "." + std::to_string( i + 1 );
+        rename( from.c_str(), to.c_str() );
+    }
+    if( g_keep > 0 ) {
+        rename( g_path.c_str(), ( g_path + ".1" ).c_str() );
+    } else {
+        unlink( g_path.c_str() );
+    }
+    g_fd = open( g_path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644 );
+    g_file_size = 0;
+}
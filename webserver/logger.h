@@ -0,0 +1,97 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <atomic>
+#include <stdint.h>
+#include <pthread.h>
+#include "mpmc_queue.h"
+
+/*
+    异步日志
+    每个线程第一次写日志时得到自己的单生产者单消费者环形缓冲区，写一条日志只是把一条定长记录填进环中，
+    访问日志只保存原始字段，不做任何格式化；后台线程定期取出所有环中的记录，格式化后攒成大块write到日志文件，
+    文件超过上限时轮转（path -> path.1 -> ... -> path.N）。环满时丢弃记录并计数，不会阻塞请求处理。
+    没有指定日志文件时，错误日志仍然直接printf到标准输出，访问日志关闭。
+
+    编译时用-DWS_LOG_LEVEL=N去掉级别高于N的日志，为0时所有日志调用（包括判断）都被编译掉。
+*/
+
+enum LOG_LEVEL {
+    LOG_LEVEL_NONE = 0,
+    LOG_LEVEL_ERROR,
+    LOG_LEVEL_WARN,
+    LOG_LEVEL_INFO,     // 访问日志属于这一级
+    LOG_LEVEL_DEBUG
+};
+
+#ifndef WS_LOG_LEVEL
+#define WS_LOG_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+#define LOG_ENABLED( level ) ( ( level ) <= WS_LOG_LEVEL && ( level ) <= logger::g_level )
+#define LOG_MESSAGE( level, ... ) do { if( LOG_ENABLED( level ) ) logger::message( level, __VA_ARGS__ ); } while( 0 )
+#define LOG_ERROR( ... ) LOG_MESSAGE( LOG_LEVEL_ERROR, __VA_ARGS__ )
+#define LOG_WARN( ... ) LOG_MESSAGE( LOG_LEVEL_WARN, __VA_ARGS__ )
+#define LOG_INFO( ... ) LOG_MESSAGE( LOG_LEVEL_INFO, __VA_ARGS__ )
+#define LOG_DEBUG( ... ) LOG_MESSAGE( LOG_LEVEL_DEBUG, __VA_ARGS__ )
+// 访问日志要在后台线程运行时才记录，参数见logger::access
+#define LOG_ACCESS( ... ) do { if( LOG_ENABLED( LOG_LEVEL_INFO ) && logger::g_access ) logger::access( __VA_ARGS__ ); } while( 0 )
+
+class logger {
+public:
+    static const int RING_SIZE = 4096;      // 每个线程的环中的记录数，必须是2的幂
+    static const int MAX_RINGS = 256;       // 最多写日志的线程数，超过的线程的日志被丢弃
+    static const int TEXT_LEN = 96;         // 记录中URL或者消息文本的长度，超过的部分被截断
+
+    // 一条定长日志记录，128字节
+    struct record {
+        int64_t time_ns;        // 墙上时间（纳秒）
+        uint64_t bytes;         // 访问日志：应答的字节数
+        uint32_t addr;          // 访问日志：客户端地址（网络字节序）
+        uint32_t duration_us;   // 访问日志：从开始解析到生成应答的时间（微秒）
+        uint16_t port;          // 访问日志：客户端端口（网络字节序）
+        uint16_t status;        // 访问日志：状态码
+        uint8_t level;          // 日志级别，访问日志为LOG_LEVEL_INFO
+        uint8_t access;         // 是否为访问日志
+        uint8_t method;         // 访问日志：http_conn::METHOD
+        uint8_t pad;
+        char text[ TEXT_LEN ];  // 访问日志为URL，否则为格式化好的消息，以'\0'结尾
+    };
+
+    // 一个线程的单生产者（该线程）单消费者（日志线程）环形缓冲区
+    struct ring {
+        ring() : head( 0 ), tail( 0 ), cached_head( 0 ), sample_count( 0 ), dropped( 0 ) {}
+        alignas( CACHELINE_SIZE ) std::atomic< uint32_t > head;    // 消费者（后台线程）读到的位置
+        alignas( CACHELINE_SIZE ) std::atomic< uint32_t > tail;    // 生产者写到的位置
+        uint32_t cached_head;           // 生产者看到的head，只有环看起来满了才重新读取
+        uint32_t sample_count;          // 访问日志的采样计数
+        std::atomic< uint64_t > dropped;    // 环满时丢弃的记录数
+        record records[ RING_SIZE ];
+    };
+
+    /*
+        启动后台线程，日志写入path，应在其他线程开始写日志之前调用
+        level: 记录的最高级别    sample: 每sample个请求记录一条访问日志
+        max_bytes: 单个日志文件的大小上限    keep: 保留的旧日志文件个数
+    */
+    static bool start( const char* path, int level, int sample, long max_bytes, int keep );
+    static void stop();     // 写完所有记录后结束后台线程
+
+    static void message( int level, const char* format, ... ) __attribute__(( format( printf, 2, 3 ) ));
+    static void access( uint32_t addr, uint16_t port, int method, const char* url, int status,
+            uint64_t bytes, uint64_t duration_ns );
+
+    static int g_level;     // 运行时的级别过滤，高于它的日志不记录
+    static bool g_access;   // 是否记录访问日志
+
+private:
+    static ring* local();
+    static record* reserve( ring* r );  // 取得下一条记录的位置，环满时返回NULL
+    static void commit( ring* r ) { r->tail.store( r->tail.load( std::memory_order_relaxed ) + 1, std::memory_order_release ); }
+    static void* worker( void* arg );
+    static int drain( char* buf, int size, int* len );  // 取出所有环中的记录格式化到buf，返回取出的条数
+    static void flush( const char* buf, int len );
+    static void rotate();
+};
+
+#endif
@@ -8,16 +8,56 @@
 #include <fcntl.h>
 #include <stdlib.h>
 #include <sys/epoll.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <signal.h>
+#include <string>
+#include <vector>
 #include "locker.h"
 #include "threadpool.h"
 #include "http_conn.h"
+#include "reactor.h"
+#include "uring_reactor.h"
+#include "coro_reactor.h"
+#include "config.h"
+#include "file_cache.h"
+#include "http_response.h"
+#include "metrics.h"
+#include "logger.h"
+#include "mime_types.h"
+#include "conn_table.h"
+#include "upstream.h"
+#include "response_arena.h"
+#include "tls.h"
+#include "http2.h"
+#include "doc_index.h"
 
-#define MAX_FD 65536   // 最大的文件描述符个数
-#define MAX_EVENT_NUMBER 10000  // 监听的最大的事件数量
+extern const char* doc_root;
 
-// 添加文件描述符
-extern void addfd( int epollfd, int fd, bool one_shot );
-extern void removefd( int epollfd, int fd );
+// 供/metrics读取线程池的队列长度
+static int pool_queue_depth( void* pool ) {
+    return ( ( threadpool< http_conn >* )pool )->queue_depth();
+}
+
+static int pool_threads( void* pool ) {
+    return ( ( threadpool< http_conn >* )pool )->thread_count();
+}
+
+// 进程可以使用的CPU个数（受taskset、cgroup cpuset限制）
+static int online_cpus() {
+    cpu_set_t set;
+    CPU_ZERO( &set );
+    if( sched_getaffinity( 0, sizeof( set ), &set ) == 0 && CPU_COUNT( &set ) > 0 ) {
+        return CPU_COUNT( &set );
+    }
+    long cpus = sysconf( _SC_NPROCESSORS_ONLN );
+    return cpus > 0 ? ( int )cpus : 1;
+}
+
+#define READY_FD_ENV "WS_READY_FD"   // 热升级时新进程启动完成后向这个fd写一个字节
+#define READY_TIMEOUT_MS 10000          // 等待新进程启动完成的时间
+
+extern char** environ;
 
 // 添加信号捕捉
 void addsig(int sig, void( handler )(int)){
@@ -28,113 +68,279 @@ void addsig(int sig, void( handler )(int)){
     assert( sigaction( sig, &sa, NULL ) != -1 );
 }
 
+/*
+    热升级：用同样的命令行启动磁盘上的（新）程序，监听socket通过fd继承交给它。
+    新进程的事件循环都开始接受连接后写ready管道，此时本进程才开始平滑退出，两个进程之间没有不接受连接的空档；
+    新进程启动失败（比如新的参数不合法）时本进程继续服务。
+*/
+static bool spawn_successor( const char* exe, char* argv[], const std::vector< event_loop* >& reactors ) {
+    int ready[2];
+    if( pipe2( ready, O_CLOEXEC ) < 0 ) {
+        return false;
+    }
+    // fork之后的子进程中只能调用异步信号安全的函数，环境变量在fork之前准备好
+    std::string fds;
+    for( size_t i = 0; i < reactors.size(); ++i ) {
+        fds += ( i ? "," : "" ) + std::to_string( reactors[i]->listen_fd() );
+    }
+    std::string listen_env = std::string( LISTEN_FDS_ENV ) + "=" + fds;
+    std::string ready_env = std::string( READY_FD_ENV ) + "=" + std::to_string( ready[1] );
+    std::vector< char* > envp;
+    for( char** e = environ; *e; ++e ) {
+        if( strncmp( *e, LISTEN_FDS_ENV "=", strlen( LISTEN_FDS_ENV ) + 1 ) != 0
+                && strncmp( *e, READY_FD_ENV "=", strlen( READY_FD_ENV ) + 1 ) != 0 ) {
+            envp.push_back( *e );
+        }
+    }
+    envp.push_back( &listen_env[0] );
+    envp.push_back( &ready_env[0] );
+    envp.push_back( NULL );
+
+    pid_t pid = fork();
+    if( pid < 0 ) {
+        close( ready[0] );
+        close( ready[1] );
+        return false;
+    }
+    if( pid == 0 ) {
+        // 只有监听socket和ready管道的写端在exec之后保留
+        for( size_t i = 0; i < reactors.size(); ++i ) {
+            fcntl( reactors[i]->listen_fd(), F_SETFD, 0 );
+        }
+        fcntl( ready[1], F_SETFD, 0 );
+        execve( exe, argv, &envp[0] );
+        _exit( 127 );
+    }
+    close( ready[1] );
+
+    char c = 0;
+    struct pollfd pfd = { ready[0], POLLIN, 0 };
+    bool ok = poll( &pfd, 1, READY_TIMEOUT_MS ) == 1 && read( ready[0], &c, 1 ) == 1;
+    close( ready[0] );
+    if( !ok ) {
+        // 新进程退出了或者没有按时启动完成，结束它，本进程继续服务
+        kill( pid, SIGKILL );
+        waitpid( pid, NULL, 0 );
+        LOG_ERROR( "start new process %s failure", exe );
+        return false;
+    }
+    LOG_INFO( "new process %d is serving, draining", ( int )pid );
+    return true;
+}
+
+// 本进程是热升级启动的：通知上一个进程已经可以接受连接
+static void notify_ready() {
+    const char* env = getenv( READY_FD_ENV );
+    if( !env ) {
+        return;
+    }
+    int fd = atoi( env );
+    unsetenv( READY_FD_ENV );
+    if( write( fd, "1", 1 ) != 1 ) {
+        LOG_ERROR( "notify the old process failure" );
+    }
+    close( fd );
+}
+
 int main( int argc, char* argv[] ) {
-    
-    if( argc <= 1 ) {
-        printf( "usage: %s port_number\n", basename(argv[0]));
+
+    // 解析启动参数
+    config conf;
+    if( !conf.parse( argc, argv ) ) {
+        conf.usage( argv[0] );
         return 1;
     }
+    int reactor_number = conf.reactor_number;
+
+    // 绝对路径，热升级时执行这个路径上的（新）程序；启动时解析，之后替换文件也不影响
+    char exe[ 4096 ];
+    ssize_t exe_len = readlink( "/proc/self/exe", exe, sizeof( exe ) - 1 );
+    exe[ exe_len > 0 ? exe_len : 0 ] = '\0';
+
+    /*
+        SIGTERM、SIGINT：平滑退出；SIGHUP：热升级（启动新进程接管监听socket后平滑退出）。
+        在创建任何线程之前屏蔽它们，所有线程都继承这个屏蔽字，只由主线程用sigwaitinfo同步地处理，
+        处理时可以调用任何函数，不受信号处理函数的限制
+    */
+    sigset_t signals;
+    sigemptyset( &signals );
+    sigaddset( &signals, SIGTERM );
+    sigaddset( &signals, SIGINT );
+    sigaddset( &signals, SIGHUP );
+    pthread_sigmask( SIG_BLOCK, &signals, NULL );
+
+    if( conf.io_mode == IO_URING && conf.proxy_route_number > 0 ) {
+        // 转发由反应堆在epoll中完成
+        printf( "reverse proxy is not supported with io_uring, use epoll\n" );
+        conf.io_mode = IO_EPOLL;
+    }
+    if( conf.io_mode == IO_URING && conf.tls_cert ) {
+        // 握手在反应堆中按epoll事件推进
+        printf( "TLS is not supported with io_uring, use epoll\n" );
+        conf.io_mode = IO_EPOLL;
+    }
+    if( conf.io_mode == IO_CORO && !coro_reactor::supported() ) {
+        printf( "coroutines are not compiled in, rebuild with -std=c++20, use epoll\n" );
+        conf.io_mode = IO_EPOLL;
+    }
+    if( conf.io_mode == IO_CORO && conf.proxy_route_number > 0 ) {
+        // 转发的状态机在reactor中，不在协程里
+        printf( "reverse proxy is not supported with coroutines, use epoll\n" );
+        conf.io_mode = IO_EPOLL;
+    }
+    if( conf.http2 && conf.proxy_route_number > 0 ) {
+        // HTTP/2的流只提供静态文件
+        printf( "HTTP/2 is not supported with reverse proxy, use HTTP/1.1\n" );
+        conf.http2 = false;
+    }
+    if( conf.io_mode == IO_URING && !uring_reactor::supported() ) {
+        printf( "io_uring is not supported by this kernel, use epoll\n" );
+        conf.io_mode = IO_EPOLL;
+    }
+    if( conf.io_mode == IO_URING ) {
+        // io_uring没有sendfile，文件内容都从映射发送
+        conf.sendfile_threshold = -1;
+    }
 
-    // 获取端口号
-    int port = atoi( argv[1] );
+    if( conf.mime_types_path && !mime_types::load( conf.mime_types_path ) ) {
+        printf( "load mime types from %s failure\n", conf.mime_types_path );
+        return 1;
+    }
+
+    // 启动日志线程，之后各线程的日志都写入它的环形缓冲区
+    if( conf.log_path && !logger::start( conf.log_path, conf.log_level, conf.log_sample,
+            conf.log_max_bytes, conf.log_keep ) ) {
+        printf( "open log file %s failure\n", conf.log_path );
+        return 1;
+    }
 
     // 对SIGPIE信号进行处理
     addsig( SIGPIPE, SIG_IGN );
     
-    // 创建和初始化线程池
-    threadpool< http_conn >* pool = NULL;
-    try {
-        pool = new threadpool<http_conn>;
-    } catch( ... ) {
+    // 扫描网站根目录建立索引，请求的路径都在索引中查找
+    if( conf.doc_root ) {
+        doc_root = conf.doc_root;
+    }
+    if( !doc_index::instance()->init( doc_root ) ) {
+        printf( "scan document root %s failure\n", doc_root );
         return 1;
     }
 
-    // 创建一个数组 用于保存所有的客户端信息
-    http_conn* users = new http_conn[ MAX_FD ];
+    // 初始化打开文件缓存
+    if( !file_cache::instance()->init( conf.cache_max_bytes, conf.cache_max_entries,
+            conf.cache_revalidate_ms, conf.cache_inotify ) ) {
+        printf( "init file cache failure\n" );
+        return 1;
+    }
+    // HTTPS：证书在这里加载，之后所有反应堆共享
+    http2_session::set_enabled( conf.http2 );
+    if( conf.tls_cert && !tls::init( conf.tls_cert, conf.tls_key ? conf.tls_key : conf.tls_cert, conf.http2 ) ) {
+        printf( "init TLS failure\n" );
+        return 1;
+    }
+    // 用sendfile发送的大文件不需要映射到用户态；HTTPS的连接没有内核加密时只能从映射发送，
+    // HTTP/2的DATA帧也从映射发送，这两种情况所有文件都映射
+    http_conn::m_sendfile_threshold = conf.sendfile_threshold;
+    if( conf.sendfile_threshold > 0 && !tls::enabled() && !conf.http2 ) {
+        file_cache::instance()->set_map_limit( conf.sendfile_threshold );
+    }
+    // 小文件的完整应答预先生成在大页区中
+    http_conn::m_prerender_size = conf.small_file_bytes;
+    if( conf.small_file_bytes > 0 && !response_arena::instance()->init( conf.small_cache_bytes ) ) {
+        printf( "map response arena failure\n" );
+        return 1;
+    }
+    // 请求体：PUT保存到上传目录中，POST交给默认的处理者
+    http_conn::m_max_body_size = conf.max_body_bytes;
+    if( conf.upload_dir ) {
+        file_upload::set_dir( conf.upload_dir );
+    }
+    // 反向代理的路由，后端的主机名在启动时解析
+    for( int i = 0; i < conf.proxy_route_number; ++i ) {
+        if( !upstream::add_route( conf.proxy_routes[i] ) ) {
+            printf( "invalid proxy route %s\n", conf.proxy_routes[i] );
+            return 1;
+        }
+    }
+    upstream::m_keepalive = conf.upstream_keepalive;
+    // 生成第一个Date头部，之后由反应堆每个滴答检查更新
+    update_http_date();
 
+    // 创建和初始化线程池，io_uring和协程模式下请求在事件循环线程中直接处理，不需要线程池
+    threadpool< http_conn >* pool = NULL;
+    if( conf.io_mode == IO_EPOLL ) {
+        // 工作线程数从CPU个数开始，排队时间变长（比如阻塞在磁盘I/O上）时在上限内增加，空闲时减回下限
+        int threads = conf.pool_threads > 0 ? conf.pool_threads : online_cpus();
+        int max_threads = conf.pool_max_threads > 0 ? conf.pool_max_threads : threads * 4;
+        try {
+            pool = new threadpool<http_conn>( threads, 10000, ( QUEUE_MODE )conf.queue_mode,
+                    ( PIN_MODE )conf.pin_mode, max_threads, conf.queue_slo_ms );
+        } catch( ... ) {
+            return 1;
+        }
+        metrics::set_queue_depth( pool_queue_depth, pool );
+        metrics::set_pool_threads( pool_threads, pool );
+    }
 
-    // 创建监听套接字
-    int listenfd = socket( PF_INET, SOCK_STREAM, 0 );
+    // 缓冲区按NUMA节点分池，反应堆和工作线程取得的缓冲区都在自己所在的节点上
+    if( conf.numa ) {
+        buffer_pool::instance()->init_numa();
+    }
 
-    int ret = 0;
-    struct sockaddr_in address;
-    address.sin_addr.s_addr = INADDR_ANY;
-    address.sin_family = AF_INET;
-    address.sin_port = htons( port );
+    // 创建连接表，保存所有的客户端信息，每个反应堆一个计数分片
+    if( !conn_table::instance()->init( MAX_FD, reactor_number ) ) {
+        printf( "create connection table failure\n" );
+        return 1;
+    }
 
-    // 端口复用
-    int reuse = 1;
-    setsockopt( listenfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof( reuse ) );
-    ret = bind( listenfd, ( struct sockaddr* )&address, sizeof( address ) );
+    // 创建反应堆，每个反应堆拥有自己的SO_REUSEPORT监听socket，以及自己的epoll对象或io_uring
+    std::vector< event_loop* > reactors;
+    try {
+        for( int i = 0; i < reactor_number; ++i ) {
+            if( conf.io_mode == IO_URING ) {
+                reactors.push_back( new uring_reactor( i, conf ) );
+            } else if( conf.io_mode == IO_CORO ) {
+                reactors.push_back( new coro_reactor( i, conf ) );
+            } else {
+                reactors.push_back( new reactor( i, conf, pool ) );
+            }
+        }
+    } catch( ... ) {
+        printf( "create reactor failure\n" );
+        return 1;
+    }
 
-    // 监听
-    ret = listen( listenfd, 5 );
+    // 反应堆比上一个进程少时，多出来的继承的监听socket关闭，其中排队的连接会被重置
+    event_loop::close_inherited();
 
-    // 创建epoll对象，和事件数组，添加
-    epoll_event events[ MAX_EVENT_NUMBER ];
-    int epollfd = epoll_create( 5 );
-    // 添加到epoll对象中
-    addfd( epollfd, listenfd, false );
-    http_conn::m_epollfd = epollfd;
+    for( int i = 0; i < reactor_number; ++i ) {
+        if( !reactors[i]->start() ) {
+            printf( "start reactor %d failure\n", i );
+            return 1;
+        }
+    }
+    notify_ready();
 
-    while(true) {
-        
-        int number = epoll_wait( epollfd, events, MAX_EVENT_NUMBER, -1 );
-        
-        if ( ( number < 0 ) && ( errno != EINTR ) ) {
-            printf( "epoll failure\n" );
+    while( true ) {
+        int sig = sigwaitinfo( &signals, NULL );
+        if( sig == SIGTERM || sig == SIGINT ) {
             break;
         }
-
-        for ( int i = 0; i < number; i++ ) {
-            
-            int sockfd = events[i].data.fd;
-            
-            if( sockfd == listenfd ) {
-                // 有客户端连接进来
-                struct sockaddr_in client_address;
-                socklen_t client_addrlength = sizeof( client_address );
-                int connfd = accept( listenfd, ( struct sockaddr* )&client_address, &client_addrlength );
-                
-                if ( connfd < 0 ) {
-                    printf( "errno is: %d\n", errno );
-                    continue;
-                } 
-
-                if( http_conn::m_user_count >= MAX_FD ) {
-                    // 目前连接数满了
-                    // 给客户端写一个信息： 服务器正忙
-                    close(connfd);
-                    continue;
-                }
-                // 将新的客户的数据初始化， 放入数组中
-                users[connfd].init( connfd, client_address);
-            
-            } else if( events[i].events & ( EPOLLRDHUP | EPOLLHUP | EPOLLERR ) ) {
-                // 对方异常断开或错误等事件
-                users[sockfd].close_conn();
-
-            } else if(events[i].events & EPOLLIN) {
-                // 一次性把全部数据读完
-                if(users[sockfd].read()) {
-                    pool->append(users + sockfd);
-                } else {
-                    users[sockfd].close_conn();
-                }
-
-            }  else if( events[i].events & EPOLLOUT ) {
-                // 一次性把全部数据写完
-                if( !users[sockfd].write() ) {
-                    users[sockfd].close_conn();
-                }
-
-            }
+        if( sig == SIGHUP && exe[0] && spawn_successor( exe, argv, reactors ) ) {
+            break;
         }
     }
-    
-    close( epollfd );
-    close( listenfd );
-    delete [] users;
+
+    // 平滑退出：各反应堆停止accept，已有连接处理完后事件循环结束；之后线程池中不会再有任务，唤醒并回收工作线程
+    for( int i = 0; i < reactor_number; ++i ) {
+        reactors[i]->drain( conf.drain_timeout_ms );
+    }
+    for( int i = 0; i < reactor_number; ++i ) {
+        reactors[i]->join();
+        delete reactors[i];
+    }
+
     delete pool;
+    logger::stop();
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,146 @@
+#include "metrics.h"
+#include <stdio.h>
+#include <stdarg.h>
+#include <time.h>
+#include "http_conn.h"
+#include "conn_table.h"
+
+static metrics::slot g_slots[ metrics::MAX_SLOTS ];
+static std::atomic< int > g_slot_count( 0 );
+static int ( *g_queue_depth )( void* ) = NULL;
+static void* g_queue_depth_arg = NULL;
+static int ( *g_pool_threads )( void* ) = NULL;
+static void* g_pool_threads_arg = NULL;
+
+// 按http_conn::HTTP_CODE的顺序
+static const char* code_names[] = { "no_request", "get_request", "bad_request", "no_resource",
+        "forbidden", "file", "internal_error", "closed_connection", "metrics",
+        "not_modified", "partial_content", "range_not_satisfiable", "body", "body_too_large",
+        "proxy", "length_required", "uri_too_long" };
+static const int CODE_NAME_NUMBER = sizeof( code_names ) / sizeof( code_names[0] );
+
+static const char* counter_names[ METRIC_COUNTER_NUMBER ][ 2 ] = {
+    { "ws_accepts_total", "Accepted connections." },
+    { "ws_rejects_total", "Connections rejected with 503 because the server was full." },
+    { "ws_bytes_in_total", "Bytes received from clients." },
+    { "ws_bytes_out_total", "Bytes sent to clients." },
+    { "ws_write_stalls_total", "Responses that had to wait for the socket to become writable." },
+    { "ws_tls_handshakes_total", "Completed TLS handshakes." },
+    { "ws_tls_resumed_total", "TLS handshakes that resumed a session from a ticket." },
+    { "ws_ktls_tx_total", "TLS connections whose sending side is encrypted by the kernel." },
+    { "ws_ktls_rx_total", "TLS connections whose receiving side is decrypted by the kernel." },
+    { "ws_overloads_total", "Requests answered with 503 because the thread pool queue was over its latency SLO or full." },
+};
+
+metrics::slot* metrics::claim() {
+    int i = g_slot_count.fetch_add( 1, std::memory_order_relaxed );
+    return g_slots + ( i < MAX_SLOTS ? i : MAX_SLOTS - 1 );
+}
+
+uint64_t metrics::now_ns() {
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ( uint64_t )ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void metrics::request( int code, uint64_t parse_ns ) {
+    slot* s = local();
+    if( code >= 0 && code < MAX_CODES ) {
+        bump( s->requests[ code ], 1 );
+    }
+    // 耗时不超过2^(i+7)纳秒的落在第i个桶
+    int i = 0;
+    if( parse_ns > ( 1ull << LATENCY_SHIFT ) ) {
+        i = 64 - __builtin_clzll( parse_ns - 1 ) - LATENCY_SHIFT;
+        if( i > LATENCY_BUCKETS ) {
+            i = LATENCY_BUCKETS;
+        }
+    }
+    bump( s->parse_ns[ i ], 1 );
+    bump( s->parse_ns_sum, parse_ns );
+}
+
+void metrics::set_pool_threads( int ( *fn )( void* ), void* arg ) {
+    g_pool_threads_arg = arg;
+    g_pool_threads = fn;
+}
+
+void metrics::set_queue_depth( int ( *fn )( void* ), void* arg ) {
+    g_queue_depth_arg = arg;
+    g_queue_depth = fn;
+}
+
+// 向buf追加格式化的内容，空间不够时把*len置为-1
+static void append( char* buf, int size, int* len, const char* format, ... ) {
+    if( *len < 0 ) {
+        return;
+    }
+    va_list arg_list;
+    va_start( arg_list, format );
+    int n = vsnprintf( buf + *len, size - *len, format, arg_list );
+    va_end( arg_list );
+    *len = ( n < 0 || n >= size - *len ) ? -1 : *len + n;
+}
+
+int metrics::render( char* buf, int size ) {
+    int count = g_slot_count.load( std::memory_order_relaxed );
+    if( count > MAX_SLOTS ) {
+        count = MAX_SLOTS;
+    }
+    int len = 0;
+
+    for( int c = 0; c < METRIC_COUNTER_NUMBER; ++c ) {
+        uint64_t total = 0;
+        for( int i = 0; i < count; ++i ) {
+            total += g_slots[i].counters[c].load( std::memory_order_relaxed );
+        }
+        append( buf, size, &len, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n", counter_names[c][0],
+                counter_names[c][1], counter_names[c][0], counter_names[c][0], ( unsigned long long )total );
+    }
+
+    append( buf, size, &len, "# HELP ws_requests_total Parsed requests by result.\n"
+            "# TYPE ws_requests_total counter\n" );
+    for( int code = 0; code < CODE_NAME_NUMBER; ++code ) {
+        uint64_t total = 0;
+        for( int i = 0; i < count; ++i ) {
+            total += g_slots[i].requests[ code ].load( std::memory_order_relaxed );
+        }
+        if( total > 0 ) {
+            append( buf, size, &len, "ws_requests_total{code=\"%s\"} %llu\n", code_names[ code ],
+                    ( unsigned long long )total );
+        }
+    }
+
+    append( buf, size, &len, "# HELP ws_parse_seconds Time to parse one request.\n"
+            "# TYPE ws_parse_seconds histogram\n" );
+    uint64_t cumulative = 0;
+    for( int b = 0; b <= LATENCY_BUCKETS; ++b ) {
+        for( int i = 0; i < count; ++i ) {
+            cumulative += g_slots[i].parse_ns[b].load( std::memory_order_relaxed );
+        }
+        if( b < LATENCY_BUCKETS ) {
+            append( buf, size, &len, "ws_parse_seconds_bucket{le=\"%.9g\"} %llu\n",
+                    ( double )( 1ull << ( b + LATENCY_SHIFT ) ) / 1e9, ( unsigned long long )cumulative );
+        } else {
+            append( buf, size, &len, "ws_parse_seconds_bucket{le=\"+Inf\"} %llu\n", ( unsigned long long )cumulative );
+        }
+    }
+    uint64_t parse_sum = 0;
+    for( int i = 0; i < count; ++i ) {
+        parse_sum += g_slots[i].parse_ns_sum.load( std::memory_order_relaxed );
+    }
+    append( buf, size, &len, "ws_parse_seconds_sum %.9f\nws_parse_seconds_count %llu\n",
+            parse_sum / 1e9, ( unsigned long long )cumulative );
+
+    append( buf, size, &len, "# HELP ws_connections Open client connections.\n"
+            "# TYPE ws_connections gauge\nws_connections %d\n", conn_table::instance()->count() );
+    if( g_queue_depth ) {
+        append( buf, size, &len, "# HELP ws_queue_depth Requests waiting in the thread pool queue.\n"
+                "# TYPE ws_queue_depth gauge\nws_queue_depth %d\n", g_queue_depth( g_queue_depth_arg ) );
+    }
+    if( g_pool_threads ) {
+        append( buf, size, &len, "# HELP ws_pool_threads Worker threads in the thread pool.\n"
+                "# TYPE ws_pool_threads gauge\nws_pool_threads %d\n", g_pool_threads( g_pool_threads_arg ) );
+    }
+    return len;
+}
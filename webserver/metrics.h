@@ -0,0 +1,78 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <atomic>
+#include <stdint.h>
+#include "mpmc_queue.h"
+
+/*
+    运行时统计
+    每个线程（反应堆、工作线程）第一次记录时领取一个独占的槽，各槽按缓存行对齐，
+    计数只由拥有者线程写，用relaxed的读和写代替原子加，记录时既没有锁也没有总线锁定的指令。
+    读取/metrics时把所有槽的计数加起来，单个计数是64位对齐的原子变量，不会读到撕裂的值。
+*/
+
+// 计数器
+enum METRIC_COUNTER {
+    METRIC_ACCEPTS = 0,     // 接受的连接数
+    METRIC_REJECTS,         // 因连接数已满被拒绝（回复503）的连接数
+    METRIC_BYTES_IN,        // 收到的字节数
+    METRIC_BYTES_OUT,       // 发送的字节数
+    METRIC_WRITE_STALLS,    // 应答没能一次发完、要等socket可写的次数
+    METRIC_TLS_HANDSHAKES,  // 完成的TLS握手数
+    METRIC_TLS_RESUMED,     // 其中用session ticket恢复的会话数
+    METRIC_KTLS_TX,         // 发送方向由内核加密的TLS连接数
+    METRIC_KTLS_RX,         // 接收方向由内核解密的TLS连接数
+    METRIC_OVERLOADS,       // 因线程池排队超过SLO或者队列已满回复503的请求数
+    METRIC_COUNTER_NUMBER
+};
+
+class metrics {
+public:
+    static const int MAX_SLOTS = 256;       // 槽的个数，超过的线程共用最后一个槽，计数可能丢失少量
+    static const int MAX_CODES = 20;        // 按http_conn::HTTP_CODE统计请求数
+    static const int LATENCY_SHIFT = 7;     // 第一个延迟桶的上界为2^7纳秒
+    static const int LATENCY_BUCKETS = 24;  // 延迟桶的个数，第i个桶的上界为2^(i+7)纳秒，最后一个约1秒
+
+    struct alignas( CACHELINE_SIZE ) slot {
+        std::atomic< uint64_t > counters[ METRIC_COUNTER_NUMBER ];
+        std::atomic< uint64_t > requests[ MAX_CODES ];
+        std::atomic< uint64_t > parse_ns[ LATENCY_BUCKETS + 1 ];   // 解析一个请求的耗时，最后一个桶为+Inf
+        std::atomic< uint64_t > parse_ns_sum;
+    };
+
+    // 当前线程的槽
+    static slot* local() {
+        static thread_local slot* s = NULL;
+        if( !s ) {
+            s = claim();
+        }
+        return s;
+    }
+
+    static void add( METRIC_COUNTER c, uint64_t n ) {
+        bump( local()->counters[ c ], n );
+    }
+
+    // 记录一个解析完成的请求：结果和解析耗时
+    static void request( int code, uint64_t parse_ns );
+
+    // 当前的请求队列长度，由线程池提供，读取时才调用
+    static void set_queue_depth( int ( *fn )( void* ), void* arg );
+    // 线程池当前的工作线程数，同上
+    static void set_pool_threads( int ( *fn )( void* ), void* arg );
+
+    // 把所有统计按Prometheus文本格式写入buf，返回写入的字节数，空间不够时返回-1
+    static int render( char* buf, int size );
+
+    // 单调时钟，纳秒
+    static uint64_t now_ns();
+
+private:
+    static slot* claim();
+    static void bump( std::atomic< uint64_t >& c, uint64_t n ) {
+        c.store( c.load( std::memory_order_relaxed ) + n, std::memory_order_relaxed );
+    }
+};
+
+#endif
@@ -0,0 +1,238 @@
+#include "mime_types.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <vector>
+
+#define CONTENT_TYPE( type ) { "Content-Type: " type "\r\n", sizeof( "Content-Type: " type "\r\n" ) - 1 }
+#define MIME( ext, type ) { ext, sizeof( ext ) - 1, CONTENT_TYPE( type ) }
+
+// 内置的类型，扩展名必须是小写
+static constexpr mime_types::type builtin_types[] = {
+    MIME( "html", "text/html" ),
+    MIME( "htm", "text/html" ),
+    MIME( "shtml", "text/html" ),
+    MIME( "css", "text/css" ),
+    MIME( "js", "text/javascript" ),
+    MIME( "mjs", "text/javascript" ),
+    MIME( "txt", "text/plain" ),
+    MIME( "csv", "text/csv" ),
+    MIME( "md", "text/markdown" ),
+    MIME( "xml", "text/xml" ),
+    MIME( "json", "application/json" ),
+    MIME( "map", "application/json" ),
+    MIME( "wasm", "application/wasm" ),
+    MIME( "pdf", "application/pdf" ),
+    MIME( "zip", "application/zip" ),
+    MIME( "gz", "application/gzip" ),
+    MIME( "tar", "application/x-tar" ),
+    MIME( "bin", "application/octet-stream" ),
+    MIME( "png", "image/png" ),
+    MIME( "jpg", "image/jpeg" ),
+    MIME( "jpeg", "image/jpeg" ),
+    MIME( "gif", "image/gif" ),
+    MIME( "webp", "image/webp" ),
+    MIME( "avif", "image/avif" ),
+    MIME( "svg", "image/svg+xml" ),
+    MIME( "svgz", "image/svg+xml" ),
+    MIME( "ico", "image/x-icon" ),
+    MIME( "bmp", "image/bmp" ),
+    MIME( "tif", "image/tiff" ),
+    MIME( "tiff", "image/tiff" ),
+    MIME( "woff", "font/woff" ),
+    MIME( "woff2", "font/woff2" ),
+    MIME( "ttf", "font/ttf" ),
+    MIME( "otf", "font/otf" ),
+    MIME( "mp3", "audio/mpeg" ),
+    MIME( "ogg", "audio/ogg" ),
+    MIME( "wav", "audio/wav" ),
+    MIME( "m4a", "audio/mp4" ),
+    MIME( "mp4", "video/mp4" ),
+    MIME( "webm", "video/webm" ),
+    MIME( "mov", "video/quicktime" ),
+};
+static constexpr int BUILTIN_NUMBER = sizeof( builtin_types ) / sizeof( builtin_types[0] );
+
+static const http_fragment default_type = CONTENT_TYPE( "application/octet-stream" );
+
+// 不区分大小写的FNV-1a，最后再混合一次，让高位也影响低位
+static constexpr uint64_t ext_hash( const char* s, int len, uint32_t seed ) {
+    uint64_t h = 14695981039346656037ull ^ seed;
+    for( int i = 0; i < len; ++i ) {
+        unsigned char c = ( unsigned char )s[i];
+        if( c >= 'A' && c <= 'Z' ) {
+            c += 'a' - 'A';
+        }
+        h = ( h ^ c ) * 1099511628211ull;
+    }
+    h ^= h >> 29;
+    h *= 0xbf58476d1ce4e5b9ull;
+    return h ^ ( h >> 32 );
+}
+
+static constexpr int bucket_of( uint64_t h ) {
+    return ( int )( h & ( mime_types::BUCKETS - 1 ) );
+}
+
+// 步长为奇数，位移取遍0到TABLE_SIZE-1时经过所有的槽
+static constexpr int slot_of( uint64_t h, int displacement ) {
+    return ( int )( ( ( h >> 16 ) + ( uint64_t )displacement * ( ( h >> 40 ) | 1 ) ) & ( mime_types::TABLE_SIZE - 1 ) );
+}
+
+// 为一个桶中的扩展名找位移，成功时占用这些槽
+static constexpr bool place_bucket( mime_types::table& t, const mime_types::type* types, int count, int bucket ) {
+    int members[ 64 ] = {};
+    int n = 0;
+    for( int i = 0; i < count; ++i ) {
+        if( bucket_of( ext_hash( types[i].ext, types[i].ext_len, t.seed ) ) == bucket ) {
+            if( n == 64 ) {
+                return false;
+            }
+            members[ n++ ] = i;
+        }
+    }
+    for( int d = 0; d < mime_types::TABLE_SIZE; ++d ) {
+        bool fit = true;
+        for( int i = 0; i < n && fit; ++i ) {
+            int s = slot_of( ext_hash( types[ members[i] ].ext, types[ members[i] ].ext_len, t.seed ), d );
+            fit = t.slots[s] < 0;
+            for( int j = 0; j < i && fit; ++j ) {
+                fit = s != slot_of( ext_hash( types[ members[j] ].ext, types[ members[j] ].ext_len, t.seed ), d );
+            }
+        }
+        if( fit ) {
+            for( int i = 0; i < n; ++i ) {
+                t.slots[ slot_of( ext_hash( types[ members[i] ].ext, types[ members[i] ].ext_len, t.seed ), d ) ] = ( int16_t )members[i];
+            }
+            t.displacements[ bucket ] = ( uint16_t )d;
+            return true;
+        }
+    }
+    return false;
+}
+
+// 生成完美哈希表，编译期和运行时共用，大的桶先放；某个种子下有桶放不下时换下一个种子
+static constexpr mime_types::table make_table( const mime_types::type* types, int count ) {
+    mime_types::table t = {};
+    if( count > mime_types::MAX_TYPES ) {
+        return t;
+    }
+    for( uint32_t seed = 0; seed < 64; ++seed ) {
+        t.seed = seed;
+        for( int i = 0; i < mime_types::TABLE_SIZE; ++i ) {
+            t.slots[i] = -1;
+        }
+        int sizes[ mime_types::BUCKETS ] = {};
+        int largest = 0;
+        for( int i = 0; i < count; ++i ) {
+            int b = bucket_of( ext_hash( types[i].ext, types[i].ext_len, seed ) );
+            if( ++sizes[b] > largest ) {
+                largest = sizes[b];
+            }
+        }
+        bool ok = true;
+        for( int size = largest; size > 0 && ok; --size ) {
+            for( int b = 0; b < mime_types::BUCKETS && ok; ++b ) {
+                if( sizes[b] == size ) {
+                    ok = place_bucket( t, types, count, b );
+                }
+            }
+        }
+        if( ok ) {
+            t.ok = true;
+            return t;
+        }
+    }
+    return t;
+}
+
+static constexpr mime_types::table builtin_table = make_table( builtin_types, BUILTIN_NUMBER );
+static_assert( builtin_table.ok, "cannot build the perfect hash table of mime types" );
+
+// 当前使用的表，load()之后指向合并后的表，旧表不释放（缓存项可能还引用其中的响应头）
+static const mime_types::type* g_types = builtin_types;
+static const mime_types::table* g_table = &builtin_table;
+
+const http_fragment* mime_types::lookup( const char* path ) {
+    const char* dot = strrchr( path, '.' );
+    if( !dot || strchr( dot, '/' ) ) {
+        return &default_type;
+    }
+    const char* ext = dot + 1;
+    int len = strlen( ext );
+    if( len == 0 || len > MAX_EXT_LEN ) {
+        return &default_type;
+    }
+    uint64_t h = ext_hash( ext, len, g_table->seed );
+    int i = g_table->slots[ slot_of( h, g_table->displacements[ bucket_of( h ) ] ) ];
+    if( i >= 0 && g_types[i].ext_len == len && strncasecmp( g_types[i].ext, ext, len ) == 0 ) {
+        return &g_types[i].header;
+    }
+    return &default_type;
+}
+
+bool mime_types::load( const char* path ) {
+    FILE* fp = fopen( path, "r" );
+    if( !fp ) {
+        return false;
+    }
+    std::vector< type > types( builtin_types, builtin_types + BUILTIN_NUMBER );
+    char line[ 1024 ];
+    bool ok = true;
+    while( ok && fgets( line, sizeof( line ), fp ) ) {
+        char* comment = strchr( line, '#' );
+        if( comment ) {
+            *comment = '\0';
+        }
+        char* save = NULL;
+        const char* name = strtok_r( line, " \t\r\n;", &save );
+        if( !name ) {
+            continue;
+        }
+        char* header = NULL;
+        int header_len = 0;
+        for( char* ext = strtok_r( NULL, " \t\r\n;", &save ); ext; ext = strtok_r( NULL, " \t\r\n;", &save ) ) {
+            int len = strlen( ext );
+            if( len > MAX_EXT_LEN ) {
+                ok = false;
+                break;
+            }
+            if( !header ) {
+                // 同一行的扩展名共用一个响应头，和扩展名一样在进程退出前不释放
+                header_len = strlen( "Content-Type: " ) + strlen( name ) + 2;
+                header = ( char* )malloc( header_len + 1 );
+                sprintf( header, "Content-Type: %s\r\n", name );
+            }
+            for( int i = 0; i < len; ++i ) {
+                if( ext[i] >= 'A' && ext[i] <= 'Z' ) {
+                    ext[i] += 'a' - 'A';
+                }
+            }
+            type t = { strdup( ext ), len, { header, header_len } };
+            size_t i = 0;
+            while( i < types.size() && !( types[i].ext_len == len && strcmp( types[i].ext, ext ) == 0 ) ) {
+                ++i;
+            }
+            if( i < types.size() ) {
+                types[i] = t;
+            } else {
+                types.push_back( t );
+            }
+        }
+    }
+    fclose( fp );
+    if( !ok || types.size() > ( size_t )MAX_TYPES ) {
+        return false;
+    }
+    table* t = new table( make_table( types.data(), types.size() ) );
+    if( !t->ok ) {
+        delete t;
+        return false;
+    }
+    type* copy = new type[ types.size() ];
+    memcpy( copy, types.data(), types.size() * sizeof( type ) );
+    g_types = copy;
+    g_table = t;
+    return true;
+}
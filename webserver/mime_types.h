@@ -0,0 +1,46 @@
+#ifndef MIME_TYPES_H
+#define MIME_TYPES_H
+
+#include <stdint.h>
+#include "http_response.h"
+
+/*
+    按文件扩展名确定Content-Type
+    内置的扩展名表在编译期由constexpr函数生成完美哈希表（hash and displace）：扩展名先按哈希值分到桶，
+    再为每个桶找一个位移，使桶中的扩展名都落在空槽中。查找时对扩展名（不区分大小写）哈希一次，
+    由所在桶的位移得到唯一的槽，再与槽中的扩展名比较一次，没有分配也没有复制。
+    启动时可以从mime.types格式的文件追加或覆盖类型，这时用同一个constexpr函数在运行时为合并后的表重新生成哈希表。
+    打开文件缓存在加载文件时查找一次，结果保存在缓存项中，之后的应答直接复制这一行响应头。
+*/
+class mime_types {
+public:
+    static const int MAX_EXT_LEN = 15;      // 扩展名的最大长度，更长的按未知类型处理
+    static const int TABLE_SIZE = 2048;     // 哈希表的槽数，必须是2的幂
+    static const int BUCKETS = 512;         // 桶数，必须是2的幂
+    static const int MAX_TYPES = 1024;      // 扩展名的最大个数，保证装载因子不超过1/2
+
+    // 一个扩展名及其完整的响应头
+    struct type {
+        const char* ext;        // 小写的扩展名，不含'.'
+        int ext_len;
+        http_fragment header;   // "Content-Type: image/jpeg\r\n"
+    };
+
+    // 完美哈希表
+    struct table {
+        bool ok;                            // 是否生成成功
+        uint32_t seed;                      // 哈希种子，有整体冲突时换下一个
+        uint16_t displacements[ BUCKETS ];  // 各桶的位移
+        int16_t slots[ TABLE_SIZE ];        // 槽中扩展名在类型数组中的下标，-1表示空槽
+    };
+
+    // 按path的扩展名查找响应头，未知的扩展名返回application/octet-stream
+    static const http_fragment* lookup( const char* path );
+    /*
+        从mime.types格式的文件中读取类型：每行是"类型 扩展名 扩展名..."，'#'之后为注释，行尾的';'被忽略，
+        与内置表重复的扩展名以文件为准。应在服务启动、开始处理请求之前调用，失败时保留原来的表
+    */
+    static bool load( const char* path );
+};
+
+#endif
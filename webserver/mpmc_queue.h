@@ -0,0 +1,128 @@
+#ifndef MPMC_QUEUE_H
+#define MPMC_QUEUE_H
+
+#include <atomic>
+#include <exception>
+#include <stddef.h>
+#include <stdint.h>
+
+#define CACHELINE_SIZE 64
+
+/*
+    有界的多生产者多消费者无锁队列（Dmitry Vyukov的算法）
+    队列是一个环形数组，每个槽位带一个序号：
+    - 序号等于入队位置pos时，槽位空闲，生产者用CAS抢到pos后写入数据，再把序号置为pos + 1
+    - 序号等于pos + 1时，槽位有数据，消费者用CAS抢到pos后取出数据，再把序号置为pos + 容量
+    入队、出队各只需一次CAS，不分配内存；入队位置和出队位置分别独占一个缓存行，避免生产者和消费者伪共享。
+    容量向上取整为2的幂，以便用位与代替取模。
+*/
+template< typename T >
+class mpmc_queue {
+public:
+    explicit mpmc_queue( size_t capacity );
+    ~mpmc_queue();
+    bool push( const T& data );  // 队列满时返回false
+    bool pop( T& data );         // 队列空时返回false
+    size_t size() const;         // 近似的元素个数
+    size_t capacity() const { return m_mask + 1; }
+
+private:
+    mpmc_queue( const mpmc_queue& );
+    mpmc_queue& operator=( const mpmc_queue& );
+
+    struct cell {
+        std::atomic< size_t > sequence;
+        T data;
+    };
+
+private:
+    cell* m_buffer;
+    size_t m_mask;
+    alignas( CACHELINE_SIZE ) std::atomic< size_t > m_enqueue_pos;
+    alignas( CACHELINE_SIZE ) std::atomic< size_t > m_dequeue_pos;
+    char m_pad[ CACHELINE_SIZE - sizeof( std::atomic< size_t > ) ];
+};
+
+template< typename T >
+mpmc_queue< T >::mpmc_queue( size_t capacity ) : m_buffer( NULL ), m_mask( 0 ) {
+    if( capacity == 0 ) {
+        throw std::exception();
+    }
+    size_t size = 2;
+    while( size < capacity ) {
+        size <<= 1;
+    }
+    m_buffer = new cell[ size ];
+    m_mask = size - 1;
+    for( size_t i = 0; i < size; ++i ) {
+        m_buffer[ i ].sequence.store( i, std::memory_order_relaxed );
+    }
+    m_enqueue_pos.store( 0, std::memory_order_relaxed );
+    m_dequeue_pos.store( 0, std::memory_order_relaxed );
+}
+
+template< typename T >
+mpmc_queue< T >::~mpmc_queue() {
+    delete [] m_buffer;
+}
+
+template< typename T >
+bool mpmc_queue< T >::push( const T& data ) {
+    cell* c;
+    size_t pos = m_enqueue_pos.load( std::memory_order_relaxed );
+    while( true ) {
+        c = &m_buffer[ pos & m_mask ];
+        size_t seq = c->sequence.load( std::memory_order_acquire );
+        intptr_t diff = ( intptr_t )seq - ( intptr_t )pos;
+        if( diff == 0 ) {
+            // 槽位空闲，尝试占用
+            if( m_enqueue_pos.compare_exchange_weak( pos, pos + 1, std::memory_order_relaxed ) ) {
+                break;
+            }
+        } else if( diff < 0 ) {
+            // 槽位中的数据还没有被取走，队列已满
+            return false;
+        } else {
+            // 其他生产者已经占用了这个位置
+            pos = m_enqueue_pos.load( std::memory_order_relaxed );
+        }
+    }
+    c->data = data;
+    c->sequence.store( pos + 1, std::memory_order_release );
+    return true;
+}
+
+template< typename T >
+bool mpmc_queue< T >::pop( T& data ) {
+    cell* c;
+    size_t pos = m_dequeue_pos.load( std::memory_order_relaxed );
+    while( true ) {
+        c = &m_buffer[ pos & m_mask ];
+        size_t seq = c->sequence.load( std::memory_order_acquire );
+        intptr_t diff = ( intptr_t )seq - ( intptr_t )( pos + 1 );
+        if( diff == 0 ) {
+            // 槽位有数据，尝试取走
+            if( m_dequeue_pos.compare_exchange_weak( pos, pos + 1, std::memory_order_relaxed ) ) {
+                break;
+            }
+        } else if( diff < 0 ) {
+            // 队列为空
+            return false;
+        } else {
+            // 其他消费者已经取走了这个位置
+            pos = m_dequeue_pos.load( std::memory_order_relaxed );
+        }
+    }
+    data = c->data;
+    c->sequence.store( pos + m_mask + 1, std::memory_order_release );
+    return true;
+}
+
+template< typename T >
+size_t mpmc_queue< T >::size() const {
+    size_t enqueue = m_enqueue_pos.load( std::memory_order_relaxed );
+    size_t dequeue = m_dequeue_pos.load( std::memory_order_relaxed );
+    return enqueue > dequeue ? enqueue - dequeue : 0;
+}
+
+#endif
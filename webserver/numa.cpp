@@ -0,0 +1,155 @@
+#include "numa.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+// <numaif.h>属于libnuma，这里只需要两个常量
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+#ifndef MPOL_INTERLEAVE
+#define MPOL_INTERLEAVE 3
+#endif
+
+namespace {
+
+// 启动后不变的节点信息
+struct topology {
+    topology() : nodes( 0 ) {
+        memset( cpu_node, 0, sizeof( cpu_node ) );
+        cpu_set_t set;
+        for( int node = 0; ; ++node ) {
+            CPU_ZERO( &set );
+            if( numa::node_cpus( node, &set ) == 0 ) {
+                break;
+            }
+            for( int cpu = 0; cpu < CPU_SETSIZE; ++cpu ) {
+                if( CPU_ISSET( cpu, &set ) ) {
+                    cpu_node[ cpu ] = ( uint8_t )( node % numa::MAX_NODES );
+                }
+            }
+            ++nodes;
+        }
+        if( nodes < 1 ) {
+            nodes = 1;
+        } else if( nodes > numa::MAX_NODES ) {
+            nodes = numa::MAX_NODES;
+        }
+    }
+
+    int nodes;
+    uint8_t cpu_node[ CPU_SETSIZE ];    // CPU所在的节点
+};
+
+const topology& topo() {
+    static topology t;
+    return t;
+}
+
+}
+
+// 单节点的机器上什么也不做
+void numa::place( void* p, size_t bytes, int node ) {
+    int nodes = topo().nodes;
+    if( nodes < 2 ) {
+        return;
+    }
+    unsigned long mask;
+    int mode;
+    if( node == numa::INTERLEAVE ) {
+        mask = ( 1ul << nodes ) - 1;
+        mode = MPOL_INTERLEAVE;
+    } else {
+        mask = 1ul << ( node % nodes );
+        mode = MPOL_PREFERRED;
+    }
+    // 失败（比如内核没有编译NUMA支持）时保持默认的本地分配
+    syscall( SYS_mbind, p, bytes, mode, &mask, sizeof( mask ) * 8, 0 );
+}
+
+int numa::node_count() {
+    return topo().nodes;
+}
+
+// 读取/sys下的NUMA节点信息，失败时返回0
+int numa::node_cpus( int node, cpu_set_t* set ) {
+    char path[ 64 ];
+    snprintf( path, sizeof( path ), "/sys/devices/system/node/node%d/cpulist", node );
+    FILE* fp = fopen( path, "r" );
+    if ( !fp ) {
+        return 0;
+    }
+    // 格式形如 0-15,32-47
+    int count = 0;
+    int first, last;
+    while ( fscanf( fp, "%d", &first ) == 1 ) {
+        last = first;
+        int c = fgetc( fp );
+        if ( c == '-' ) {
+            if ( fscanf( fp, "%d", &last ) != 1 ) {
+                break;
+            }
+            c = fgetc( fp );
+        }
+        for ( int cpu = first; cpu <= last && cpu < CPU_SETSIZE; ++cpu ) {
+            CPU_SET( cpu, set );
+            ++count;
+        }
+        if ( c != ',' ) {
+            break;
+        }
+    }
+    fclose( fp );
+    return count;
+}
+
+int numa::current_node() {
+    const topology& t = topo();
+    if( t.nodes < 2 ) {
+        return 0;
+    }
+    int cpu = sched_getcpu();
+    return cpu >= 0 && cpu < CPU_SETSIZE ? t.cpu_node[ cpu ] : 0;
+}
+
+bool numa::bind_thread( int node ) {
+    cpu_set_t set;
+    CPU_ZERO( &set );
+    if( node_cpus( node, &set ) == 0 ) {
+        return false;
+    }
+    return pthread_setaffinity_np( pthread_self(), sizeof( set ), &set ) == 0;
+}
+
+void* numa::map( size_t bytes, int node, bool* huge ) {
+    size_t size = ( bytes + HUGE_PAGE_SIZE - 1 ) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+    void* p = mmap( NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0 );
+    *huge = p != MAP_FAILED;
+    if( !*huge ) {
+        // 多映射一个大页再把两端裁掉，按大页对齐，透明大页才能覆盖整个区间
+        char* raw = ( char* )mmap( NULL, size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+        if( raw == MAP_FAILED ) {
+            return NULL;
+        }
+        char* aligned = ( char* )( ( ( uintptr_t )raw + HUGE_PAGE_SIZE - 1 ) & ~( uintptr_t )( HUGE_PAGE_SIZE - 1 ) );
+        if( aligned > raw ) {
+            munmap( raw, aligned - raw );
+        }
+        munmap( aligned + size, raw + HUGE_PAGE_SIZE - aligned );
+        p = aligned;
+        madvise( p, size, MADV_HUGEPAGE );
+    }
+    place( p, size, node );
+    return p;
+}
+
+void numa::unmap( void* p, size_t bytes ) {
+    if( p ) {
+        munmap( p, ( bytes + HUGE_PAGE_SIZE - 1 ) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE );
+    }
+}
@@ -0,0 +1,37 @@
+#ifndef NUMA_H
+#define NUMA_H
+
+#include <stddef.h>
+#include <sched.h>
+
+/*
+    NUMA节点和大页内存
+    节点信息在第一次使用时从/sys/devices/system/node读取，没有这些信息（单节点的机器、容器中）时按一个节点处理，
+    所有函数照常工作，只是不再绑定。不依赖libnuma，内存策略直接用mbind系统调用设置。
+    map()映射的内存优先使用2MB的大页（MAP_HUGETLB），系统没有预留大页时退回到普通映射并madvise(MADV_HUGEPAGE)；
+    映射之后、第一次访问之前设置内存策略，页在访问时才按策略分配到节点上。
+    策略用MPOL_PREFERRED而不是MPOL_BIND：节点的内存（或大页）不够时从其他节点分配，不会因此OOM或SIGBUS。
+*/
+class numa {
+public:
+    static const int MAX_NODES = 8;                         // 更多的节点按取模合并
+    static const size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+    static const int INTERLEAVE = -1;                       // map()的node参数：按页轮流分配到所有节点
+
+public:
+    static int node_count();        // 节点个数，至少为1
+    // 把节点node的CPU加入set，返回CPU个数，没有这个节点时返回0
+    static int node_cpus( int node, cpu_set_t* set );
+    // 调用线程当前所在的节点，由sched_getcpu()（vDSO，不进入内核）查表得到
+    static int current_node();
+    // 把调用线程绑定到节点node的CPU上
+    static bool bind_thread( int node );
+
+    // 映射bytes字节（向上取整到大页）的内存，分配到节点node上或者交错分配，是否使用了MAP_HUGETLB写入*huge；失败返回NULL
+    static void* map( size_t bytes, int node, bool* huge );
+    static void unmap( void* p, size_t bytes );
+    // 设置已经映射、还没有访问的[p, p + bytes)的内存策略，node同map()
+    static void place( void* p, size_t bytes, int node );
+};
+
+#endif
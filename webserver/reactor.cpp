@@ -0,0 +1,259 @@
+#include "reactor.h"
+#include <sched.h>
+#include <sys/timerfd.h>
+#include "http_response.h"
+#include "conn_table.h"
+
+// 添加文件描述符
+extern void addfd( int epollfd, int fd, bool one_shot, uint64_t data );
+extern void removefd( int epollfd, int fd );
+
+reactor::reactor( int id, const config& conf, threadpool< http_conn >* pool ) :
+        event_loop( id, conf ), m_epollfd( -1 ), m_timerfd( -1 ), m_pool( pool ), m_upstreams( NULL ) {
+
+    // 创建本反应堆自己的epoll对象，并把监听socket添加进去
+    // close-on-exec：热升级时新进程不应继承它
+    m_epollfd = epoll_create1( EPOLL_CLOEXEC );
+    if( m_epollfd < 0 ) {
+        throw std::exception();
+    }
+    // 监听socket和timerfd的数据就是fd本身（代数为0），不会和连接的句柄混淆
+    addfd( m_epollfd, m_listenfd, false, m_listenfd );
+
+    // 每个滴答触发一次的timerfd，与socket一起在epoll中等待
+    m_timerfd = timerfd_create( CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC );
+    if( m_timerfd < 0 ) {
+        close( m_epollfd );
+        throw std::exception();
+    }
+    struct itimerspec its;
+    its.it_interval.tv_sec = m_wheel.tick_ms() / 1000;
+    its.it_interval.tv_nsec = ( m_wheel.tick_ms() % 1000 ) * 1000000L;
+    its.it_value = its.it_interval;
+    timerfd_settime( m_timerfd, 0, &its, NULL );
+    addfd( m_epollfd, m_timerfd, false, m_timerfd );
+
+    // 后端连接和客户端连接注册在同一个epoll中，数据也是fd本身
+    if( upstream::enabled() ) {
+        m_upstreams = new upstream_pool( m_epollfd, m_table->size() );
+    }
+}
+
+reactor::~reactor() {
+    delete m_upstreams;
+    close( m_timerfd );
+    close( m_epollfd );
+}
+
+// 有客户端连接进来
+// 一次把监听队列中已完成的连接全部取出，直到EAGAIN；监听socket是水平触发的，
+// 一批达到MAX_ACCEPT_BATCH时先去处理别的事件，剩下的连接下一轮epoll_wait还会通知
+void reactor::handle_accept() {
+    for( int i = 0; i < MAX_ACCEPT_BATCH; ++i ) {
+        struct sockaddr_in client_address;
+        socklen_t client_addrlength = sizeof( client_address );
+        // 直接得到非阻塞、close-on-exec的socket，不需要再fcntl
+        int connfd = accept4( m_listenfd, ( struct sockaddr* )&client_address, &client_addrlength,
+                SOCK_NONBLOCK | SOCK_CLOEXEC );
+
+        if ( connfd < 0 ) {
+            if( errno == EAGAIN || errno == EWOULDBLOCK ) {
+                break;
+            } else if( errno == EINTR || errno == ECONNABORTED ) {
+                continue;
+            } else if( ( errno == EMFILE || errno == ENFILE ) && shed_one() ) {
+                continue;
+            }
+            LOG_ERROR( "reactor %d: accept failure, errno is: %d", m_id, errno );
+            break;
+        }
+
+        if( !admit( connfd ) ) {
+            // 目前连接数满了，已经给客户端发送了503
+            continue;
+        }
+        // 将新的客户的数据初始化， 放入数组中，连接的后续事件都由本反应堆处理
+        m_users[connfd].init( connfd, client_address, m_epollfd );
+        track( connfd );
+        // 新连接从accept开始计算读取请求头的超时
+        set_timer( m_users + connfd, http_conn::PHASE_HEADER );
+    }
+}
+
+// 把连接交给线程池处理
+void reactor::dispatch( http_conn* conn, int sockfd ) {
+    // 排队时间已经超过SLO时不再入队，快速失败，客户端不用长时间等待（队列满时也一样）
+    if( !m_pool->overloaded() ) {
+        // 以fd作为亲和性提示，工作窃取模式下同一连接的请求优先交给同一个工作线程
+        conn->m_in_worker.store( true, std::memory_order_relaxed );
+        if( m_pool->append( conn, sockfd ) ) {
+            return;
+        }
+        conn->m_in_worker.store( false, std::memory_order_relaxed );
+    }
+    metrics::add( METRIC_OVERLOADS, 1 );
+    conn->send_overload();
+    close_conn( conn );
+}
+
+void reactor::relayed( http_conn* conn, upstream_pool::RESULT result ) {
+    if( result == upstream_pool::RELAY_WAIT ) {
+        // 转发在等待后端或客户端，有进展就重置超时
+        set_timer( conn, http_conn::PHASE_WRITE );
+    } else if( result == upstream_pool::RELAY_CLOSE ) {
+        close_conn( conn );
+    } else if( conn->pending_input() ) {
+        // 转发的请求之后还有流水线请求
+        set_timer( conn, http_conn::PHASE_HEADER );
+        dispatch( conn, conn - m_users );
+    } else {
+        set_timer( conn, http_conn::PHASE_IDLE );
+    }
+}
+
+void reactor::close_conn( http_conn* conn ) {
+    if( conn->relaying() ) {
+        m_upstreams->abort( conn );
+    }
+    m_wheel.del( &conn->m_timer );
+    release( conn );
+}
+
+void reactor::stop_accept() {
+    removefd( m_epollfd, m_listenfd );
+    m_listenfd = -1;
+}
+
+void reactor::handle_tick() {
+    uint64_t expirations = 0;
+    if( ::read( m_timerfd, &expirations, sizeof( expirations ) ) != sizeof( expirations ) ) {
+        return;
+    }
+    // 所有反应堆共享一个Date头部，秒数变化时由先到的反应堆重新生成
+    update_http_date();
+    // 事件循环被阻塞了多个滴答时，补转相应的格数
+    for( uint64_t i = 0; i < expirations; ++i ) {
+        m_wheel.tick( on_timeout, this );
+    }
+    m_pool->check();
+    drain_tick();
+}
+
+void reactor::on_timeout( tw_timer* timer, void* arg ) {
+    reactor* r = ( reactor* )arg;
+    http_conn* conn = ( http_conn* )timer->data;
+    if( conn->closed() ) {
+        // 连接已经被工作线程关闭
+        return;
+    }
+    if( conn->m_in_worker.load( std::memory_order_acquire ) ) {
+        // 工作线程正在处理该连接，不能在这里关闭，下一个滴答再检查
+        r->m_wheel.add( timer, r->m_wheel.tick_ms() );
+        return;
+    }
+    // 超时，关闭连接
+    r->close_conn( conn );
+}
+
+void reactor::run() {
+    while( !m_stopped ) {
+
+        int number = epoll_wait( m_epollfd, m_events, MAX_EVENT_NUMBER, -1 );
+
+        if ( ( number < 0 ) && ( errno != EINTR ) ) {
+            LOG_ERROR( "reactor %d: epoll failure", m_id );
+            break;
+        }
+
+        for ( int i = 0; i < number; i++ ) {
+
+            uint64_t data = m_events[i].data.u64;
+            int sockfd = ( int )( uint32_t )data;
+
+            if( data == ( uint64_t )m_listenfd ) {
+                handle_accept();
+                continue;
+
+            } else if( data == ( uint64_t )m_timerfd ) {
+                handle_tick();
+                continue;
+
+            } else if( ( data >> 32 ) == 0 ) {
+                // 代数为0的其他数据只能是后端socket
+                upstream_pool::RESULT result;
+                http_conn* conn = m_upstreams->backend_event( sockfd, m_events[i].events, &result );
+                if( conn ) {
+                    relayed( conn, result );
+                }
+                continue;
+            }
+
+            // 同一批事件中前面已经关闭的连接（超时、平滑退出），或者fd已经被复用，句柄对不上
+            http_conn* conn = m_table->lookup( data );
+            if( !conn ) {
+                continue;
+            }
+            // 工作线程先重新注册事件再归还连接，事件可能在这两步之间到达；工作线程此时已经不再访问连接，只差归还这一步
+            while( conn->m_in_worker.load( std::memory_order_acquire ) ) {
+                sched_yield();
+            }
+
+            if( conn->relaying() ) {
+                // 正在转发，客户端socket只在转发需要时注册，事件都交给连接池
+                relayed( conn, m_upstreams->client_event( conn, m_events[i].events ) );
+
+            } else if( m_events[i].events & ( EPOLLRDHUP | EPOLLHUP | EPOLLERR ) ) {
+                // 对方异常断开或错误等事件
+                close_conn( conn );
+
+            } else if( conn->handshaking() ) {
+                // TLS握手，不论等的是可读还是可写都继续推进；完成时请求可能已经跟在客户端的Finished后面到达，按可读处理
+                tls::RESULT result = conn->handshake();
+                if( result == tls::TLS_ERROR ) {
+                    close_conn( conn );
+                } else if( result == tls::TLS_DONE ) {
+                    if( conn->read() ) {
+                        dispatch( conn, sockfd );
+                    } else {
+                        close_conn( conn );
+                    }
+                }
+
+            } else if( m_events[i].events & EPOLLIN ) {
+                // 一次性把全部数据读完
+                if( conn->read() ) {
+                    if( conn->m_phase == http_conn::PHASE_IDLE ) {
+                        // keep-alive连接上新请求的第一个字节，开始计算请求头超时
+                        set_timer( conn, http_conn::PHASE_HEADER );
+                    } else if( conn->reading_body() ) {
+                        // 请求体每收到一批数据就重置超时
+                        set_timer( conn, http_conn::PHASE_BODY );
+                    }
+                    dispatch( conn, sockfd );
+                } else {
+                    close_conn( conn );
+                }
+
+            }  else if( m_events[i].events & EPOLLOUT ) {
+                // 一次性把全部数据写完
+                if( !conn->write() ) {
+                    close_conn( conn );
+                } else if( conn->writing() ) {
+                    // 没有发完，等待客户端接收，发送有进展就重置超时
+                    set_timer( conn, http_conn::PHASE_WRITE );
+                } else if( conn->proxying() ) {
+                    // 这一批前面的应答都发完了，开始转发最后一个请求
+                    relayed( conn, m_upstreams->start( conn ) );
+                } else if( conn->pending_input() ) {
+                    // 读缓冲区中还有流水线请求，开始计算下一个请求的超时，并直接交给线程池
+                    set_timer( conn, http_conn::PHASE_HEADER );
+                    dispatch( conn, sockfd );
+                } else {
+                    // 响应发送完毕，keep-alive连接进入空闲
+                    set_timer( conn, http_conn::PHASE_IDLE );
+                }
+
+            }
+        }
+    }
+}
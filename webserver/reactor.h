@@ -0,0 +1,40 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <sys/epoll.h>
+#include "threadpool.h"
+#include "event_loop.h"
+#include "upstream.h"
+
+#define MAX_EVENT_NUMBER 10000  // 监听的最大的事件数量
+#define MAX_ACCEPT_BATCH 256    // 每次监听socket可读时最多accept的连接数
+
+/*
+    反应堆（Reactor）类，多反应堆模式下每个线程拥有一个实例
+    每个反应堆拥有自己的epoll对象，监听socket和新连接的读写事件都在其中等待，
+    因此accept、read、write都不再集中在一个线程上，请求的解析和应答交给所有反应堆共享的线程池。
+*/
+class reactor : public event_loop {
+public:
+    reactor( int id, const config& conf, threadpool< http_conn >* pool );
+    ~reactor();
+    void run();     // 事件循环
+
+private:
+    void handle_accept();
+    void handle_tick();         // timerfd到期，转动时间轮
+    static void on_timeout( tw_timer* timer, void* arg );
+    void close_conn( http_conn* conn );     // 删除定时器并关闭连接
+    void stop_accept();                     // 从epoll中删除并关闭监听socket
+    void dispatch( http_conn* conn, int sockfd );   // 把连接交给线程池，线程池过载时回复503并关闭连接
+    void relayed( http_conn* conn, upstream_pool::RESULT result );  // 按转发的进展维护客户端连接
+
+private:
+    int m_epollfd;                      // 本反应堆独占的epoll对象
+    int m_timerfd;                      // 周期性触发的timerfd，驱动时间轮
+    threadpool< http_conn >* m_pool;    // 处理业务逻辑的线程池，所有反应堆共享
+    upstream_pool* m_upstreams;         // 本反应堆的后端连接池，没有配置反向代理时为NULL
+    epoll_event m_events[ MAX_EVENT_NUMBER ];
+};
+
+#endif
@@ -0,0 +1,79 @@
+#include "response_arena.h"
+#include <string.h>
+#include "numa.h"
+
+response_arena* response_arena::instance() {
+    // 进程内唯一的实例，且不析构，退出时工作线程可能还在复制其中的应答
+    static response_arena* arena = new response_arena;
+    return arena;
+}
+
+response_arena::response_arena() : m_base( NULL ), m_size( 0 ), m_used( 0 ), m_huge( false ) {
+    memset( m_free, 0, sizeof( m_free ) );
+}
+
+response_arena::~response_arena() {
+    numa::unmap( m_base, m_size );
+}
+
+bool response_arena::init( size_t bytes ) {
+    if( m_base || bytes == 0 ) {
+        return bytes == 0;
+    }
+    // 所有工作线程都从这里复制应答，多节点的机器上交错分配
+    void* p = numa::map( bytes, numa::INTERLEAVE, &m_huge );
+    if( !p ) {
+        return false;
+    }
+    m_base = ( char* )p;
+    m_size = ( bytes + HUGE_PAGE_SIZE - 1 ) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+    return true;
+}
+
+int response_arena::class_of( int size ) {
+    int c = 0;
+    while( ( MIN_SIZE << c ) < size ) {
+        ++c;
+    }
+    return c;
+}
+
+char* response_arena::alloc( int size, int* actual ) {
+    if( !m_base || size > MAX_SIZE ) {
+        return NULL;
+    }
+    int c = class_of( size );
+    size_t block = ( size_t )MIN_SIZE << c;
+    char* p = NULL;
+
+    m_lock.lock();
+    if( m_free[c] ) {
+        p = ( char* )m_free[c];
+        m_free[c] = m_free[c]->next;
+    } else {
+        // 块按自己的大小对齐，不会跨越大页的边界，对齐留下的空隙不再使用
+        size_t start = ( m_used + block - 1 ) & ~( block - 1 );
+        if( start + block <= m_size ) {
+            p = m_base + start;
+            m_used = start + block;
+        }
+    }
+    m_lock.unlock();
+
+    if( p ) {
+        *actual = ( int )block;
+    }
+    return p;
+}
+
+void response_arena::free( char* p, int size ) {
+    if( !p ) {
+        return;
+    }
+    int c = class_of( size );
+    free_block* b = ( free_block* )p;
+    m_lock.lock();
+    b->next = m_free[c];
+    m_free[c] = b;
+    m_lock.unlock();
+}
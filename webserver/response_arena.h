@@ -0,0 +1,54 @@
+#ifndef RESPONSE_ARENA_H
+#define RESPONSE_ARENA_H
+
+#include <stddef.h>
+#include "locker.h"
+#include "numa.h"
+
+/*
+    进程级的预生成应答区
+    小文件的完整200应答（状态行、头部和内容）保存在这里，见file_cache::entry::responses。
+    启动时一次性映射一整块内存，优先使用2MB的大页（MAP_HUGETLB），系统没有预留大页时退回到普通映射并
+    madvise(MADV_HUGEPAGE)交给透明大页；所有热点小文件的应答挤在少数几个大页中，命中时复制它们几乎不产生TLB缺失。
+    区内按2的幂分为若干大小等级（256B ~ 4KB），从区的开头依次切出，释放的块挂在所在等级的空闲链表上，
+    区用完之后不再分配，新的小文件按普通文件发送。分配只发生在每个缓存项第一次应答时，一把锁就够了。
+*/
+class response_arena {
+public:
+    static const int MIN_SHIFT = 8;                 // 最小的等级256B
+    static const int MAX_SHIFT = 12;                // 最大的等级4KB，不超过写缓冲区的大小
+    static const int MIN_SIZE = 1 << MIN_SHIFT;
+    static const int MAX_SIZE = 1 << MAX_SHIFT;
+    static const size_t HUGE_PAGE_SIZE = numa::HUGE_PAGE_SIZE;
+
+public:
+    static response_arena* instance();
+
+    // 映射bytes字节（向上取整到大页）的区，应在开始处理请求之前调用，0表示不使用
+    bool init( size_t bytes );
+    bool huge() const { return m_huge; }    // 是否使用了MAP_HUGETLB的大页
+
+    // 取一块不小于size的内存，实际大小写入*actual，size超过MAX_SIZE、未初始化或区已用完时返回NULL
+    char* alloc( int size, int* actual );
+    // 归还alloc得到的内存，size是alloc给出的实际大小
+    void free( char* p, int size );
+
+private:
+    response_arena();
+    ~response_arena();
+    static int class_of( int size );    // 不小于size的最小等级
+
+    struct free_block {
+        free_block* next;
+    };
+
+private:
+    locker m_lock;      // 保护下面所有成员
+    char* m_base;
+    size_t m_size;
+    size_t m_used;      // 已经切出的字节数
+    bool m_huge;
+    free_block* m_free[ MAX_SHIFT - MIN_SHIFT + 1 ];
+};
+
+#endif
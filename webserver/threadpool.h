@@ -2,27 +2,99 @@
 #define THREADPOOL_H
 
 #include <list>
+#include <vector>
 #include <cstdio>
 #include <exception>
 #include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <time.h>
 #include "locker.h"
+#include "mpmc_queue.h"
+#include "ws_deque.h"
+#include "numa.h"
 
 // 实现线程池类，利用多线程并发处理任务
 
+/*
+请求队列的实现方式，可以在启动时选择，便于对比
+QUEUE_LOCKED    :   std::list + 互斥锁 + 信号量，每次入队分配一个链表节点，出队要等待信号量并加锁
+QUEUE_LOCKFREE  :   有界无锁环形队列，只有工作线程空闲时才通过futex休眠和唤醒
+QUEUE_STEALING  :   工作窃取，每个工作线程有自己的收件箱和Chase-Lev双端队列，
+                    同一个连接的请求按fd哈希总是交给同一个工作线程，空闲的工作线程从其他线程窃取任务
+*/
+enum QUEUE_MODE { QUEUE_LOCKED = 0, QUEUE_LOCKFREE, QUEUE_STEALING };
+
+/*
+工作线程的CPU绑定方式
+PIN_NONE    :   不绑定，由内核调度
+PIN_CPU     :   第i个工作线程绑定到第i个CPU上（按CPU个数取模）
+PIN_NUMA    :   第i个工作线程绑定到第i个NUMA节点的全部CPU上（按节点个数取模）
+*/
+enum PIN_MODE { PIN_NONE = 0, PIN_CPU, PIN_NUMA };
+
+// 单调时钟，纳秒，用于计算任务的排队时间
+static inline uint64_t pool_now_ns() {
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ( uint64_t )ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+线程数的自适应调整和排队时间
+- 每个任务入队时记下时刻（任务类T的m_queued_ns成员），开始处理时得到它的排队时间，线程池维护排队时间的移动平均
+- 排队时间超过增长阈值（SLO的1/4），或者队列非空却有一段时间没有任务开始处理（工作线程都阻塞在磁盘I/O上，
+  由反应堆每个滴答调用check()发现），并且线程数没有达到上限时，增加一个工作线程，每GROW_INTERVAL_MS最多增加一个
+- 空闲了IDLE_EXIT_MS还没有取到任务的工作线程在线程数多于下限时退出
+- overloaded()：队列非空且排队时间的移动平均（或者距上一次有任务开始处理的时间）超过SLO，
+  此时再入队的任务要等得更久，由反应堆直接回复503
+工作窃取模式下任务按亲和性哈希到固定的工作线程，线程数固定为下限，只估计排队时间。
+*/
+
 // 线程池类，将它定义为模板类是为了代码复用，模板参数T是任务类
 template<typename T>
 class threadpool {
 public:
-    /*thread_number是线程池中线程的数量，max_requests是请求队列中最多允许的、等待处理的请求的数量*/
-    threadpool(int thread_number = 8, int max_requests = 10000);
+    static const int IDLE_EXIT_MS = 10000;      // 工作线程空闲这么久之后，线程数多于下限时退出
+    static const int GROW_INTERVAL_MS = 100;     // 两次增加线程之间的最短间隔
+    static const int GROW_WAIT_MS = 10;         // 没有设置SLO时，排队时间超过这个值就增加线程
+
+    /*
+    thread_number是线程池中线程的数量（下限），max_requests是请求队列中最多允许的、等待处理的请求的数量，
+    max_threads是按排队时间增加线程时的上限，不大于thread_number时线程数固定；
+    slo_ms是排队时间的SLO，0表示不限制（overloaded()总是返回false）
+    */
+    threadpool(int thread_number = 8, int max_requests = 10000, QUEUE_MODE mode = QUEUE_LOCKED,
+            PIN_MODE pin = PIN_NONE, int max_threads = 0, int slo_ms = 0);
+    // 唤醒并等待所有工作线程结束。应在所有反应堆都停止之后调用，此时队列中已经没有任务
     ~threadpool();
-    bool append(T* request); // 用于向请求队列添加任务。
+    // 用于向请求队列添加任务。affinity是亲和性提示（如连接的fd），工作窃取模式下相同提示的任务交给同一个工作线程
+    bool append(T* request, int affinity = -1);
+    // 等待处理的任务数（近似值），供统计使用
+    int queue_depth();
+    // 现在入队的任务预计会排队超过SLO
+    bool overloaded();
+    // 由反应堆周期性调用：没有新任务入队时，队列停滞也要增加线程
+    void check();
+    // 正在运行的工作线程数
+    int thread_count() const { return m_live.load( std::memory_order_relaxed ); }
 
 private:
     /*工作线程运行的函数，它不断从工作队列中取出任务并执行之*/
     static void* worker(void* arg);
 
     void run(); // 线程池内线程实际执行任务的循环体。持续循环处理任务，直到 m_stop 变为 true。
+    void run_lockfree(); // 无锁队列模式下的循环体
+    void run_stealing(); // 工作窃取模式下的循环体
+    T* steal( int self ); // 从其他工作线程窃取一个任务
+    void set_affinity( int index, PIN_MODE pin ); // 把第index个工作线程绑定到CPU或NUMA节点上
+    void stop_workers(); // 通知所有工作线程退出，唤醒休眠的线程并等待它们结束
+    bool spawn( int index ); // 在m_threads的第index个位置上创建工作线程
+    void grow(); // 增加一个工作线程
+    void maybe_grow( uint64_t now ); // 没有到上限并且距上一次增加足够久时增加一个工作线程
+    bool push( T* request, int affinity ); // 按队列的实现方式入队，队列满时返回false
+    bool retire(); // 空闲的工作线程在线程数多于下限时登记退出，返回true表示调用者应当退出
+    void execute( T* request ); // 记录任务的排队时间并处理它
     /*
     只要 m_stop 为 false，线程就会等待信号量 m_queuestat，有信号时表示有新任务，获取锁访问队列。
     若队列为空则解锁继续等待；否则取出队首任务，解锁后执行任务的 process 方法（前提是任务指针不为空）。
@@ -51,28 +123,82 @@ private:
     // 一个信号量对象，用于指示队列中是否有任务需要处理
     sem m_queuestat;
 
-    // 布尔变量，用于标记是否结束线程池          
-    bool m_stop;                    
+    // 请求队列的实现方式
+    QUEUE_MODE m_mode;
+
+    // 无锁模式下的请求队列，容量为不小于m_max_requests的2的幂，队列满时append同样返回false
+    mpmc_queue< T* >* m_lockfree_queue;
+
+    // 无锁模式下空闲工作线程休眠在这个事件计数器上
+    eventcount m_idle;
+
+    // 工作窃取模式下每个工作线程私有的数据，各占独立的缓存行
+    struct alignas( CACHELINE_SIZE ) worker_slot {
+        mpmc_queue< T* >* inbox;    // 反应堆投递给该线程的任务
+        ws_deque< T > deque;        // 从收件箱转入的一批任务，拥有者从底部取，其他线程从顶部窃取
+        eventcount wake;            // 该线程空闲时休眠在这里
+    };
+    worker_slot* m_slots;
+    std::atomic< int > m_next_index;    // 工作线程启动时领取自己的编号
+
+    // 是否结束线程池，工作线程每次醒来和休眠之前都检查它
+    std::atomic< bool > m_stop;
+
+    // m_threads中每个位置的状态，由m_resize_lock保护
+    enum SLOT_STATE { SLOT_FREE = 0, SLOT_RUNNING, SLOT_EXITED };
+    int m_max_threads;                      // 线程数的上限，即m_threads的大小
+    char* m_slot_state;
+    locker m_resize_lock;                   // 创建和退出工作线程时加锁
+    std::atomic< int > m_live;              // 正在运行的工作线程数
+    PIN_MODE m_pin;
+
+    std::atomic< int > m_pending;           // 已经入队、还没有开始处理的任务数
+    std::atomic< uint64_t > m_wait_ns;      // 排队时间的指数移动平均
+    std::atomic< uint64_t > m_progress_ns;  // 最近一次有任务开始处理，或者队列由空变为非空的时刻
+    std::atomic< uint64_t > m_last_grow_ns; // 最近一次增加线程的时刻
+    uint64_t m_slo_ns;
+    uint64_t m_grow_ns;                     // 排队时间超过它时增加线程
 };
 
 template< typename T >
-threadpool< T >::threadpool(int thread_number, int max_requests) : 
+threadpool< T >::threadpool(int thread_number, int max_requests, QUEUE_MODE mode, PIN_MODE pin,
+        int max_threads, int slo_ms) : 
         m_thread_number(thread_number), m_max_requests(max_requests), 
-        m_stop(false), m_threads(NULL) {
+        m_stop(false), m_threads(NULL), m_mode(mode), m_lockfree_queue(NULL),
+        m_slots(NULL), m_next_index(0), m_max_threads(max_threads), m_slot_state(NULL), m_live(0), m_pin(pin),
+        m_pending(0), m_wait_ns(0), m_progress_ns(0), m_last_grow_ns(0),
+        m_slo_ns( ( uint64_t )slo_ms * 1000000ULL ) {
 
     if((thread_number <= 0) || (max_requests <= 0) ) { // 检查传入参数是否合法
         throw std::exception();
     }
 
-    m_threads = new pthread_t[m_thread_number]; // 分配内存用于存储线程标识符数组
+    // 工作窃取模式下每个工作线程有自己的队列，线程数固定
+    if( m_max_threads < m_thread_number || m_mode == QUEUE_STEALING ) {
+        m_max_threads = m_thread_number;
+    }
+    m_grow_ns = slo_ms > 0 ? m_slo_ns / 4 : GROW_WAIT_MS * 1000000ULL;
+
+    if( m_mode == QUEUE_LOCKFREE ) {
+        m_lockfree_queue = new mpmc_queue< T* >( m_max_requests );
+    } else if( m_mode == QUEUE_STEALING ) {
+        // 每个收件箱分得m_max_requests的一份，总容量不少于m_max_requests
+        m_slots = new worker_slot[ m_thread_number ];
+        for( int i = 0; i < m_thread_number; ++i ) {
+            m_slots[i].inbox = new mpmc_queue< T* >( ( m_max_requests + m_thread_number - 1 ) / m_thread_number );
+        }
+    }
+
+    m_threads = new pthread_t[m_max_threads]; // 分配内存用于存储线程标识符数组，按上限分配
     if(!m_threads) { // 如果分配失败抛出异常。
         throw std::exception();
     }
+    m_slot_state = new char[m_max_threads]();
 
-    // 创建thread_number 个线程，并将他们设置为脱离线程。
+    // 创建thread_number 个线程，析构时回收它们。
     for ( int i = 0; i < thread_number; ++i ) { // 逐个创建 thread_number 个线程
         printf( "create the %dth thread\n", i);
-        if(pthread_create(m_threads + i, NULL, worker, this ) != 0) {
+        if(!spawn( i )) {
             /*
             int pthread_create(pthread_t *thread, const pthread_attr_t *attr, 
                     void *(*start_routine)(void *), void *arg);各参数的含义
@@ -92,44 +218,231 @@ threadpool< T >::threadpool(int thread_number, int max_requests) :
                 这个参数机制方便把必要的信息传递给新线程，让它知晓要处理的任务细节。
             */
             // 如果 pthread_create 函数调用失败，返回非零值，就会进入 if 分支执行后续代码。
-            // 如果线程创建失败，先释放之前已经分配的 m_threads 数组内存，避免内存泄漏。
-            // 抛出一个 std::exception 类型的异常，通知调用者线程创建过程出现问题，调用者可以捕获这个异常进行相应处理。
+            // 先让已经创建的线程退出并回收它们，再释放 m_threads 数组，最后抛出异常通知调用者。
+            stop_workers();
             delete [] m_threads;
+            delete [] m_slot_state;
             throw std::exception();
         }
-        
-        if( pthread_detach( m_threads[i] ) ) {
-            /*
-            int pthread_detach(pthread_t thread);
-            - thread 是要设置为脱离状态的线程的标识符，也就是通过 pthread_create 函数创建线程时，
-                存储在 pthread_t 类型变量中的那个值。这个值唯一标识了程序中的某个线程。
-            脱离状态的意义：在常规的线程模型里，当一个线程结束执行后，它的资源（例如线程栈空间）
-                并不会立即被系统回收，需要其他线程调用 pthread_join 函数来等待该线程结束，并回收它的资源。
-                但如果一个线程被设置为脱离状态，当它执行完毕，系统会自动回收它的所有资源，
-                无需等待其他线程执行 pthread_join。
-            */
-            // 如果 pthread_detach 函数调用失败
-            // 如果线程创建失败，先释放之前已经分配的 m_threads 数组内存，避免内存泄漏。
-            delete [] m_threads;
-            throw std::exception();
+
+        // 工作线程不设置为脱离状态，析构时用pthread_join等待它们结束，保证退出时没有线程还在访问连接
+    }
+}
+
+template< typename T >
+bool threadpool< T >::spawn( int index ) {
+    if( pthread_create( m_threads + index, NULL, worker, this ) != 0 ) {
+        return false;
+    }
+    m_slot_state[index] = SLOT_RUNNING;
+    m_live.fetch_add( 1, std::memory_order_relaxed );
+    if( m_pin != PIN_NONE ) {
+        set_affinity( index, m_pin );
+    }
+    return true;
+}
+
+template< typename T >
+void threadpool< T >::grow() {
+    m_resize_lock.lock();
+    if( !m_stop && m_live.load( std::memory_order_relaxed ) < m_max_threads ) {
+        for( int i = 0; i < m_max_threads; ++i ) {
+            if( m_slot_state[i] == SLOT_RUNNING ) {
+                continue;
+            }
+            // 退出的线程已经登记过，很快就会结束，回收之后复用它的位置
+            if( m_slot_state[i] == SLOT_EXITED ) {
+                pthread_join( m_threads[i], NULL );
+                m_slot_state[i] = SLOT_FREE;
+            }
+            spawn( i );
+            break;
         }
     }
+    m_resize_lock.unlock();
+}
+
+template< typename T >
+void threadpool< T >::maybe_grow( uint64_t now ) {
+    if( m_live.load( std::memory_order_relaxed ) >= m_max_threads ) {
+        return;
+    }
+    // 新线程要过一会儿才能让排队时间降下来，限制增加的速度，同时只有一个线程去增加
+    uint64_t last = m_last_grow_ns.load( std::memory_order_relaxed );
+    if( ( int64_t )( now - last ) < GROW_INTERVAL_MS * 1000000LL
+            || !m_last_grow_ns.compare_exchange_strong( last, now, std::memory_order_relaxed ) ) {
+        return;
+    }
+    grow();
+}
+
+template< typename T >
+bool threadpool< T >::retire() {
+    bool retired = false;
+    m_resize_lock.lock();
+    if( !m_stop && m_live.load( std::memory_order_relaxed ) > m_thread_number ) {
+        for( int i = 0; i < m_max_threads; ++i ) {
+            if( m_slot_state[i] == SLOT_RUNNING && pthread_equal( m_threads[i], pthread_self() ) ) {
+                // 由下一次grow()或者析构函数回收
+                m_slot_state[i] = SLOT_EXITED;
+                m_live.fetch_sub( 1, std::memory_order_relaxed );
+                retired = true;
+                break;
+            }
+        }
+    }
+    m_resize_lock.unlock();
+    return retired;
+}
+
+template< typename T >
+void threadpool< T >::execute( T* request ) {
+    uint64_t now = pool_now_ns();
+    uint64_t wait = now - request->m_queued_ns;
+    m_pending.fetch_sub( 1, std::memory_order_relaxed );
+    m_progress_ns.store( now, std::memory_order_relaxed );
+    // 权重1/8的移动平均，多个线程同时更新时丢掉个别样本无关紧要
+    uint64_t avg = m_wait_ns.load( std::memory_order_relaxed );
+    m_wait_ns.store( avg - avg / 8 + wait / 8, std::memory_order_relaxed );
+    if( wait >= m_grow_ns ) {
+        maybe_grow( now );
+    }
+    request->process();
+}
+
+template< typename T >
+void threadpool< T >::check() {
+    if( m_pending.load( std::memory_order_relaxed ) == 0 ) {
+        return;
+    }
+    // 队列非空却有一段时间没有任务开始处理，工作线程可能都阻塞了
+    uint64_t now = pool_now_ns();
+    if( ( int64_t )( now - m_progress_ns.load( std::memory_order_relaxed ) ) > ( int64_t )m_grow_ns ) {
+        maybe_grow( now );
+    }
+}
+
+template< typename T >
+bool threadpool< T >::overloaded() {
+    // 队列是空的，新任务马上就能开始处理；这也保证了拒绝期间移动平均不再更新时不会一直拒绝下去
+    if( m_slo_ns == 0 || m_pending.load( std::memory_order_relaxed ) == 0 ) {
+        return false;
+    }
+    int64_t stalled = ( int64_t )( pool_now_ns() - m_progress_ns.load( std::memory_order_relaxed ) );
+    return m_wait_ns.load( std::memory_order_relaxed ) > m_slo_ns || stalled > ( int64_t )m_slo_ns;
 }
 
 template< typename T >
 threadpool< T >::~threadpool() {
     /*
-    先释放之前已经分配的 m_threads 数组内存，避免内存泄漏。
-    m_stop标记为true，结束线程池
+    m_stop标记为true，唤醒所有工作线程并等待它们退出，
+    之后才能释放 m_threads 数组和各个队列，否则工作线程可能还在访问它们。
     */
+    stop_workers();
     delete [] m_threads;
-    m_stop = true;
+    delete [] m_slot_state;
+    delete m_lockfree_queue;
+    if( m_slots ) {
+        for( int i = 0; i < m_thread_number; ++i ) {
+            delete m_slots[i].inbox;
+        }
+        delete [] m_slots;
+    }
+}
+
+template< typename T >
+void threadpool< T >::stop_workers() {
+    m_stop.store( true, std::memory_order_seq_cst );
+    // 三种模式的休眠方式不同，各自都要唤醒：信号量每个线程post一次，事件计数器唤醒全部等待者
+    for( int i = 0; i < m_max_threads; ++i ) {
+        m_queuestat.post();
+    }
+    m_idle.notify_all();
+    if( m_slots ) {
+        for( int i = 0; i < m_thread_number; ++i ) {
+            m_slots[i].wake.notify_all();
+        }
+    }
+    // 设置m_stop之后不会再创建线程；join时不能持有m_resize_lock，正在登记退出的线程要用它
+    m_resize_lock.lock();
+    std::vector< pthread_t > threads;
+    for( int i = 0; i < m_max_threads; ++i ) {
+        if( m_slot_state[i] != SLOT_FREE ) {
+            threads.push_back( m_threads[i] );
+            m_slot_state[i] = SLOT_FREE;
+        }
+    }
+    m_resize_lock.unlock();
+    for( size_t i = 0; i < threads.size(); ++i ) {
+        pthread_join( threads[i], NULL );
+    }
+}
+
+template< typename T >
+int threadpool< T >::queue_depth()
+{
+    if( m_mode == QUEUE_STEALING ) {
+        int depth = 0;
+        for( int i = 0; i < m_thread_number; ++i ) {
+            depth += ( int )m_slots[i].inbox->size() + m_slots[i].deque.size();
+        }
+        return depth;
+    }
+    if( m_mode == QUEUE_LOCKFREE ) {
+        return ( int )m_lockfree_queue->size();
+    }
+    m_queuelocker.lock();
+    int depth = ( int )m_workqueue.size();
+    m_queuelocker.unlock();
+    return depth;
 }
 
 //主要功能是向线程池的工作队列中添加任务
 template< typename T >
-bool threadpool< T >::append( T* request )
+bool threadpool< T >::append( T* request, int affinity )
 {
+    // 记下入队的时刻，先于入队：工作线程可能马上就取走它
+    uint64_t now = pool_now_ns();
+    request->m_queued_ns = now;
+    if( m_pending.fetch_add( 1, std::memory_order_relaxed ) == 0 ) {
+        // 队列由空变为非空，从现在开始计算有没有任务开始处理
+        m_progress_ns.store( now, std::memory_order_relaxed );
+    }
+    if( !push( request, affinity ) ) {
+        m_pending.fetch_sub( 1, std::memory_order_relaxed );
+        return false;
+    }
+    return true;
+}
+
+template< typename T >
+bool threadpool< T >::push( T* request, int affinity )
+{
+    if( m_mode == QUEUE_STEALING ) {
+        // 按亲和性提示的乘法哈希选择目标线程，同一个连接总是落到同一个线程上，它的缓冲区就留在该线程的缓存中
+        uint32_t h = affinity >= 0 ? ( uint32_t )affinity : ( uint32_t )( ( uintptr_t )request >> 4 );
+        int target = ( h * 2654435761u ) % m_thread_number;
+        if( !m_slots[target].inbox->push( request ) ) {
+            return false;
+        }
+        // 目标线程没有休眠（正忙）时，唤醒一个空闲的线程来窃取，避免突发负载下任务在忙碌的线程后面排队
+        for( int i = 0; i < m_thread_number; ++i ) {
+            if( m_slots[ ( target + i ) % m_thread_number ].wake.notify_one() ) {
+                break;
+            }
+        }
+        return true;
+    }
+
+    if( m_mode == QUEUE_LOCKFREE ) {
+        // 无锁入队，队列满时拒绝；只有存在休眠的工作线程时才需要futex唤醒
+        if( !m_lockfree_queue->push( request ) ) {
+            return false;
+        }
+        m_idle.notify_one();
+        return true;
+    }
+
     // 操作工作队列时一定要加锁，因为它被所有线程共享。
     // 共享队列加锁，多线程环境下，多个线程可能同时尝试访问和修改工作队列，加锁能避免数据竞争和不一致问题，确保线程安全。
     m_queuelocker.lock();
@@ -173,7 +486,13 @@ void* threadpool< T >::worker( void* arg )
     调用获取到的线程池对象 pool 的 run 方法。run 方法包含了线程池内线程实际执行任务的逻辑循环：
     不断检查任务队列是否有任务、取出任务并执行。线程创建后，就从这里开始进入正式的任务处理流程。
     */
-    pool->run();
+    if( pool->m_mode == QUEUE_LOCKFREE ) {
+        pool->run_lockfree();
+    } else if( pool->m_mode == QUEUE_STEALING ) {
+        pool->run_stealing();
+    } else {
+        pool->run();
+    }
 
     return pool; // 返回指向线程池对象的指针
 }
@@ -191,7 +510,17 @@ void threadpool< T >::run() {
         前面在往任务队列添加任务时，会执行 m_queuestat.post() 来增加信号量的值，
         意味着当有新任务加入队列时，处于等待状态的线程就会被唤醒，避免线程空转消耗资源，实现高效的任务调度。
         */
-        m_queuestat.wait();
+        if ( !m_queuestat.timedwait( IDLE_EXIT_MS ) ) {
+            // 空闲了IDLE_EXIT_MS（或者被信号打断），线程数多于下限时退出；没有取走信号量，不会丢失任务
+            if ( retire() ) {
+                break;
+            }
+            continue;
+        }
+        if ( m_stop ) {
+            // 被析构函数唤醒
+            break;
+        }
 
         /*
         线程被唤醒后，先获取互斥锁 m_queuelocker，用于锁定任务队列 m_workqueue。
@@ -222,9 +551,128 @@ void threadpool< T >::run() {
         调用任务对象的 process 方法来执行实际的任务内容。
         这里假设任务类 T 定义了 process 方法，该方法包含了针对特定任务的具体处理逻辑。
         */
-        request->process();
+        execute( request );
     }
 
 }
 
+/*
+无锁队列模式下的工作线程循环
+队列非空时直接出队，不加锁也不陷入内核；队列为空时先自旋若干次，
+仍然取不到任务再登记到m_idle上，最后检查一次队列后通过futex休眠。
+*/
+template< typename T >
+void threadpool< T >::run_lockfree() {
+    const int SPIN_COUNT = 64;
+    while ( !m_stop ) {
+        T* request = NULL;
+        bool got = false;
+        for ( int i = 0; i < SPIN_COUNT && !got; ++i ) {
+            got = m_lockfree_queue->pop( request );
+            if ( !got ) {
+                cpu_relax();
+            }
+        }
+        if ( !got ) {
+            int key = m_idle.prepare_wait();
+            // 登记之后再检查一次m_stop：析构函数设置m_stop在notify_all之前，这里要么看到m_stop，要么被唤醒
+            if ( m_stop ) {
+                m_idle.cancel_wait();
+                break;
+            }
+            if ( m_lockfree_queue->pop( request ) ) {
+                m_idle.cancel_wait();
+            } else {
+                if ( !m_idle.wait( key, IDLE_EXIT_MS ) && m_lockfree_queue->size() == 0 && retire() ) {
+                    // 超时的同时可能有唤醒落在了自己身上，转交给其他空闲线程
+                    m_idle.notify_one();
+                    break;
+                }
+                continue;
+            }
+        }
+        if ( !request ) {
+            continue;
+        }
+        execute( request );
+    }
+}
+
+/*
+工作窃取模式下的工作线程循环
+1. 先从本地双端队列的底部取任务，它们是最近投递给本线程的，数据很可能还在本核的缓存中
+2. 本地队列为空时，从收件箱取一个任务执行，并把收件箱中随后的一小批任务转入本地队列
+3. 仍然没有任务时，依次从其他线程的本地队列顶部和收件箱中窃取
+4. 全都为空时登记到自己的事件计数器上，最后检查一遍后休眠
+*/
+template< typename T >
+void threadpool< T >::run_stealing() {
+    const int SPIN_COUNT = 16;
+    const int BATCH = 32;
+    int self = m_next_index.fetch_add( 1 ) % m_thread_number;
+    worker_slot& me = m_slots[self];
+    while ( !m_stop ) {
+        T* request = me.deque.pop();
+        if ( !request && me.inbox->pop( request ) ) {
+            T* more = NULL;
+            for ( int i = 0; i < BATCH && me.inbox->pop( more ); ++i ) {
+                if ( !me.deque.push( more ) ) {
+                    execute( more );
+                }
+            }
+        }
+        for ( int i = 0; i < SPIN_COUNT && !request; ++i ) {
+            request = steal( self );
+            if ( !request ) {
+                cpu_relax();
+            }
+        }
+        if ( !request ) {
+            int key = me.wake.prepare_wait();
+            if ( m_stop ) {
+                me.wake.cancel_wait();
+                break;
+            }
+            if ( me.inbox->pop( request ) || ( request = steal( self ) ) ) {
+                me.wake.cancel_wait();
+            } else {
+                me.wake.wait( key );
+                continue;
+            }
+        }
+        execute( request );
+    }
+}
+
+template< typename T >
+T* threadpool< T >::steal( int self ) {
+    T* request = NULL;
+    for ( int i = 1; i < m_thread_number; ++i ) {
+        worker_slot& victim = m_slots[ ( self + i ) % m_thread_number ];
+        if ( ( request = victim.deque.steal() ) || victim.inbox->pop( request ) ) {
+            return request;
+        }
+    }
+    return NULL;
+}
+
+template< typename T >
+void threadpool< T >::set_affinity( int index, PIN_MODE pin ) {
+    cpu_set_t set;
+    CPU_ZERO( &set );
+    if ( pin == PIN_NUMA ) {
+        if ( numa::node_cpus( index % numa::node_count(), &set ) > 0 ) {
+            pthread_setaffinity_np( m_threads[index], sizeof( set ), &set );
+            return;
+        }
+        // 没有NUMA信息时退化为按CPU绑定
+    }
+    long cpus = sysconf( _SC_NPROCESSORS_ONLN );
+    if ( cpus <= 0 ) {
+        return;
+    }
+    CPU_SET( index % cpus, &set );
+    pthread_setaffinity_np( m_threads[index], sizeof( set ), &set );
+}
+
 #endif
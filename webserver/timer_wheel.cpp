@@ -0,0 +1,64 @@
+#include "timer_wheel.h"
+
+timer_wheel::timer_wheel( int tick_ms ) : m_tick_ms( tick_ms > 0 ? tick_ms : 1 ), m_cur_slot( 0 ) {
+    for( int i = 0; i < N; ++i ) {
+        m_slots[i] = NULL;
+    }
+}
+
+// 定时器都嵌入在其他对象中，时间轮不拥有它们
+timer_wheel::~timer_wheel() {
+}
+
+void timer_wheel::add( tw_timer* timer, int timeout_ms ) {
+    if( timer->active() ) {
+        del( timer );
+    }
+    // 不足一个滴答的超时按一个滴答计算
+    // 指针在k（1 <= k <= N）个滴答后第一次经过 (当前槽 + k) % N 槽，之后每转一圈经过一次
+    int ticks = timeout_ms < m_tick_ms ? 1 : timeout_ms / m_tick_ms;
+    timer->rotation = ( ticks - 1 ) / N;
+    timer->slot = ( m_cur_slot + ( ticks - 1 ) % N + 1 ) % N;
+    timer->prev = NULL;
+    timer->next = m_slots[ timer->slot ];
+    if( timer->next ) {
+        timer->next->prev = timer;
+    }
+    m_slots[ timer->slot ] = timer;
+}
+
+void timer_wheel::del( tw_timer* timer ) {
+    if( !timer->active() ) {
+        return;
+    }
+    if( timer->prev ) {
+        timer->prev->next = timer->next;
+    } else {
+        m_slots[ timer->slot ] = timer->next;
+    }
+    if( timer->next ) {
+        timer->next->prev = timer->prev;
+    }
+    timer->prev = timer->next = NULL;
+    timer->slot = -1;
+}
+
+void timer_wheel::reset( tw_timer* timer, int timeout_ms ) {
+    add( timer, timeout_ms );
+}
+
+void timer_wheel::tick( void ( *on_expire )( tw_timer* timer, void* arg ), void* arg ) {
+    // 指针先转到下一格，这样回调中新添加的定时器至少要等一个完整的滴答
+    m_cur_slot = ( m_cur_slot + 1 ) % N;
+    tw_timer* timer = m_slots[ m_cur_slot ];
+    while( timer ) {
+        tw_timer* next = timer->next;
+        if( timer->rotation > 0 ) {
+            timer->rotation--;
+        } else {
+            del( timer );
+            on_expire( timer, arg );
+        }
+        timer = next;
+    }
+}
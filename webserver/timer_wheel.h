@@ -0,0 +1,47 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stddef.h>
+
+// 时间轮上的定时器，侵入式地嵌入在被管理的对象（如http_conn）中，添加和删除都不分配内存
+struct tw_timer {
+    tw_timer() : rotation( 0 ), slot( -1 ), prev( NULL ), next( NULL ), data( NULL ) {}
+    bool active() const { return slot >= 0; }
+
+    int rotation;       // 定时器在时间轮转多少圈后生效
+    int slot;           // 定时器所在的槽，-1表示不在时间轮上
+    tw_timer* prev;     // 槽内的双向链表
+    tw_timer* next;
+    void* data;         // 定时器所属的对象
+};
+
+/*
+    时间轮
+    时间轮有N个槽，指针每隔一个滴答（tick_ms毫秒）转动一格，每个槽是一个定时器的双向链表。
+    超时时间为t的定时器放在 (当前槽 + t / tick_ms) % N 槽中，并记录还需要转动的圈数rotation，
+    指针转到该槽时，rotation为0的定时器到期，其余的圈数减1。
+    添加、删除和重置都是O(1)，连接每次有活动时重置定时器的开销很小。
+    时间轮只由所属的反应堆线程访问，不需要加锁。
+*/
+class timer_wheel {
+public:
+    explicit timer_wheel( int tick_ms );
+    ~timer_wheel();
+
+    void add( tw_timer* timer, int timeout_ms );    // 添加定时器，timeout_ms毫秒后到期
+    void del( tw_timer* timer );                    // 删除定时器，不在时间轮上时什么也不做
+    void reset( tw_timer* timer, int timeout_ms );  // 重置到期时间
+
+    // 指针转动一格，对到期的定时器调用on_expire，回调中只能重新添加或删除这个到期的定时器
+    void tick( void ( *on_expire )( tw_timer* timer, void* arg ), void* arg );
+
+    int tick_ms() const { return m_tick_ms; }
+
+private:
+    static const int N = 512;   // 时间轮上槽的数目
+    int m_tick_ms;              // 槽间隔（滴答）
+    int m_cur_slot;             // 时间轮的当前槽
+    tw_timer* m_slots[ N ];     // 每个槽的链表头
+};
+
+#endif
@@ -0,0 +1,228 @@
+#include "tls.h"
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include "metrics.h"
+#include "logger.h"
+#ifdef WS_WITH_TLS
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#endif
+
+ssl_ctx_st* tls::m_ctx = NULL;
+bool tls::m_h2 = false;
+
+#ifdef WS_WITH_TLS
+
+// 长度前缀的协议列表，没有打开HTTP/2时从http/1.1开始
+static const unsigned char alpn_protos[] = "\x02h2\x08http/1.1";
+static const int ALPN_H1_OFFSET = 3;
+
+// arg指向服务端可以接受的协议列表
+static int select_alpn( SSL* ssl, const unsigned char** out, unsigned char* outlen,
+        const unsigned char* in, unsigned int inlen, void* arg ) {
+    const unsigned char* protos = static_cast< const unsigned char* >( arg );
+    unsigned int len = alpn_protos + sizeof( alpn_protos ) - 1 - protos;
+    unsigned char* selected = NULL;
+    if( SSL_select_next_proto( &selected, outlen, protos, len, in, inlen ) != OPENSSL_NPN_NEGOTIATED ) {
+        return SSL_TLSEXT_ERR_NOACK;
+    }
+    *out = selected;
+    return SSL_TLSEXT_ERR_OK;
+}
+
+bool tls::init( const char* cert, const char* key, bool h2 ) {
+    SSL_CTX* ctx = SSL_CTX_new( TLS_server_method() );
+    if( !ctx ) {
+        return false;
+    }
+    SSL_CTX_set_min_proto_version( ctx, TLS1_2_VERSION );
+    SSL_CTX_set_options( ctx, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION | SSL_OP_CIPHER_SERVER_PREFERENCE );
+    // writev的一块可能只发出一部分，下一轮从断点继续，缓冲区的地址会变；空闲连接不保留OpenSSL的读写缓冲区
+    SSL_CTX_set_mode( ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER | SSL_MODE_RELEASE_BUFFERS );
+    // TLS1.2只用内核能够卸载的AEAD算法，TLS1.3默认的算法内核都支持
+    SSL_CTX_set_cipher_list( ctx, "ECDHE+AESGCM:ECDHE+CHACHA20" );
+    // 会话恢复只用无状态的ticket，TLS1.3每次握手只发一张
+    SSL_CTX_set_session_cache_mode( ctx, SSL_SESS_CACHE_OFF );
+    SSL_CTX_set_num_tickets( ctx, 1 );
+    SSL_CTX_set_alpn_select_cb( ctx, select_alpn,
+            const_cast< unsigned char* >( h2 ? alpn_protos : alpn_protos + ALPN_H1_OFFSET ) );
+    if( SSL_CTX_use_certificate_chain_file( ctx, cert ) != 1
+            || SSL_CTX_use_PrivateKey_file( ctx, key, SSL_FILETYPE_PEM ) != 1
+            || SSL_CTX_check_private_key( ctx ) != 1 ) {
+        printf( "load certificate %s and key %s failure: %s\n", cert, key, ERR_error_string( ERR_get_error(), NULL ) );
+        SSL_CTX_free( ctx );
+        return false;
+    }
+    m_ctx = ctx;
+    m_h2 = h2;
+    return true;
+}
+
+ssl_st* tls::accept( int fd ) {
+    SSL* ssl = SSL_new( m_ctx );
+    if( !ssl ) {
+        return NULL;
+    }
+    // socket BIO，KTLS只能用在它上面；SSL_free时不关闭fd
+    if( SSL_set_fd( ssl, fd ) != 1 ) {
+        SSL_free( ssl );
+        return NULL;
+    }
+    SSL_set_accept_state( ssl );
+    return ssl;
+}
+
+tls::RESULT tls::handshake( ssl_st* ssl, bool* ktls_send, bool* ktls_recv ) {
+    // 错误队列是线程的，先清掉别的连接留下的错误，SSL_get_error才准确
+    ERR_clear_error();
+    int ret = SSL_do_handshake( ssl );
+    if( ret == 1 ) {
+#ifndef OPENSSL_NO_KTLS
+        *ktls_send = BIO_get_ktls_send( SSL_get_wbio( ssl ) );
+        *ktls_recv = BIO_get_ktls_recv( SSL_get_rbio( ssl ) );
+#else
+        *ktls_send = *ktls_recv = false;
+#endif
+        metrics::add( METRIC_TLS_HANDSHAKES, 1 );
+        metrics::add( METRIC_TLS_RESUMED, SSL_session_reused( ssl ) ? 1 : 0 );
+        metrics::add( METRIC_KTLS_TX, *ktls_send ? 1 : 0 );
+        metrics::add( METRIC_KTLS_RX, *ktls_recv ? 1 : 0 );
+        LOG_DEBUG( "TLS handshake done: %s %s, resumed %d, ktls tx %d rx %d", SSL_get_version( ssl ),
+                SSL_get_cipher_name( ssl ), SSL_session_reused( ssl ), *ktls_send, *ktls_recv );
+        return TLS_DONE;
+    }
+    switch( SSL_get_error( ssl, ret ) ) {
+        case SSL_ERROR_WANT_READ:
+            return TLS_WANT_READ;
+        case SSL_ERROR_WANT_WRITE:
+            return TLS_WANT_WRITE;
+        default:
+            LOG_DEBUG( "TLS handshake failure: %s", ERR_error_string( ERR_get_error(), NULL ) );
+            return TLS_ERROR;
+    }
+}
+
+ssize_t tls::read( ssl_st* ssl, char* buf, int len ) {
+    ERR_clear_error();
+    int n = SSL_read( ssl, buf, len );
+    if( n > 0 ) {
+        return n;
+    }
+    switch( SSL_get_error( ssl, n ) ) {
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE:
+            errno = EAGAIN;
+            return -1;
+        case SSL_ERROR_ZERO_RETURN:
+            return 0;
+        default:
+            errno = EIO;
+            return -1;
+    }
+}
+
+/*
+    每一块用一次SSL_write，一块只写出一部分时停下。SSL_write要等待socket时已经加密好的记录留在OpenSSL中，
+    调用者下一次从同一个断点重新调用，第一块的内容和长度都和这次相同，满足OpenSSL对重试的要求
+*/
+/*
+    每次SSL_write都是单独的TLS记录和单独的send，HTTP/2的帧头只有9字节，逐块写会产生大量小记录和小TCP段，
+    还会和Nagle算法、对方的延迟确认互相等待。所以不满一个记录的块先复制到栈上的缓冲区凑满一个记录再写，
+    只有从块的开头就够一个记录的大块直接从原地址写出。
+    WANT_WRITE之后调用者用同样的（已经去掉发出部分的）iovec重试，合并的结果和上一次相同，满足SSL_write重试的要求
+*/
+static const int RECORD_SIZE = 16384;
+
+ssize_t tls::writev( ssl_st* ssl, const struct iovec* iov, int count ) {
+    char buf[ RECORD_SIZE ];
+    ssize_t total = 0;
+    int i = 0;
+    size_t offset = 0;      // iov[i]中已经写出或复制的字节数
+    while( i < count ) {
+        const char* data;
+        int len;
+        int next = i;
+        size_t next_offset = offset;
+        if( iov[i].iov_len - offset >= ( size_t )RECORD_SIZE ) {
+            data = ( const char* )iov[i].iov_base + offset;
+            len = iov[i].iov_len - offset;
+            ++next;
+            next_offset = 0;
+        } else {
+            len = 0;
+            while( next < count && len < RECORD_SIZE ) {
+                size_t n = iov[next].iov_len - next_offset;
+                if( n > ( size_t )( RECORD_SIZE - len ) ) {
+                    n = RECORD_SIZE - len;
+                }
+                memcpy( buf + len, ( const char* )iov[next].iov_base + next_offset, n );
+                len += n;
+                next_offset += n;
+                if( next_offset == iov[next].iov_len ) {
+                    ++next;
+                    next_offset = 0;
+                }
+            }
+            data = buf;
+        }
+        ERR_clear_error();
+        int n = SSL_write( ssl, data, len );
+        if( n <= 0 ) {
+            if( total > 0 ) {
+                return total;
+            }
+            int err = SSL_get_error( ssl, n );
+            errno = ( err == SSL_ERROR_WANT_WRITE || err == SSL_ERROR_WANT_READ ) ? EAGAIN : EIO;
+            return -1;
+        }
+        total += n;
+        if( n < len ) {
+            break;
+        }
+        i = next;
+        offset = next_offset;
+    }
+    return total;
+}
+
+bool tls::pending( const ssl_st* ssl ) {
+    return SSL_pending( ssl ) > 0;
+}
+
+bool tls::alpn_h2( const ssl_st* ssl ) {
+    if( !m_h2 ) {
+        return false;
+    }
+    const unsigned char* proto = NULL;
+    unsigned int len = 0;
+    SSL_get0_alpn_selected( ssl, &proto, &len );
+    return len == 2 && proto[0] == 'h' && proto[1] == '2';
+}
+
+void tls::close( ssl_st* ssl ) {
+    // socket是非阻塞的，close_notify发不出去就算了，也不等待对方的close_notify
+    if( SSL_is_init_finished( ssl ) ) {
+        ERR_clear_error();
+        SSL_shutdown( ssl );
+    }
+    SSL_free( ssl );
+}
+
+#else
+
+// 编译时没有OpenSSL，只能使用明文的HTTP
+bool tls::init( const char* cert, const char* key, bool h2 ) {
+    printf( "TLS is not compiled in, rebuild with -DWS_WITH_TLS -lssl -lcrypto\n" );
+    return false;
+}
+
+ssl_st* tls::accept( int fd ) { return NULL; }
+tls::RESULT tls::handshake( ssl_st* ssl, bool* ktls_send, bool* ktls_recv ) { return TLS_ERROR; }
+ssize_t tls::read( ssl_st* ssl, char* buf, int len ) { errno = EIO; return -1; }
+ssize_t tls::writev( ssl_st* ssl, const struct iovec* iov, int count ) { errno = EIO; return -1; }
+bool tls::pending( const ssl_st* ssl ) { return false; }
+bool tls::alpn_h2( const ssl_st* ssl ) { return false; }
+void tls::close( ssl_st* ssl ) {}
+
+#endif
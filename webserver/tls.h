@@ -0,0 +1,46 @@
+#ifndef TLS_H
+#define TLS_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+struct ssl_st;
+struct ssl_ctx_st;
+
+/*
+    HTTPS，用 g++ -DWS_WITH_TLS *.cpp -pthread -lssl -lcrypto 编译，配置了证书时监听端口上的连接都是HTTPS
+    - 握手由连接所属的反应堆非阻塞地推进：socket可读或可写时继续SSL_do_handshake，每次只等待OpenSSL需要的那个方向，
+      握手的时间计入请求头超时
+    - 会话恢复只用无状态的session ticket，密钥启动时生成，所有反应堆共享一个SSL_CTX，服务端不缓存会话
+    - 打开OpenSSL的KTLS：协商出内核能够卸载的算法时，密钥在握手过程中交给内核（setsockopt(SOL_TLS)），
+      之后这个方向的socket上收发的都是明文，writev、sendfile、splice照常工作，加解密在内核中完成，静态文件仍然零拷贝
+    - 内核或OpenSSL不支持时这个方向退回到SSL_read/SSL_write：文件从映射发送，请求体不splice，不回复100 Continue，
+      反向代理的请求回复500（转发需要两个方向都由内核加解密）
+    - ALPN：打开HTTP/2时按客户端的顺序在h2和http/1.1中选择，否则只接受http/1.1，没有交集时不带ALPN继续握手
+    SSL对象和连接一样同一时刻只被一个线程使用，不需要加锁。
+*/
+class tls {
+public:
+    enum RESULT { TLS_DONE = 0, TLS_WANT_READ, TLS_WANT_WRITE, TLS_ERROR };
+
+    // 加载证书链和私钥（PEM），编译时没有WS_WITH_TLS或者加载失败时返回false；h2为true时ALPN可以选择HTTP/2
+    static bool init( const char* cert, const char* key, bool h2 );
+    static bool enabled() { return m_ctx != NULL; }
+
+    static ssl_st* accept( int fd );    // 为新连接创建服务端的SSL对象，失败时返回NULL
+    // 推进握手，完成时给出两个方向是否由内核加解密
+    static RESULT handshake( ssl_st* ssl, bool* ktls_send, bool* ktls_recv );
+    // 与recv、writev的返回值相同：-1时errno为EAGAIN表示要等待socket，对方发送close_notify时read返回0
+    static ssize_t read( ssl_st* ssl, char* buf, int len );
+    static ssize_t writev( ssl_st* ssl, const struct iovec* iov, int count );
+    static bool pending( const ssl_st* ssl );   // SSL中还有已经解密、没有读走的数据
+    static bool alpn_h2( const ssl_st* ssl );   // 握手时ALPN选择了h2
+    static void close( ssl_st* ssl );           // 尽量发出close_notify，释放SSL对象，不关闭socket
+
+private:
+    static ssl_ctx_st* m_ctx;
+    static bool m_h2;
+};
+
+#endif
@@ -0,0 +1,716 @@
+#include "upstream.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/tcp.h>
+#include "http_conn.h"
+#include "http_parser.h"
+#include "http_response.h"
+#include "metrics.h"
+#include "logger.h"
+
+extern void removefd( int epollfd, int fd );
+extern void modfd( int epollfd, int fd, int ev, uint64_t data );
+
+static const int SPLICE_CHUNK = 65536;  // 每次splice的最大字节数，不超过管道的容量
+
+// 分块编码的应答中正在扫描的部分
+enum CHUNK_SCAN {
+    CS_SIZE = 0,        // 块大小
+    CS_EXT,             // 块大小之后的扩展，直到行尾
+    CS_DATA,            // 块的数据
+    CS_DATA_END,        // 块数据之后的行尾
+    CS_TRAILER_START,   // 最后一个块之后一行的开始，空行表示应答结束
+    CS_TRAILER,         // 尾部字段的其余部分
+    CS_DONE
+};
+
+upstream::route upstream::m_routes[ upstream::MAX_ROUTES ];
+int upstream::m_route_number = 0;
+int upstream::m_keepalive = 32;
+
+bool upstream::add_route( const char* spec ) {
+    const char* eq = strchr( spec, '=' );
+    if( !eq || spec[0] != '/' || eq - spec >= PREFIX_LEN || m_route_number >= MAX_ROUTES ) {
+        return false;
+    }
+    const char* host = eq + 1;
+    const char* colon = strrchr( host, ':' );
+    if( !colon || colon == host || strlen( host ) >= ( size_t )HOST_LEN ) {
+        return false;
+    }
+    char* end = NULL;
+    long port = strtol( colon + 1, &end, 10 );
+    if( end == colon + 1 || *end != '\0' || port <= 0 || port > 65535 ) {
+        return false;
+    }
+    char name[ HOST_LEN ];
+    memcpy( name, host, colon - host );
+    name[ colon - host ] = '\0';
+
+    struct addrinfo hints;
+    memset( &hints, 0, sizeof( hints ) );
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo* res = NULL;
+    if( getaddrinfo( name, NULL, &hints, &res ) != 0 || !res ) {
+        return false;
+    }
+    route& r = m_routes[ m_route_number ];
+    r.prefix_len = eq - spec;
+    memcpy( r.prefix, spec, r.prefix_len );
+    r.prefix[ r.prefix_len ] = '\0';
+    strcpy( r.host, host );
+    memcpy( &r.addr, res->ai_addr, sizeof( r.addr ) );
+    r.addr.sin_port = htons( ( uint16_t )port );
+    freeaddrinfo( res );
+    ++m_route_number;
+    return true;
+}
+
+int upstream::match( const char* url ) {
+    int best = -1;
+    for( int i = 0; i < m_route_number; ++i ) {
+        if( strncmp( url, m_routes[i].prefix, m_routes[i].prefix_len ) == 0
+                && ( best < 0 || m_routes[i].prefix_len > m_routes[ best ].prefix_len ) ) {
+            best = i;
+        }
+    }
+    return best;
+}
+
+// 在[p, p + len)中查找不区分大小写的token（Connection、Transfer-Encoding的值是逗号分隔的列表）
+static bool has_token( const char* p, int len, const char* token ) {
+    int n = strlen( token );
+    for( int i = 0; i + n <= len; ++i ) {
+        if( strncasecmp( p + i, token, n ) == 0 ) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// 扫描分块编码的应答，返回属于这个应答的字节数，遇到结尾的空行时停止，后面的数据不属于它
+static int scan_chunks( upstream_conn* u, const char* p, int n ) {
+    int i = 0;
+    while( i < n && u->chunk_state != CS_DONE ) {
+        char ch = p[i];
+        switch( u->chunk_state ) {
+            case CS_SIZE:
+            case CS_EXT: {
+                if( ch == '\n' ) {
+                    u->chunk_state = u->chunk_left == 0 ? CS_TRAILER_START : CS_DATA;
+                } else if( u->chunk_state == CS_SIZE && isxdigit( ( unsigned char )ch ) ) {
+                    if( u->chunk_left > ( ( off_t )1 << 58 ) ) {
+                        // 块大小不可能这么大，当作直到关闭
+                        u->chunk_left = ( off_t )1 << 62;
+                    } else {
+                        u->chunk_left = u->chunk_left * 16 + ( ch <= '9' ? ch - '0' : ( ch | 0x20 ) - 'a' + 10 );
+                    }
+                } else if( ch != '\r' ) {
+                    u->chunk_state = CS_EXT;
+                }
+                ++i;
+                break;
+            }
+            case CS_DATA: {
+                off_t k = n - i;
+                if( k > u->chunk_left ) {
+                    k = u->chunk_left;
+                }
+                i += k;
+                u->chunk_left -= k;
+                if( u->chunk_left == 0 ) {
+                    u->chunk_state = CS_DATA_END;
+                }
+                break;
+            }
+            case CS_DATA_END: {
+                if( ch == '\n' ) {
+                    u->chunk_state = CS_SIZE;
+                }
+                ++i;
+                break;
+            }
+            case CS_TRAILER_START: {
+                if( ch == '\n' ) {
+                    u->chunk_state = CS_DONE;
+                } else if( ch != '\r' ) {
+                    u->chunk_state = CS_TRAILER;
+                }
+                ++i;
+                break;
+            }
+            case CS_TRAILER: {
+                if( ch == '\n' ) {
+                    u->chunk_state = CS_TRAILER_START;
+                }
+                ++i;
+                break;
+            }
+            default: {
+                break;
+            }
+        }
+    }
+    return i;
+}
+
+// 开始在后端连接u上转发客户端连接c的请求
+static void begin( upstream_conn* u, http_conn* c ) {
+    u->client = c;
+    u->req_sent = 0;
+    u->streamed = false;
+    u->in_len = 0;
+    u->out_len = 0;
+    u->out_sent = 0;
+    u->status = 0;
+    u->framing = upstream_conn::BODY_NONE;
+    u->remaining = 0;
+    u->chunk_state = CS_SIZE;
+    u->chunk_left = 0;
+    u->keep = false;
+    u->client_keep = false;
+    u->bytes = 0;
+}
+
+upstream_pool::upstream_pool( int epollfd, int size ) :
+        m_epollfd( epollfd ), m_conns( size, ( upstream_conn* )NULL ), m_idle( upstream::route_number() ) {
+}
+
+upstream_pool::~upstream_pool() {
+    // 平滑退出之后只剩下空闲连接
+    for( size_t fd = 0; fd < m_conns.size(); ++fd ) {
+        if( m_conns[ fd ] ) {
+            destroy( m_conns[ fd ] );
+        }
+    }
+}
+
+upstream_conn* upstream_pool::get( int route ) {
+    std::vector< upstream_conn* >& idle = m_idle[ route ];
+    if( !idle.empty() ) {
+        // 最近放回的连接最不可能已经被后端的空闲超时关闭
+        upstream_conn* u = idle.back();
+        idle.pop_back();
+        u->reused = true;
+        u->state = upstream_conn::SEND_REQUEST;
+        return u;
+    }
+    return connect_to( route );
+}
+
+upstream_conn* upstream_pool::connect_to( int route ) {
+    const upstream::route& r = upstream::get( route );
+    int fd = socket( AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 );
+    if( fd < 0 ) {
+        LOG_ERROR( "create upstream socket failure: %s", strerror( errno ) );
+        return NULL;
+    }
+    if( fd >= ( int )m_conns.size() ) {
+        close( fd );
+        return NULL;
+    }
+    int one = 1;
+    setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof( one ) );
+    bool connected = connect( fd, ( const struct sockaddr* )&r.addr, sizeof( r.addr ) ) == 0;
+    if( !connected && errno != EINPROGRESS ) {
+        LOG_WARN( "connect to upstream %s failure: %s", r.host, strerror( errno ) );
+        close( fd );
+        return NULL;
+    }
+    // 后端socket的数据是fd本身（代数为0），反应堆据此把事件交给连接池；一次性事件，需要时才注册
+    epoll_event event;
+    event.data.u64 = fd;
+    event.events = EPOLLONESHOT;
+    if( epoll_ctl( m_epollfd, EPOLL_CTL_ADD, fd, &event ) < 0 ) {
+        close( fd );
+        return NULL;
+    }
+    upstream_conn* u = new upstream_conn;
+    u->fd = fd;
+    u->route = route;
+    u->pipe[0] = u->pipe[1] = -1;
+    u->piped = 0;
+    u->state = connected ? upstream_conn::SEND_REQUEST : upstream_conn::CONNECTING;
+    u->reused = false;
+    u->client = NULL;
+    m_conns[ fd ] = u;
+    return u;
+}
+
+void upstream_pool::put( upstream_conn* u ) {
+    std::vector< upstream_conn* >& idle = m_idle[ u->route ];
+    if( !u->keep || u->piped > 0 || ( int )idle.size() >= upstream::m_keepalive ) {
+        destroy( u );
+        return;
+    }
+    // 空闲时等待EPOLLIN：后端关闭了连接，或者发来了不属于任何请求的数据，连接都不能再用
+    u->state = upstream_conn::IDLE;
+    u->client = NULL;
+    watch( u, EPOLLIN );
+    idle.push_back( u );
+}
+
+void upstream_pool::destroy( upstream_conn* u ) {
+    if( u->pipe[0] >= 0 ) {
+        close( u->pipe[0] );
+        close( u->pipe[1] );
+    }
+    m_conns[ u->fd ] = NULL;
+    removefd( m_epollfd, u->fd );
+    delete u;
+}
+
+void upstream_pool::watch( upstream_conn* u, uint32_t events ) {
+    epoll_event event;
+    event.data.u64 = u->fd;
+    event.events = events | EPOLLONESHOT;
+    epoll_ctl( m_epollfd, EPOLL_CTL_MOD, u->fd, &event );
+}
+
+void upstream_pool::wait_client( upstream_conn* u, int ev ) {
+    modfd( u->client->m_epollfd, u->client->m_sockfd, ev, u->client->handle() );
+}
+
+bool upstream_pool::ensure_pipe( upstream_conn* u ) {
+    if( u->pipe[0] < 0 && pipe2( u->pipe, O_NONBLOCK | O_CLOEXEC ) < 0 ) {
+        u->pipe[0] = u->pipe[1] = -1;
+        return false;
+    }
+    return true;
+}
+
+upstream_pool::RESULT upstream_pool::start( http_conn* conn ) {
+    upstream_conn* u = get( conn->m_proxy_route );
+    if( !u ) {
+        // 连不上后端：这一批之前的应答都已经发完，socket的发送缓冲区是空的，502直接发出
+        if( send( conn->m_sockfd, HTTP_RESPONSE_502.data, HTTP_RESPONSE_502.len, MSG_DONTWAIT | MSG_NOSIGNAL ) > 0 ) {
+            metrics::add( METRIC_BYTES_OUT, HTTP_RESPONSE_502.len );
+        }
+        LOG_ACCESS( conn->m_address.sin_addr.s_addr, conn->m_address.sin_port, conn->m_proxy_method, conn->m_url_buf,
+                502, HTTP_RESPONSE_502.len, metrics::now_ns() - conn->m_proxy_start );
+        return RELAY_CLOSE;
+    }
+    begin( u, conn );
+    conn->m_upstream = u;
+    return advance( u );
+}
+
+upstream_pool::RESULT upstream_pool::client_event( http_conn* conn, uint32_t events ) {
+    if( events & ( EPOLLRDHUP | EPOLLHUP | EPOLLERR ) ) {
+        // 客户端断开，后端连接上的应答已经没有人要了，由abort()关闭
+        return RELAY_CLOSE;
+    }
+    return advance( conn->m_upstream );
+}
+
+http_conn* upstream_pool::backend_event( int fd, uint32_t events, RESULT* result ) {
+    upstream_conn* u = fd >= 0 && fd < ( int )m_conns.size() ? m_conns[ fd ] : NULL;
+    if( !u ) {
+        // 同一批事件中前面已经关闭的后端连接
+        return NULL;
+    }
+    if( !u->client ) {
+        std::vector< upstream_conn* >& idle = m_idle[ u->route ];
+        for( size_t i = 0; i < idle.size(); ++i ) {
+            if( idle[i] == u ) {
+                idle.erase( idle.begin() + i );
+                break;
+            }
+        }
+        destroy( u );
+        return NULL;
+    }
+    http_conn* conn = u->client;
+    if( u->state == upstream_conn::CONNECTING ) {
+        int err = 0;
+        socklen_t len = sizeof( err );
+        if( getsockopt( fd, SOL_SOCKET, SO_ERROR, &err, &len ) < 0 ) {
+            err = errno;
+        }
+        if( err != 0 ) {
+            LOG_WARN( "connect to upstream %s failure: %s", upstream::get( u->route ).host, strerror( err ) );
+            *result = fail( u );
+            return conn;
+        }
+        u->state = upstream_conn::SEND_REQUEST;
+    }
+    *result = advance( u );
+    return conn;
+}
+
+void upstream_pool::abort( http_conn* conn ) {
+    upstream_conn* u = conn->m_upstream;
+    if( u ) {
+        conn->m_upstream = NULL;
+        destroy( u );
+    }
+}
+
+/*
+    依次完成转发的各个阶段，某个socket暂时不能读写时注册它的一次性事件并返回RELAY_WAIT。
+    同一时刻只等待后端和客户端中的一个，事件到达时从断点继续。
+*/
+upstream_pool::RESULT upstream_pool::advance( upstream_conn* u ) {
+    http_conn* c = u->client;
+    while( true ) {
+        switch( u->state ) {
+            case upstream_conn::CONNECTING: {
+                watch( u, EPOLLOUT );
+                return RELAY_WAIT;
+            }
+            case upstream_conn::SEND_REQUEST: {
+                ssize_t n = send( u->fd, c->m_proxy_buf + u->req_sent, c->m_proxy_len - u->req_sent, MSG_NOSIGNAL );
+                if( n < 0 ) {
+                    if( errno == EAGAIN || errno == EWOULDBLOCK ) {
+                        watch( u, EPOLLOUT );
+                        return RELAY_WAIT;
+                    } else if( errno == EINTR ) {
+                        break;
+                    }
+                    return fail( u );
+                }
+                u->req_sent += n;
+                if( u->req_sent == c->m_proxy_len ) {
+                    u->state = c->m_proxy_body > 0 ? upstream_conn::SEND_BODY : upstream_conn::RECV_HEAD;
+                }
+                break;
+            }
+            case upstream_conn::SEND_BODY: {
+                // 客户端socket -> 管道 -> 后端socket
+                if( u->piped > 0 ) {
+                    ssize_t n = splice( u->pipe[0], NULL, u->fd, NULL, u->piped, SPLICE_F_MOVE | SPLICE_F_NONBLOCK );
+                    if( n < 0 ) {
+                        if( errno == EAGAIN ) {
+                            watch( u, EPOLLOUT );
+                            return RELAY_WAIT;
+                        }
+                        return fail( u );
+                    }
+                    u->piped -= n;
+                    break;
+                }
+                if( c->m_proxy_body == 0 ) {
+                    u->state = upstream_conn::RECV_HEAD;
+                    break;
+                }
+                if( !ensure_pipe( u ) ) {
+                    return fail( u );
+                }
+                size_t want = c->m_proxy_body < SPLICE_CHUNK ? c->m_proxy_body : SPLICE_CHUNK;
+                ssize_t n = splice( c->m_sockfd, NULL, u->pipe[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK );
+                if( n < 0 ) {
+                    if( errno == EAGAIN ) {
+                        wait_client( u, EPOLLIN );
+                        return RELAY_WAIT;
+                    }
+                    return RELAY_CLOSE;
+                } else if( n == 0 ) {
+                    // 请求体还没有发完客户端就关闭了
+                    return RELAY_CLOSE;
+                }
+                metrics::add( METRIC_BYTES_IN, n );
+                u->streamed = true;
+                u->piped += n;
+                c->m_proxy_body -= n;
+                break;
+            }
+            case upstream_conn::RECV_HEAD: {
+                char* end = ( char* )memmem( u->in, u->in_len, "\r\n\r\n", 4 );
+                if( end ) {
+                    if( !parse_head( u, end + 4 - u->in ) ) {
+                        return fail( u );
+                    }
+                    break;
+                }
+                if( u->in_len == upstream_conn::BUF_SIZE ) {
+                    // 应答头太大
+                    return fail( u );
+                }
+                ssize_t n = recv( u->fd, u->in + u->in_len, upstream_conn::BUF_SIZE - u->in_len, 0 );
+                if( n < 0 ) {
+                    if( errno == EAGAIN || errno == EWOULDBLOCK ) {
+                        watch( u, EPOLLIN );
+                        return RELAY_WAIT;
+                    } else if( errno == EINTR ) {
+                        break;
+                    }
+                    return fail( u );
+                } else if( n == 0 ) {
+                    return fail( u );
+                }
+                u->in_len += n;
+                break;
+            }
+            case upstream_conn::SEND_OUT: {
+                if( u->out_sent < u->out_len ) {
+                    ssize_t n = send( c->m_sockfd, u->out + u->out_sent, u->out_len - u->out_sent, MSG_NOSIGNAL );
+                    if( n < 0 ) {
+                        if( errno == EAGAIN || errno == EWOULDBLOCK ) {
+                            metrics::add( METRIC_WRITE_STALLS, 1 );
+                            wait_client( u, EPOLLOUT );
+                            return RELAY_WAIT;
+                        } else if( errno == EINTR ) {
+                            break;
+                        }
+                        return RELAY_CLOSE;
+                    }
+                    metrics::add( METRIC_BYTES_OUT, n );
+                    u->out_sent += n;
+                    u->bytes += n;
+                    break;
+                }
+                u->out_len = u->out_sent = 0;
+                if( u->framing == upstream_conn::BODY_NONE || ( u->framing == upstream_conn::BODY_LENGTH && u->remaining == 0 )
+                        || ( u->framing == upstream_conn::BODY_CHUNKED && u->chunk_state == CS_DONE ) ) {
+                    return finish( u );
+                }
+                u->state = upstream_conn::RELAY_BODY;
+                break;
+            }
+            case upstream_conn::RELAY_BODY: {
+                if( u->framing == upstream_conn::BODY_CHUNKED ) {
+                    // 分块编码：经过out转发，边转发边找应答的结尾
+                    ssize_t n = recv( u->fd, u->out, upstream_conn::BUF_SIZE, 0 );
+                    if( n < 0 ) {
+                        if( errno == EAGAIN || errno == EWOULDBLOCK ) {
+                            watch( u, EPOLLIN );
+                            return RELAY_WAIT;
+                        } else if( errno == EINTR ) {
+                            break;
+                        }
+                        return RELAY_CLOSE;
+                    } else if( n == 0 ) {
+                        // 应答没有结束后端就关闭了，客户端只能从连接关闭知道应答不完整
+                        return RELAY_CLOSE;
+                    }
+                    u->out_len = scan_chunks( u, u->out, n );
+                    if( u->out_len < n ) {
+                        u->keep = false;
+                    }
+                    u->state = upstream_conn::SEND_OUT;
+                    break;
+                }
+                // 长度已知或者直到关闭：后端socket -> 管道 -> 客户端socket
+                if( u->piped > 0 ) {
+                    ssize_t n = splice( u->pipe[0], NULL, c->m_sockfd, NULL, u->piped, SPLICE_F_MOVE | SPLICE_F_NONBLOCK );
+                    if( n < 0 ) {
+                        if( errno == EAGAIN ) {
+                            metrics::add( METRIC_WRITE_STALLS, 1 );
+                            wait_client( u, EPOLLOUT );
+                            return RELAY_WAIT;
+                        }
+                        return RELAY_CLOSE;
+                    }
+                    metrics::add( METRIC_BYTES_OUT, n );
+                    u->piped -= n;
+                    u->bytes += n;
+                    break;
+                }
+                if( u->framing == upstream_conn::BODY_LENGTH && u->remaining == 0 ) {
+                    return finish( u );
+                }
+                if( !ensure_pipe( u ) ) {
+                    return RELAY_CLOSE;
+                }
+                size_t want = SPLICE_CHUNK;
+                if( u->framing == upstream_conn::BODY_LENGTH && u->remaining < SPLICE_CHUNK ) {
+                    want = u->remaining;
+                }
+                ssize_t n = splice( u->fd, NULL, u->pipe[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK );
+                if( n < 0 ) {
+                    if( errno == EAGAIN ) {
+                        watch( u, EPOLLIN );
+                        return RELAY_WAIT;
+                    }
+                    return RELAY_CLOSE;
+                } else if( n == 0 ) {
+                    // 直到关闭的应答在这里正常结束，长度已知的应答被截断了
+                    return u->framing == upstream_conn::BODY_CLOSE ? finish( u ) : RELAY_CLOSE;
+                }
+                u->piped += n;
+                if( u->framing == upstream_conn::BODY_LENGTH ) {
+                    u->remaining -= n;
+                }
+                break;
+            }
+            default: {
+                return RELAY_CLOSE;
+            }
+        }
+    }
+}
+
+// 只在还没有向客户端发送任何数据之前调用
+upstream_pool::RESULT upstream_pool::fail( upstream_conn* u ) {
+    http_conn* c = u->client;
+    if( u->reused && !u->streamed && u->in_len == 0 ) {
+        // 空闲连接在复用之前已经被后端关闭，请求还完整地在m_proxy_buf中，换一个新连接重发
+        upstream_conn* n = connect_to( u->route );
+        if( n ) {
+            destroy( u );
+            begin( n, c );
+            c->m_upstream = n;
+            return advance( n );
+        }
+    }
+    // 502之后关闭连接：请求体可能还有一部分留在客户端socket中
+    u->keep = false;
+    u->client_keep = false;
+    u->status = 502;
+    u->framing = upstream_conn::BODY_NONE;
+    memcpy( u->out, HTTP_RESPONSE_502.data, HTTP_RESPONSE_502.len );
+    u->out_len = HTTP_RESPONSE_502.len;
+    u->out_sent = 0;
+    u->state = upstream_conn::SEND_OUT;
+    return advance( u );
+}
+
+upstream_pool::RESULT upstream_pool::finish( upstream_conn* u ) {
+    http_conn* c = u->client;
+    LOG_ACCESS( c->m_address.sin_addr.s_addr, c->m_address.sin_port, c->m_proxy_method, c->m_url_buf,
+            u->status, u->bytes, metrics::now_ns() - c->m_proxy_start );
+    bool keep = u->client_keep;
+    c->end_proxy();
+    put( u );
+    if( !keep ) {
+        return RELAY_CLOSE;
+    }
+    if( !c->pending_input() ) {
+        // 读缓冲区中有流水线请求时由反应堆直接交给线程池，否则等待下一个请求
+        modfd( c->m_epollfd, c->m_sockfd, EPOLLIN, c->handle() );
+    }
+    return RELAY_DONE;
+}
+
+/*
+    解析后端的应答头u->in[0, head_len)，确定内容的长度，把应答头改写进out：
+    状态行统一为HTTP/1.1，去掉逐跳的Connection、Keep-Alive头部，换成对客户端的Connection头部，
+    随应答头一起收到的那部分内容也复制进out。1xx的中间应答直接丢弃，继续接收最终的应答。
+*/
+bool upstream_pool::parse_head( upstream_conn* u, int head_len ) {
+    const char* p = u->in;
+    const char* end = u->in + head_len;
+    if( head_len < 16 || memcmp( p, "HTTP/1.", 7 ) != 0 || !isdigit( ( unsigned char )p[9] )
+            || !isdigit( ( unsigned char )p[10] ) || !isdigit( ( unsigned char )p[11] ) ) {
+        return false;
+    }
+    int status = ( p[9] - '0' ) * 100 + ( p[10] - '0' ) * 10 + ( p[11] - '0' );
+    if( status < 100 ) {
+        return false;
+    }
+    if( status < 200 ) {
+        memmove( u->in, end, u->in_len - head_len );
+        u->in_len -= head_len;
+        return true;
+    }
+    bool backend_keep = p[7] != '0';    // HTTP/1.0的后端要明确地带上Connection: keep-alive
+    bool chunked = false;
+    off_t length = -1;
+
+    const char* eol = ( const char* )memchr( p, '\n', head_len ) + 1;
+    char* o = u->out;
+    memcpy( o, "HTTP/1.1", 8 );
+    memcpy( o + 8, p + 8, eol - p - 8 );
+    o += eol - p;
+    for( const char* line = eol; line < end - 2; ) {
+        const char* next = ( const char* )memchr( line, '\n', end - line ) + 1;
+        const char* colon = ( const char* )memchr( line, ':', next - line );
+        if( !colon ) {
+            return false;
+        }
+        int name_len = colon - line;
+        const char* value = colon + 1;
+        int value_len = next - value;
+        bool drop = false;
+        if( header_name_is( line, name_len, "connection", 10 ) ) {
+            if( has_token( value, value_len, "close" ) ) {
+                backend_keep = false;
+            } else if( has_token( value, value_len, "keep-alive" ) ) {
+                backend_keep = true;
+            }
+            drop = true;
+        } else if( header_name_is( line, name_len, "keep-alive", 10 )
+                || header_name_is( line, name_len, "proxy-connection", 16 ) ) {
+            drop = true;
+        } else if( header_name_is( line, name_len, "content-length", 14 ) ) {
+            while( *value == ' ' || *value == '\t' ) {
+                ++value;
+            }
+            if( !isdigit( ( unsigned char )*value ) ) {
+                return false;
+            }
+            length = 0;
+            for( ; isdigit( ( unsigned char )*value ); ++value ) {
+                if( length > ( ( off_t )1 << 58 ) ) {
+                    return false;
+                }
+                length = length * 10 + ( *value - '0' );
+            }
+        } else if( header_name_is( line, name_len, "transfer-encoding", 17 ) ) {
+            chunked = has_token( value, value_len, "chunked" );
+        }
+        if( !drop ) {
+            memcpy( o, line, next - line );
+            o += next - line;
+        }
+        line = next;
+    }
+
+    u->status = status;
+    u->remaining = 0;
+    if( status == 204 || status == 304 ) {
+        u->framing = upstream_conn::BODY_NONE;
+    } else if( chunked ) {
+        u->framing = upstream_conn::BODY_CHUNKED;
+    } else if( length > 0 ) {
+        u->framing = upstream_conn::BODY_LENGTH;
+        u->remaining = length;
+    } else if( length == 0 ) {
+        u->framing = upstream_conn::BODY_NONE;
+    } else {
+        // 没有长度，内容直到后端关闭连接为止，客户端也只能从连接关闭知道内容结束
+        u->framing = upstream_conn::BODY_CLOSE;
+        backend_keep = false;
+    }
+    http_conn* c = u->client;
+    u->keep = backend_keep;
+    u->client_keep = c->m_proxy_linger && u->framing != upstream_conn::BODY_CLOSE
+            && !http_conn::m_draining.load( std::memory_order_relaxed );
+    const http_fragment& connection = u->client_keep ? HTTP_CONNECTION_KEEP_ALIVE : HTTP_CONNECTION_CLOSE;
+    memcpy( o, connection.data, connection.len );
+    o += connection.len;
+    memcpy( o, HTTP_CRLF.data, HTTP_CRLF.len );
+    o += HTTP_CRLF.len;
+
+    // 随应答头收到的内容，超出应答长度的数据说明后端的应答有问题，连接不再复用
+    int extra = u->in_len - head_len;
+    int body = extra;
+    if( u->framing == upstream_conn::BODY_NONE ) {
+        body = 0;
+    } else if( u->framing == upstream_conn::BODY_LENGTH && body > u->remaining ) {
+        body = u->remaining;
+    } else if( u->framing == upstream_conn::BODY_CHUNKED ) {
+        body = scan_chunks( u, end, extra );
+    }
+    if( body < extra ) {
+        u->keep = false;
+    }
+    memcpy( o, end, body );
+    o += body;
+    if( u->framing == upstream_conn::BODY_LENGTH ) {
+        u->remaining -= body;
+    }
+    u->out_len = o - u->out;
+    u->out_sent = 0;
+    u->state = upstream_conn::SEND_OUT;
+    return true;
+}
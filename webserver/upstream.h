@@ -0,0 +1,139 @@
+#ifndef UPSTREAM_H
+#define UPSTREAM_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <vector>
+
+class http_conn;
+
+/*
+    反向代理
+    URL以某个路由的前缀开头的请求不读本地文件，而是转发给这个路由的后端。
+    工作线程解析完请求头后，do_request()返回PROXY_REQUEST，process_write()把改写过的请求头
+    （去掉逐跳头部，加上X-Forwarded-For）和读缓冲区中已有的那部分请求体放进连接的m_proxy_buf，
+    之后的转发全部由连接所属的反应堆完成：
+    - 每个反应堆为每个路由保留一组空闲的keep-alive后端连接，和客户端socket注册在同一个epoll中，
+      请求优先复用空闲连接，没有时才发起非阻塞的connect
+    - 还在客户端socket中的请求体、长度已知或直到关闭的应答内容都经过管道splice转发，不进入用户态；
+      分块编码的应答要跟踪分块的边界才知道在哪里结束，经过缓冲区转发
+    - 应答结束后后端连接回到空闲池，客户端连接回到keep-alive，读缓冲区中的流水线请求接着处理
+    复用的空闲连接可能刚好被后端关闭，还没有收到应答的任何字节、也没有转发过socket中的请求体时换一个新连接重试一次。
+    转发的超时使用写超时，每次有进展时重置。io_uring模式不支持反向代理。
+*/
+
+// 反向代理的路由表，启动时配置，之后只读
+class upstream {
+public:
+    static const int MAX_ROUTES = 16;       // 路由的最大个数
+    static const int PREFIX_LEN = 64;       // URL前缀的最大长度
+    static const int HOST_LEN = 128;        // 后端的"主机:端口"的最大长度
+
+    struct route {
+        char prefix[ PREFIX_LEN ];
+        int prefix_len;
+        char host[ HOST_LEN ];              // 请求没有Host头部时使用
+        struct sockaddr_in addr;
+    };
+
+    // 添加一个路由，spec形如"/api/=127.0.0.1:8080"，主机名在这里解析，不合法时返回false
+    static bool add_route( const char* spec );
+    // URL匹配的路由（最长前缀），没有时返回-1
+    static int match( const char* url );
+    static bool enabled() { return m_route_number > 0; }
+    static const route& get( int i ) { return m_routes[ i ]; }
+    static int route_number() { return m_route_number; }
+
+    static int m_keepalive;     // 每个反应堆每个路由最多保留的空闲后端连接数
+
+private:
+    static route m_routes[ MAX_ROUTES ];
+    static int m_route_number;
+};
+
+// 一个后端连接，以及正在它上面转发的请求的状态
+struct upstream_conn {
+    static const int BUF_SIZE = 8192;   // 应答头的最大大小，也是分块编码的应答每次转发的大小
+
+    /*
+        CONNECTING  :   非阻塞connect还没有完成
+        SEND_REQUEST:   发送m_proxy_buf中的请求头和请求体
+        SEND_BODY   :   把客户端socket中剩余的请求体splice给后端
+        RECV_HEAD   :   接收应答头
+        SEND_OUT    :   向客户端发送out中的数据：改写过的应答头和随它收到的内容、分块编码的内容，或者502
+        RELAY_BODY  :   转发应答内容
+        IDLE        :   在空闲池中
+    */
+    enum STATE { CONNECTING = 0, SEND_REQUEST, SEND_BODY, RECV_HEAD, SEND_OUT, RELAY_BODY, IDLE };
+
+    // 应答内容的长度怎样确定
+    enum FRAMING { BODY_NONE = 0, BODY_LENGTH, BODY_CHUNKED, BODY_CLOSE };
+
+    int fd;
+    int route;
+    int pipe[2];            // splice用的管道，第一次需要时创建，随连接复用
+    int piped;              // 管道中还没有转发出去的字节数
+    STATE state;
+    bool reused;            // 是否是从空闲池中取出的连接
+    http_conn* client;      // 正在为它转发的客户端连接，空闲时为NULL
+
+    int req_sent;           // m_proxy_buf中已经发给后端的字节数
+    bool streamed;          // 是否已经从客户端socket转发过请求体，之后就不能重试了
+
+    char in[ BUF_SIZE ];    // 收到的应答头
+    int in_len;
+    char out[ BUF_SIZE + 64 ];      // 发给客户端的数据：改写过的应答头（多出的空间放Connection头部）和内容
+    int out_len;
+    int out_sent;
+
+    int status;             // 后端应答的状态码，502表示后端出错
+    FRAMING framing;
+    off_t remaining;        // BODY_LENGTH时还没有转发的内容字节数
+    int chunk_state;        // BODY_CHUNKED时分块边界的扫描状态
+    off_t chunk_left;       // 当前块还没有扫描的字节数或者正在累计的块大小
+    bool keep;              // 应答结束后后端连接能否复用
+    bool client_keep;       // 应答结束后客户端连接是否保持
+    uint64_t bytes;         // 发给客户端的字节数
+};
+
+// 每个反应堆一个的后端连接池，以及在其中进行的转发，只由所属的反应堆线程使用
+class upstream_pool {
+public:
+    /*
+        转发的进展，由反应堆据此维护客户端连接
+        RELAY_WAIT  :   在等待某个socket，重置超时
+        RELAY_DONE  :   应答已经转发完，客户端连接保持
+        RELAY_CLOSE :   应由反应堆关闭客户端连接
+    */
+    enum RESULT { RELAY_WAIT = 0, RELAY_DONE, RELAY_CLOSE };
+
+    upstream_pool( int epollfd, int size );     // size是fd的上限，后端连接按fd索引
+    ~upstream_pool();
+
+    RESULT start( http_conn* conn );                        // 客户端连接的请求已经准备好，取一个后端连接开始转发
+    RESULT client_event( http_conn* conn, uint32_t events ); // 正在转发的客户端连接上的事件
+    // 后端socket上的事件，返回受影响的客户端连接，空闲连接的事件返回NULL
+    http_conn* backend_event( int fd, uint32_t events, RESULT* result );
+    void abort( http_conn* conn );                          // 客户端连接要关闭了，丢弃正在进行的转发
+
+private:
+    upstream_conn* get( int route );        // 取一个空闲连接，没有时新建
+    upstream_conn* connect_to( int route );
+    void put( upstream_conn* u );           // 应答结束，后端连接放回空闲池或关闭
+    void destroy( upstream_conn* u );
+    void watch( upstream_conn* u, uint32_t events );    // 修改后端socket在epoll中等待的事件
+    void wait_client( upstream_conn* u, int ev );       // 重新注册客户端socket的一次性事件
+    RESULT advance( upstream_conn* u );     // 推进转发，直到需要等待某个socket
+    RESULT fail( upstream_conn* u );        // 后端出错，还没有向客户端发送过数据时重试或者回复502
+    RESULT finish( upstream_conn* u );      // 应答转发完毕
+    bool parse_head( upstream_conn* u, int head_len );  // 解析应答头，改写后放进out
+    bool ensure_pipe( upstream_conn* u );
+
+private:
+    int m_epollfd;
+    std::vector< upstream_conn* > m_conns;                  // 本反应堆的后端连接，按fd索引
+    std::vector< std::vector< upstream_conn* > > m_idle;    // 按路由索引的空闲连接
+};
+
+#endif
@@ -0,0 +1,505 @@
+#include "uring_reactor.h"
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include "http_response.h"
+#include "conn_table.h"
+
+static int io_uring_setup( unsigned entries, struct io_uring_params* p ) {
+    return ( int )syscall( __NR_io_uring_setup, entries, p );
+}
+
+static int io_uring_enter( int fd, unsigned to_submit, unsigned min_complete, unsigned flags ) {
+    return ( int )syscall( __NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0 );
+}
+
+static int io_uring_register( int fd, unsigned opcode, void* arg, unsigned nr_args ) {
+    return ( int )syscall( __NR_io_uring_register, fd, opcode, arg, nr_args );
+}
+
+bool uring_reactor::supported() {
+    struct io_uring_params p;
+    memset( &p, 0, sizeof( p ) );
+    int fd = io_uring_setup( 8, &p );
+    if( fd < 0 ) {
+        return false;
+    }
+    // multishot recv与IORING_OP_SEND_ZC同在6.0内核加入，用后者是否存在来判断
+    size_t len = sizeof( struct io_uring_probe ) + 256 * sizeof( struct io_uring_probe_op );
+    struct io_uring_probe* probe = ( struct io_uring_probe* )calloc( 1, len );
+    bool ok = probe && io_uring_register( fd, IORING_REGISTER_PROBE, probe, 256 ) == 0
+            && probe->last_op >= IORING_OP_SEND_ZC
+            && ( probe->ops[ IORING_OP_SEND_ZC ].flags & IO_URING_OP_SUPPORTED );
+    free( probe );
+    close( fd );
+    return ok;
+}
+
+uring_reactor::uring_reactor( int id, const config& conf ) :
+        event_loop( id, conf ), m_ring_fd( -1 ), m_sq_ptr( MAP_FAILED ), m_sq_size( 0 ),
+        m_sqes( ( struct io_uring_sqe* )MAP_FAILED ), m_sqes_size( 0 ), m_sq_local_tail( 0 ),
+        m_cq_ptr( MAP_FAILED ), m_cq_size( 0 ),
+        m_buf_ring( ( struct io_uring_buf_ring* )MAP_FAILED ), m_bufs( NULL ), m_buf_tail( 0 ),
+        m_enable( false ), m_states( NULL ) {
+
+    m_tick.tv_sec = m_wheel.tick_ms() / 1000;
+    m_tick.tv_nsec = ( m_wheel.tick_ms() % 1000 ) * 1000000L;
+
+    m_states = ( conn_state* )calloc( m_table->size(), sizeof( conn_state ) );
+    m_bufs = ( char* )malloc( ( size_t )BUF_COUNT * BUF_SIZE );
+    if( !m_states || !m_bufs || !setup_ring() ) {
+        destroy_ring();
+        throw std::exception();
+    }
+}
+
+uring_reactor::~uring_reactor() {
+    destroy_ring();
+}
+
+void uring_reactor::destroy_ring() {
+    if( m_buf_ring != MAP_FAILED ) {
+        munmap( m_buf_ring, BUF_COUNT * sizeof( struct io_uring_buf ) );
+        m_buf_ring = ( struct io_uring_buf_ring* )MAP_FAILED;
+    }
+    if( m_sqes != MAP_FAILED ) {
+        munmap( m_sqes, m_sqes_size );
+        m_sqes = ( struct io_uring_sqe* )MAP_FAILED;
+    }
+    if( m_cq_ptr != MAP_FAILED && m_cq_ptr != m_sq_ptr ) {
+        munmap( m_cq_ptr, m_cq_size );
+    }
+    m_cq_ptr = MAP_FAILED;
+    if( m_sq_ptr != MAP_FAILED ) {
+        munmap( m_sq_ptr, m_sq_size );
+        m_sq_ptr = MAP_FAILED;
+    }
+    if( m_ring_fd >= 0 ) {
+        close( m_ring_fd );
+        m_ring_fd = -1;
+    }
+    free( m_bufs );
+    m_bufs = NULL;
+    free( m_states );
+    m_states = NULL;
+}
+
+bool uring_reactor::setup_ring() {
+    /*
+        只有本事件循环的线程提交请求（SINGLE_ISSUER），完成事件推迟到io_uring_enter等待时才处理（DEFER_TASKRUN），
+        这样内核不需要在任意时刻打断本线程。ring在主线程中创建，先以禁用状态创建，由事件循环线程在run()中启用，
+        它才成为唯一的提交者。较老的内核不支持这些标志时退回到默认方式。
+    */
+    static const unsigned flag_sets[] = {
+        IORING_SETUP_CLAMP | IORING_SETUP_R_DISABLED | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN,
+        IORING_SETUP_CLAMP | IORING_SETUP_R_DISABLED | IORING_SETUP_SINGLE_ISSUER,
+        IORING_SETUP_CLAMP
+    };
+    struct io_uring_params p;
+    for( size_t i = 0; i < sizeof( flag_sets ) / sizeof( flag_sets[0] ) && m_ring_fd < 0; ++i ) {
+        memset( &p, 0, sizeof( p ) );
+        p.flags = flag_sets[i];
+        m_ring_fd = io_uring_setup( RING_ENTRIES, &p );
+    }
+    if( m_ring_fd < 0 ) {
+        return false;
+    }
+    m_enable = ( p.flags & IORING_SETUP_R_DISABLED ) != 0;
+
+    // 映射提交队列、完成队列和提交项数组，新内核上两个队列在同一次映射中
+    m_sq_size = p.sq_off.array + p.sq_entries * sizeof( unsigned );
+    m_cq_size = p.cq_off.cqes + p.cq_entries * sizeof( struct io_uring_cqe );
+    bool single = ( p.features & IORING_FEAT_SINGLE_MMAP ) != 0;
+    if( single && m_cq_size > m_sq_size ) {
+        m_sq_size = m_cq_size;
+    }
+    m_sq_ptr = mmap( NULL, m_sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            m_ring_fd, IORING_OFF_SQ_RING );
+    if( m_sq_ptr == MAP_FAILED ) {
+        return false;
+    }
+    if( single ) {
+        m_cq_ptr = m_sq_ptr;
+    } else {
+        m_cq_ptr = mmap( NULL, m_cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                m_ring_fd, IORING_OFF_CQ_RING );
+        if( m_cq_ptr == MAP_FAILED ) {
+            return false;
+        }
+    }
+    m_sqes_size = p.sq_entries * sizeof( struct io_uring_sqe );
+    m_sqes = ( struct io_uring_sqe* )mmap( NULL, m_sqes_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, m_ring_fd, IORING_OFF_SQES );
+    if( m_sqes == MAP_FAILED ) {
+        return false;
+    }
+
+    char* sq = ( char* )m_sq_ptr;
+    m_sq_head = ( unsigned* )( sq + p.sq_off.head );
+    m_sq_tail = ( unsigned* )( sq + p.sq_off.tail );
+    m_sq_array = ( unsigned* )( sq + p.sq_off.array );
+    m_sq_mask = *( unsigned* )( sq + p.sq_off.ring_mask );
+    m_sq_entries = p.sq_entries;
+    m_sq_local_tail = *m_sq_tail;
+
+    char* cq = ( char* )m_cq_ptr;
+    m_cq_head = ( unsigned* )( cq + p.cq_off.head );
+    m_cq_tail = ( unsigned* )( cq + p.cq_off.tail );
+    m_cq_mask = *( unsigned* )( cq + p.cq_off.ring_mask );
+    m_cqes = ( struct io_uring_cqe* )( cq + p.cq_off.cqes );
+
+    // 缓冲区环：内核从这里取缓冲区存放multishot recv收到的数据
+    m_buf_ring = ( struct io_uring_buf_ring* )mmap( NULL, BUF_COUNT * sizeof( struct io_uring_buf ),
+            PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+    if( m_buf_ring == MAP_FAILED ) {
+        return false;
+    }
+    struct io_uring_buf_reg reg;
+    memset( &reg, 0, sizeof( reg ) );
+    reg.ring_addr = ( uint64_t )( uintptr_t )m_buf_ring;
+    reg.ring_entries = BUF_COUNT;
+    reg.bgid = BUF_GROUP;
+    if( io_uring_register( m_ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1 ) < 0 ) {
+        return false;
+    }
+    for( int bid = 0; bid < BUF_COUNT; ++bid ) {
+        add_buffer( bid );
+    }
+    return true;
+}
+
+// 缓冲区环就是一个io_uring_buf数组，环的尾部与第一项的resv字段重叠。
+// 内核头文件中的柔性数组bufs在C++中会被放在一个空结构体之后，偏移不对，所以这里不通过它访问
+void uring_reactor::add_buffer( int bid ) {
+    struct io_uring_buf* bufs = ( struct io_uring_buf* )m_buf_ring;
+    struct io_uring_buf* b = &bufs[ m_buf_tail & ( BUF_COUNT - 1 ) ];
+    b->addr = ( uint64_t )( uintptr_t )( m_bufs + ( size_t )bid * BUF_SIZE );
+    b->len = BUF_SIZE;
+    b->bid = bid;
+    ++m_buf_tail;
+    __atomic_store_n( &bufs[0].resv, m_buf_tail, __ATOMIC_RELEASE );
+}
+
+struct io_uring_sqe* uring_reactor::get_sqe() {
+    if( m_sq_local_tail - __atomic_load_n( m_sq_head, __ATOMIC_ACQUIRE ) >= m_sq_entries ) {
+        // 提交队列满了，先把已填好的提交给内核
+        submit_and_wait( 0 );
+        if( m_sq_local_tail - __atomic_load_n( m_sq_head, __ATOMIC_ACQUIRE ) >= m_sq_entries ) {
+            return NULL;
+        }
+    }
+    unsigned idx = m_sq_local_tail & m_sq_mask;
+    struct io_uring_sqe* sqe = &m_sqes[ idx ];
+    memset( sqe, 0, sizeof( *sqe ) );
+    m_sq_array[ idx ] = idx;
+    ++m_sq_local_tail;
+    return sqe;
+}
+
+int uring_reactor::submit_and_wait( unsigned wait_nr ) {
+    __atomic_store_n( m_sq_tail, m_sq_local_tail, __ATOMIC_RELEASE );
+    unsigned to_submit = m_sq_local_tail - __atomic_load_n( m_sq_head, __ATOMIC_ACQUIRE );
+    return io_uring_enter( m_ring_fd, to_submit, wait_nr, wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0 );
+}
+
+void uring_reactor::arm_accept() {
+    struct io_uring_sqe* sqe = get_sqe();
+    if( !sqe ) {
+        return;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = m_listenfd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = pack( m_listenfd, OP_ACCEPT );
+}
+
+void uring_reactor::arm_recv( int fd ) {
+    struct io_uring_sqe* sqe = get_sqe();
+    if( !sqe ) {
+        close_conn( m_users + fd );
+        return;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BUF_GROUP;
+    sqe->user_data = pack( fd, OP_RECV );
+    m_states[fd].recv_armed = true;
+    m_states[fd].inflight++;
+}
+
+void uring_reactor::arm_send( int fd ) {
+    struct io_uring_sqe* sqe = get_sqe();
+    if( !sqe ) {
+        close_conn( m_users + fd );
+        return;
+    }
+    conn_state& st = m_states[fd];
+    struct iovec* iov = NULL;
+    memset( &st.msg, 0, sizeof( st.msg ) );
+    st.msg.msg_iovlen = m_users[fd].send_iov( &iov );
+    st.msg.msg_iov = iov;
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = ( uint64_t )( uintptr_t )&st.msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = pack( fd, OP_SEND );
+    st.sending = true;
+    st.inflight++;
+}
+
+void uring_reactor::arm_tick() {
+    struct io_uring_sqe* sqe = get_sqe();
+    if( !sqe ) {
+        return;
+    }
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = ( uint64_t )( uintptr_t )&m_tick;
+    sqe->len = 1;
+    sqe->user_data = pack( 0, OP_TICK );
+}
+
+void uring_reactor::run() {
+    if( m_enable && io_uring_register( m_ring_fd, IORING_REGISTER_ENABLE_RINGS, NULL, 0 ) < 0 ) {
+        LOG_ERROR( "uring reactor %d: enable ring failure", m_id );
+        return;
+    }
+    arm_accept();
+    arm_tick();
+
+    while( !m_stopped ) {
+        // 提交这一轮产生的所有请求，并等待至少一个完成事件
+        int ret = submit_and_wait( 1 );
+        if( ret < 0 && errno != EINTR && errno != EBUSY && errno != EAGAIN ) {
+            LOG_ERROR( "uring reactor %d: io_uring_enter failure, errno is: %d", m_id, errno );
+            break;
+        }
+
+        unsigned head = *m_cq_head;
+        unsigned tail = __atomic_load_n( m_cq_tail, __ATOMIC_ACQUIRE );
+        for( ; head != tail; ++head ) {
+            handle_cqe( &m_cqes[ head & m_cq_mask ] );
+        }
+        __atomic_store_n( m_cq_head, head, __ATOMIC_RELEASE );
+    }
+}
+
+void uring_reactor::handle_cqe( const struct io_uring_cqe* cqe ) {
+    int fd = ( int )( cqe->user_data >> 8 );
+    switch( ( OP )( cqe->user_data & 0xff ) ) {
+        case OP_ACCEPT:
+            handle_accept( cqe );
+            break;
+        case OP_RECV:
+            handle_recv( fd, cqe );
+            break;
+        case OP_SEND:
+            handle_send( fd, cqe );
+            break;
+        case OP_SHUTDOWN:
+            if( --m_states[fd].inflight == 0 ) {
+                finish_close( fd );
+            }
+            break;
+        case OP_TICK:
+            handle_tick();
+            break;
+        case OP_CANCEL:
+            break;
+    }
+}
+
+// 有客户端连接进来
+void uring_reactor::handle_accept( const struct io_uring_cqe* cqe ) {
+    int connfd = cqe->res;
+    if( connfd == -EMFILE || connfd == -ENFILE ) {
+        // 文件描述符用完，用备用fd取出一个连接并拒绝，避免它一直停在监听队列中
+        shed_one();
+    } else if( connfd == -ECANCELED ) {
+        // 平滑退出时被stop_accept()取消
+    } else if( connfd < 0 ) {
+        LOG_ERROR( "uring reactor %d: accept failure, errno is: %d", m_id, -connfd );
+    } else if( !admit( connfd ) ) {
+        // 目前连接数满了，已经给客户端发送了503
+    } else {
+        // multishot accept不返回对方地址
+        struct sockaddr_in client_address;
+        bzero( &client_address, sizeof( client_address ) );
+        m_users[connfd].init( connfd, client_address, -1 );
+        track( connfd );
+        memset( &m_states[connfd], 0, sizeof( conn_state ) );
+        arm_recv( connfd );
+        // 新连接从accept开始计算读取请求头的超时
+        set_timer( m_users + connfd, http_conn::PHASE_HEADER );
+    }
+    if( !( cqe->flags & IORING_CQE_F_MORE ) && m_listenfd >= 0 ) {
+        // multishot accept被内核终止，重新提交
+        arm_accept();
+    }
+}
+
+void uring_reactor::handle_recv( int fd, const struct io_uring_cqe* cqe ) {
+    conn_state& st = m_states[fd];
+    http_conn* conn = m_users + fd;
+    bool more = ( cqe->flags & IORING_CQE_F_MORE ) != 0;
+    if( !more ) {
+        st.recv_armed = false;
+        st.inflight--;
+    }
+
+    bool ok = false;
+    if( cqe->res > 0 && ( cqe->flags & IORING_CQE_F_BUFFER ) ) {
+        // 数据复制到连接的读缓冲区后，缓冲区立即还给环
+        int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        ok = st.closing || conn->feed( m_bufs + ( size_t )bid * BUF_SIZE, cqe->res );
+        add_buffer( bid );
+    }
+    if( st.closing ) {
+        if( st.inflight == 0 ) {
+            finish_close( fd );
+        }
+        return;
+    }
+    if( cqe->res == -ENOBUFS ) {
+        // 缓冲区环暂时用完了，multishot recv已终止，重新提交
+        arm_recv( fd );
+        return;
+    }
+    if( !ok ) {
+        // 对方关闭连接、出错，或者请求太大
+        close_conn( conn );
+        return;
+    }
+
+    if( conn->m_phase == http_conn::PHASE_IDLE ) {
+        // keep-alive连接上新请求的第一个字节，开始计算请求头超时
+        set_timer( conn, http_conn::PHASE_HEADER );
+    } else if( conn->reading_body() ) {
+        // 请求体每收到一批数据就重置超时
+        set_timer( conn, http_conn::PHASE_BODY );
+    }
+    // 正在发送上一批应答时，新到的（流水线）请求等发送完再处理
+    if( !st.sending ) {
+        process( conn );
+    }
+    if( !more && !st.closing ) {
+        arm_recv( fd );
+    }
+}
+
+void uring_reactor::handle_send( int fd, const struct io_uring_cqe* cqe ) {
+    conn_state& st = m_states[fd];
+    http_conn* conn = m_users + fd;
+    st.sending = false;
+    st.inflight--;
+    if( st.closing ) {
+        if( st.inflight == 0 ) {
+            finish_close( fd );
+        }
+        return;
+    }
+    if( cqe->res == -EAGAIN || cqe->res == -EINTR ) {
+        arm_send( fd );
+        return;
+    }
+    if( cqe->res <= 0 || !conn->sent( cqe->res ) ) {
+        // 发送出错，或者应答已经发完且不保持连接
+        close_conn( conn );
+        return;
+    }
+    if( conn->writing() ) {
+        // 没有发完，从断点继续，发送有进展就重置超时
+        arm_send( fd );
+        set_timer( conn, http_conn::PHASE_WRITE );
+    } else if( conn->pending_input() ) {
+        // 读缓冲区中还有流水线请求，开始计算下一个请求的超时
+        set_timer( conn, http_conn::PHASE_HEADER );
+        process( conn );
+    } else {
+        // 响应发送完毕，keep-alive连接进入空闲
+        set_timer( conn, http_conn::PHASE_IDLE );
+    }
+}
+
+void uring_reactor::process( http_conn* conn ) {
+    if( !conn->process_requests() ) {
+        // 请求还不完整，继续等待数据
+        return;
+    }
+    if( conn->writing() ) {
+        arm_send( conn - m_users );
+        set_timer( conn, http_conn::PHASE_WRITE );
+    } else if( conn->sent( 0 ) ) {
+        // 没有要发送的内容（HTTP/2连接处理完的帧都不需要回复），保持连接等待下一批数据
+        set_timer( conn, http_conn::PHASE_IDLE );
+    } else {
+        // 生成应答失败
+        close_conn( conn );
+    }
+}
+
+void uring_reactor::close_conn( http_conn* conn ) {
+    int fd = conn - m_users;
+    conn_state& st = m_states[fd];
+    if( st.closing || conn->closed() ) {
+        return;
+    }
+    st.closing = true;
+    m_wheel.del( &conn->m_timer );
+    // 内核中的recv和sendmsg都持有socket的引用，直接close不会让它们结束，
+    // shutdown使它们立即完成，等最后一个完成事件到达后才close，在此之前fd不会被新连接复用
+    struct io_uring_sqe* sqe = get_sqe();
+    if( sqe ) {
+        sqe->opcode = IORING_OP_SHUTDOWN;
+        sqe->fd = fd;
+        sqe->len = SHUT_RDWR;
+        sqe->user_data = pack( fd, OP_SHUTDOWN );
+        st.inflight++;
+        return;
+    }
+    shutdown( fd, SHUT_RDWR );
+    if( st.inflight == 0 ) {
+        finish_close( fd );
+    }
+}
+
+void uring_reactor::finish_close( int fd ) {
+    m_states[fd].closing = false;
+    release( m_users + fd );
+}
+
+void uring_reactor::stop_accept() {
+    // 内核中的multishot accept持有监听socket的引用，只close不会让它停止，热升级时它会继续抢走新进程的连接
+    struct io_uring_sqe* sqe = get_sqe();
+    if( sqe ) {
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->addr = pack( m_listenfd, OP_ACCEPT );
+        sqe->user_data = pack( 0, OP_CANCEL );
+    }
+    close( m_listenfd );
+    m_listenfd = -1;
+}
+
+void uring_reactor::handle_tick() {
+    update_http_date();
+    m_wheel.tick( on_timeout, this );
+    drain_tick();
+    if( !m_stopped ) {
+        arm_tick();
+    }
+}
+
+void uring_reactor::on_timeout( tw_timer* timer, void* arg ) {
+    uring_reactor* r = ( uring_reactor* )arg;
+    http_conn* conn = ( http_conn* )timer->data;
+    if( conn->closed() ) {
+        return;
+    }
+    // 超时，关闭连接
+    r->close_conn( conn );
+}
+
@@ -0,0 +1,102 @@
+#ifndef URING_REACTOR_H
+#define URING_REACTOR_H
+
+#include <linux/io_uring.h>
+#include <sys/socket.h>
+#include "event_loop.h"
+
+/*
+    基于io_uring的事件循环，直接使用系统调用和内核的ring布局，不依赖liburing
+    - 监听socket上挂一个multishot accept，一次提交持续产生新连接
+    - 每个连接挂一个multishot recv，数据由内核写入事先提供给它的缓冲区环（provided buffer ring），
+      复制到连接的读缓冲区后立即把缓冲区还给环
+    - 一批应答用一个sendmsg发出，没发完时从断点继续提交
+    - 时间轮由IORING_OP_TIMEOUT驱动
+    所有提交和收割都合并在每轮一次的io_uring_enter中，稳态下没有epoll_ctl、recv、writev这些逐个连接的系统调用。
+    请求的解析和应答直接在本线程中完成（命中打开文件缓存时只是几次memcpy），不再经过线程池。
+    io_uring不支持sendfile，这种模式下文件内容都从缓存的映射发送。
+    需要5.19以上内核（multishot accept和provided buffer ring）以及6.0以上（multishot recv），由supported()检测。
+*/
+class uring_reactor : public event_loop {
+public:
+    uring_reactor( int id, const config& conf );
+    ~uring_reactor();
+    void run();     // 事件循环
+
+    static bool supported();    // 当前内核是否支持这里用到的io_uring特性
+
+private:
+    // 提交的请求种类，与fd一起编码在user_data中
+    enum OP { OP_ACCEPT = 0, OP_RECV, OP_SEND, OP_SHUTDOWN, OP_TICK, OP_CANCEL };
+
+    // 每个连接在本事件循环中的io_uring状态
+    struct conn_state {
+        struct msghdr msg;      // 正在进行的sendmsg，提交后到完成前必须保持有效
+        int inflight;           // 还没有完成的请求数，关闭时要等它归零才能close
+        bool recv_armed;        // multishot recv是否仍然有效
+        bool sending;           // 是否有sendmsg正在进行
+        bool closing;           // 已经发起关闭
+    };
+
+    bool setup_ring();
+    void destroy_ring();
+    struct io_uring_sqe* get_sqe();     // 取一个空闲的提交项，提交队列满时先提交一次
+    int submit_and_wait( unsigned wait_nr );
+    void add_buffer( int bid );         // 把一个缓冲区还给缓冲区环
+
+    void arm_accept();
+    void arm_recv( int fd );
+    void arm_send( int fd );
+    void arm_tick();
+
+    void handle_cqe( const struct io_uring_cqe* cqe );
+    void handle_accept( const struct io_uring_cqe* cqe );
+    void handle_recv( int fd, const struct io_uring_cqe* cqe );
+    void handle_send( int fd, const struct io_uring_cqe* cqe );
+    void handle_tick();
+    static void on_timeout( tw_timer* timer, void* arg );
+
+    void process( http_conn* conn );    // 解析请求，有应答时提交发送
+    void close_conn( http_conn* conn ); // 发起关闭：shutdown后等待该连接所有的请求完成
+    void finish_close( int fd );        // 请求都完成后真正关闭连接
+    void stop_accept();                 // 取消multishot accept并关闭监听socket
+
+    static uint64_t pack( int fd, OP op ) { return ( ( uint64_t )( unsigned )fd << 8 ) | op; }
+
+private:
+    static const unsigned RING_ENTRIES = 1024;  // 提交队列的大小
+    static const int BUF_COUNT = 256;           // 缓冲区环中缓冲区的个数，必须是2的幂
+    static const int BUF_SIZE = 4096;           // 每个缓冲区的大小
+    static const int BUF_GROUP = 0;             // 缓冲区组号
+
+    int m_ring_fd;
+    // 提交队列
+    void* m_sq_ptr;
+    size_t m_sq_size;
+    unsigned* m_sq_head;
+    unsigned* m_sq_tail;
+    unsigned* m_sq_array;
+    unsigned m_sq_mask;
+    unsigned m_sq_entries;
+    struct io_uring_sqe* m_sqes;
+    size_t m_sqes_size;
+    unsigned m_sq_local_tail;   // 本地已经填好、尚未发布给内核的提交项的尾部
+    // 完成队列
+    void* m_cq_ptr;
+    size_t m_cq_size;
+    unsigned* m_cq_head;
+    unsigned* m_cq_tail;
+    unsigned m_cq_mask;
+    struct io_uring_cqe* m_cqes;
+    // 缓冲区环
+    struct io_uring_buf_ring* m_buf_ring;
+    char* m_bufs;
+    unsigned short m_buf_tail;
+
+    bool m_enable;                      // ring以禁用状态创建，需要在事件循环线程中启用
+
+    struct __kernel_timespec m_tick;    // 时间轮滴答
+    conn_state* m_states;               // 按fd索引，calloc分配，只有用到的页才占用内存
+};
+
+#endif
@@ -0,0 +1,90 @@
+#ifndef WS_DEQUE_H
+#define WS_DEQUE_H
+
+#include <atomic>
+#include <stdint.h>
+#include "mpmc_queue.h"
+
+/*
+    Chase-Lev工作窃取双端队列（采用Lê等人给出的C11内存模型版本）
+    只有拥有者线程在底部push和pop，其他线程只能从顶部steal。
+    拥有者的push/pop在没有竞争时不需要任何原子读改写操作，只有取最后一个元素时才与窃取者竞争一次CAS。
+    这里的容量固定为2的幂，不做扩容：拥有者每次只把自己收件箱中的一小批任务转入本队列。
+*/
+template< typename T, int CAPACITY = 64 >
+class ws_deque {
+public:
+    ws_deque() : m_top( 0 ), m_bottom( 0 ) {
+        for( int i = 0; i < CAPACITY; ++i ) {
+            m_buffer[ i ].store( NULL, std::memory_order_relaxed );
+        }
+    }
+
+    // 拥有者调用，队列满时返回false
+    bool push( T* item ) {
+        int64_t b = m_bottom.load( std::memory_order_relaxed );
+        int64_t t = m_top.load( std::memory_order_acquire );
+        if( b - t >= CAPACITY ) {
+            return false;
+        }
+        m_buffer[ b & ( CAPACITY - 1 ) ].store( item, std::memory_order_relaxed );
+        std::atomic_thread_fence( std::memory_order_release );
+        m_bottom.store( b + 1, std::memory_order_relaxed );
+        return true;
+    }
+
+    // 拥有者调用，从底部取出最近放入的任务，队列为空时返回NULL
+    T* pop() {
+        int64_t b = m_bottom.load( std::memory_order_relaxed ) - 1;
+        m_bottom.store( b, std::memory_order_relaxed );
+        std::atomic_thread_fence( std::memory_order_seq_cst );
+        int64_t t = m_top.load( std::memory_order_relaxed );
+        T* item = NULL;
+        if( t <= b ) {
+            item = m_buffer[ b & ( CAPACITY - 1 ) ].load( std::memory_order_relaxed );
+            if( t == b ) {
+                // 只剩最后一个元素，与窃取者竞争
+                if( !m_top.compare_exchange_strong( t, t + 1, std::memory_order_seq_cst,
+                        std::memory_order_relaxed ) ) {
+                    item = NULL;
+                }
+                m_bottom.store( b + 1, std::memory_order_relaxed );
+            }
+        } else {
+            m_bottom.store( b + 1, std::memory_order_relaxed );
+        }
+        return item;
+    }
+
+    // 任意线程调用，从顶部窃取最早放入的任务，队列为空或竞争失败时返回NULL
+    T* steal() {
+        int64_t t = m_top.load( std::memory_order_acquire );
+        std::atomic_thread_fence( std::memory_order_seq_cst );
+        int64_t b = m_bottom.load( std::memory_order_acquire );
+        if( t < b ) {
+            T* item = m_buffer[ t & ( CAPACITY - 1 ) ].load( std::memory_order_relaxed );
+            if( !m_top.compare_exchange_strong( t, t + 1, std::memory_order_seq_cst,
+                    std::memory_order_relaxed ) ) {
+                return NULL;
+            }
+            return item;
+        }
+        return NULL;
+    }
+
+    int size() const {     // 近似的元素个数
+        int64_t n = m_bottom.load( std::memory_order_relaxed ) - m_top.load( std::memory_order_relaxed );
+        return n > 0 ? ( int )n : 0;
+    }
+
+    bool empty() const {
+        return m_bottom.load( std::memory_order_relaxed ) <= m_top.load( std::memory_order_relaxed );
+    }
+
+private:
+    alignas( CACHELINE_SIZE ) std::atomic< int64_t > m_top;      // 窃取者竞争的一端
+    alignas( CACHELINE_SIZE ) std::atomic< int64_t > m_bottom;   // 拥有者使用的一端
+    std::atomic< T* > m_buffer[ CAPACITY ];
+};
+
+#endif